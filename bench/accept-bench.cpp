@@ -0,0 +1,198 @@
+#include "bench/bench-common.h"
+#include "bench/stub-agent.h"
+#include "relay/agent-message.h"
+#include "relay/posix/thread-server.h"
+#include "relay/posix/unix-socket.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Bursts of clients connecting at the same time, like CI jobs or IDE windows starting together:
+// each client connects to the proxy, sends REQUEST_IDENTITIES and waits for the reply.
+// Compares the time spent in connect and until the first reply with one or several acceptor
+// threads and with a shallow or deep listen backlog. Unix socket connects block while the backlog
+// is full, like named pipe clients retrying with WaitNamedPipe while no instance is listening.
+
+struct burst_result {
+	std::vector<uint64_t> connectNs;
+	std::vector<uint64_t> firstReplyNs;
+	size_t failures;
+};
+
+static void print_help(char* argv[]) {
+	printf("Usage: %s [--clients count] [--bursts count] [--acceptors list] [--backlogs list]\n\n"
+	       " --clients: clients connecting at the same time in each burst (default 200)\n"
+	       " --bursts: bursts measured for each configuration (default 10)\n"
+	       " --acceptors: comma separated acceptor thread counts to compare (default 1,%d)\n"
+	       " --backlogs: comma separated listen backlogs to compare (default 16,%d)\n",
+	       argv[0],
+	       THREAD_SERVER_DEFAULT_ACCEPTORS,
+	       SOMAXCONN);
+}
+
+static bool parseList(const char* arg, std::vector<int>& values) {
+	std::string list(arg);
+	size_t start = 0;
+
+	values.clear();
+	while(start <= list.size()) {
+		size_t end = list.find(',', start);
+		if(end == std::string::npos)
+			end = list.size();
+
+		int value = atoi(list.substr(start, end - start).c_str());
+		if(value <= 0)
+			return false;
+		values.push_back(value);
+		start = end + 1;
+	}
+
+	return !values.empty();
+}
+
+static burst_result runScenario(int acceptors, int backlog, int clientCount, int bursts) {
+	std::string proxyPath = makeTempSocketPath("accept-bench-proxy");
+	std::string agentPath = makeTempSocketPath("accept-bench-agent");
+	burst_result result;
+
+	result.failures = 0;
+
+	SOCKET listenSock = listenUnixSocket(proxyPath.c_str(), backlog);
+	if(listenSock == INVALID_SOCKET)
+		return result;
+
+	pid_t proxyPid = startProxyProcess([&]() {
+		socket_connector connectUpstream = [&agentPath]() { return connectUnixSocket(agentPath.c_str()); };
+		serveThreadPerClient(listenSock, connectUpstream, AGENT_MAX_MSGLEN, NULL, NULL, acceptors);
+	});
+	closesocket(listenSock);
+
+	stub_agent agent(agentPath.c_str(), 0);
+	if(proxyPid < 0 || !agent.start()) {
+		stopProxyProcess(proxyPid);
+		return result;
+	}
+
+	for(int burst = 0; burst < bursts; burst++) {
+		std::vector<uint64_t> connectNs(clientCount, 0);
+		std::vector<uint64_t> firstReplyNs(clientCount, 0);
+		std::vector<std::thread> clients;
+		bench_barrier ready(clientCount + 1);
+
+		for(int i = 0; i < clientCount; i++) {
+			clients.emplace_back([&, i]() {
+				std::vector<char> request = makeAgentMessage(SSH2_AGENTC_REQUEST_IDENTITIES, 0);
+				std::vector<char> reply;
+
+				ready.wait();
+
+				uint64_t start = nowNs();
+				SOCKET sock = connectUnixSocket(proxyPath.c_str());
+				if(sock == INVALID_SOCKET)
+					return;
+				connectNs[i] = nowNs() - start;
+
+				if(agentRoundTrip(sock, request, reply))
+					firstReplyNs[i] = nowNs() - start;
+				closesocket(sock);
+			});
+		}
+
+		ready.wait();
+		for(std::thread& client : clients) {
+			client.join();
+		}
+
+		for(int i = 0; i < clientCount; i++) {
+			if(firstReplyNs[i] == 0) {
+				result.failures++;
+				continue;
+			}
+			result.connectNs.push_back(connectNs[i]);
+			result.firstReplyNs.push_back(firstReplyNs[i]);
+		}
+
+		// Let the proxy finish the sessions of the burst
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	}
+
+	stopProxyProcess(proxyPid);
+	unlink(proxyPath.c_str());
+
+	return result;
+}
+
+int main(int argc, char* argv[]) {
+	int clientCount = 200;
+	int bursts = 10;
+	std::vector<int> acceptorCounts = {1, THREAD_SERVER_DEFAULT_ACCEPTORS};
+	std::vector<int> backlogs = {16, SOMAXCONN};
+
+	for(int i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "--clients") == 0 && i + 1 < argc) {
+			clientCount = atoi(argv[++i]);
+		} else if(strcmp(argv[i], "--bursts") == 0 && i + 1 < argc) {
+			bursts = atoi(argv[++i]);
+		} else if(strcmp(argv[i], "--acceptors") == 0 && i + 1 < argc) {
+			if(!parseList(argv[++i], acceptorCounts)) {
+				print_help(argv);
+				return 1;
+			}
+		} else if(strcmp(argv[i], "--backlogs") == 0 && i + 1 < argc) {
+			if(!parseList(argv[++i], backlogs)) {
+				print_help(argv);
+				return 1;
+			}
+		} else {
+			print_help(argv);
+			return 1;
+		}
+	}
+
+	if(clientCount <= 0 || bursts <= 0) {
+		print_help(argv);
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	printf("%-10s %8s %8s %8s %12s %12s %12s %12s\n",
+	       "acceptors",
+	       "backlog",
+	       "samples",
+	       "failed",
+	       "conn_p50_us",
+	       "conn_p99_us",
+	       "reply_p50_us",
+	       "reply_p99_us");
+
+	for(int backlog : backlogs) {
+		for(int acceptors : acceptorCounts) {
+			burst_result result = runScenario(acceptors, backlog, clientCount, bursts);
+			latency_stats connect = computeLatencyStats(result.connectNs);
+			latency_stats firstReply = computeLatencyStats(result.firstReplyNs);
+
+			printf("%-10d %8d %8zu %8zu %12.1f %12.1f %12.1f %12.1f\n",
+			       acceptors,
+			       backlog,
+			       connect.count,
+			       result.failures,
+			       connect.p50Us,
+			       connect.p99Us,
+			       firstReply.p50Us,
+			       firstReply.p99Us);
+			fflush(stdout);
+		}
+	}
+
+	return 0;
+}
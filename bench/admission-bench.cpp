@@ -0,0 +1,299 @@
+#include "bench/bench-common.h"
+#include "bench/stub-agent.h"
+#include "relay/agent-message.h"
+#include "relay/posix/thread-server.h"
+#include "relay/posix/unix-socket.h"
+#include "relay/session-pool.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Connection storm against the thread-per-client relay, with and without the session pool: new clients
+// connect at a fixed rate, send one REQUEST_IDENTITIES and disconnect, while the stub agent answers slowly
+// so sessions pile up. Clients are driven by a single epoll loop so the rate does not depend on replies.
+// Reports answered, refused (disconnected without reply) and timed out clients with their latencies,
+// and the peak thread count and memory of the proxy.
+
+#define ADMISSION_BENCH_CLIENT_TIMEOUT_MS 10000
+
+struct bench_config {
+	double rate;
+	double durationS;
+	uint32_t agentLatencyUs;
+	size_t maxSessions;
+	uint32_t sessionWaitMs;
+};
+
+struct scenario_result {
+	uint64_t attempts;
+	uint64_t connectFailures;
+	std::vector<uint64_t> answered;
+	std::vector<uint64_t> refused;
+	uint64_t timedOut;
+	double achievedRate;
+	long peakThreads;
+	long peakRssKb;
+};
+
+struct pending_client {
+	uint64_t startNs;
+	int32_t received;
+	char reply[64];
+};
+
+static void print_help(char* argv[]) {
+	printf("Usage: %s [--rate connections_per_s] [--duration seconds] [--agent-latency-us us] [--max-sessions count]\n"
+	       "          [--session-wait ms]\n\n"
+	       " --rate: new client connections per second (default 5000)\n"
+	       " --duration: time during which clients connect (default 3)\n"
+	       " --agent-latency-us: delay added by the stub agent to each reply (default 100000)\n"
+	       " --max-sessions: concurrent sessions of the session pool (default %d)\n"
+	       " --session-wait: time a client may wait for a session worker (default 500)\n",
+	       argv[0],
+	       SESSION_POOL_DEFAULT_MAX_SESSIONS);
+}
+
+static int connectNonBlocking(const char* path) {
+	struct sockaddr_un addr;
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+	if(sock < 0)
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+	// Unix socket connections complete at once or fail with EAGAIN when the listen backlog is full
+	if(connect(sock, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+		close(sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+// Open clients at the configured rate and follow them until they are answered, refused or time out
+static void runClients(const bench_config& config, const std::string& proxyPath, scenario_result& result) {
+	std::vector<char> request = makeAgentMessage(SSH2_AGENTC_REQUEST_IDENTITIES, 0);
+	std::unordered_map<int, pending_client> clients;
+	int epollFd = epoll_create1(EPOLL_CLOEXEC);
+	struct epoll_event events[256];
+	uint64_t start = nowNs();
+	uint64_t end = start + (uint64_t) (config.durationS * 1e9);
+	uint64_t intervalNs = (uint64_t) (1e9 / config.rate);
+	uint64_t nextAttempt = start;
+
+	auto finish = [&](int sock, bool answered) {
+		uint64_t latency = nowNs() - clients[sock].startNs;
+		(answered ? result.answered : result.refused).push_back(latency);
+		epoll_ctl(epollFd, EPOLL_CTL_DEL, sock, NULL);
+		close(sock);
+		clients.erase(sock);
+	};
+
+	for(;;) {
+		uint64_t now = nowNs();
+
+		while(nextAttempt <= now && nextAttempt < end) {
+			nextAttempt += intervalNs;
+			result.attempts++;
+
+			int sock = connectNonBlocking(proxyPath.c_str());
+			if(sock < 0 || write(sock, request.data(), request.size()) != (ssize_t) request.size()) {
+				if(sock >= 0)
+					close(sock);
+				result.connectFailures++;
+				continue;
+			}
+
+			struct epoll_event event;
+			event.events = EPOLLIN | EPOLLRDHUP;
+			event.data.fd = sock;
+			epoll_ctl(epollFd, EPOLL_CTL_ADD, sock, &event);
+			clients[sock] = {nowNs(), 0, {0}};
+		}
+
+		if(now >= end && clients.empty())
+			break;
+
+		int count = epoll_wait(epollFd, events, sizeof(events) / sizeof(events[0]), 1);
+		for(int i = 0; i < count; i++) {
+			int sock = events[i].data.fd;
+			pending_client& client = clients[sock];
+			ssize_t size =
+			    read(sock, client.reply + client.received, sizeof(client.reply) - (size_t) client.received);
+
+			if(size <= 0) {
+				if(size < 0 && errno == EAGAIN)
+					continue;
+				finish(sock, false);
+				continue;
+			}
+
+			client.received += (int32_t) size;
+			if(client.received >= 4 && client.received >= (int32_t) readu32(client.reply) + 4)
+				finish(sock, true);
+			else if(client.received == (int32_t) sizeof(client.reply))
+				// Larger replies are not expected from the stub, only their start matters
+				finish(sock, true);
+		}
+
+		// Expire clients that got neither a reply nor a disconnection
+		if(now >= end) {
+			std::vector<int> expired;
+			for(auto& entry : clients) {
+				if(now - entry.second.startNs > (uint64_t) ADMISSION_BENCH_CLIENT_TIMEOUT_MS * 1000000)
+					expired.push_back(entry.first);
+			}
+			for(int sock : expired) {
+				epoll_ctl(epollFd, EPOLL_CTL_DEL, sock, NULL);
+				close(sock);
+				clients.erase(sock);
+				result.timedOut++;
+			}
+		}
+	}
+
+	result.achievedRate = (double) result.attempts / ((double) (end - start) / 1e9);
+	close(epollFd);
+}
+
+static scenario_result runScenario(const bench_config& config, bool pooled) {
+	std::string proxyPath = makeTempSocketPath("admission-bench-proxy");
+	std::string agentPath = makeTempSocketPath("admission-bench-agent");
+	scenario_result result;
+
+	result.attempts = 0;
+	result.connectFailures = 0;
+	result.timedOut = 0;
+	result.achievedRate = 0;
+	result.peakThreads = 0;
+	result.peakRssKb = 0;
+
+	SOCKET listenSock = listenUnixSocket(proxyPath.c_str(), SOMAXCONN);
+	if(listenSock == INVALID_SOCKET)
+		return result;
+
+	pid_t proxyPid = startProxyProcess([&]() {
+		socket_connector connectUpstream = [&agentPath]() { return connectUnixSocket(agentPath.c_str()); };
+
+		if(pooled) {
+			session_pool sessionPool(config.maxSessions, config.maxSessions, config.sessionWaitMs);
+			serveThreadPerClient(listenSock, connectUpstream, AGENT_MAX_MSGLEN, NULL, &sessionPool);
+		} else {
+			serveThreadPerClient(listenSock, connectUpstream, AGENT_MAX_MSGLEN);
+		}
+	});
+	closesocket(listenSock);
+
+	stub_agent agent(agentPath.c_str(), config.agentLatencyUs);
+	if(proxyPid < 0 || !agent.start()) {
+		stopProxyProcess(proxyPid);
+		return result;
+	}
+
+	// Sample the proxy thread count, the peak RSS is also kept by the kernel
+	std::atomic<bool> sampling(true);
+	std::thread sampler([&]() {
+		while(sampling) {
+			process_stats stats;
+			if(readProcessStats(proxyPid, &stats)) {
+				if(stats.threads > result.peakThreads)
+					result.peakThreads = stats.threads;
+				result.peakRssKb = stats.peakRssKb;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		}
+	});
+
+	runClients(config, proxyPath, result);
+
+	sampling = false;
+	sampler.join();
+	stopProxyProcess(proxyPid);
+	unlink(proxyPath.c_str());
+
+	return result;
+}
+
+int main(int argc, char* argv[]) {
+	bench_config config;
+
+	config.rate = 5000;
+	config.durationS = 3;
+	config.agentLatencyUs = 100000;
+	config.maxSessions = SESSION_POOL_DEFAULT_MAX_SESSIONS;
+	config.sessionWaitMs = 500;
+
+	for(int i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "--rate") == 0 && i + 1 < argc) {
+			config.rate = atof(argv[++i]);
+		} else if(strcmp(argv[i], "--duration") == 0 && i + 1 < argc) {
+			config.durationS = atof(argv[++i]);
+		} else if(strcmp(argv[i], "--agent-latency-us") == 0 && i + 1 < argc) {
+			config.agentLatencyUs = (uint32_t) atol(argv[++i]);
+		} else if(strcmp(argv[i], "--max-sessions") == 0 && i + 1 < argc) {
+			config.maxSessions = (size_t) atol(argv[++i]);
+		} else if(strcmp(argv[i], "--session-wait") == 0 && i + 1 < argc) {
+			config.sessionWaitMs = (uint32_t) atol(argv[++i]);
+		} else {
+			print_help(argv);
+			return 1;
+		}
+	}
+
+	if(config.rate <= 0) {
+		print_help(argv);
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	printf("%-10s %8s %8s %8s %8s %8s %10s %10s %10s %8s %9s\n",
+	       "mode",
+	       "conn/s",
+	       "answered",
+	       "refused",
+	       "timeout",
+	       "failed",
+	       "ok_p50_us",
+	       "ok_p99_us",
+	       "ref_p99_us",
+	       "threads",
+	       "rss_kb");
+
+	for(bool pooled : {false, true}) {
+		scenario_result result = runScenario(config, pooled);
+		latency_stats answered = computeLatencyStats(result.answered);
+		latency_stats refused = computeLatencyStats(result.refused);
+
+		printf("%-10s %8.0f %8zu %8zu %8llu %8llu %10.0f %10.0f %10.0f %8ld %9ld\n",
+		       pooled ? "pool" : "unbounded",
+		       result.achievedRate,
+		       answered.count,
+		       refused.count,
+		       (unsigned long long) result.timedOut,
+		       (unsigned long long) result.connectFailures,
+		       answered.p50Us,
+		       answered.p99Us,
+		       refused.p99Us,
+		       result.peakThreads,
+		       result.peakRssKb);
+		fflush(stdout);
+	}
+
+	return 0;
+}
@@ -0,0 +1,283 @@
+#include "bench/bench-common.h"
+#include "relay/agent-message.h"
+#include "relay/posix/coro-reactor.h"
+#include "relay/posix/epoll-reactor.h"
+#include "relay/posix/thread-server.h"
+#include "relay/posix/unix-socket.h"
+#include "relay/posix/uring-reactor.h"
+#include "relay/relay-stats.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#include <algorithm>
+
+uint64_t nowNs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+void bench_barrier::wait() {
+	std::unique_lock<std::mutex> lock(mutex);
+	size_t currentGeneration = generation;
+
+	if(++waiting == count) {
+		waiting = 0;
+		generation++;
+		condition.notify_all();
+	} else {
+		condition.wait(lock, [this, currentGeneration]() { return generation != currentGeneration; });
+	}
+}
+
+latency_stats computeLatencyStats(std::vector<uint64_t>& samples) {
+	latency_stats stats;
+
+	memset(&stats, 0, sizeof(stats));
+	stats.count = samples.size();
+	if(samples.empty())
+		return stats;
+
+	std::sort(samples.begin(), samples.end());
+
+	double total = 0;
+	for(uint64_t sample : samples) {
+		total += (double) sample;
+	}
+
+	auto percentile = [&samples](double p) {
+		size_t index = (size_t) (p * (double) (samples.size() - 1) + 0.5);
+		return (double) samples[index] / 1000.0;
+	};
+
+	stats.meanUs = total / (double) samples.size() / 1000.0;
+	stats.p50Us = percentile(0.50);
+	stats.p99Us = percentile(0.99);
+	stats.p999Us = percentile(0.999);
+	stats.maxUs = (double) samples.back() / 1000.0;
+
+	return stats;
+}
+
+std::vector<char> makeAgentMessage(uint8_t type, size_t payloadSize) {
+	std::vector<char> message(5 + payloadSize, 'x');
+	uint32_t length = (uint32_t) (1 + payloadSize);
+
+	message[0] = (char) (length >> 24);
+	message[1] = (char) (length >> 16);
+	message[2] = (char) (length >> 8);
+	message[3] = (char) (length >> 0);
+	message[4] = (char) type;
+
+	return message;
+}
+
+bool writeFull(SOCKET sock, const void* buffer, size_t size) {
+	const char* bufferChar = (const char*) buffer;
+	size_t written = 0;
+
+	while(written < size) {
+		ssize_t result = send(sock, bufferChar + written, size - written, MSG_NOSIGNAL);
+		if(result <= 0) {
+			if(result < 0 && errno == EINTR)
+				continue;
+			return false;
+		}
+		written += (size_t) result;
+	}
+
+	return true;
+}
+
+bool readFull(SOCKET sock, void* buffer, size_t size) {
+	char* bufferChar = (char*) buffer;
+	size_t totalRead = 0;
+
+	while(totalRead < size) {
+		ssize_t result = recv(sock, bufferChar + totalRead, size - totalRead, 0);
+		if(result <= 0) {
+			if(result < 0 && errno == EINTR)
+				continue;
+			return false;
+		}
+		totalRead += (size_t) result;
+	}
+
+	return true;
+}
+
+bool readFullAgentMessage(SOCKET sock, std::vector<char>& message) {
+	message.resize(4);
+	if(!readFull(sock, message.data(), 4))
+		return false;
+
+	uint32_t length = readu32(message.data());
+	if(length > AGENT_MAX_MSGLEN)
+		return false;
+
+	message.resize(4 + length);
+	return readFull(sock, message.data() + 4, length);
+}
+
+bool agentRoundTrip(SOCKET sock, const std::vector<char>& request, std::vector<char>& reply) {
+	if(!writeFull(sock, request.data(), request.size()))
+		return false;
+
+	return readFullAgentMessage(sock, reply);
+}
+
+uint64_t readProxyCounter(const std::string& proxyPath, const char* key) {
+	static const char name[] = RELAY_STATS_EXTENSION;
+	std::vector<char> request = makeAgentMessage(SSH_AGENTC_EXTENSION, 4 + sizeof(name) - 1);
+	std::vector<char> reply;
+
+	writeu32(request.data() + 5, sizeof(name) - 1);
+	memcpy(request.data() + 9, name, sizeof(name) - 1);
+
+	SOCKET sock = connectUnixSocket(proxyPath.c_str());
+	if(sock == INVALID_SOCKET)
+		return 0;
+	bool answered = agentRoundTrip(sock, request, reply);
+	closesocket(sock);
+	if(!answered)
+		return 0;
+
+	reply.push_back('\0');
+	const char* value = strstr(reply.data() + 9, key);
+	return value != NULL ? strtoull(value + strlen(key), NULL, 10) : 0;
+}
+
+bool readProcessStats(pid_t pid, process_stats* stats) {
+	char path[64];
+	char line[256];
+
+	snprintf(path, sizeof(path), "/proc/%d/status", (int) pid);
+
+	FILE* file = fopen(path, "r");
+	if(file == NULL)
+		return false;
+
+	memset(stats, 0, sizeof(*stats));
+	while(fgets(line, sizeof(line), file)) {
+		sscanf(line, "Threads: %ld", &stats->threads);
+		sscanf(line, "VmRSS: %ld", &stats->rssKb);
+		sscanf(line, "VmHWM: %ld", &stats->peakRssKb);
+	}
+
+	fclose(file);
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+	file = fopen(path, "r");
+	if(file == NULL)
+		return false;
+
+	// Skip the command name, it may contain spaces
+	unsigned long utime = 0;
+	unsigned long stime = 0;
+	if(fgets(line, sizeof(line), file)) {
+		char* fields = strrchr(line, ')');
+		if(fields != NULL)
+			sscanf(fields + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime);
+	}
+	stats->cpuUs = (double) (utime + stime) * 1e6 / (double) sysconf(_SC_CLK_TCK);
+
+	fclose(file);
+
+	return true;
+}
+
+pid_t startProxyProcess(const std::function<void()>& serve) {
+	fflush(stdout);
+
+	pid_t pid = fork();
+	if(pid < 0) {
+		printf("fork failed: %d\n", errno);
+		return -1;
+	}
+
+	if(pid == 0) {
+		if(freopen("/dev/null", "w", stdout) == NULL)
+			_exit(1);
+		serve();
+		_exit(0);
+	}
+
+	return pid;
+}
+
+void stopProxyProcess(pid_t pid) {
+	if(pid <= 0)
+		return;
+
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+}
+
+std::string makeTempSocketPath(const char* name) {
+	const char* tmpDir = getenv("TMPDIR");
+	char path[256];
+
+	snprintf(path, sizeof(path), "%s/%s-%d.sock", tmpDir ? tmpDir : "/tmp", name, (int) getpid());
+
+	return path;
+}
+
+const char* serverModeName(server_mode mode) {
+	switch(mode) {
+		case server_mode::threads:
+			return "threads";
+		case server_mode::epoll:
+			return "epoll";
+		case server_mode::io_uring:
+			return "io_uring";
+		case server_mode::coroutines:
+		default:
+			return "coroutines";
+	}
+}
+
+relay_fixture::~relay_fixture() {
+	stopProxyProcess(proxyPid);
+	if(!proxyPath.empty())
+		unlink(proxyPath.c_str());
+}
+
+bool startRelayFixture(relay_fixture& fixture,
+                       const char* name,
+                       server_mode mode,
+                       int eventLoopThreads,
+                       uint32_t agentLatencyUs) {
+	std::string agentPath = makeTempSocketPath((std::string(name) + "-agent").c_str());
+
+	fixture.proxyPath = makeTempSocketPath((std::string(name) + "-proxy").c_str());
+
+	SOCKET listenSock = listenUnixSocket(fixture.proxyPath.c_str(), SOMAXCONN);
+	if(listenSock == INVALID_SOCKET)
+		return false;
+
+	socket_connector connectUpstream = [agentPath]() { return connectUnixSocket(agentPath.c_str()); };
+
+	fixture.proxyPid = startProxyProcess([&]() {
+		if(mode == server_mode::epoll) {
+			epoll_reactor reactor(listenSock, connectUpstream, AGENT_MAX_MSGLEN);
+			reactor.run(eventLoopThreads);
+		} else if(mode == server_mode::io_uring) {
+			uring_reactor reactor(listenSock, connectUpstream, AGENT_MAX_MSGLEN);
+			reactor.run(eventLoopThreads);
+		} else if(mode == server_mode::coroutines) {
+			coro_reactor reactor(listenSock, connectUpstream, AGENT_MAX_MSGLEN);
+			reactor.run(eventLoopThreads);
+		} else {
+			serveThreadPerClient(listenSock, connectUpstream, AGENT_MAX_MSGLEN);
+		}
+	});
+	closesocket(listenSock);
+
+	fixture.agent = std::make_unique<stub_agent>(agentPath.c_str(), agentLatencyUs);
+	return fixture.proxyPid >= 0 && fixture.agent->start();
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include "bench/stub-agent.h"
+#include "relay/agent-message.h"
+#include "relay/socket-compat.h"
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Monotonic time in nanoseconds.
+uint64_t nowNs();
+
+// Block threads until count of them are waiting (C++17 has no std::barrier).
+class bench_barrier {
+public:
+	explicit bench_barrier(size_t count) : count(count), waiting(0), generation(0) {}
+
+	void wait();
+
+private:
+	std::mutex mutex;
+	std::condition_variable condition;
+	size_t count;
+	size_t waiting;
+	size_t generation;
+};
+
+struct latency_stats {
+	size_t count;
+	double meanUs;
+	double p50Us;
+	double p99Us;
+	double p999Us;
+	double maxUs;
+};
+
+// Compute latency percentiles of samples given in nanoseconds. samples is sorted in place.
+latency_stats computeLatencyStats(std::vector<uint64_t>& samples);
+
+// Build a complete agent message of the given type with payloadSize bytes of dummy payload.
+std::vector<char> makeAgentMessage(uint8_t type, size_t payloadSize);
+
+// Send request on sock and read one complete agent message into reply.
+// Returns false on error or if the connection was closed.
+bool agentRoundTrip(SOCKET sock, const std::vector<char>& request, std::vector<char>& reply);
+
+// Read one complete agent message from sock into message. Returns false on error or EOF.
+bool readFullAgentMessage(SOCKET sock, std::vector<char>& message);
+
+// Read exactly size bytes from sock. Returns false on error or EOF.
+bool readFull(SOCKET sock, void* buffer, size_t size);
+
+// Write the whole buffer to sock. Returns false on error.
+bool writeFull(SOCKET sock, const void* buffer, size_t size);
+
+// Value of a counter in the JSON statistics of the proxy listening on proxyPath, 0 if it cannot be read.
+// key is the text right before the value, like "\"rejected_requests\":".
+uint64_t readProxyCounter(const std::string& proxyPath, const char* key);
+
+struct process_stats {
+	long threads;
+	long rssKb;
+	long peakRssKb;
+	double cpuUs;  // user + system time of all threads, clock tick resolution
+};
+
+// Read thread count, memory usage and CPU time of a process from /proc.
+bool readProcessStats(pid_t pid, process_stats* stats);
+
+// Fork a child process running serve() with its standard output discarded, so the proxy
+// thread count and memory usage can be measured separately from the benchmark clients.
+// Must be called before the benchmark starts any thread. Returns the child pid or -1.
+pid_t startProxyProcess(const std::function<void()>& serve);
+
+// Kill and reap a process started by startProxyProcess.
+void stopProxyProcess(pid_t pid);
+
+// Make a unique socket path in the temporary directory.
+std::string makeTempSocketPath(const char* name);
+
+// Serving loops of the proxy compared by the benchmarks.
+enum class server_mode { threads, epoll, io_uring, coroutines };
+
+const char* serverModeName(server_mode mode);
+
+// Proxy process relaying a temporary socket to a stub agent, see startRelayFixture.
+// The destructor stops the proxy and removes its socket, then the agent.
+struct relay_fixture {
+	relay_fixture() : proxyPid(-1) {}
+	~relay_fixture();
+
+	relay_fixture(const relay_fixture&) = delete;
+	relay_fixture& operator=(const relay_fixture&) = delete;
+
+	std::string proxyPath;  // socket the clients connect to
+	pid_t proxyPid;
+	std::unique_ptr<stub_agent> agent;
+};
+
+// Start a proxy process serving with mode, on eventLoopThreads threads for the event loops, and a stub agent
+// answering after agentLatencyUs. name prefixes the socket paths. Like startProxyProcess, it must be called
+// before the benchmark starts any thread. Returns false if the proxy or the agent could not be started.
+bool startRelayFixture(relay_fixture& fixture,
+                       const char* name,
+                       server_mode mode,
+                       int eventLoopThreads,
+                       uint32_t agentLatencyUs);
@@ -0,0 +1,106 @@
+#include "bench/bench-common.h"
+#include "relay/agent-message.h"
+#include "relay/buffer-pool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <thread>
+#include <vector>
+
+// Cost of the per-session message buffers: two zero-filled AGENT_MAX_MSGLEN vectors per session
+// (the previous behavior) versus pooled buffers grown from the message length header.
+// Each simulated session handles a few messages with a realistic size mix: mostly small
+// identity/sign messages and an occasional large ADD_IDENTITY.
+
+static size_t messageSize(unsigned int* seed) {
+	int draw = rand_r(seed) % 1000;
+
+	if(draw < 950)
+		return 64 + rand_r(seed) % 900;
+	else if(draw < 998)
+		return 1024 + rand_r(seed) % 16384;
+	else
+		return 65536 + rand_r(seed) % 200000;
+}
+
+static void runVectorSessions(int sessions, int messagesPerSession, unsigned int seed) {
+	for(int i = 0; i < sessions; i++) {
+		std::vector<char> request(AGENT_MAX_MSGLEN);
+		std::vector<char> reply(AGENT_MAX_MSGLEN);
+
+		for(int j = 0; j < messagesPerSession; j++) {
+			size_t size = messageSize(&seed);
+			memset(&request[0], 1, size);
+			memcpy(&reply[0], &request[0], size);
+		}
+	}
+}
+
+static void runPooledSessions(int sessions, int messagesPerSession, unsigned int seed) {
+	for(int i = 0; i < sessions; i++) {
+		message_buffer request;
+		message_buffer reply;
+
+		for(int j = 0; j < messagesPerSession; j++) {
+			size_t size = messageSize(&seed);
+
+			request.reserve(BUFFER_POOL_SMALL_SIZE, 0);
+			request.reserve(size, 4);
+			reply.reserve(size, 0);
+			memset(request.data(), 1, size);
+			memcpy(reply.data(), request.data(), size);
+
+			request.shrink();
+			reply.shrink();
+		}
+	}
+}
+
+int main(int argc, char* argv[]) {
+	int threadCount = 8;
+	int sessionsPerThread = 2000;
+	int messagesPerSession = 4;
+
+	for(int i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+			threadCount = atoi(argv[++i]);
+		} else if(strcmp(argv[i], "--sessions") == 0 && i + 1 < argc) {
+			sessionsPerThread = atoi(argv[++i]);
+		} else if(strcmp(argv[i], "--messages") == 0 && i + 1 < argc) {
+			messagesPerSession = atoi(argv[++i]);
+		} else {
+			printf("Usage: %s [--threads count] [--sessions count] [--messages count]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	for(bool pooled : {false, true}) {
+		std::vector<std::thread> threads;
+		uint64_t start = nowNs();
+
+		for(int i = 0; i < threadCount; i++) {
+			threads.emplace_back(pooled ? runPooledSessions : runVectorSessions,
+			                     sessionsPerThread,
+			                     messagesPerSession,
+			                     (unsigned int) i + 1);
+		}
+		for(std::thread& thread : threads) {
+			thread.join();
+		}
+
+		double elapsedMs = (double) (nowNs() - start) / 1e6;
+		int sessions = threadCount * sessionsPerThread;
+
+		printf("%-8s %d sessions in %.1f ms, %.2f us/session\n",
+		       pooled ? "pooled" : "vector",
+		       sessions,
+		       elapsedMs,
+		       elapsedMs * 1000.0 / sessions);
+	}
+
+	printBufferPoolStats();
+
+	return 0;
+}
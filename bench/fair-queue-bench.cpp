@@ -0,0 +1,228 @@
+#include "bench/bench-common.h"
+#include "bench/stub-agent.h"
+#include "relay/agent-message.h"
+#include "relay/posix/thread-server.h"
+#include "relay/posix/unix-socket.h"
+#include "relay/upstream-scheduler.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Interactive client next to a bulk signer, in front of an agent handling one request at a time like ssh-agent
+// or Pageant: a separate flooder process keeps N connections sending sign requests back to back, while the
+// interactive client repeatedly connects and makes what an ssh login makes, one REQUEST_IDENTITIES then one
+// SIGN_REQUEST. Reports the latency of the interactive logins without flood, with flood through the plain
+// relay, and with flood through the relay with --fair-queue.
+
+enum class scenario { idle, flood_fifo, flood_fair };
+
+struct bench_config {
+	int flooders;
+	int logins;
+	uint32_t signLatencyUs;
+	uint32_t thinkMs;
+};
+
+struct scenario_result {
+	latency_stats identities;
+	latency_stats login;
+	size_t failedLogins;
+};
+
+static const char* scenarioName(scenario kind) {
+	switch(kind) {
+		case scenario::idle:
+			return "no-flood";
+		case scenario::flood_fifo:
+			return "flood-fifo";
+		case scenario::flood_fair:
+		default:
+			return "flood-fair";
+	}
+}
+
+static void print_help(char* argv[]) {
+	printf("Usage: %s [--flooders count] [--logins count] [--sign-latency-us us] [--think-ms ms]\n\n"
+	       " --flooders: connections of the bulk signer sending sign requests back to back (default 8)\n"
+	       " --logins: logins made by the interactive client (default 200)\n"
+	       " --sign-latency-us: time the stub agent spends on each sign request (default 2000)\n"
+	       " --think-ms: pause of the interactive client between logins (default 5)\n",
+	       argv[0]);
+}
+
+// Bulk signer, runs until killed. Connections are retried until the proxy and the agent are up.
+static void flood(const std::string& proxyPath, int connections) {
+	std::vector<std::thread> threads;
+
+	for(int i = 0; i < connections; i++) {
+		threads.emplace_back([proxyPath]() {
+			std::vector<char> request = makeAgentMessage(SSH2_AGENTC_SIGN_REQUEST, 128);
+			std::vector<char> reply;
+
+			for(;;) {
+				SOCKET sock = connectUnixSocket(proxyPath.c_str());
+				if(sock == INVALID_SOCKET) {
+					std::this_thread::sleep_for(std::chrono::milliseconds(10));
+					continue;
+				}
+				while(agentRoundTrip(sock, request, reply)) {
+				}
+				closesocket(sock);
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			}
+		});
+	}
+
+	for(std::thread& thread : threads) {
+		thread.join();
+	}
+}
+
+static scenario_result runScenario(scenario kind, const bench_config& config) {
+	std::string proxyPath = makeTempSocketPath("fair-queue-bench-proxy");
+	std::string agentPath = makeTempSocketPath("fair-queue-bench-agent");
+	scenario_result result;
+
+	memset(&result, 0, sizeof(result));
+
+	SOCKET listenSock = listenUnixSocket(proxyPath.c_str(), SOMAXCONN);
+	if(listenSock == INVALID_SOCKET) {
+		result.failedLogins = config.logins;
+		return result;
+	}
+
+	socket_connector connectUpstream = [agentPath]() { return connectUnixSocket(agentPath.c_str()); };
+
+	// Both processes are forked before the stub agent starts its threads
+	pid_t proxyPid = startProxyProcess([&]() {
+		upstream_scheduler* scheduler = NULL;
+		if(kind == scenario::flood_fair)
+			scheduler = new upstream_scheduler(1, UPSTREAM_SCHEDULER_DEFAULT_CLIENT_INFLIGHT);
+		serveThreadPerClient(listenSock,
+		                     connectUpstream,
+		                     AGENT_MAX_MSGLEN,
+		                     NULL,
+		                     NULL,
+		                     THREAD_SERVER_DEFAULT_ACCEPTORS,
+		                     NULL,
+		                     scheduler);
+	});
+	closesocket(listenSock);
+
+	pid_t flooderPid = -1;
+	if(kind != scenario::idle)
+		flooderPid = startProxyProcess([&]() { flood(proxyPath, config.flooders); });
+
+	stub_agent agent(agentPath.c_str(), 0);
+	agent.setSignLatency(config.signLatencyUs);
+	agent.setSerialized(true);
+	if(proxyPid < 0 || (kind != scenario::idle && flooderPid < 0) || !agent.start()) {
+		stopProxyProcess(flooderPid);
+		stopProxyProcess(proxyPid);
+		unlink(proxyPath.c_str());
+		result.failedLogins = config.logins;
+		return result;
+	}
+
+	// Let the flooder reach its steady state
+	if(kind != scenario::idle)
+		std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+	std::vector<char> identitiesRequest = makeAgentMessage(SSH2_AGENTC_REQUEST_IDENTITIES, 0);
+	std::vector<char> signRequest = makeAgentMessage(SSH2_AGENTC_SIGN_REQUEST, 128);
+	std::vector<char> reply;
+	std::vector<uint64_t> identitiesSamples;
+	std::vector<uint64_t> loginSamples;
+
+	for(int i = 0; i < config.logins; i++) {
+		uint64_t start = nowNs();
+		SOCKET sock = connectUnixSocket(proxyPath.c_str());
+		if(sock == INVALID_SOCKET || !agentRoundTrip(sock, identitiesRequest, reply)) {
+			if(sock != INVALID_SOCKET)
+				closesocket(sock);
+			result.failedLogins++;
+			continue;
+		}
+		identitiesSamples.push_back(nowNs() - start);
+
+		if(!agentRoundTrip(sock, signRequest, reply)) {
+			closesocket(sock);
+			result.failedLogins++;
+			continue;
+		}
+		loginSamples.push_back(nowNs() - start);
+		closesocket(sock);
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(config.thinkMs));
+	}
+
+	result.identities = computeLatencyStats(identitiesSamples);
+	result.login = computeLatencyStats(loginSamples);
+
+	stopProxyProcess(flooderPid);
+	stopProxyProcess(proxyPid);
+	unlink(proxyPath.c_str());
+
+	return result;
+}
+
+int main(int argc, char* argv[]) {
+	bench_config config;
+
+	config.flooders = 8;
+	config.logins = 200;
+	config.signLatencyUs = 2000;
+	config.thinkMs = 5;
+
+	for(int i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "--flooders") == 0 && i + 1 < argc) {
+			config.flooders = atoi(argv[++i]);
+		} else if(strcmp(argv[i], "--logins") == 0 && i + 1 < argc) {
+			config.logins = atoi(argv[++i]);
+		} else if(strcmp(argv[i], "--sign-latency-us") == 0 && i + 1 < argc) {
+			config.signLatencyUs = (uint32_t) strtoul(argv[++i], NULL, 10);
+		} else if(strcmp(argv[i], "--think-ms") == 0 && i + 1 < argc) {
+			config.thinkMs = (uint32_t) strtoul(argv[++i], NULL, 10);
+		} else {
+			print_help(argv);
+			return 1;
+		}
+	}
+
+	if(config.flooders <= 0 || config.logins <= 0) {
+		print_help(argv);
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	printf("%-12s %14s %14s %12s %12s %8s\n",
+	       "scenario",
+	       "list_p50_us",
+	       "list_p99_us",
+	       "login_p50_us",
+	       "login_p99_us",
+	       "failed");
+
+	for(scenario kind : {scenario::idle, scenario::flood_fifo, scenario::flood_fair}) {
+		scenario_result result = runScenario(kind, config);
+
+		printf("%-12s %14.1f %14.1f %12.1f %12.1f %8zu\n",
+		       scenarioName(kind),
+		       result.identities.p50Us,
+		       result.identities.p99Us,
+		       result.login.p50Us,
+		       result.login.p99Us,
+		       result.failedLogins);
+		fflush(stdout);
+	}
+
+	return 0;
+}
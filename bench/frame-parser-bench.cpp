@@ -0,0 +1,175 @@
+#include "bench/bench-common.h"
+#include "relay/agent-message.h"
+#include "relay/frame-parser.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+// Frames parsed per second by agent_frame_parser for typical agent message sizes, with the stream
+// delivered in large coalesced reads or split in small chunks. The baseline reads the length header
+// then the payload separately so it never reads past a frame, like readAgentMessage used to for
+// pipelined connections. Reads come from memory, so this measures parsing and copying only;
+// the read count per frame is what a socket would turn into system calls.
+
+struct memory_stream {
+	const std::vector<char>* data;
+	size_t offset;
+	size_t chunkSize;  // largest read, 0 for no limit
+	uint64_t reads;
+
+	int32_t read(const agent_read_span* spans, int count) {
+		size_t available = data->size() - offset;
+		int32_t total = 0;
+
+		if(chunkSize > 0 && available > chunkSize)
+			available = chunkSize;
+		reads++;
+
+		for(int i = 0; i < count && available > 0; i++) {
+			size_t size = (size_t) spans[i].size < available ? (size_t) spans[i].size : available;
+			memcpy(spans[i].data, data->data() + offset, size);
+			offset += size;
+			available -= size;
+			total += (int32_t) size;
+		}
+
+		return total;
+	}
+};
+
+struct run_result {
+	double framesPerSecond;
+	double readsPerFrame;
+};
+
+static run_result runParser(const std::vector<char>& stream, size_t frameCount, size_t chunkSize, int iterations) {
+	memory_stream source = {&stream, 0, chunkSize, 0};
+	agent_frame_parser parser;
+	message_buffer buffer;
+	size_t frames = 0;
+
+	uint64_t start = nowNs();
+	for(int i = 0; i < iterations; i++) {
+		source.offset = 0;
+		parser.reset();
+		for(size_t j = 0; j < frameCount; j++) {
+			int32_t size = readAgentMessage(
+			    [&source](const agent_read_span* spans, int count) { return source.read(spans, count); },
+			    parser,
+			    buffer,
+			    AGENT_MAX_MSGLEN);
+			if(size <= 0) {
+				printf("Parse error at frame %zu: %d\n", j, size);
+				exit(1);
+			}
+			frames++;
+		}
+	}
+	uint64_t elapsed = nowNs() - start;
+
+	return {(double) frames * 1e9 / (double) elapsed, (double) source.reads / (double) frames};
+}
+
+static int32_t readExact(memory_stream& source, message_buffer& buffer) {
+	int32_t byteRead = 0;
+	int32_t messageSize = 4;
+
+	if(!buffer.reserve(BUFFER_POOL_SMALL_SIZE, 0))
+		return -1;
+
+	while(byteRead < messageSize) {
+		agent_read_span span = {buffer.data() + byteRead, messageSize - byteRead};
+		int32_t result = source.read(&span, 1);
+		if(result <= 0)
+			return result;
+		byteRead += result;
+
+		if(byteRead == 4) {
+			messageSize = (int32_t) readu32(buffer.data()) + 4;
+			if(!buffer.reserve(messageSize, 4))
+				return -1;
+		}
+	}
+
+	return byteRead;
+}
+
+static run_result runExact(const std::vector<char>& stream, size_t frameCount, size_t chunkSize, int iterations) {
+	memory_stream source = {&stream, 0, chunkSize, 0};
+	message_buffer buffer;
+	size_t frames = 0;
+
+	uint64_t start = nowNs();
+	for(int i = 0; i < iterations; i++) {
+		source.offset = 0;
+		for(size_t j = 0; j < frameCount; j++) {
+			if(readExact(source, buffer) <= 0) {
+				printf("Read error at frame %zu\n", j);
+				exit(1);
+			}
+			buffer.shrink();
+			frames++;
+		}
+	}
+	uint64_t elapsed = nowNs() - start;
+
+	return {(double) frames * 1e9 / (double) elapsed, (double) source.reads / (double) frames};
+}
+
+int main(int argc, char* argv[]) {
+	std::vector<size_t> payloadSizes = {1, 400, 1500, 70000};
+	size_t streamBytes = 8 * 1024 * 1024;
+	int iterations = 5;
+
+	for(int i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "--sizes") == 0 && i + 1 < argc) {
+			payloadSizes.clear();
+			for(char* token = strtok(argv[++i], ","); token != NULL; token = strtok(NULL, ",")) {
+				payloadSizes.push_back((size_t) atol(token));
+			}
+		} else if(strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) {
+			iterations = atoi(argv[++i]);
+		} else {
+			printf("Usage: %s [--sizes 1,400,1500,70000] [--iterations count]\n\n"
+			       " --sizes: comma separated payload sizes, type byte included\n"
+			       " --iterations: passes over the %zu MB stream of each size\n",
+			       argv[0],
+			       streamBytes / (1024 * 1024));
+			return 1;
+		}
+	}
+
+	printf("%-8s %-10s %-9s %14s %12s\n", "payload", "delivery", "parser", "frames/s", "reads/frame");
+
+	for(size_t payloadSize : payloadSizes) {
+		std::vector<char> frame = makeAgentMessage(SSH2_AGENTC_SIGN_REQUEST, payloadSize - 1);
+		size_t frameCount = streamBytes / frame.size() + 1;
+		std::vector<char> stream;
+
+		stream.reserve(frameCount * frame.size());
+		for(size_t i = 0; i < frameCount; i++) {
+			stream.insert(stream.end(), frame.begin(), frame.end());
+		}
+
+		// Coalesced: the whole pipelined stream is available to every read. Split: at most 256 bytes per read.
+		for(size_t chunkSize : {(size_t) 0, (size_t) 256}) {
+			for(bool incremental : {false, true}) {
+				run_result result = incremental ? runParser(stream, frameCount, chunkSize, iterations)
+				                                : runExact(stream, frameCount, chunkSize, iterations);
+
+				printf("%-8zu %-10s %-9s %14.0f %12.2f\n",
+				       payloadSize,
+				       chunkSize == 0 ? "coalesced" : "split-256",
+				       incremental ? "parser" : "exact",
+				       result.framesPerSecond,
+				       result.readsPerFrame);
+				fflush(stdout);
+			}
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,236 @@
+#include "relay/agent-message.h"
+#include "relay/frame-parser.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <string>
+#include <vector>
+
+// Fuzz target of agent_frame_parser, checking every frame it returns against a plain sequential
+// split of the same stream, whatever the read sizes are.
+// The same inputs make a performance corpus: without libFuzzer, main() replays the files given
+// on the command line (or a generated corpus) and reports the throughput.
+// libFuzzer build, on one line:
+//   clang++ -std=c++17 -g -O1 -fsanitize=fuzzer,address -DFRAME_PARSER_LIBFUZZER -I.
+//     bench/frame-parser-fuzz.cpp relay/frame-parser.cpp relay/buffer-pool.cpp relay/logger.cpp -o frame-parser-fuzz
+//
+// Input layout: byte 0 selects the reads (bit 0: single span reads, other bits: seed of the read sizes),
+// bytes 1-2 the maximum frame size in 64 bytes units and the rest is the stream.
+
+struct fuzz_stream {
+	const uint8_t* data;
+	size_t size;
+	size_t offset;
+	uint32_t seed;
+	bool singleSpan;
+
+	int32_t read(const agent_read_span* spans, int count) {
+		size_t available = size - offset;
+		int32_t total = 0;
+
+		// Read sizes from tiny to unlimited
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		static const size_t limits[] = {1, 2, 3, 5, 8, 64, 4096, SIZE_MAX};
+		size_t limit = limits[seed % (sizeof(limits) / sizeof(limits[0]))];
+		if(available > limit)
+			available = limit;
+
+		if(singleSpan)
+			count = 1;
+		for(int i = 0; i < count && available > 0; i++) {
+			size_t chunk = (size_t) spans[i].size < available ? (size_t) spans[i].size : available;
+			memcpy(spans[i].data, data + offset, chunk);
+			offset += chunk;
+			available -= chunk;
+			total += (int32_t) chunk;
+		}
+
+		return total;
+	}
+};
+
+extern "C" int LLVMFuzzerInitialize(int* /* argc */, char*** /* argv */) {
+	// Oversized frames are expected
+	setLogLevel(log_level::error);
+	return 0;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+	if(size < 3)
+		return 0;
+
+	int32_t maxSize = (int32_t) ((data[1] << 8) | data[2]) * 64 + 4;
+	fuzz_stream stream = {data + 3, size - 3, 0, (uint32_t) data[0] | 0x100, (data[0] & 1) != 0};
+	agent_frame_parser parser;
+	message_buffer buffer;
+	size_t offset = 0;
+
+	for(;;) {
+		// Expected result from a sequential split
+		int32_t expected = 0;
+		if(stream.size - offset >= 4) {
+			uint32_t length = readu32(stream.data + offset);
+			if(length > (uint32_t) maxSize - 4)
+				expected = -1;
+			else if(stream.size - offset >= length + 4)
+				expected = (int32_t) length + 4;
+		}
+
+		int32_t result = readAgentMessage(
+		    [&stream](const agent_read_span* spans, int count) { return stream.read(spans, count); },
+		    parser,
+		    buffer,
+		    maxSize);
+
+		if(result != expected || (result > 0 && memcmp(buffer.data(), stream.data + offset, result) != 0)) {
+			fprintf(stderr, "Frame at offset %zu: got %d, expected %d\n", offset, result, expected);
+			abort();
+		}
+		if(result <= 0)
+			return 0;
+
+		offset += result;
+	}
+}
+
+#ifndef FRAME_PARSER_LIBFUZZER
+static void appendFrame(std::string& input, uint32_t length, unsigned int* seed) {
+	for(int shift = 24; shift >= 0; shift -= 8) {
+		input.push_back((char) (length >> shift));
+	}
+	for(uint32_t i = 0; i < length; i++) {
+		input.push_back((char) rand_r(seed));
+	}
+}
+
+// Pipelined streams of typical agent message sizes, some ending with a truncated or oversized frame.
+static std::string generateInput(unsigned int* seed) {
+	std::string input;
+	int frameCount = 1 + rand_r(seed) % 32;
+
+	input.push_back((char) rand_r(seed));
+	input.push_back((char) 0x10);  // 1 MB maximum frame size
+	input.push_back((char) 0x00);
+
+	for(int i = 0; i < frameCount; i++) {
+		int draw = rand_r(seed) % 100;
+		if(draw < 40)
+			appendFrame(input, 1, seed);
+		else if(draw < 80)
+			appendFrame(input, 100 + rand_r(seed) % 1000, seed);
+		else if(draw < 97)
+			appendFrame(input, 1000 + rand_r(seed) % 8000, seed);
+		else
+			appendFrame(input, 65536 + rand_r(seed) % 65536, seed);
+	}
+
+	switch(rand_r(seed) % 8) {
+		case 0:
+			input.resize(input.size() - rand_r(seed) % 8);
+			break;
+		case 1:
+			input.append("\x7f\xff\xff\xff", 4);
+			break;
+		default:
+			break;
+	}
+
+	return input;
+}
+
+static bool readFile(const char* path, std::string& content) {
+	FILE* file = fopen(path, "rb");
+	char chunk[65536];
+	size_t size;
+
+	if(file == NULL)
+		return false;
+	while((size = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+		content.append(chunk, size);
+	}
+	fclose(file);
+
+	return true;
+}
+
+int main(int argc, char* argv[]) {
+	std::vector<std::string> corpus;
+	const char* generateDir = NULL;
+	int iterations = 20;
+	int generateCount = 1000;
+
+	for(int i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "--generate") == 0 && i + 2 < argc) {
+			generateDir = argv[++i];
+			generateCount = atoi(argv[++i]);
+		} else if(strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) {
+			iterations = atoi(argv[++i]);
+		} else if(argv[i][0] != '-') {
+			std::string content;
+			if(!readFile(argv[i], content)) {
+				printf("Cannot read %s\n", argv[i]);
+				return 1;
+			}
+			corpus.push_back(content);
+		} else {
+			printf("Usage: %s [--generate dir count] [--iterations count] [corpus_file...]\n\n"
+			       " --generate: write count generated inputs to dir, to seed a fuzzer\n"
+			       " --iterations: passes over the corpus\n"
+			       " Without corpus files, replays count generated inputs.\n",
+			       argv[0]);
+			return 1;
+		}
+	}
+
+	LLVMFuzzerInitialize(&argc, &argv);
+
+	if(corpus.empty()) {
+		unsigned int seed = 1;
+		for(int i = 0; i < generateCount; i++) {
+			corpus.push_back(generateInput(&seed));
+		}
+	}
+
+	if(generateDir != NULL) {
+		for(size_t i = 0; i < corpus.size(); i++) {
+			std::string path = std::string(generateDir) + "/frames-" + std::to_string(i);
+			FILE* file = fopen(path.c_str(), "wb");
+			if(file == NULL || fwrite(corpus[i].data(), 1, corpus[i].size(), file) != corpus[i].size()) {
+				printf("Cannot write %s\n", path.c_str());
+				return 1;
+			}
+			fclose(file);
+		}
+		printf("Wrote %zu inputs to %s\n", corpus.size(), generateDir);
+		return 0;
+	}
+
+	size_t totalBytes = 0;
+	struct timespec start;
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(int i = 0; i < iterations; i++) {
+		for(const std::string& input : corpus) {
+			LLVMFuzzerTestOneInput((const uint8_t*) input.data(), input.size());
+			totalBytes += input.size();
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double elapsed = (double) (end.tv_sec - start.tv_sec) + (double) (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%zu inputs x %d: %.0f inputs/s, %.1f MB/s, all frames matched\n",
+	       corpus.size(),
+	       iterations,
+	       (double) corpus.size() * iterations / elapsed,
+	       (double) totalBytes / elapsed / 1e6);
+
+	return 0;
+}
+#endif
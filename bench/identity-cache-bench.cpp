@@ -0,0 +1,252 @@
+#include "bench/bench-common.h"
+#include "bench/stub-agent.h"
+#include "relay/agent-message.h"
+#include "relay/identity-cache.h"
+#include "relay/posix/epoll-reactor.h"
+#include "relay/posix/thread-server.h"
+#include "relay/posix/unix-socket.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Replay the agent traffic of short ssh invocations: each client session connects to the proxy,
+// lists the identities, signs once and disconnects. The stub agent delays every reply to simulate
+// an agent behind Pageant or a slow transport. Every few sessions a key is added to check the
+// cache is invalidated. Upstream REQUEST_IDENTITIES are counted by the stub agent.
+// Then checks that sessions bound with session-bind@openssh.com, whose identity lists the agent filters for
+// their connection, never get a cached list nor fill the cache, with the blocking loop and the event loop.
+
+struct scenario_result {
+	latency_stats listLatency;
+	latency_stats sessionLatency;
+	uint64_t upstreamListRequests;
+	uint64_t listRequests;
+};
+
+static void print_help(char* argv[]) {
+	printf("Usage: %s [--sessions count] [--parallel count] [--latency-us us] [--ttl-ms ms] [--add-every count]\n\n"
+	       " --sessions: sessions made by each parallel client\n"
+	       " --parallel: clients running sessions at the same time\n"
+	       " --latency-us: delay added by the stub agent to each reply\n"
+	       " --ttl-ms: identity cache TTL when the cache is enabled\n"
+	       " --add-every: send an ADD_IDENTITY request every that many sessions, 0 to disable\n",
+	       argv[0]);
+}
+
+static scenario_result
+runScenario(uint32_t ttlMs, int sessions, int parallel, uint32_t latencyUs, int addEvery) {
+	std::string proxyPath = makeTempSocketPath("identity-cache-bench-proxy");
+	std::string agentPath = makeTempSocketPath("identity-cache-bench-agent");
+	std::vector<uint64_t> listSamples;
+	std::vector<uint64_t> sessionSamples;
+	scenario_result result;
+
+	result.upstreamListRequests = 0;
+	result.listRequests = 0;
+
+	stub_agent agent(agentPath.c_str(), latencyUs);
+	if(!agent.start()) {
+		result.listLatency = computeLatencyStats(listSamples);
+		result.sessionLatency = computeLatencyStats(sessionSamples);
+		return result;
+	}
+
+	SOCKET listenSock = listenUnixSocket(proxyPath.c_str(), SOMAXCONN);
+	pid_t proxyPid = startProxyProcess([&]() {
+		std::unique_ptr<identity_cache> cache;
+		if(ttlMs > 0)
+			cache = std::make_unique<identity_cache>(ttlMs);
+
+		serveThreadPerClient(
+		    listenSock, [&agentPath]() { return connectUnixSocket(agentPath.c_str()); }, AGENT_MAX_MSGLEN, cache.get());
+	});
+	closesocket(listenSock);
+
+	std::vector<std::vector<uint64_t>> clientListSamples(parallel);
+	std::vector<std::vector<uint64_t>> clientSessionSamples(parallel);
+	std::vector<std::thread> clients;
+
+	for(int i = 0; i < parallel && proxyPid > 0; i++) {
+		clients.emplace_back([&, i]() {
+			std::vector<char> listRequest = makeAgentMessage(SSH2_AGENTC_REQUEST_IDENTITIES, 0);
+			std::vector<char> signRequest = makeAgentMessage(SSH2_AGENTC_SIGN_REQUEST, 256);
+			std::vector<char> addRequest = makeAgentMessage(SSH2_AGENTC_ADD_IDENTITY, 128);
+			std::vector<char> reply;
+
+			for(int j = 0; j < sessions; j++) {
+				uint64_t start = nowNs();
+				SOCKET sock = connectUnixSocket(proxyPath.c_str());
+				if(sock == INVALID_SOCKET)
+					continue;
+
+				uint64_t listStart = nowNs();
+				bool success = agentRoundTrip(sock, listRequest, reply);
+				uint64_t listEnd = nowNs();
+
+				success = success && agentRoundTrip(sock, signRequest, reply);
+				if(addEvery > 0 && j % addEvery == addEvery - 1)
+					success = success && agentRoundTrip(sock, addRequest, reply);
+				closesocket(sock);
+
+				if(success) {
+					clientListSamples[i].push_back(listEnd - listStart);
+					clientSessionSamples[i].push_back(nowNs() - start);
+				}
+			}
+		});
+	}
+
+	for(std::thread& client : clients) {
+		client.join();
+	}
+
+	stopProxyProcess(proxyPid);
+	unlink(proxyPath.c_str());
+
+	for(int i = 0; i < parallel; i++) {
+		listSamples.insert(listSamples.end(), clientListSamples[i].begin(), clientListSamples[i].end());
+		sessionSamples.insert(sessionSamples.end(), clientSessionSamples[i].begin(), clientSessionSamples[i].end());
+	}
+
+	result.listLatency = computeLatencyStats(listSamples);
+	result.sessionLatency = computeLatencyStats(sessionSamples);
+	result.upstreamListRequests = agent.getRequestCount(SSH2_AGENTC_REQUEST_IDENTITIES);
+	result.listRequests = listSamples.size();
+
+	return result;
+}
+
+// Identity lists of bound sessions which were not forwarded to the agent, 0 unless the cache leaks across bindings
+static uint64_t checkBoundSessions(bool eventLoop) {
+	static const char bindName[] = "session-bind@openssh.com";
+	std::string proxyPath = makeTempSocketPath("identity-cache-bench-bound-proxy");
+	std::string agentPath = makeTempSocketPath("identity-cache-bench-bound-agent");
+
+	stub_agent agent(agentPath.c_str(), 0);
+	if(!agent.start())
+		return UINT64_MAX;
+
+	SOCKET listenSock = listenUnixSocket(proxyPath.c_str(), SOMAXCONN);
+	pid_t proxyPid = startProxyProcess([&]() {
+		identity_cache cache(60000);
+		socket_connector connectUpstream = [&agentPath]() { return connectUnixSocket(agentPath.c_str()); };
+
+		if(eventLoop) {
+			epoll_reactor reactor(listenSock, connectUpstream, AGENT_MAX_MSGLEN, &cache);
+			reactor.run(1);
+		} else {
+			serveThreadPerClient(listenSock, connectUpstream, AGENT_MAX_MSGLEN, &cache);
+		}
+	});
+	closesocket(listenSock);
+	if(proxyPid < 0)
+		return UINT64_MAX;
+
+	std::vector<char> listRequest = makeAgentMessage(SSH2_AGENTC_REQUEST_IDENTITIES, 0);
+	std::vector<char> bindRequest = makeAgentMessage(SSH_AGENTC_EXTENSION, 4 + sizeof(bindName) - 1 + 64);
+	std::vector<char> reply;
+	uint64_t boundLists = 0;
+	bool success = true;
+
+	writeu32(bindRequest.data() + 5, sizeof(bindName) - 1);
+	memcpy(bindRequest.data() + 9, bindName, sizeof(bindName) - 1);
+
+	// A bound session on an empty cache, an unbound one listing twice (one miss, then a hit on its own list),
+	// and a bound session on the warm cache
+	for(int bound : {1, 0, 1}) {
+		SOCKET sock = connectUnixSocket(proxyPath.c_str());
+		success = success && sock != INVALID_SOCKET && (!bound || agentRoundTrip(sock, bindRequest, reply));
+		for(int i = 0; i < 2 && success; i++) {
+			success = agentRoundTrip(sock, listRequest, reply);
+			boundLists += bound;
+		}
+		if(sock != INVALID_SOCKET)
+			closesocket(sock);
+	}
+
+	stopProxyProcess(proxyPid);
+	unlink(proxyPath.c_str());
+
+	uint64_t upstreamLists = agent.getRequestCount(SSH2_AGENTC_REQUEST_IDENTITIES);
+	if(!success)
+		return UINT64_MAX;
+	return boundLists + 1 > upstreamLists ? boundLists + 1 - upstreamLists : 0;
+}
+
+int main(int argc, char* argv[]) {
+	int sessions = 500;
+	int parallel = 4;
+	uint32_t latencyUs = 1000;
+	uint32_t ttlMs = 5000;
+	int addEvery = 100;
+
+	for(int i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "--sessions") == 0 && i + 1 < argc) {
+			sessions = atoi(argv[++i]);
+		} else if(strcmp(argv[i], "--parallel") == 0 && i + 1 < argc) {
+			parallel = atoi(argv[++i]);
+		} else if(strcmp(argv[i], "--latency-us") == 0 && i + 1 < argc) {
+			latencyUs = (uint32_t) atoi(argv[++i]);
+		} else if(strcmp(argv[i], "--ttl-ms") == 0 && i + 1 < argc) {
+			ttlMs = (uint32_t) atoi(argv[++i]);
+		} else if(strcmp(argv[i], "--add-every") == 0 && i + 1 < argc) {
+			addEvery = atoi(argv[++i]);
+		} else {
+			print_help(argv);
+			return 1;
+		}
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	printf("%-8s %8s %9s %12s %12s %12s %14s %14s\n",
+	       "cache",
+	       "lists",
+	       "upstream",
+	       "hit_rate",
+	       "list_p50_us",
+	       "list_p99_us",
+	       "session_p50_us",
+	       "session_p99_us");
+
+	for(uint32_t ttl : {(uint32_t) 0, ttlMs}) {
+		scenario_result result = runScenario(ttl, sessions, parallel, latencyUs, addEvery);
+		double hitRate = 0;
+
+		if(result.listRequests > 0 && result.upstreamListRequests < result.listRequests)
+			hitRate = 1.0 - (double) result.upstreamListRequests / result.listRequests;
+
+		printf("%-8s %8llu %9llu %11.1f%% %12.1f %12.1f %14.1f %14.1f\n",
+		       ttl > 0 ? "on" : "off",
+		       (unsigned long long) result.listRequests,
+		       (unsigned long long) result.upstreamListRequests,
+		       hitRate * 100,
+		       result.listLatency.p50Us,
+		       result.listLatency.p99Us,
+		       result.sessionLatency.p50Us,
+		       result.sessionLatency.p99Us);
+		fflush(stdout);
+	}
+
+	int failures = 0;
+	for(bool eventLoop : {false, true}) {
+		uint64_t cachedLists = checkBoundSessions(eventLoop);
+		if(cachedLists == UINT64_MAX)
+			printf("bound sessions, %s: failed to run\n", eventLoop ? "epoll" : "threads");
+		else
+			printf("bound sessions, %s: %llu lists answered from the cache\n",
+			       eventLoop ? "epoll" : "threads",
+			       (unsigned long long) cachedLists);
+		if(cachedLists != 0)
+			failures++;
+	}
+
+	return failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,163 @@
+#include "bench/bench-common.h"
+#include "relay/agent-message.h"
+#include "relay/posix/unix-socket.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Cost of idle sessions, like ssh ControlMaster connections or IDEs keeping an agent connection open:
+// N clients connect, make one request and stay connected without sending anything. Reports the proxy
+// threads and memory per idle session for the blocking thread-per-client loop, the epoll event loop,
+// the io_uring event loop and the coroutine sessions of coro_reactor, and the round-trip latency of one active
+// client while the idle ones are connected.
+
+struct scenario_result {
+	process_stats baseline;  // proxy with only the active client connected
+	process_stats idle;      // proxy with every idle client connected
+	latency_stats latency;
+	size_t failedClients;
+};
+
+static void print_help(char* argv[]) {
+	printf("Usage: %s [--idle 100,1000,4000] [--requests count] [--threads count]\n\n"
+	       " --idle: comma separated list of idle client counts\n"
+	       " --requests: round trips made by the active client\n"
+	       " --threads: event loop thread count of the epoll, io_uring and coroutines modes\n",
+	       argv[0]);
+}
+
+static scenario_result runScenario(server_mode mode, size_t idleCount, int requests, int eventLoopThreads) {
+	relay_fixture fixture;
+	scenario_result result;
+
+	memset(&result, 0, sizeof(result));
+
+	if(!startRelayFixture(fixture, "idle-session-bench", mode, eventLoopThreads, 0)) {
+		result.failedClients = idleCount + 1;
+		return result;
+	}
+	const std::string& proxyPath = fixture.proxyPath;
+	pid_t proxyPid = fixture.proxyPid;
+
+	std::vector<char> request = makeAgentMessage(SSH2_AGENTC_REQUEST_IDENTITIES, 0);
+	std::vector<char> reply;
+
+	SOCKET activeSock = connectUnixSocket(proxyPath.c_str());
+	if(activeSock == INVALID_SOCKET || !agentRoundTrip(activeSock, request, reply)) {
+		if(activeSock != INVALID_SOCKET)
+			closesocket(activeSock);
+		result.failedClients = idleCount + 1;
+		return result;
+	}
+
+	// Let threads started by the first session settle before taking the baseline
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	readProcessStats(proxyPid, &result.baseline);
+
+	// Each idle client makes one round trip so its session is fully set up, then stays quiet
+	std::vector<SOCKET> idleSocks;
+	idleSocks.reserve(idleCount);
+	for(size_t i = 0; i < idleCount; i++) {
+		SOCKET sock = connectUnixSocket(proxyPath.c_str());
+		if(sock == INVALID_SOCKET || !agentRoundTrip(sock, request, reply)) {
+			result.failedClients++;
+			if(sock != INVALID_SOCKET)
+				closesocket(sock);
+			continue;
+		}
+		idleSocks.push_back(sock);
+	}
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	readProcessStats(proxyPid, &result.idle);
+
+	std::vector<uint64_t> samples;
+	samples.reserve(requests);
+	for(int i = 0; i < requests; i++) {
+		uint64_t start = nowNs();
+		if(!agentRoundTrip(activeSock, request, reply)) {
+			result.failedClients++;
+			break;
+		}
+		samples.push_back(nowNs() - start);
+	}
+	result.latency = computeLatencyStats(samples);
+
+	closesocket(activeSock);
+	for(SOCKET sock : idleSocks) {
+		closesocket(sock);
+	}
+
+	return result;
+}
+
+int main(int argc, char* argv[]) {
+	std::vector<size_t> idleCounts = {100, 1000, 4000};
+	int requests = 2000;
+	int eventLoopThreads = 1;
+
+	for(int i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "--idle") == 0 && i + 1 < argc) {
+			idleCounts.clear();
+			char* list = argv[++i];
+			for(char* token = strtok(list, ","); token != NULL; token = strtok(NULL, ",")) {
+				idleCounts.push_back((size_t) strtoul(token, NULL, 10));
+			}
+		} else if(strcmp(argv[i], "--requests") == 0 && i + 1 < argc) {
+			requests = atoi(argv[++i]);
+		} else if(strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+			eventLoopThreads = atoi(argv[++i]);
+		} else {
+			print_help(argv);
+			return 1;
+		}
+	}
+
+	if(idleCounts.empty() || requests <= 0 || eventLoopThreads <= 0) {
+		print_help(argv);
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	printf("%-10s %8s %8s %10s %12s %10s %10s %8s\n",
+	       "mode",
+	       "idle",
+	       "threads",
+	       "rss_kb",
+	       "kb_per_idle",
+	       "p50_us",
+	       "p99_us",
+	       "failed");
+
+	for(size_t idleCount : idleCounts) {
+		for(server_mode mode :
+		     {server_mode::threads, server_mode::epoll, server_mode::io_uring, server_mode::coroutines}) {
+			scenario_result result = runScenario(mode, idleCount, requests, eventLoopThreads);
+			size_t idleSessions = idleCount - result.failedClients;
+			double kbPerIdle = idleSessions > 0
+			                       ? (double) (result.idle.rssKb - result.baseline.rssKb) / (double) idleSessions
+			                       : 0.0;
+
+			printf("%-10s %8zu %8ld %10ld %12.2f %10.1f %10.1f %8zu\n",
+			       serverModeName(mode),
+			       idleCount,
+			       result.idle.threads,
+			       result.idle.rssKb,
+			       kbPerIdle,
+			       result.latency.p50Us,
+			       result.latency.p99Us,
+			       result.failedClients);
+			fflush(stdout);
+		}
+	}
+
+	return 0;
+}
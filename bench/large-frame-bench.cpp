@@ -0,0 +1,209 @@
+#include "bench/bench-common.h"
+#include "bench/stub-agent.h"
+#include "relay/agent-message.h"
+#include "relay/agent-session.h"
+#include "relay/posix/thread-server.h"
+#include "relay/posix/unix-socket.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Large requests, like ADD_IDENTITY with big RSA keys or certificates, relayed by the thread-per-client loop
+// to the stub agent, buffered whole or streamed to the agent while they are read (spliced on Linux).
+// Reports the throughput, the per-request latency, the proxy CPU time and peak memory, and the request bytes
+// that went through the relay's memory instead of being spliced, read from the proxy statistics.
+
+struct bench_config {
+	std::vector<int32_t> sizes;
+	int clients;
+	int requests;
+};
+
+struct scenario_result {
+	latency_stats latency;
+	double mbPerS;
+	double cpuUsPerMb;
+	long peakRssKb;
+	double copiedBytesPerRequest;
+	size_t failures;
+};
+
+static void print_help(char* argv[]) {
+	printf("Usage: %s [--sizes 4096,65536,262144,1048576] [--clients count] [--requests count]\n\n"
+	       " --sizes: comma separated list of request sizes in bytes, up to %d\n"
+	       " --clients: concurrent clients\n"
+	       " --requests: requests sent by each client\n",
+	       argv[0],
+	       AGENT_MAX_MSGLEN);
+}
+
+static scenario_result runScenario(bool streamed, int32_t size, const bench_config& config) {
+	std::string proxyPath = makeTempSocketPath("large-frame-bench-proxy");
+	std::string agentPath = makeTempSocketPath("large-frame-bench-agent");
+	scenario_result result;
+
+	memset(&result, 0, sizeof(result));
+
+	SOCKET listenSock = listenUnixSocket(proxyPath.c_str(), SOMAXCONN);
+	if(listenSock == INVALID_SOCKET) {
+		result.failures = (size_t) config.clients * config.requests;
+		return result;
+	}
+
+	socket_connector connectUpstream = [agentPath]() { return connectUnixSocket(agentPath.c_str()); };
+
+	pid_t proxyPid = startProxyProcess([&]() {
+		setRequestStreaming(streamed ? AGENT_SESSION_DEFAULT_STREAM_MIN_SIZE : 0);
+		serveThreadPerClient(listenSock, connectUpstream, AGENT_MAX_MSGLEN);
+	});
+	closesocket(listenSock);
+
+	stub_agent agent(agentPath.c_str(), 0);
+	if(proxyPid < 0 || !agent.start()) {
+		stopProxyProcess(proxyPid);
+		unlink(proxyPath.c_str());
+		result.failures = (size_t) config.clients * config.requests;
+		return result;
+	}
+
+	std::vector<char> request = makeAgentMessage(SSH2_AGENTC_ADD_IDENTITY, (size_t) size - 5);
+	std::vector<std::vector<uint64_t>> clientSamples(config.clients);
+	std::atomic<size_t> failures(0);
+	std::vector<std::thread> threads;
+	bench_barrier barrier(config.clients + 1);
+
+	process_stats before;
+	readProcessStats(proxyPid, &before);
+
+	for(int i = 0; i < config.clients; i++) {
+		threads.emplace_back([&, i]() {
+			std::vector<char> reply;
+			SOCKET sock = connectUnixSocket(proxyPath.c_str());
+
+			barrier.wait();
+			if(sock == INVALID_SOCKET) {
+				failures += config.requests;
+				return;
+			}
+
+			clientSamples[i].reserve(config.requests);
+			for(int j = 0; j < config.requests; j++) {
+				uint64_t start = nowNs();
+				if(!agentRoundTrip(sock, request, reply)) {
+					failures += config.requests - j;
+					break;
+				}
+				clientSamples[i].push_back(nowNs() - start);
+			}
+			closesocket(sock);
+		});
+	}
+
+	barrier.wait();
+	uint64_t startNs = nowNs();
+	for(std::thread& thread : threads) {
+		thread.join();
+	}
+	uint64_t elapsedNs = nowNs() - startNs;
+
+	process_stats after;
+	readProcessStats(proxyPid, &after);
+
+	std::vector<uint64_t> samples;
+	for(std::vector<uint64_t>& clientSample : clientSamples) {
+		samples.insert(samples.end(), clientSample.begin(), clientSample.end());
+	}
+
+	double megabytes = (double) samples.size() * size / (1024.0 * 1024.0);
+	uint64_t splicedBytes = readProxyCounter(proxyPath, "\"spliced_bytes\":");
+
+	result.latency = computeLatencyStats(samples);
+	result.failures = failures;
+	result.mbPerS = elapsedNs > 0 ? megabytes * 1e9 / (double) elapsedNs : 0;
+	result.cpuUsPerMb = megabytes > 0 ? (after.cpuUs - before.cpuUs) / megabytes : 0;
+	result.peakRssKb = after.peakRssKb;
+	if(!samples.empty())
+		result.copiedBytesPerRequest = ((double) samples.size() * size - (double) splicedBytes) / samples.size();
+
+	stopProxyProcess(proxyPid);
+	unlink(proxyPath.c_str());
+
+	return result;
+}
+
+int main(int argc, char* argv[]) {
+	bench_config config;
+
+	config.sizes = {4096, 65536, 262144, 1048576};
+	config.clients = 4;
+	config.requests = 200;
+
+	for(int i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "--sizes") == 0 && i + 1 < argc) {
+			config.sizes.clear();
+			char* list = argv[++i];
+			for(char* token = strtok(list, ","); token != NULL; token = strtok(NULL, ",")) {
+				config.sizes.push_back((int32_t) strtol(token, NULL, 10));
+			}
+		} else if(strcmp(argv[i], "--clients") == 0 && i + 1 < argc) {
+			config.clients = atoi(argv[++i]);
+		} else if(strcmp(argv[i], "--requests") == 0 && i + 1 < argc) {
+			config.requests = atoi(argv[++i]);
+		} else {
+			print_help(argv);
+			return 1;
+		}
+	}
+
+	if(config.sizes.empty() || config.clients <= 0 || config.requests <= 0) {
+		print_help(argv);
+		return 1;
+	}
+	for(int32_t size : config.sizes) {
+		if(size < 5 || size > AGENT_MAX_MSGLEN) {
+			print_help(argv);
+			return 1;
+		}
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	printf("%-9s %9s %10s %10s %10s %12s %10s %14s %8s\n",
+	       "mode",
+	       "size",
+	       "MB/s",
+	       "p50_us",
+	       "p99_us",
+	       "cpu_us/MB",
+	       "peak_kb",
+	       "copied_B/req",
+	       "failed");
+
+	for(int32_t size : config.sizes) {
+		for(bool streamed : {false, true}) {
+			scenario_result result = runScenario(streamed, size, config);
+
+			printf("%-9s %9d %10.1f %10.1f %10.1f %12.1f %10ld %14.0f %8zu\n",
+			       streamed ? "streamed" : "buffered",
+			       size,
+			       result.mbPerS,
+			       result.latency.p50Us,
+			       result.latency.p99Us,
+			       result.cpuUsPerMb,
+			       result.peakRssKb,
+			       result.copiedBytesPerRequest,
+			       result.failures);
+			fflush(stdout);
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,179 @@
+#include "bench/bench-common.h"
+#include "relay/agent-message.h"
+#include "relay/agent-session.h"
+#include "relay/agent-upstream.h"
+#include "relay/logger.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <thread>
+#include <vector>
+
+// Per-message overhead of the relay loop at each log level. runAgentSession is driven by
+// an in-memory client replaying a list/sign mix and an upstream answering with canned replies,
+// so the measured time is the relay itself and its logging. The "sync-dump" row formats and writes
+// hex dumps of each message inline, like the proxies used to do.
+// Log output goes to /dev/null unless --output is given (a terminal shows the console cost).
+
+// Client sending the same requests count times, then closing.
+class replay_client : public agent_stream {
+public:
+	replay_client(const std::vector<std::vector<char>>& requests, int count)
+	    : requests(requests), remaining(count), current(0), offset(0) {}
+
+	int32_t read(void* buffer, int32_t size) override {
+		if(remaining == 0)
+			return 0;
+
+		const std::vector<char>& request = requests[current];
+		int32_t available = (int32_t) request.size() - offset;
+		int32_t readSize = size < available ? size : available;
+
+		memcpy(buffer, request.data() + offset, readSize);
+		offset += readSize;
+		if(offset == (int32_t) request.size()) {
+			offset = 0;
+			current = (current + 1) % requests.size();
+			remaining--;
+		}
+
+		return readSize;
+	}
+
+	int32_t write(const void* buffer, int32_t size) override {
+		(void) buffer;
+		return size;
+	}
+
+private:
+	const std::vector<std::vector<char>>& requests;
+	int remaining;
+	size_t current;
+	int32_t offset;
+};
+
+class canned_upstream : public agent_upstream {
+public:
+	explicit canned_upstream(bool syncDump) : syncDump(syncDump) {
+		identitiesAnswer = makeAgentMessage(SSH2_AGENT_IDENTITIES_ANSWER, 400);
+		signResponse = makeAgentMessage(SSH2_AGENT_SIGN_RESPONSE, 100);
+	}
+
+	int32_t transact(const void* request, int32_t requestSize, message_buffer& reply, int32_t replyMaxSize) override {
+		(void) replyMaxSize;
+		const std::vector<char>& answer =
+		    agentMessageType(request, requestSize) == SSH2_AGENTC_REQUEST_IDENTITIES ? identitiesAnswer : signResponse;
+
+		if(syncDump)
+			dump("Sending to upstream", request, requestSize);
+
+		if(!reply.reserve(answer.size(), 0))
+			return -1;
+		memcpy(reply.data(), answer.data(), answer.size());
+
+		if(syncDump)
+			dump("Read agent message", reply.data(), (int32_t) answer.size());
+
+		return (int32_t) answer.size();
+	}
+
+private:
+	static void dump(const char* description, const void* data, int32_t size) {
+		printf("%s %d bytes\n", description, size);
+		for(int32_t i = 0; i < size; i++) {
+			printf("%02x ", ((const uint8_t*) data)[i]);
+		}
+		printf("\n");
+	}
+
+	bool syncDump;
+	std::vector<char> identitiesAnswer;
+	std::vector<char> signResponse;
+};
+
+static void print_help(char* argv[]) {
+	printf("Usage: %s [--messages count] [--sessions count] [--output path]\n\n"
+	       " --messages: messages relayed by each session\n"
+	       " --sessions: concurrent sessions\n"
+	       " --output: file receiving the log output, defaults to /dev/null\n",
+	       argv[0]);
+}
+
+int main(int argc, char* argv[]) {
+	int messages = 100000;
+	int sessions = 1;
+	const char* output = "/dev/null";
+
+	for(int i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "--messages") == 0 && i + 1 < argc) {
+			messages = atoi(argv[++i]);
+		} else if(strcmp(argv[i], "--sessions") == 0 && i + 1 < argc) {
+			sessions = atoi(argv[++i]);
+		} else if(strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+			output = argv[++i];
+		} else {
+			print_help(argv);
+			return 1;
+		}
+	}
+
+	FILE* out = fdopen(dup(STDOUT_FILENO), "w");
+	if(out == NULL || freopen(output, "w", stdout) == NULL)
+		return 1;
+
+	std::vector<std::vector<char>> requests = {makeAgentMessage(SSH2_AGENTC_REQUEST_IDENTITIES, 0),
+	                                           makeAgentMessage(SSH2_AGENTC_SIGN_REQUEST, 300)};
+
+	struct scenario {
+		const char* name;
+		log_level level;
+		bool syncDump;
+	};
+	static const scenario scenarios[] = {
+	    {"error", log_level::error, false},
+	    {"info", log_level::info, false},
+	    {"debug", log_level::debug, false},
+	    {"payload", log_level::payload, false},
+	    {"sync-dump", log_level::error, true},
+	};
+
+	fprintf(out, "%-10s %10s %12s %12s %10s\n", "level", "messages", "ns/message", "drain_ms", "dropped");
+
+	for(const scenario& scenario : scenarios) {
+		setLogLevel(scenario.level);
+		uint64_t droppedBefore = getDroppedLogCount();
+		std::vector<std::thread> threads;
+
+		uint64_t start = nowNs();
+		for(int i = 0; i < sessions; i++) {
+			threads.emplace_back([&]() {
+				replay_client client(requests, messages);
+				canned_upstream upstream(scenario.syncDump);
+				runAgentSession(client, upstream, AGENT_MAX_MSGLEN);
+			});
+		}
+		for(std::thread& thread : threads) {
+			thread.join();
+		}
+		uint64_t elapsed = nowNs() - start;
+
+		uint64_t drainStart = nowNs();
+		flushLog();
+		fflush(stdout);
+		uint64_t drainElapsed = nowNs() - drainStart;
+
+		fprintf(out,
+		        "%-10s %10d %12.1f %12.2f %10llu\n",
+		        scenario.name,
+		        messages * sessions,
+		        (double) elapsed / ((double) messages * sessions),
+		        drainElapsed / 1e6,
+		        (unsigned long long) (getDroppedLogCount() - droppedBefore));
+		fflush(out);
+	}
+
+	return 0;
+}
@@ -0,0 +1,224 @@
+#include "bench/bench-common.h"
+#include "bench/stub-agent.h"
+#include "relay/agent-message.h"
+#include "relay/agent-session.h"
+#include "relay/buffer-pool.h"
+#include "relay/posix/thread-server.h"
+#include "relay/posix/unix-socket.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Many clients sending large buffered requests (ADD_IDENTITY with big keys or certificates) at once through the
+// thread-per-client loop to the stub agent, without and with a memory budget. Reports the peak memory of the
+// proxy, the requests answered by the agent and the ones refused with SSH_AGENT_FAILURE, the latency, and the
+// budget counters read from the proxy statistics.
+
+struct bench_config {
+	int clients;
+	int requests;
+	int32_t size;
+	std::vector<int> budgetsMb;
+	int waitMs;
+};
+
+struct scenario_result {
+	latency_stats latency;
+	long baselineRssKb;
+	long peakRssKb;
+	size_t succeeded;
+	size_t refused;
+	size_t failures;
+	uint64_t admitted;
+	uint64_t rejected;
+};
+
+static void print_help(char* argv[]) {
+	printf("Usage: %s [--clients count] [--requests count] [--size bytes] [--budgets 0,32,128] [--wait ms]\n\n"
+	       " --clients: concurrent clients\n"
+	       " --requests: requests sent by each client\n"
+	       " --size: request size in bytes, up to %d\n"
+	       " --budgets: comma separated list of memory budgets in megabytes, 0 for none\n"
+	       " --wait: time sessions wait for memory before refusing a request (default %d)\n",
+	       argv[0],
+	       AGENT_MAX_MSGLEN,
+	       BUFFER_POOL_DEFAULT_BUDGET_WAIT_MS);
+}
+
+static scenario_result runScenario(int budgetMb, const bench_config& config, const std::vector<char>& request) {
+	std::string proxyPath = makeTempSocketPath("memory-budget-bench-proxy");
+	std::string agentPath = makeTempSocketPath("memory-budget-bench-agent");
+	scenario_result result;
+
+	memset(&result, 0, sizeof(result));
+
+	SOCKET listenSock = listenUnixSocket(proxyPath.c_str(), SOMAXCONN);
+	if(listenSock == INVALID_SOCKET) {
+		result.failures = (size_t) config.clients * config.requests;
+		return result;
+	}
+
+	socket_connector connectUpstream = [agentPath]() { return connectUnixSocket(agentPath.c_str()); };
+
+	// Buffered requests, streaming would keep them out of the relay's memory
+	pid_t proxyPid = startProxyProcess([&]() {
+		setRequestStreaming(0);
+		if(budgetMb > 0)
+			buffer_pool::instance().setBudget((size_t) budgetMb * 1024 * 1024, config.waitMs);
+		serveThreadPerClient(listenSock, connectUpstream, AGENT_MAX_MSGLEN);
+	});
+	closesocket(listenSock);
+
+	stub_agent agent(agentPath.c_str(), 0);
+	if(proxyPid < 0 || !agent.start()) {
+		stopProxyProcess(proxyPid);
+		unlink(proxyPath.c_str());
+		result.failures = (size_t) config.clients * config.requests;
+		return result;
+	}
+
+	std::vector<std::vector<uint64_t>> clientSamples(config.clients);
+	std::atomic<size_t> succeeded(0);
+	std::atomic<size_t> refused(0);
+	std::atomic<size_t> failures(0);
+	std::vector<std::thread> threads;
+	bench_barrier barrier(config.clients + 1);
+
+	process_stats before;
+	readProcessStats(proxyPid, &before);
+
+	for(int i = 0; i < config.clients; i++) {
+		threads.emplace_back([&, i]() {
+			std::vector<char> reply;
+			SOCKET sock = connectUnixSocket(proxyPath.c_str());
+
+			barrier.wait();
+			if(sock == INVALID_SOCKET) {
+				failures += config.requests;
+				return;
+			}
+
+			clientSamples[i].reserve(config.requests);
+			for(int j = 0; j < config.requests; j++) {
+				uint64_t start = nowNs();
+				if(!agentRoundTrip(sock, request, reply) || reply.size() < 5) {
+					failures += config.requests - j;
+					break;
+				}
+				clientSamples[i].push_back(nowNs() - start);
+				if(reply[4] == SSH_AGENT_SUCCESS)
+					succeeded++;
+				else
+					refused++;
+			}
+			closesocket(sock);
+		});
+	}
+
+	barrier.wait();
+	for(std::thread& thread : threads) {
+		thread.join();
+	}
+
+	process_stats after;
+	readProcessStats(proxyPid, &after);
+
+	std::vector<uint64_t> samples;
+	for(std::vector<uint64_t>& clientSample : clientSamples) {
+		samples.insert(samples.end(), clientSample.begin(), clientSample.end());
+	}
+
+	result.latency = computeLatencyStats(samples);
+	result.baselineRssKb = before.peakRssKb;
+	result.peakRssKb = after.peakRssKb;
+	result.succeeded = succeeded;
+	result.refused = refused;
+	result.failures = failures;
+	result.admitted = readProxyCounter(proxyPath, "\"budget\":{\"admitted\":");
+	result.rejected = readProxyCounter(proxyPath, "\"rejected_requests\":");
+
+	stopProxyProcess(proxyPid);
+	unlink(proxyPath.c_str());
+
+	return result;
+}
+
+int main(int argc, char* argv[]) {
+	bench_config config;
+
+	config.clients = 100;
+	config.requests = 4;
+	config.size = 1048576;
+	config.budgetsMb = {0, 32, 128};
+	config.waitMs = BUFFER_POOL_DEFAULT_BUDGET_WAIT_MS;
+
+	for(int i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "--clients") == 0 && i + 1 < argc) {
+			config.clients = atoi(argv[++i]);
+		} else if(strcmp(argv[i], "--requests") == 0 && i + 1 < argc) {
+			config.requests = atoi(argv[++i]);
+		} else if(strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+			config.size = (int32_t) strtol(argv[++i], NULL, 10);
+		} else if(strcmp(argv[i], "--budgets") == 0 && i + 1 < argc) {
+			config.budgetsMb.clear();
+			char* list = argv[++i];
+			for(char* token = strtok(list, ","); token != NULL; token = strtok(NULL, ",")) {
+				config.budgetsMb.push_back(atoi(token));
+			}
+		} else if(strcmp(argv[i], "--wait") == 0 && i + 1 < argc) {
+			config.waitMs = atoi(argv[++i]);
+		} else {
+			print_help(argv);
+			return 1;
+		}
+	}
+
+	if(config.clients <= 0 || config.requests <= 0 || config.size < 5 || config.size > AGENT_MAX_MSGLEN ||
+	   config.budgetsMb.empty() || config.waitMs < 0) {
+		print_help(argv);
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	// Shared by every client, so the bench itself does not grow with the client count
+	std::vector<char> request = makeAgentMessage(SSH2_AGENTC_ADD_IDENTITY, (size_t) config.size - 5);
+
+	printf("%-9s %10s %10s %10s %10s %10s %10s %10s %10s %8s\n",
+	       "budget_mb",
+	       "base_kb",
+	       "peak_kb",
+	       "succeeded",
+	       "refused",
+	       "admitted",
+	       "rejected",
+	       "p50_us",
+	       "p99_us",
+	       "failed");
+
+	for(int budgetMb : config.budgetsMb) {
+		scenario_result result = runScenario(budgetMb, config, request);
+
+		printf("%-9d %10ld %10ld %10zu %10zu %10llu %10llu %10.1f %10.1f %8zu\n",
+		       budgetMb,
+		       result.baselineRssKb,
+		       result.peakRssKb,
+		       result.succeeded,
+		       result.refused,
+		       (unsigned long long) result.admitted,
+		       (unsigned long long) result.rejected,
+		       result.latency.p50Us,
+		       result.latency.p99Us,
+		       result.failures);
+		fflush(stdout);
+	}
+
+	return 0;
+}
@@ -0,0 +1,206 @@
+#include "bench/bench-common.h"
+#include "bench/stub-pageant.h"
+#include "relay/agent-message.h"
+#include "relay/pageant-dispatcher.h"
+#include "relay/pageant-upstream.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <thread>
+#include <vector>
+
+// Per-request cost of the Pageant shared memory transport, with the shared memory
+// created for each request (like the WM_COPYDATA backend used to do), kept for the session,
+// or owned by a single dispatcher thread sending the requests of every session.
+// POSIX shared memory and a stub responder thread stand in for the file mapping and the Pageant window.
+// The stub is restarted every few requests to check that a stale agent handle is looked up again.
+
+enum class transport_mode { per_request, persistent, dispatcher };
+
+struct scenario_result {
+	latency_stats latency;
+	double syscallsPerRequest;
+	double contextSwitchesPerRequest;
+	size_t sharedMemoryObjects;
+	size_t failures;
+	size_t mismatches;
+};
+
+static const char* modeName(transport_mode mode) {
+	switch(mode) {
+		case transport_mode::per_request:
+			return "per-request";
+		case transport_mode::persistent:
+			return "persistent";
+		case transport_mode::dispatcher:
+		default:
+			return "dispatcher";
+	}
+}
+
+static uint64_t contextSwitches() {
+	struct rusage usage;
+
+	if(getrusage(RUSAGE_SELF, &usage) != 0)
+		return 0;
+	return (uint64_t) usage.ru_nvcsw + (uint64_t) usage.ru_nivcsw;
+}
+
+static void print_help(char* argv[]) {
+	printf("Usage: %s [--requests count] [--threads count] [--restart-every count]\n\n"
+	       " --requests: requests made by each thread\n"
+	       " --threads: session threads, each with its own transport or sharing the dispatcher\n"
+	       " --restart-every: restart the stub Pageant every that many requests, 0 to disable\n",
+	       argv[0]);
+}
+
+static scenario_result runScenario(transport_mode mode, int requests, int threadCount, int restartEvery) {
+	stub_pageant pageant;
+	shm_transport* dispatcherTransport = NULL;
+	std::unique_ptr<pageant_dispatcher> dispatcher;
+	std::vector<std::vector<uint64_t>> threadSamples(threadCount);
+	std::vector<uint64_t> syscalls(threadCount, 0);
+	std::vector<size_t> failures(threadCount, 0);
+	std::vector<size_t> mismatches(threadCount, 0);
+	std::vector<std::thread> threads;
+	scenario_result result;
+
+	if(mode == transport_mode::dispatcher) {
+		dispatcher = std::make_unique<pageant_dispatcher>(
+		    [&]() -> std::unique_ptr<pageant_transport> {
+			    std::unique_ptr<shm_transport> transport = std::make_unique<shm_transport>(pageant, true);
+			    dispatcherTransport = transport.get();
+			    return transport;
+		    },
+		    PAGEANT_DISPATCHER_DEFAULT_QUEUE);
+	}
+
+	uint64_t contextSwitchesBefore = contextSwitches();
+
+	for(int i = 0; i < threadCount; i++) {
+		threads.emplace_back([&, i]() {
+			shm_transport transport(pageant, mode == transport_mode::persistent);
+			pageant_upstream sessionUpstream(transport);
+			std::unique_ptr<dispatched_pageant_upstream> dispatchedUpstream;
+			agent_upstream* upstream = &sessionUpstream;
+			if(dispatcher) {
+				dispatchedUpstream = std::make_unique<dispatched_pageant_upstream>(*dispatcher);
+				upstream = dispatchedUpstream.get();
+			}
+			std::vector<char> listRequest = makeAgentMessage(SSH2_AGENTC_REQUEST_IDENTITIES, 0);
+			std::vector<char> signRequest = makeAgentMessage(SSH2_AGENTC_SIGN_REQUEST, 256);
+			message_buffer reply;
+
+			threadSamples[i].reserve(requests);
+			for(int j = 0; j < requests; j++) {
+				bool isList = j % 2 == 0;
+				const std::vector<char>& request = isList ? listRequest : signRequest;
+
+				if(i == 0 && restartEvery > 0 && j % restartEvery == restartEvery - 1)
+					pageant.restart();
+
+				uint64_t start = nowNs();
+				int32_t replySize = upstream->transact(request.data(), (int32_t) request.size(), reply, AGENT_MAX_MSGLEN);
+				threadSamples[i].push_back(nowNs() - start);
+
+				int expectedType = isList ? SSH2_AGENT_IDENTITIES_ANSWER : SSH2_AGENT_SIGN_RESPONSE;
+				if(replySize <= 0)
+					failures[i]++;
+				else if(agentMessageType(reply.data(), replySize) != expectedType)
+					mismatches[i]++;
+			}
+
+			syscalls[i] = transport.getSyscallCount();
+		});
+	}
+
+	for(std::thread& thread : threads) {
+		thread.join();
+	}
+
+	uint64_t totalContextSwitches = contextSwitches() - contextSwitchesBefore;
+	std::vector<uint64_t> samples;
+	// Session transports never mapped their shared memory with the dispatcher
+	uint64_t totalSyscalls = dispatcherTransport != NULL ? dispatcherTransport->getSyscallCount() : 0;
+	result.failures = 0;
+	result.mismatches = 0;
+	for(int i = 0; i < threadCount; i++) {
+		samples.insert(samples.end(), threadSamples[i].begin(), threadSamples[i].end());
+		totalSyscalls += syscalls[i];
+		result.failures += failures[i];
+		result.mismatches += mismatches[i];
+	}
+
+	result.syscallsPerRequest = samples.empty() ? 0 : (double) totalSyscalls / samples.size();
+	result.contextSwitchesPerRequest = samples.empty() ? 0 : (double) totalContextSwitches / samples.size();
+	if(mode == transport_mode::per_request)
+		result.sharedMemoryObjects = 0;
+	else if(mode == transport_mode::persistent)
+		result.sharedMemoryObjects = threadCount;
+	else
+		result.sharedMemoryObjects = 1;
+	result.latency = computeLatencyStats(samples);
+
+	return result;
+}
+
+int main(int argc, char* argv[]) {
+	int requests = 20000;
+	int threadCount = 1;
+	int restartEvery = 1000;
+
+	for(int i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "--requests") == 0 && i + 1 < argc) {
+			requests = atoi(argv[++i]);
+		} else if(strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+			threadCount = atoi(argv[++i]);
+		} else if(strcmp(argv[i], "--restart-every") == 0 && i + 1 < argc) {
+			restartEvery = atoi(argv[++i]);
+		} else {
+			print_help(argv);
+			return 1;
+		}
+	}
+
+	// The relay logs each message to stdout, keep it out of the results
+	FILE* out = fdopen(dup(STDOUT_FILENO), "w");
+	if(out == NULL || freopen("/dev/null", "w", stdout) == NULL)
+		return 1;
+
+	fprintf(out,
+	        "%-12s %10s %10s %10s %10s %12s %10s %8s %9s %9s\n",
+	        "shm",
+	        "requests",
+	        "mean_us",
+	        "p50_us",
+	        "p99_us",
+	        "syscalls/req",
+	        "csw/req",
+	        "shm_objs",
+	        "failures",
+	        "mismatch");
+
+	for(transport_mode mode : {transport_mode::per_request, transport_mode::persistent, transport_mode::dispatcher}) {
+		scenario_result result = runScenario(mode, requests, threadCount, restartEvery);
+
+		fprintf(out,
+		        "%-12s %10zu %10.2f %10.2f %10.2f %12.2f %10.2f %8zu %9zu %9zu\n",
+		        modeName(mode),
+		        result.latency.count,
+		        result.latency.meanUs,
+		        result.latency.p50Us,
+		        result.latency.p99Us,
+		        result.syscallsPerRequest,
+		        result.contextSwitchesPerRequest,
+		        result.sharedMemoryObjects,
+		        result.failures,
+		        result.mismatches);
+		fflush(out);
+	}
+
+	return 0;
+}
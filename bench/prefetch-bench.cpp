@@ -0,0 +1,162 @@
+#include "bench/bench-common.h"
+#include "bench/stub-agent.h"
+#include "relay/agent-message.h"
+#include "relay/cygwin-socket-file.h"
+#include "relay/identity-prefetch.h"
+#include "relay/posix/thread-server.h"
+#include "relay/posix/unix-socket.h"
+#include "relay/socket-stream.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Time from connect to the first reply of short-lived clients, like one ssh invocation per git operation,
+// with and without identity prefetch. Each client connects to the proxy, waits as ssh does while it reads
+// its configuration and keys, then sends REQUEST_IDENTITIES.
+// The upstream is a slow stub agent behind a cygwin socket file: with prefetch, its round trip overlaps
+// with the client's delay and the reply is ready as soon as the request arrives.
+
+static void print_help(char* argv[]) {
+	printf("Usage: %s [--connections count] [--latency-us us] [--handshake-latency-us us] [--client-delays list]\n\n"
+	       " --connections: client connections measured for each scenario (default 300)\n"
+	       " --latency-us: delay added by the stub agent to each reply (default 1000)\n"
+	       " --handshake-latency-us: delay added by the stub agent to each cygwin handshake (default 500)\n"
+	       " --client-delays: comma separated delays in us between connect and the first request\n"
+	       "                  (default 0,500,2000)\n",
+	       argv[0]);
+}
+
+static bool parseList(const char* arg, std::vector<int>& values) {
+	std::string list(arg);
+	size_t start = 0;
+
+	values.clear();
+	while(start <= list.size()) {
+		size_t end = list.find(',', start);
+		if(end == std::string::npos)
+			end = list.size();
+
+		std::string value = list.substr(start, end - start);
+		if(value.empty() || atoi(value.c_str()) < 0)
+			return false;
+		values.push_back(atoi(value.c_str()));
+		start = end + 1;
+	}
+
+	return !values.empty();
+}
+
+static latency_stats
+runScenario(bool prefetch, int connections, uint32_t latencyUs, uint32_t handshakeLatencyUs, int clientDelayUs) {
+	std::string proxyPath = makeTempSocketPath("prefetch-bench-proxy");
+	std::string agentPath = makeTempSocketPath("prefetch-bench-agent");
+	std::vector<uint64_t> samples;
+
+	SOCKET listenSock = listenUnixSocket(proxyPath.c_str(), SOMAXCONN);
+	if(listenSock == INVALID_SOCKET)
+		return computeLatencyStats(samples);
+
+	pid_t proxyPid = startProxyProcess([&]() {
+		cygwin_socket_file socketFile(agentPath);
+		upstream_connector connectUpstream = [&socketFile]() -> std::unique_ptr<agent_upstream> {
+			SOCKET sock = socketFile.connect();
+			if(sock == INVALID_SOCKET)
+				return nullptr;
+			return std::make_unique<stream_upstream>(std::make_unique<socket_stream>(sock));
+		};
+
+		if(prefetch)
+			connectUpstream = prefetchingConnector(connectUpstream);
+
+		serveThreadPerClient(listenSock, connectUpstream, AGENT_MAX_MSGLEN);
+	});
+	closesocket(listenSock);
+
+	stub_agent agent(agentPath.c_str(), latencyUs, true);
+	agent.setHandshakeLatency(handshakeLatencyUs);
+	if(proxyPid < 0 || !agent.start()) {
+		stopProxyProcess(proxyPid);
+		return computeLatencyStats(samples);
+	}
+
+	std::vector<char> request = makeAgentMessage(SSH2_AGENTC_REQUEST_IDENTITIES, 0);
+	std::vector<char> reply;
+
+	for(int i = 0; i < connections; i++) {
+		uint64_t start = nowNs();
+		SOCKET sock = connectUnixSocket(proxyPath.c_str());
+		if(sock == INVALID_SOCKET)
+			continue;
+
+		if(clientDelayUs > 0)
+			std::this_thread::sleep_for(std::chrono::microseconds(clientDelayUs));
+
+		if(agentRoundTrip(sock, request, reply))
+			samples.push_back(nowNs() - start);
+		closesocket(sock);
+	}
+
+	stopProxyProcess(proxyPid);
+	unlink(proxyPath.c_str());
+
+	return computeLatencyStats(samples);
+}
+
+int main(int argc, char* argv[]) {
+	int connections = 300;
+	uint32_t latencyUs = 1000;
+	uint32_t handshakeLatencyUs = 500;
+	std::vector<int> clientDelays = {0, 500, 2000};
+
+	for(int i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "--connections") == 0 && i + 1 < argc) {
+			connections = atoi(argv[++i]);
+		} else if(strcmp(argv[i], "--latency-us") == 0 && i + 1 < argc) {
+			latencyUs = (uint32_t) atoi(argv[++i]);
+		} else if(strcmp(argv[i], "--handshake-latency-us") == 0 && i + 1 < argc) {
+			handshakeLatencyUs = (uint32_t) atoi(argv[++i]);
+		} else if(strcmp(argv[i], "--client-delays") == 0 && i + 1 < argc) {
+			if(!parseList(argv[++i], clientDelays)) {
+				print_help(argv);
+				return 1;
+			}
+		} else {
+			print_help(argv);
+			return 1;
+		}
+	}
+
+	if(connections <= 0) {
+		print_help(argv);
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	printf("%-10s %14s %8s %10s %10s %10s\n", "prefetch", "client_delay", "samples", "mean_us", "p50_us", "p99_us");
+
+	for(int clientDelayUs : clientDelays) {
+		for(bool prefetch : {false, true}) {
+			latency_stats stats = runScenario(prefetch, connections, latencyUs, handshakeLatencyUs, clientDelayUs);
+
+			printf("%-10s %14d %8zu %10.1f %10.1f %10.1f\n",
+			       prefetch ? "on" : "off",
+			       clientDelayUs,
+			       stats.count,
+			       stats.meanUs,
+			       stats.p50Us,
+			       stats.p99Us);
+			fflush(stdout);
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,420 @@
+#include "bench/bench-common.h"
+#include "bench/stub-agent.h"
+#include "relay/agent-message.h"
+#include "relay/posix/epoll-reactor.h"
+#include "relay/posix/thread-server.h"
+#include "relay/posix/unix-socket.h"
+#include "relay/posix/uring-reactor.h"
+#include "relay/upstream-mux.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// End-to-end load test of the relay against the stub agent: N clients connect to the proxy, send a mix of
+// REQUEST_IDENTITIES and SIGN_REQUEST for a fixed duration and reconnect after a given number of requests,
+// like ssh invocations do. Reports throughput, proxy CPU time and latency percentiles per request type,
+// plus the time from connect to the first reply, as a table and optionally as JSON so runs made before
+// and after a change can be compared by a script.
+
+enum class proxy_mode { threads, epoll, io_uring, multiplex };
+
+struct bench_config {
+	std::vector<proxy_mode> modes;
+	size_t clientCount;
+	double durationS;
+	int signPercent;
+	int lifetime;  // requests per connection, 0 to keep the connection for the whole run
+	uint32_t agentLatencyUs;
+	size_t signPayload;
+	int eventLoopThreads;
+	size_t muxConnections;
+};
+
+struct scenario_result {
+	latency_stats all;
+	latency_stats list;
+	latency_stats sign;
+	latency_stats firstReply;
+	uint64_t connections;
+	uint64_t errors;
+	double requestsPerSecond;
+	double cpuUsPerRequest;
+};
+
+struct client_samples {
+	std::vector<uint64_t> list;
+	std::vector<uint64_t> sign;
+	std::vector<uint64_t> firstReply;
+	uint64_t connections;
+	uint64_t errors;
+};
+
+static const char* modeName(proxy_mode mode) {
+	switch(mode) {
+		case proxy_mode::threads:
+			return "threads";
+		case proxy_mode::epoll:
+			return "epoll";
+		case proxy_mode::io_uring:
+			return "io_uring";
+		case proxy_mode::multiplex:
+		default:
+			return "multiplex";
+	}
+}
+
+static bool parseModes(char* list, std::vector<proxy_mode>& modes) {
+	modes.clear();
+	for(char* token = strtok(list, ","); token != NULL; token = strtok(NULL, ",")) {
+		if(strcmp(token, "threads") == 0)
+			modes.push_back(proxy_mode::threads);
+		else if(strcmp(token, "epoll") == 0)
+			modes.push_back(proxy_mode::epoll);
+		else if(strcmp(token, "io_uring") == 0)
+			modes.push_back(proxy_mode::io_uring);
+		else if(strcmp(token, "multiplex") == 0)
+			modes.push_back(proxy_mode::multiplex);
+		else
+			return false;
+	}
+
+	return !modes.empty();
+}
+
+static void print_help(char* argv[]) {
+	printf("Usage: %s [--modes threads,epoll,io_uring,multiplex] [--clients count] [--duration seconds]\n"
+	       "          [--sign-percent percent] [--lifetime requests] [--agent-latency-us us] [--payload bytes]\n"
+	       "          [--threads count] [--connections count] [--json file]\n\n"
+	       " --modes: comma separated relay modes to run, default threads,epoll,io_uring\n"
+	       " --clients: concurrent clients (default 50)\n"
+	       " --duration: run time of each mode (default 5)\n"
+	       " --sign-percent: share of SIGN_REQUEST, the rest are REQUEST_IDENTITIES (default 30)\n"
+	       " --lifetime: requests made on a connection before reconnecting, 0 to never reconnect (default 10)\n"
+	       " --agent-latency-us: delay added by the stub agent to each reply (default 0)\n"
+	       " --payload: SIGN_REQUEST payload bytes (default 300)\n"
+	       " --threads: event loop thread count of the epoll and io_uring modes (default 1)\n"
+	       " --connections: upstream connections of the multiplex mode (default 4)\n"
+	       " --json: also write the results as JSON to file, - for the standard output only\n",
+	       argv[0]);
+}
+
+static void serveMode(const bench_config& config, proxy_mode mode, SOCKET listenSock, const std::string& agentPath) {
+	socket_connector connectUpstream = [&agentPath]() { return connectUnixSocket(agentPath.c_str()); };
+
+	switch(mode) {
+		case proxy_mode::epoll: {
+			epoll_reactor reactor(listenSock, connectUpstream, AGENT_MAX_MSGLEN);
+			reactor.run(config.eventLoopThreads);
+			break;
+		}
+		case proxy_mode::io_uring: {
+			uring_reactor reactor(listenSock, connectUpstream, AGENT_MAX_MSGLEN);
+			reactor.run(config.eventLoopThreads);
+			break;
+		}
+		case proxy_mode::multiplex: {
+			upstream_mux mux(connectUpstream, config.muxConnections);
+			serveThreadPerClient(
+			    listenSock,
+			    [&mux]() -> std::unique_ptr<agent_upstream> { return std::make_unique<multiplexed_upstream>(mux); },
+			    AGENT_MAX_MSGLEN);
+			break;
+		}
+		case proxy_mode::threads:
+		default:
+			serveThreadPerClient(listenSock, connectUpstream, AGENT_MAX_MSGLEN);
+			break;
+	}
+}
+
+static void runClient(const bench_config& config,
+                      const std::string& proxyPath,
+                      uint64_t deadline,
+                      unsigned int seed,
+                      client_samples& samples) {
+	std::vector<char> listRequest = makeAgentMessage(SSH2_AGENTC_REQUEST_IDENTITIES, 0);
+	std::vector<char> signRequest = makeAgentMessage(SSH2_AGENTC_SIGN_REQUEST, config.signPayload);
+	std::vector<char> reply;
+	SOCKET sock = INVALID_SOCKET;
+	uint64_t connectStart = 0;
+	int requestsOnConnection = 0;
+
+	while(nowNs() < deadline) {
+		if(sock == INVALID_SOCKET) {
+			connectStart = nowNs();
+			sock = connectUnixSocket(proxyPath.c_str());
+			if(sock == INVALID_SOCKET) {
+				samples.errors++;
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+				continue;
+			}
+			samples.connections++;
+			requestsOnConnection = 0;
+		}
+
+		bool isSign = (int) (rand_r(&seed) % 100) < config.signPercent;
+		uint8_t expectedType = isSign ? SSH2_AGENT_SIGN_RESPONSE : SSH2_AGENT_IDENTITIES_ANSWER;
+		uint64_t start = nowNs();
+
+		if(!agentRoundTrip(sock, isSign ? signRequest : listRequest, reply) || reply.size() < 5 ||
+		   (uint8_t) reply[4] != expectedType) {
+			samples.errors++;
+			closesocket(sock);
+			sock = INVALID_SOCKET;
+			continue;
+		}
+
+		uint64_t end = nowNs();
+		(isSign ? samples.sign : samples.list).push_back(end - start);
+		if(requestsOnConnection == 0)
+			samples.firstReply.push_back(end - connectStart);
+		requestsOnConnection++;
+
+		if(config.lifetime > 0 && requestsOnConnection >= config.lifetime) {
+			closesocket(sock);
+			sock = INVALID_SOCKET;
+		}
+	}
+
+	if(sock != INVALID_SOCKET)
+		closesocket(sock);
+}
+
+static scenario_result runScenario(const bench_config& config, proxy_mode mode) {
+	std::string proxyPath = makeTempSocketPath("proxy-bench-proxy");
+	std::string agentPath = makeTempSocketPath("proxy-bench-agent");
+	scenario_result result;
+
+	memset(&result, 0, sizeof(result));
+
+	SOCKET listenSock = listenUnixSocket(proxyPath.c_str(), SOMAXCONN);
+	if(listenSock == INVALID_SOCKET) {
+		result.errors = 1;
+		return result;
+	}
+
+	pid_t proxyPid = startProxyProcess([&]() { serveMode(config, mode, listenSock, agentPath); });
+	closesocket(listenSock);
+
+	stub_agent agent(agentPath.c_str(), config.agentLatencyUs);
+	if(proxyPid < 0 || !agent.start()) {
+		stopProxyProcess(proxyPid);
+		result.errors = 1;
+		return result;
+	}
+
+	bench_barrier started(config.clientCount + 1);
+	bench_barrier finished(config.clientCount + 1);
+	std::vector<client_samples> samples(config.clientCount);
+	std::vector<std::thread> clients;
+	uint64_t deadline = 0;
+
+	for(size_t i = 0; i < config.clientCount; i++) {
+		clients.emplace_back([&, i]() {
+			samples[i].connections = 0;
+			samples[i].errors = 0;
+			started.wait();
+			runClient(config, proxyPath, deadline, (unsigned int) i + 1, samples[i]);
+			finished.wait();
+		});
+	}
+
+	process_stats before;
+	process_stats after;
+
+	readProcessStats(proxyPid, &before);
+	uint64_t start = nowNs();
+	deadline = start + (uint64_t) (config.durationS * 1e9);
+	started.wait();
+	finished.wait();
+	uint64_t elapsed = nowNs() - start;
+	readProcessStats(proxyPid, &after);
+
+	for(std::thread& client : clients) {
+		client.join();
+	}
+
+	stopProxyProcess(proxyPid);
+	unlink(proxyPath.c_str());
+
+	std::vector<uint64_t> all;
+	std::vector<uint64_t> list;
+	std::vector<uint64_t> sign;
+	std::vector<uint64_t> firstReply;
+	for(client_samples& client : samples) {
+		list.insert(list.end(), client.list.begin(), client.list.end());
+		sign.insert(sign.end(), client.sign.begin(), client.sign.end());
+		firstReply.insert(firstReply.end(), client.firstReply.begin(), client.firstReply.end());
+		result.connections += client.connections;
+		result.errors += client.errors;
+	}
+	all.insert(all.end(), list.begin(), list.end());
+	all.insert(all.end(), sign.begin(), sign.end());
+
+	result.all = computeLatencyStats(all);
+	result.list = computeLatencyStats(list);
+	result.sign = computeLatencyStats(sign);
+	result.firstReply = computeLatencyStats(firstReply);
+	result.requestsPerSecond = (double) result.all.count * 1e9 / (double) elapsed;
+	if(result.all.count > 0)
+		result.cpuUsPerRequest = (after.cpuUs - before.cpuUs) / (double) result.all.count;
+
+	return result;
+}
+
+static void writeLatencyJson(FILE* file, const char* name, const latency_stats& stats, bool last) {
+	fprintf(file,
+	        "        \"%s\": {\"count\": %zu, \"mean\": %.1f, \"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f, "
+	        "\"max\": %.1f}%s\n",
+	        name,
+	        stats.count,
+	        stats.meanUs,
+	        stats.p50Us,
+	        stats.p99Us,
+	        stats.p999Us,
+	        stats.maxUs,
+	        last ? "" : ",");
+}
+
+static void writeJson(FILE* file,
+                      const bench_config& config,
+                      const std::vector<proxy_mode>& modes,
+                      const std::vector<scenario_result>& results) {
+	fprintf(file,
+	        "{\n"
+	        "  \"config\": {\"clients\": %zu, \"duration_s\": %.1f, \"sign_percent\": %d, \"lifetime\": %d, "
+	        "\"agent_latency_us\": %u, \"payload\": %zu, \"threads\": %d, \"connections\": %zu},\n"
+	        "  \"results\": [\n",
+	        config.clientCount,
+	        config.durationS,
+	        config.signPercent,
+	        config.lifetime,
+	        config.agentLatencyUs,
+	        config.signPayload,
+	        config.eventLoopThreads,
+	        config.muxConnections);
+
+	for(size_t i = 0; i < results.size(); i++) {
+		const scenario_result& result = results[i];
+
+		fprintf(file,
+		        "    {\n"
+		        "      \"mode\": \"%s\", \"requests\": %zu, \"connections\": %llu, \"errors\": %llu,\n"
+		        "      \"requests_per_s\": %.0f, \"cpu_us_per_request\": %.2f,\n"
+		        "      \"latency_us\": {\n",
+		        modeName(modes[i]),
+		        result.all.count,
+		        (unsigned long long) result.connections,
+		        (unsigned long long) result.errors,
+		        result.requestsPerSecond,
+		        result.cpuUsPerRequest);
+		writeLatencyJson(file, "all", result.all, false);
+		writeLatencyJson(file, "list", result.list, false);
+		writeLatencyJson(file, "sign", result.sign, false);
+		writeLatencyJson(file, "first_reply", result.firstReply, true);
+		fprintf(file, "      }\n    }%s\n", i + 1 < results.size() ? "," : "");
+	}
+
+	fprintf(file, "  ]\n}\n");
+}
+
+int main(int argc, char* argv[]) {
+	bench_config config;
+	const char* jsonPath = NULL;
+
+	config.modes = {proxy_mode::threads, proxy_mode::epoll, proxy_mode::io_uring};
+	config.clientCount = 50;
+	config.durationS = 5;
+	config.signPercent = 30;
+	config.lifetime = 10;
+	config.agentLatencyUs = 0;
+	config.signPayload = 300;
+	config.eventLoopThreads = 1;
+	config.muxConnections = 4;
+
+	for(int i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "--modes") == 0 && i + 1 < argc) {
+			if(!parseModes(argv[++i], config.modes)) {
+				print_help(argv);
+				return 1;
+			}
+		} else if(strcmp(argv[i], "--clients") == 0 && i + 1 < argc) {
+			config.clientCount = (size_t) atol(argv[++i]);
+		} else if(strcmp(argv[i], "--duration") == 0 && i + 1 < argc) {
+			config.durationS = atof(argv[++i]);
+		} else if(strcmp(argv[i], "--sign-percent") == 0 && i + 1 < argc) {
+			config.signPercent = atoi(argv[++i]);
+		} else if(strcmp(argv[i], "--lifetime") == 0 && i + 1 < argc) {
+			config.lifetime = atoi(argv[++i]);
+		} else if(strcmp(argv[i], "--agent-latency-us") == 0 && i + 1 < argc) {
+			config.agentLatencyUs = (uint32_t) atol(argv[++i]);
+		} else if(strcmp(argv[i], "--payload") == 0 && i + 1 < argc) {
+			config.signPayload = (size_t) atol(argv[++i]);
+		} else if(strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+			config.eventLoopThreads = atoi(argv[++i]);
+		} else if(strcmp(argv[i], "--connections") == 0 && i + 1 < argc) {
+			config.muxConnections = (size_t) atol(argv[++i]);
+		} else if(strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+			jsonPath = argv[++i];
+		} else {
+			print_help(argv);
+			return 1;
+		}
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	bool tableOutput = jsonPath == NULL || strcmp(jsonPath, "-") != 0;
+	std::vector<scenario_result> results;
+
+	if(tableOutput)
+		printf("%-10s %10s %9s %9s %9s %9s %10s %12s %7s\n",
+		       "mode",
+		       "req/s",
+		       "p50_us",
+		       "p99_us",
+		       "p999_us",
+		       "sign_p99",
+		       "first_p99",
+		       "cpu_us/req",
+		       "errors");
+
+	for(proxy_mode mode : config.modes) {
+		scenario_result result = runScenario(config, mode);
+		results.push_back(result);
+
+		if(tableOutput) {
+			printf("%-10s %10.0f %9.1f %9.1f %9.1f %9.1f %10.1f %12.2f %7llu\n",
+			       modeName(mode),
+			       result.requestsPerSecond,
+			       result.all.p50Us,
+			       result.all.p99Us,
+			       result.all.p999Us,
+			       result.sign.p99Us,
+			       result.firstReply.p99Us,
+			       result.cpuUsPerRequest,
+			       (unsigned long long) result.errors);
+			fflush(stdout);
+		}
+	}
+
+	if(jsonPath != NULL) {
+		FILE* file = tableOutput ? fopen(jsonPath, "w") : stdout;
+		if(file == NULL) {
+			printf("Cannot write %s\n", jsonPath);
+			return 1;
+		}
+		writeJson(file, config, config.modes, results);
+		if(file != stdout)
+			fclose(file);
+	}
+
+	return 0;
+}
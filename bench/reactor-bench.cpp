@@ -0,0 +1,285 @@
+#include "bench/bench-common.h"
+#include "bench/stub-agent.h"
+#include "relay/agent-message.h"
+#include "relay/posix/epoll-reactor.h"
+#include "relay/posix/thread-server.h"
+#include "relay/posix/unix-socket.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Compare the thread-per-client server with the epoll event loop: proxy thread count,
+// proxy RSS and round-trip latency while N clients are connected at the same time.
+// Then check the event loop survives clients hanging up while their request is upstream,
+// with sessions moving between the loop threads.
+
+struct scenario_result {
+	process_stats proxyStats;
+	latency_stats latency;
+	double requestsPerSecond;
+	size_t failedClients;
+};
+
+static void print_help(char* argv[]) {
+	printf("Usage: %s [--clients 10,100,1000] [--requests count] [--threads count] [--max-message-size bytes]\n\n"
+	       " --clients: comma separated list of concurrent client counts\n"
+	       " --requests: REQUEST_IDENTITIES round trips made by each client, half as many connections\n"
+	       "             in the disconnect case\n"
+	       " --threads: event loop thread count\n"
+	       " --max-message-size: maximum agent message size given to the proxy\n",
+	       argv[0]);
+}
+
+static scenario_result runScenario(bool eventLoop,
+                                   size_t clientCount,
+                                   int requestsPerClient,
+                                   int eventLoopThreads,
+                                   int32_t maxMessageSize) {
+	std::string proxyPath = makeTempSocketPath("reactor-bench-proxy");
+	std::string agentPath = makeTempSocketPath("reactor-bench-agent");
+	scenario_result result;
+
+	memset(&result, 0, sizeof(result));
+
+	SOCKET listenSock = listenUnixSocket(proxyPath.c_str(), SOMAXCONN);
+	if(listenSock == INVALID_SOCKET) {
+		result.failedClients = clientCount;
+		return result;
+	}
+
+	socket_connector connectUpstream = [agentPath]() { return connectUnixSocket(agentPath.c_str()); };
+
+	pid_t proxyPid = startProxyProcess([&]() {
+		if(eventLoop) {
+			epoll_reactor reactor(listenSock, connectUpstream, maxMessageSize);
+			reactor.run(eventLoopThreads);
+		} else {
+			serveThreadPerClient(listenSock, connectUpstream, maxMessageSize);
+		}
+	});
+	closesocket(listenSock);
+
+	stub_agent agent(agentPath.c_str(), 0);
+	if(proxyPid < 0 || !agent.start()) {
+		stopProxyProcess(proxyPid);
+		result.failedClients = clientCount;
+		return result;
+	}
+
+	// All clients connect, then run their requests, then stay connected until the proxy has been measured
+	bench_barrier connected(clientCount + 1);
+	bench_barrier finished(clientCount + 1);
+	bench_barrier measured(clientCount + 1);
+	std::vector<std::vector<uint64_t>> samples(clientCount);
+	std::vector<bool> failed(clientCount, false);
+	std::vector<std::thread> clients;
+
+	for(size_t i = 0; i < clientCount; i++) {
+		clients.emplace_back([&, i]() {
+			std::vector<char> request = makeAgentMessage(SSH2_AGENTC_REQUEST_IDENTITIES, 0);
+			std::vector<char> reply;
+			SOCKET sock = connectUnixSocket(proxyPath.c_str());
+
+			connected.wait();
+
+			samples[i].reserve(requestsPerClient);
+			for(int request_index = 0; sock != INVALID_SOCKET && request_index < requestsPerClient; request_index++) {
+				uint64_t start = nowNs();
+				if(!agentRoundTrip(sock, request, reply)) {
+					failed[i] = true;
+					break;
+				}
+				samples[i].push_back(nowNs() - start);
+			}
+			if(sock == INVALID_SOCKET)
+				failed[i] = true;
+
+			finished.wait();
+			measured.wait();
+
+			if(sock != INVALID_SOCKET)
+				closesocket(sock);
+		});
+	}
+
+	connected.wait();
+	uint64_t start = nowNs();
+	finished.wait();
+	uint64_t elapsed = nowNs() - start;
+	readProcessStats(proxyPid, &result.proxyStats);
+	measured.wait();
+
+	for(std::thread& client : clients) {
+		client.join();
+	}
+
+	stopProxyProcess(proxyPid);
+	unlink(proxyPath.c_str());
+
+	std::vector<uint64_t> allSamples;
+	for(size_t i = 0; i < clientCount; i++) {
+		allSamples.insert(allSamples.end(), samples[i].begin(), samples[i].end());
+		if(failed[i])
+			result.failedClients++;
+	}
+
+	result.latency = computeLatencyStats(allSamples);
+	result.requestsPerSecond = (double) result.latency.count * 1e9 / (double) elapsed;
+
+	return result;
+}
+
+// Clients connect, send a request and every other time hang up without waiting for the reply, which the
+// stub agent delays so the session is waiting upstream. Returns the failed replies, and whether the proxy
+// still answers afterwards.
+static size_t runDisconnectScenario(size_t clientCount,
+                                    int connectionsPerClient,
+                                    int eventLoopThreads,
+                                    int32_t maxMessageSize,
+                                    bool* survived) {
+	std::string proxyPath = makeTempSocketPath("reactor-bench-proxy");
+	std::string agentPath = makeTempSocketPath("reactor-bench-agent");
+
+	*survived = false;
+
+	SOCKET listenSock = listenUnixSocket(proxyPath.c_str(), SOMAXCONN);
+	if(listenSock == INVALID_SOCKET)
+		return clientCount;
+
+	socket_connector connectUpstream = [agentPath]() { return connectUnixSocket(agentPath.c_str()); };
+
+	pid_t proxyPid = startProxyProcess([&]() {
+		epoll_reactor reactor(listenSock, connectUpstream, maxMessageSize);
+		reactor.run(eventLoopThreads);
+	});
+	closesocket(listenSock);
+
+	stub_agent agent(agentPath.c_str(), 200);
+	if(proxyPid < 0 || !agent.start()) {
+		stopProxyProcess(proxyPid);
+		return clientCount;
+	}
+
+	std::vector<char> request = makeAgentMessage(SSH2_AGENTC_REQUEST_IDENTITIES, 0);
+	std::atomic<size_t> failures(0);
+	std::vector<std::thread> clients;
+
+	for(size_t i = 0; i < clientCount; i++) {
+		clients.emplace_back([&]() {
+			std::vector<char> reply;
+
+			for(int j = 0; j < connectionsPerClient; j++) {
+				SOCKET sock = connectUnixSocket(proxyPath.c_str());
+				if(sock == INVALID_SOCKET) {
+					failures++;
+					continue;
+				}
+				if(j % 2 == 0) {
+					writeFull(sock, request.data(), request.size());
+				} else if(!agentRoundTrip(sock, request, reply)) {
+					failures++;
+				}
+				closesocket(sock);
+			}
+		});
+	}
+
+	for(std::thread& client : clients) {
+		client.join();
+	}
+
+	std::vector<char> reply;
+	SOCKET sock = connectUnixSocket(proxyPath.c_str());
+	if(sock != INVALID_SOCKET) {
+		*survived = agentRoundTrip(sock, request, reply);
+		closesocket(sock);
+	}
+
+	stopProxyProcess(proxyPid);
+	unlink(proxyPath.c_str());
+
+	return failures;
+}
+
+int main(int argc, char* argv[]) {
+	std::vector<size_t> clientCounts = {10, 100, 1000};
+	int requestsPerClient = 100;
+	int eventLoopThreads = 2;
+	int32_t maxMessageSize = AGENT_MAX_MSGLEN;
+
+	for(int i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "--clients") == 0 && i + 1 < argc) {
+			clientCounts.clear();
+			for(char* token = strtok(argv[++i], ","); token != NULL; token = strtok(NULL, ",")) {
+				clientCounts.push_back((size_t) atol(token));
+			}
+		} else if(strcmp(argv[i], "--requests") == 0 && i + 1 < argc) {
+			requestsPerClient = atoi(argv[++i]);
+		} else if(strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+			eventLoopThreads = atoi(argv[++i]);
+		} else if(strcmp(argv[i], "--max-message-size") == 0 && i + 1 < argc) {
+			maxMessageSize = atoi(argv[++i]);
+		} else {
+			print_help(argv);
+			return 1;
+		}
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	printf("%-12s %8s %8s %10s %10s %10s %12s %7s\n",
+	       "mode",
+	       "clients",
+	       "threads",
+	       "rss_kb",
+	       "p50_us",
+	       "p99_us",
+	       "req/s",
+	       "failed");
+
+	for(size_t clientCount : clientCounts) {
+		for(bool eventLoop : {false, true}) {
+			scenario_result result =
+			    runScenario(eventLoop, clientCount, requestsPerClient, eventLoopThreads, maxMessageSize);
+
+			printf("%-12s %8zu %8ld %10ld %10.1f %10.1f %12.0f %7zu\n",
+			       eventLoop ? "event-loop" : "threads",
+			       clientCount,
+			       result.proxyStats.threads,
+			       result.proxyStats.rssKb,
+			       result.latency.p50Us,
+			       result.latency.p99Us,
+			       result.requestsPerSecond,
+			       result.failedClients);
+			fflush(stdout);
+		}
+	}
+
+	printf("\n%-12s %8s %8s %12s %8s %9s\n", "disconnect", "clients", "threads", "connections", "failed", "survived");
+
+	for(size_t clientCount : clientCounts) {
+		int connections = std::max(requestsPerClient / 2, 2);
+		int threads = std::max(eventLoopThreads, 2);
+		bool survived;
+		size_t failures = runDisconnectScenario(clientCount, connections, threads, maxMessageSize, &survived);
+
+		printf("%-12s %8zu %8d %12zu %8zu %9s\n",
+		       "event-loop",
+		       clientCount,
+		       threads,
+		       clientCount * connections,
+		       failures,
+		       survived ? "yes" : "no");
+		fflush(stdout);
+	}
+
+	return 0;
+}
@@ -0,0 +1,232 @@
+#include "bench/stub-agent.h"
+#include "bench/bench-common.h"
+#include "relay/posix/unix-socket.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+static void appendU32(std::vector<char>& buffer, uint32_t value) {
+	buffer.push_back((char) (value >> 24));
+	buffer.push_back((char) (value >> 16));
+	buffer.push_back((char) (value >> 8));
+	buffer.push_back((char) (value >> 0));
+}
+
+static void appendString(std::vector<char>& buffer, const std::string& value) {
+	appendU32(buffer, (uint32_t) value.size());
+	buffer.insert(buffer.end(), value.begin(), value.end());
+}
+
+static std::vector<char> finishMessage(std::vector<char> body) {
+	std::vector<char> message;
+
+	appendU32(message, (uint32_t) body.size());
+	message.insert(message.end(), body.begin(), body.end());
+
+	return message;
+}
+
+static std::vector<char> makeIdentitiesAnswer() {
+	std::vector<char> keyBlob;
+	std::vector<char> body;
+
+	appendString(keyBlob, "ssh-ed25519");
+	appendString(keyBlob, std::string(32, '\x42'));
+
+	body.push_back(SSH2_AGENT_IDENTITIES_ANSWER);
+	appendU32(body, 1);
+	appendString(body, std::string(keyBlob.begin(), keyBlob.end()));
+	appendString(body, "stub-agent@bench");
+
+	return finishMessage(body);
+}
+
+static std::vector<char> makeSignResponse() {
+	std::vector<char> signature;
+	std::vector<char> body;
+
+	appendString(signature, "ssh-ed25519");
+	appendString(signature, std::string(64, '\x53'));
+
+	body.push_back(SSH2_AGENT_SIGN_RESPONSE);
+	appendString(body, std::string(signature.begin(), signature.end()));
+
+	return finishMessage(body);
+}
+
+stub_agent::stub_agent(const char* path, uint32_t latencyUs, bool cygwinSocket)
+    : path(path),
+      latencyUs(latencyUs),
+      cygwinSocket(cygwinSocket),
+      handshakeLatencyUs(0),
+      signLatencyUs(0),
+      serialized(false),
+      listenSock(INVALID_SOCKET),
+      requestCount(0),
+      connectionCount(0),
+      activeConnections(0),
+      maxActiveConnections(0) {
+	for(std::atomic<uint64_t>& count : typeRequestCount) {
+		count = 0;
+	}
+}
+
+stub_agent::~stub_agent() {
+	if(listenSock != INVALID_SOCKET) {
+		shutdown(listenSock, SHUT_RDWR);
+		acceptThread.join();
+		closesocket(listenSock);
+		unlink(path);
+	}
+
+	while(activeConnections > 0) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+}
+
+bool stub_agent::start() {
+	if(cygwinSocket) {
+		if(!listenCygwinSocket())
+			return false;
+	} else {
+		listenSock = listenUnixSocket(path, SOMAXCONN);
+		if(listenSock == INVALID_SOCKET)
+			return false;
+	}
+
+	acceptThread = std::thread(&stub_agent::acceptLoop, this);
+
+	return true;
+}
+
+bool stub_agent::listenCygwinSocket() {
+	struct sockaddr_in address;
+	socklen_t addressLength = sizeof(address);
+
+	listenSock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+	if(listenSock == INVALID_SOCKET)
+		return false;
+
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = 0;
+
+	if(bind(listenSock, (const struct sockaddr*) &address, sizeof(address)) < 0 || listen(listenSock, SOMAXCONN) < 0 ||
+	   getsockname(listenSock, (struct sockaddr*) &address, &addressLength) < 0) {
+		printf("Failed to listen on a TCP socket: %d\n", socketLastError());
+		return false;
+	}
+
+	for(uint32_t& cookiePart : cookie) {
+		cookiePart = (uint32_t) rand();
+	}
+
+	FILE* file = fopen(path, "wb");
+	if(file == NULL) {
+		printf("Failed to create socket file %s: %d\n", path, errno);
+		return false;
+	}
+	fprintf(file,
+	        "!<socket >%u s %08X-%08X-%08X-%08X",
+	        ntohs(address.sin_port),
+	        cookie[0],
+	        cookie[1],
+	        cookie[2],
+	        cookie[3]);
+	fclose(file);
+
+	return true;
+}
+
+bool stub_agent::cygwinHandshake(SOCKET sock) {
+	uint32_t clientCookie[4];
+	uint32_t ids[3];
+
+	if(!readFull(sock, clientCookie, sizeof(clientCookie)) || memcmp(clientCookie, cookie, sizeof(cookie)) != 0)
+		return false;
+
+	if(handshakeLatencyUs > 0)
+		std::this_thread::sleep_for(std::chrono::microseconds(handshakeLatencyUs));
+
+	if(!writeFull(sock, cookie, sizeof(cookie)))
+		return false;
+
+	if(!readFull(sock, ids, sizeof(ids)))
+		return false;
+	ids[0] = (uint32_t) getpid();
+	ids[1] = (uint32_t) getuid();
+	ids[2] = (uint32_t) getgid();
+
+	return writeFull(sock, ids, sizeof(ids));
+}
+
+void stub_agent::acceptLoop() {
+	for(;;) {
+		SOCKET sock = accept4(listenSock, NULL, NULL, SOCK_CLOEXEC);
+		if(sock == INVALID_SOCKET) {
+			if(errno == EINTR || errno == ECONNABORTED)
+				continue;
+			return;
+		}
+
+		connectionCount++;
+		uint32_t active = ++activeConnections;
+		uint32_t previousMax = maxActiveConnections;
+		while(active > previousMax && !maxActiveConnections.compare_exchange_weak(previousMax, active)) {
+		}
+		std::thread(&stub_agent::serve, this, sock).detach();
+	}
+}
+
+void stub_agent::serve(SOCKET sock) {
+	static const std::vector<char> identitiesAnswer = makeIdentitiesAnswer();
+	static const std::vector<char> signResponse = makeSignResponse();
+	static const std::vector<char> success = makeAgentMessage(SSH_AGENT_SUCCESS, 0);
+	std::vector<char> request;
+
+	if(cygwinSocket && !cygwinHandshake(sock)) {
+		printf("Stub agent: cygwin socket handshake failed\n");
+		closesocket(sock);
+		activeConnections--;
+		return;
+	}
+
+	while(readFullAgentMessage(sock, request)) {
+		const std::vector<char>* reply;
+		uint32_t delayUs = latencyUs;
+		std::unique_lock<std::mutex> serializedLock(requestMutex, std::defer_lock);
+
+		if(serialized)
+			serializedLock.lock();
+
+		requestCount++;
+		if(request.size() >= 5)
+			typeRequestCount[(uint8_t) request[4]]++;
+
+		if(request.size() < 5) {
+			reply = &success;
+		} else if(request[4] == SSH2_AGENTC_REQUEST_IDENTITIES) {
+			reply = &identitiesAnswer;
+		} else if(request[4] == SSH2_AGENTC_SIGN_REQUEST) {
+			reply = &signResponse;
+			delayUs += signLatencyUs;
+		} else {
+			reply = &success;
+		}
+
+		if(delayUs > 0)
+			std::this_thread::sleep_for(std::chrono::microseconds(delayUs));
+
+		if(!writeFull(sock, reply->data(), reply->size()))
+			break;
+	}
+
+	closesocket(sock);
+	activeConnections--;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "relay/socket-compat.h"
+
+#include <stdint.h>
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+// Minimal ssh-agent speaking the agent wire protocol on a unix socket, used as upstream by the benchmarks.
+// It answers REQUEST_IDENTITIES and SIGN_REQUEST with canned replies, SSH_AGENT_SUCCESS to anything else
+// and can delay each reply to simulate a slow agent. Each connection is served by its own thread.
+// The destructor waits for all connections to be closed by their peers.
+// In cygwin mode, path is a cygwin socket file pointing to a TCP socket guarded by the cookie handshake,
+// like the sockets of Git Bash's ssh-agent.
+class stub_agent {
+public:
+	stub_agent(const char* path, uint32_t latencyUs, bool cygwinSocket = false);
+	~stub_agent();
+
+	stub_agent(const stub_agent&) = delete;
+	stub_agent& operator=(const stub_agent&) = delete;
+
+	// Delay the cygwin handshake of each connection, to simulate the connection setup cost of a real agent.
+	void setHandshakeLatency(uint32_t latencyUs) { handshakeLatencyUs = latencyUs; }
+
+	// Add latencyUs to the delay of sign requests only, like an agent spending time in the private key operation.
+	void setSignLatency(uint32_t latencyUs) { signLatencyUs = latencyUs; }
+
+	// Handle one request at a time across all connections, like ssh-agent's single threaded event loop
+	// or Pageant's window procedure.
+	void setSerialized(bool serialized) { this->serialized = serialized; }
+
+	// Start listening. Returns false if the socket could not be created.
+	bool start();
+
+	uint64_t getRequestCount() const { return requestCount; }
+	uint64_t getRequestCount(uint8_t type) const { return typeRequestCount[type]; }
+	uint64_t getConnectionCount() const { return connectionCount; }
+	uint32_t getMaxActiveConnections() const { return maxActiveConnections; }
+
+private:
+	bool listenCygwinSocket();
+	bool cygwinHandshake(SOCKET sock);
+	void acceptLoop();
+	void serve(SOCKET sock);
+
+	const char* path;
+	uint32_t latencyUs;
+	bool cygwinSocket;
+	uint32_t handshakeLatencyUs;
+	uint32_t signLatencyUs;
+	bool serialized;
+	std::mutex requestMutex;
+	uint32_t cookie[4];
+	SOCKET listenSock;
+	std::thread acceptThread;
+	std::atomic<uint64_t> requestCount;
+	std::atomic<uint64_t> typeRequestCount[256];
+	std::atomic<uint64_t> connectionCount;
+	std::atomic<uint32_t> activeConnections;
+	std::atomic<uint32_t> maxActiveConnections;
+};
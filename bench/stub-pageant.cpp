@@ -0,0 +1,168 @@
+#include "bench/stub-pageant.h"
+#include "bench/bench-common.h"
+#include "relay/agent-message.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <vector>
+
+stub_pageant::stub_pageant()
+    : generation(1), requestCount(0), pendingName(NULL), pendingResult(false), done(false), stopping(false) {
+	responder = std::thread(&stub_pageant::respondLoop, this);
+}
+
+stub_pageant::~stub_pageant() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	changed.notify_all();
+	responder.join();
+}
+
+bool stub_pageant::send(uint64_t handle, const std::string& name) {
+	if(handle != generation)
+		return false;
+
+	// Like SendMessage, one request is handled at a time by the responder thread
+	std::lock_guard<std::mutex> sendLock(sendMutex);
+	std::unique_lock<std::mutex> lock(mutex);
+
+	pendingName = &name;
+	done = false;
+	changed.notify_all();
+	changed.wait(lock, [this]() { return done; });
+
+	return pendingResult;
+}
+
+void stub_pageant::respondLoop() {
+	std::unique_lock<std::mutex> lock(mutex);
+
+	for(;;) {
+		changed.wait(lock, [this]() { return stopping || pendingName != NULL; });
+		if(stopping)
+			return;
+
+		pendingResult = answer(*pendingName);
+		pendingName = NULL;
+		done = true;
+		changed.notify_all();
+	}
+}
+
+bool stub_pageant::answer(const std::string& name) {
+	static const std::vector<char> identitiesAnswer = makeAgentMessage(SSH2_AGENT_IDENTITIES_ANSWER, 400);
+	static const std::vector<char> signResponse = makeAgentMessage(SSH2_AGENT_SIGN_RESPONSE, 100);
+	static const std::vector<char> success = makeAgentMessage(SSH_AGENT_SUCCESS, 0);
+
+	// Pageant opens and maps the request file mapping for each request
+	int fd = shm_open(name.c_str(), O_RDWR, 0);
+	if(fd < 0)
+		return false;
+
+	uint8_t* memory = (uint8_t*) mmap(NULL, PAGEANT_MAX_MSGLEN, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(memory == MAP_FAILED)
+		return false;
+
+	const std::vector<char>* reply;
+	switch(agentMessageType(memory, PAGEANT_MAX_MSGLEN)) {
+		case SSH2_AGENTC_REQUEST_IDENTITIES:
+			reply = &identitiesAnswer;
+			break;
+		case SSH2_AGENTC_SIGN_REQUEST:
+			reply = &signResponse;
+			break;
+		default:
+			reply = &success;
+			break;
+	}
+	memcpy(memory, reply->data(), reply->size());
+	munmap(memory, PAGEANT_MAX_MSGLEN);
+
+	requestCount++;
+	return true;
+}
+
+shm_transport::shm_transport(stub_pageant& pageant, bool persistent)
+    : pageant(pageant),
+      persistent(persistent),
+      fd(-1),
+      sharedMemory(NULL),
+      handle(0),
+      hasHandle(false),
+      syscallCount(0) {
+	static std::atomic<uint32_t> transportCount(0);
+	name = "/stub-pageant-" + std::to_string(getpid()) + "-" + std::to_string(transportCount++);
+}
+
+shm_transport::~shm_transport() {
+	unmap();
+}
+
+void shm_transport::unmap() {
+	if(sharedMemory == NULL)
+		return;
+
+	munmap(sharedMemory, PAGEANT_MAX_MSGLEN);
+	close(fd);
+	shm_unlink(name.c_str());
+	syscallCount += 3;
+	sharedMemory = NULL;
+	fd = -1;
+}
+
+uint8_t* shm_transport::getSharedMemory() {
+	if(!persistent)
+		findAgent();
+
+	if(sharedMemory != NULL)
+		return sharedMemory;
+
+	fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+	syscallCount++;
+	if(fd < 0) {
+		printf("shm_open failed: %d\n", errno);
+		return NULL;
+	}
+
+	syscallCount += 2;
+	if(ftruncate(fd, PAGEANT_MAX_MSGLEN) < 0) {
+		close(fd);
+		shm_unlink(name.c_str());
+		return NULL;
+	}
+
+	sharedMemory = (uint8_t*) mmap(NULL, PAGEANT_MAX_MSGLEN, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(sharedMemory == MAP_FAILED) {
+		sharedMemory = NULL;
+		close(fd);
+		shm_unlink(name.c_str());
+		return NULL;
+	}
+
+	return sharedMemory;
+}
+
+void shm_transport::releaseSharedMemory() {
+	if(!persistent)
+		unmap();
+}
+
+bool shm_transport::findAgent() {
+	handle = pageant.find();
+	hasHandle = true;
+	return true;
+}
+
+bool shm_transport::sendRequest() {
+	if(!hasHandle)
+		findAgent();
+
+	return pageant.send(handle, name);
+}
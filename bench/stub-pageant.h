@@ -0,0 +1,81 @@
+#pragma once
+
+#include "relay/pageant-upstream.h"
+
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// Stand-in for the Pageant window used by the benchmarks: a responder thread receives
+// the name of a POSIX shared memory object, maps it like Pageant maps the request file mapping,
+// and replies in place. Requests are handed over synchronously like SendMessage to another thread.
+// Handles returned by find() become stale when restart() is called, like a window handle when
+// Pageant is restarted.
+class stub_pageant {
+public:
+	stub_pageant();
+	~stub_pageant();
+
+	stub_pageant(const stub_pageant&) = delete;
+	stub_pageant& operator=(const stub_pageant&) = delete;
+
+	uint64_t find() const { return generation; }
+	void restart() { generation++; }
+
+	// Returns false if handle is stale or the request could not be answered.
+	bool send(uint64_t handle, const std::string& name);
+
+	uint64_t getRequestCount() const { return requestCount; }
+
+private:
+	void respondLoop();
+	bool answer(const std::string& name);
+
+	std::atomic<uint64_t> generation;
+	std::atomic<uint64_t> requestCount;
+
+	std::mutex sendMutex;
+	std::mutex mutex;
+	std::condition_variable changed;
+	const std::string* pendingName;
+	bool pendingResult;
+	bool done;
+	bool stopping;
+	std::thread responder;
+};
+
+// pageant_transport over a POSIX shared memory object and a stub_pageant.
+// When persistent is false, the agent is looked up and the shared memory is created and destroyed
+// for each request, like the WM_COPYDATA backend used to do.
+class shm_transport : public pageant_transport {
+public:
+	shm_transport(stub_pageant& pageant, bool persistent);
+	~shm_transport() override;
+
+	shm_transport(const shm_transport&) = delete;
+	shm_transport& operator=(const shm_transport&) = delete;
+
+	uint8_t* getSharedMemory() override;
+	void releaseSharedMemory() override;
+	bool findAgent() override;
+	bool sendRequest() override;
+
+	// Syscalls made by the transport itself, the responder side is not counted.
+	uint64_t getSyscallCount() const { return syscallCount; }
+
+private:
+	void unmap();
+
+	stub_pageant& pageant;
+	bool persistent;
+	std::string name;
+	int fd;
+	uint8_t* sharedMemory;
+	uint64_t handle;
+	bool hasHandle;
+	uint64_t syscallCount;
+};
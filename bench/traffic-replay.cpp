@@ -0,0 +1,389 @@
+#include "bench/bench-common.h"
+#include "bench/stub-agent.h"
+#include "relay/agent-message.h"
+#include "relay/posix/thread-server.h"
+#include "relay/posix/unix-socket.h"
+#include "relay/traffic-capture.h"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Replay a traffic capture written by --capture: the capture file is memory mapped and each captured session
+// is re-issued on its own connection at its original start time, so the original concurrency is preserved.
+// Requests are sent at their captured time divided by --speed (0 sends them as fast as possible) and replies
+// are only compared by type, as signatures differ between agents. Redacted requests are replaced by dummy
+// payloads of the same size and type. Without --socket, the capture is replayed against the relay running in
+// a child process in front of the stub agent.
+
+struct capture_record {
+	uint64_t timeUs;
+	uint32_t sessionId;
+	capture_event event;
+	uint8_t messageType;
+	uint32_t messageSize;
+	uint32_t storedSize;
+	const char* stored;
+};
+
+struct captured_session {
+	uint64_t startUs;
+	std::vector<capture_record> records;
+};
+
+struct replay_samples {
+	std::mutex mutex;
+	std::vector<uint64_t> all;
+	std::vector<uint64_t> list;
+	std::vector<uint64_t> sign;
+	std::vector<uint64_t> lateness;
+	uint64_t requests = 0;
+	uint64_t mismatchedReplies = 0;
+	uint64_t errors = 0;
+	std::atomic<uint32_t> activeSessions{0};
+	std::atomic<uint32_t> maxActiveSessions{0};
+};
+
+static void print_help(char* argv[]) {
+	printf("Usage: %s [--speed factor] [--socket path] [--json file] capture_file\n\n"
+	       " --speed: replay speed, 1 for the captured timing (default), 10 for ten times faster,\n"
+	       "          0 to send every request as soon as the previous reply is received\n"
+	       " --socket: replay against the proxy listening on path instead of a relay started in front of\n"
+	       "           the stub agent\n"
+	       " --json: also write the results as JSON to file, - for the standard output only\n",
+	       argv[0]);
+}
+
+static uint64_t readu64(const char* buffer) {
+	return ((uint64_t) readu32(buffer) << 32) | readu32(buffer + 4);
+}
+
+// Split the mapped capture into sessions. Returns false if the file is not a valid capture.
+static bool parseCapture(const char* data, size_t size, std::vector<captured_session>& sessions, bool* redacted) {
+	std::map<uint32_t, size_t> sessionIndexes;
+	size_t offset = TRAFFIC_CAPTURE_HEADER_SIZE;
+
+	if(size < TRAFFIC_CAPTURE_HEADER_SIZE || memcmp(data, TRAFFIC_CAPTURE_MAGIC, 8) != 0)
+		return false;
+	*redacted = (readu32(data + 8) & TRAFFIC_CAPTURE_REDACTED) != 0;
+
+	// A capture of a killed proxy may end with a truncated record, it is ignored
+	while(size - offset >= TRAFFIC_CAPTURE_RECORD_SIZE) {
+		const char* header = data + offset;
+		capture_record record;
+
+		record.timeUs = readu64(header);
+		record.sessionId = readu32(header + 8);
+		record.event = (capture_event) header[12];
+		record.messageType = (uint8_t) header[13];
+		record.messageSize = readu32(header + 16);
+		record.storedSize = readu32(header + 20);
+		record.stored = header + TRAFFIC_CAPTURE_RECORD_SIZE;
+
+		if(record.storedSize > size - offset - TRAFFIC_CAPTURE_RECORD_SIZE)
+			break;
+		if(record.event > capture_event::session_close ||
+		   (record.storedSize != 0 && record.storedSize != record.messageSize))
+			return false;
+		offset += TRAFFIC_CAPTURE_RECORD_SIZE + record.storedSize;
+
+		// Sessions already open when the capture started have no open record
+		auto it = sessionIndexes.find(record.sessionId);
+		if(it == sessionIndexes.end()) {
+			it = sessionIndexes.emplace(record.sessionId, sessions.size()).first;
+			sessions.push_back({record.timeUs, {}});
+		}
+		sessions[it->second].records.push_back(record);
+	}
+
+	std::sort(sessions.begin(), sessions.end(), [](const captured_session& a, const captured_session& b) {
+		return a.startUs < b.startUs;
+	});
+
+	return true;
+}
+
+static void waitUntil(uint64_t timeNs) {
+	uint64_t now = nowNs();
+	if(timeNs > now)
+		std::this_thread::sleep_for(std::chrono::nanoseconds(timeNs - now));
+}
+
+static void replaySession(const captured_session& session,
+                          const std::string& proxyPath,
+                          uint64_t replayStartNs,
+                          uint64_t captureStartUs,
+                          double speed,
+                          replay_samples& samples) {
+	auto scheduledNs = [&](uint64_t timeUs) {
+		if(speed <= 0)
+			return (uint64_t) 0;
+		return replayStartNs + (uint64_t) ((double) (timeUs - captureStartUs) * 1000.0 / speed);
+	};
+
+	SOCKET sock = connectUnixSocket(proxyPath.c_str());
+	if(sock == INVALID_SOCKET) {
+		std::lock_guard<std::mutex> lock(samples.mutex);
+		samples.errors++;
+		return;
+	}
+
+	uint32_t active = ++samples.activeSessions;
+	uint32_t previousMax = samples.maxActiveSessions.load();
+	while(active > previousMax && !samples.maxActiveSessions.compare_exchange_weak(previousMax, active)) {
+	}
+
+	std::vector<char> request;
+	std::vector<char> reply;
+	uint64_t requestStart = 0;
+	int requestType = -1;
+	bool failed = false;
+
+	for(const capture_record& record : session.records) {
+		if(record.event == capture_event::request) {
+			uint64_t scheduled = scheduledNs(record.timeUs);
+			waitUntil(scheduled);
+
+			if(record.storedSize > 0)
+				request.assign(record.stored, record.stored + record.storedSize);
+			else
+				request = makeAgentMessage(record.messageType, record.messageSize > 5 ? record.messageSize - 5 : 0);
+
+			requestStart = nowNs();
+			requestType = record.messageType;
+			if(!writeFull(sock, request.data(), request.size())) {
+				failed = true;
+				break;
+			}
+
+			std::lock_guard<std::mutex> lock(samples.mutex);
+			if(scheduled > 0)
+				samples.lateness.push_back(requestStart > scheduled ? requestStart - scheduled : 0);
+			samples.requests++;
+		} else if(record.event == capture_event::reply) {
+			if(!readFullAgentMessage(sock, reply)) {
+				failed = true;
+				break;
+			}
+			uint64_t latency = nowNs() - requestStart;
+			uint8_t replyType = reply.size() >= 5 ? (uint8_t) reply[4] : 0;
+
+			std::lock_guard<std::mutex> lock(samples.mutex);
+			samples.all.push_back(latency);
+			if(requestType == SSH2_AGENTC_REQUEST_IDENTITIES)
+				samples.list.push_back(latency);
+			else if(requestType == SSH2_AGENTC_SIGN_REQUEST)
+				samples.sign.push_back(latency);
+			if(replyType != record.messageType)
+				samples.mismatchedReplies++;
+		} else if(record.event == capture_event::session_close) {
+			// Keep the connection open as long as the captured one
+			waitUntil(scheduledNs(record.timeUs));
+		}
+	}
+
+	samples.activeSessions--;
+	closesocket(sock);
+
+	if(failed) {
+		std::lock_guard<std::mutex> lock(samples.mutex);
+		samples.errors++;
+	}
+}
+
+static void writeLatencyJson(FILE* file, const char* name, const latency_stats& stats, bool last) {
+	fprintf(file,
+	        "    \"%s\": {\"count\": %zu, \"mean\": %.1f, \"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f, "
+	        "\"max\": %.1f}%s\n",
+	        name,
+	        stats.count,
+	        stats.meanUs,
+	        stats.p50Us,
+	        stats.p99Us,
+	        stats.p999Us,
+	        stats.maxUs,
+	        last ? "" : ",");
+}
+
+int main(int argc, char* argv[]) {
+	const char* capturePath = NULL;
+	const char* socketPath = NULL;
+	const char* jsonPath = NULL;
+	double speed = 1;
+
+	for(int i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "--speed") == 0 && i + 1 < argc) {
+			speed = atof(argv[++i]);
+		} else if(strcmp(argv[i], "--socket") == 0 && i + 1 < argc) {
+			socketPath = argv[++i];
+		} else if(strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+			jsonPath = argv[++i];
+		} else if(capturePath == NULL && argv[i][0] != '-') {
+			capturePath = argv[i];
+		} else {
+			print_help(argv);
+			return 1;
+		}
+	}
+
+	if(capturePath == NULL) {
+		print_help(argv);
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	int fd = open(capturePath, O_RDONLY | O_CLOEXEC);
+	struct stat fileStat;
+	if(fd < 0 || fstat(fd, &fileStat) != 0 || fileStat.st_size == 0) {
+		printf("Cannot read %s\n", capturePath);
+		return 1;
+	}
+
+	const char* data = (const char*) mmap(NULL, (size_t) fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(data == MAP_FAILED) {
+		printf("Cannot map %s\n", capturePath);
+		return 1;
+	}
+	madvise((void*) data, (size_t) fileStat.st_size, MADV_SEQUENTIAL);
+
+	std::vector<captured_session> sessions;
+	bool redacted = false;
+	if(!parseCapture(data, (size_t) fileStat.st_size, sessions, &redacted)) {
+		printf("%s is not a valid traffic capture\n", capturePath);
+		return 1;
+	}
+	if(sessions.empty()) {
+		printf("%s has no session\n", capturePath);
+		return 1;
+	}
+
+	std::string proxyPath = socketPath != NULL ? socketPath : makeTempSocketPath("traffic-replay-proxy");
+	std::string agentPath = makeTempSocketPath("traffic-replay-agent");
+	pid_t proxyPid = -1;
+	std::unique_ptr<stub_agent> agent;
+
+	if(socketPath == NULL) {
+		SOCKET listenSock = listenUnixSocket(proxyPath.c_str(), SOMAXCONN);
+		if(listenSock == INVALID_SOCKET)
+			return 1;
+
+		proxyPid = startProxyProcess([&]() {
+			serveThreadPerClient(
+			    listenSock, [&agentPath]() { return connectUnixSocket(agentPath.c_str()); }, AGENT_MAX_MSGLEN);
+		});
+		closesocket(listenSock);
+
+		agent = std::make_unique<stub_agent>(agentPath.c_str(), 0);
+		if(proxyPid < 0 || !agent->start()) {
+			stopProxyProcess(proxyPid);
+			return 1;
+		}
+	}
+
+	// Sessions are started in capture order by this thread, each one then runs on its own thread
+	replay_samples samples;
+	std::vector<std::thread> threads;
+	uint64_t captureStartUs = sessions.front().startUs;
+	uint64_t replayStartNs = nowNs();
+
+	threads.reserve(sessions.size());
+	for(const captured_session& session : sessions) {
+		if(speed > 0)
+			waitUntil(replayStartNs + (uint64_t) ((double) (session.startUs - captureStartUs) * 1000.0 / speed));
+		threads.emplace_back(replaySession,
+		                     std::cref(session),
+		                     std::cref(proxyPath),
+		                     replayStartNs,
+		                     captureStartUs,
+		                     speed,
+		                     std::ref(samples));
+	}
+	for(std::thread& thread : threads) {
+		thread.join();
+	}
+	double elapsedS = (double) (nowNs() - replayStartNs) / 1e9;
+
+	if(proxyPid >= 0) {
+		stopProxyProcess(proxyPid);
+		unlink(proxyPath.c_str());
+	}
+	munmap((void*) data, (size_t) fileStat.st_size);
+
+	latency_stats all = computeLatencyStats(samples.all);
+	latency_stats list = computeLatencyStats(samples.list);
+	latency_stats sign = computeLatencyStats(samples.sign);
+	latency_stats lateness = computeLatencyStats(samples.lateness);
+	bool tableOutput = jsonPath == NULL || strcmp(jsonPath, "-") != 0;
+
+	if(tableOutput) {
+		printf("Replayed %zu sessions, %llu requests in %.2f s at speed %g%s (%.0f req/s)\n",
+		       sessions.size(),
+		       (unsigned long long) samples.requests,
+		       elapsedS,
+		       speed,
+		       redacted ? " with redacted payloads" : "",
+		       (double) samples.requests / elapsedS);
+		printf("Max concurrent sessions %u, mismatched replies %llu, errors %llu\n",
+		       samples.maxActiveSessions.load(),
+		       (unsigned long long) samples.mismatchedReplies,
+		       (unsigned long long) samples.errors);
+		printf("%-10s %9s %9s %9s %9s %9s\n", "latency", "count", "p50_us", "p99_us", "p999_us", "max_us");
+		for(const auto& row : {std::make_pair("all", &all),
+		                       std::make_pair("list", &list),
+		                       std::make_pair("sign", &sign),
+		                       std::make_pair("lateness", &lateness)}) {
+			printf("%-10s %9zu %9.1f %9.1f %9.1f %9.1f\n",
+			       row.first,
+			       row.second->count,
+			       row.second->p50Us,
+			       row.second->p99Us,
+			       row.second->p999Us,
+			       row.second->maxUs);
+		}
+	}
+
+	if(jsonPath != NULL) {
+		FILE* file = tableOutput ? fopen(jsonPath, "w") : stdout;
+		if(file == NULL) {
+			printf("Cannot write %s\n", jsonPath);
+			return 1;
+		}
+		fprintf(file,
+		        "{\n  \"sessions\": %zu, \"requests\": %llu, \"speed\": %g, \"redacted\": %s, \"elapsed_s\": %.3f,\n"
+		        "  \"max_concurrent_sessions\": %u, \"mismatched_replies\": %llu, \"errors\": %llu,\n"
+		        "  \"latency_us\": {\n",
+		        sessions.size(),
+		        (unsigned long long) samples.requests,
+		        speed,
+		        redacted ? "true" : "false",
+		        elapsedS,
+		        samples.maxActiveSessions.load(),
+		        (unsigned long long) samples.mismatchedReplies,
+		        (unsigned long long) samples.errors);
+		writeLatencyJson(file, "all", all, false);
+		writeLatencyJson(file, "list", list, false);
+		writeLatencyJson(file, "sign", sign, false);
+		writeLatencyJson(file, "lateness", lateness, true);
+		fprintf(file, "  }\n}\n");
+		if(file != stdout)
+			fclose(file);
+	}
+
+	return samples.errors > 0 ? 2 : 0;
+}
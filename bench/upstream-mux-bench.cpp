@@ -0,0 +1,187 @@
+#include "bench/bench-common.h"
+#include "bench/stub-agent.h"
+#include "relay/agent-message.h"
+#include "relay/posix/thread-server.h"
+#include "relay/posix/unix-socket.h"
+#include "relay/upstream-mux.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Load test of the upstream multiplexer: N clients stay connected and alternate
+// REQUEST_IDENTITIES and SIGN_REQUEST, either each on its own upstream connection or
+// all sharing a few multiplexed ones. Reports the peak number of upstream connections
+// seen by the stub agent, latency, throughput and replies not matching their request type.
+
+struct scenario_result {
+	latency_stats latency;
+	double requestsPerSecond;
+	uint32_t upstreamConnections;
+	size_t mismatchedReplies;
+	size_t failedClients;
+};
+
+static void print_help(char* argv[]) {
+	printf("Usage: %s [--clients count] [--requests count] [--connections count] [--latency-us us]\n\n"
+	       " --clients: concurrent clients\n"
+	       " --requests: requests made by each client\n"
+	       " --connections: upstream connections when multiplexing\n"
+	       " --latency-us: delay added by the stub agent to each reply\n",
+	       argv[0]);
+}
+
+static scenario_result
+runScenario(size_t muxConnections, size_t clientCount, int requestsPerClient, uint32_t latencyUs) {
+	std::string proxyPath = makeTempSocketPath("upstream-mux-bench-proxy");
+	std::string agentPath = makeTempSocketPath("upstream-mux-bench-agent");
+	scenario_result result;
+
+	memset(&result, 0, sizeof(result));
+
+	stub_agent agent(agentPath.c_str(), latencyUs);
+	SOCKET listenSock = listenUnixSocket(proxyPath.c_str(), SOMAXCONN);
+	if(listenSock == INVALID_SOCKET || !agent.start()) {
+		result.failedClients = clientCount;
+		return result;
+	}
+
+	pid_t proxyPid = startProxyProcess([&]() {
+		socket_connector connectUpstream = [&agentPath]() { return connectUnixSocket(agentPath.c_str()); };
+
+		if(muxConnections > 0) {
+			upstream_mux mux(connectUpstream, muxConnections);
+			serveThreadPerClient(
+			    listenSock,
+			    [&mux]() -> std::unique_ptr<agent_upstream> { return std::make_unique<multiplexed_upstream>(mux); },
+			    AGENT_MAX_MSGLEN);
+		} else {
+			serveThreadPerClient(listenSock, connectUpstream, AGENT_MAX_MSGLEN);
+		}
+	});
+	closesocket(listenSock);
+
+	bench_barrier connected(clientCount + 1);
+	bench_barrier finished(clientCount + 1);
+	std::vector<std::vector<uint64_t>> samples(clientCount);
+	std::vector<size_t> mismatches(clientCount, 0);
+	std::vector<bool> failed(clientCount, proxyPid < 0);
+	std::vector<std::thread> clients;
+
+	for(size_t i = 0; i < clientCount; i++) {
+		clients.emplace_back([&, i]() {
+			std::vector<char> listRequest = makeAgentMessage(SSH2_AGENTC_REQUEST_IDENTITIES, 0);
+			std::vector<char> signRequest = makeAgentMessage(SSH2_AGENTC_SIGN_REQUEST, 256);
+			std::vector<char> reply;
+			SOCKET sock = proxyPid > 0 ? connectUnixSocket(proxyPath.c_str()) : INVALID_SOCKET;
+
+			connected.wait();
+
+			samples[i].reserve(requestsPerClient);
+			for(int j = 0; sock != INVALID_SOCKET && j < requestsPerClient; j++) {
+				bool isList = (i + j) % 2 == 0;
+				uint64_t start = nowNs();
+
+				if(!agentRoundTrip(sock, isList ? listRequest : signRequest, reply)) {
+					failed[i] = true;
+					break;
+				}
+				samples[i].push_back(nowNs() - start);
+
+				int expectedType = isList ? SSH2_AGENT_IDENTITIES_ANSWER : SSH2_AGENT_SIGN_RESPONSE;
+				if(agentMessageType(reply.data(), (int32_t) reply.size()) != expectedType)
+					mismatches[i]++;
+			}
+			if(sock == INVALID_SOCKET)
+				failed[i] = true;
+
+			finished.wait();
+
+			if(sock != INVALID_SOCKET)
+				closesocket(sock);
+		});
+	}
+
+	connected.wait();
+	uint64_t start = nowNs();
+	finished.wait();
+	uint64_t elapsed = nowNs() - start;
+
+	for(std::thread& client : clients) {
+		client.join();
+	}
+
+	stopProxyProcess(proxyPid);
+	unlink(proxyPath.c_str());
+
+	std::vector<uint64_t> allSamples;
+	for(size_t i = 0; i < clientCount; i++) {
+		allSamples.insert(allSamples.end(), samples[i].begin(), samples[i].end());
+		result.mismatchedReplies += mismatches[i];
+		if(failed[i])
+			result.failedClients++;
+	}
+
+	result.latency = computeLatencyStats(allSamples);
+	result.requestsPerSecond = (double) result.latency.count * 1e9 / (double) elapsed;
+	result.upstreamConnections = agent.getMaxActiveConnections();
+
+	return result;
+}
+
+int main(int argc, char* argv[]) {
+	size_t clientCount = 200;
+	int requestsPerClient = 50;
+	size_t muxConnections = 4;
+	uint32_t latencyUs = 100;
+
+	for(int i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "--clients") == 0 && i + 1 < argc) {
+			clientCount = (size_t) atol(argv[++i]);
+		} else if(strcmp(argv[i], "--requests") == 0 && i + 1 < argc) {
+			requestsPerClient = atoi(argv[++i]);
+		} else if(strcmp(argv[i], "--connections") == 0 && i + 1 < argc) {
+			muxConnections = (size_t) atol(argv[++i]);
+		} else if(strcmp(argv[i], "--latency-us") == 0 && i + 1 < argc) {
+			latencyUs = (uint32_t) atoi(argv[++i]);
+		} else {
+			print_help(argv);
+			return 1;
+		}
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	printf("%-12s %8s %9s %10s %10s %12s %10s %7s\n",
+	       "mode",
+	       "clients",
+	       "upstream",
+	       "p50_us",
+	       "p99_us",
+	       "req/s",
+	       "mismatch",
+	       "failed");
+
+	for(size_t connections : {(size_t) 0, muxConnections}) {
+		scenario_result result = runScenario(connections, clientCount, requestsPerClient, latencyUs);
+
+		printf("%-12s %8zu %9u %10.1f %10.1f %12.0f %10zu %7zu\n",
+		       connections > 0 ? "multiplexed" : "dedicated",
+		       clientCount,
+		       result.upstreamConnections,
+		       result.latency.p50Us,
+		       result.latency.p99Us,
+		       result.requestsPerSecond,
+		       result.mismatchedReplies,
+		       result.failedClients);
+		fflush(stdout);
+	}
+
+	return 0;
+}
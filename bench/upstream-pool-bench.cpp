@@ -0,0 +1,151 @@
+#include "bench/bench-common.h"
+#include "bench/stub-agent.h"
+#include "relay/agent-message.h"
+#include "relay/cygwin-socket-file.h"
+#include "relay/posix/thread-server.h"
+#include "relay/posix/unix-socket.h"
+#include "relay/upstream-pool.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Time-to-first-reply of short-lived clients, like one ssh invocation per git operation:
+// connect to the proxy, send REQUEST_IDENTITIES, wait for the reply and disconnect.
+// The upstream is a stub agent behind a cygwin socket file, so each new upstream connection
+// pays the same socket file parsing and cookie handshake as ssh-agent-pipe-proxy on Windows.
+// As loopback connections are much cheaper on Linux, the stub agent can delay its handshake
+// to reproduce the connection setup cost measured on Windows.
+
+static void print_help(char* argv[]) {
+	printf("Usage: %s [--connections count] [--parallel count] [--pool size] [--interval-us us] "
+	       "[--handshake-latency-us us]\n\n"
+	       " --connections: client connections made by each parallel client\n"
+	       " --parallel: clients connecting at the same time\n"
+	       " --pool: upstream pool size when the pool is enabled\n"
+	       " --interval-us: delay between two connections of a client\n"
+	       " --handshake-latency-us: delay added by the stub agent to each cygwin handshake\n",
+	       argv[0]);
+}
+
+static latency_stats
+runScenario(size_t poolSize, int connections, int parallel, int intervalUs, uint32_t handshakeLatencyUs) {
+	std::string proxyPath = makeTempSocketPath("upstream-pool-bench-proxy");
+	std::string agentPath = makeTempSocketPath("upstream-pool-bench-agent");
+	std::vector<uint64_t> samples;
+
+	SOCKET listenSock = listenUnixSocket(proxyPath.c_str(), SOMAXCONN);
+	if(listenSock == INVALID_SOCKET)
+		return computeLatencyStats(samples);
+
+	pid_t proxyPid = startProxyProcess([&]() {
+		cygwin_socket_file socketFile(agentPath);
+		socket_connector connectUpstream = [&socketFile]() { return socketFile.connect(); };
+		std::unique_ptr<upstream_pool> pool;
+
+		if(poolSize > 0) {
+			pool = std::make_unique<upstream_pool>(connectUpstream, poolSize);
+			connectUpstream = [&pool]() { return pool->acquire(); };
+		}
+
+		serveThreadPerClient(listenSock, connectUpstream, AGENT_MAX_MSGLEN);
+	});
+	closesocket(listenSock);
+
+	stub_agent agent(agentPath.c_str(), 0, true);
+	agent.setHandshakeLatency(handshakeLatencyUs);
+	if(proxyPid < 0 || !agent.start()) {
+		stopProxyProcess(proxyPid);
+		return computeLatencyStats(samples);
+	}
+
+	// Let the pool fill up before measuring
+	std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+	std::vector<std::vector<uint64_t>> clientSamples(parallel);
+	std::vector<std::thread> clients;
+
+	for(int i = 0; i < parallel; i++) {
+		clients.emplace_back([&, i]() {
+			std::vector<char> request = makeAgentMessage(SSH2_AGENTC_REQUEST_IDENTITIES, 0);
+			std::vector<char> reply;
+
+			for(int j = 0; j < connections; j++) {
+				uint64_t start = nowNs();
+				SOCKET sock = connectUnixSocket(proxyPath.c_str());
+				if(sock == INVALID_SOCKET)
+					continue;
+
+				if(agentRoundTrip(sock, request, reply))
+					clientSamples[i].push_back(nowNs() - start);
+				closesocket(sock);
+
+				std::this_thread::sleep_for(std::chrono::microseconds(intervalUs));
+			}
+		});
+	}
+
+	for(std::thread& client : clients) {
+		client.join();
+	}
+
+	stopProxyProcess(proxyPid);
+	unlink(proxyPath.c_str());
+
+	for(std::vector<uint64_t>& clientSample : clientSamples) {
+		samples.insert(samples.end(), clientSample.begin(), clientSample.end());
+	}
+
+	return computeLatencyStats(samples);
+}
+
+int main(int argc, char* argv[]) {
+	int connections = 500;
+	int parallel = 1;
+	size_t poolSize = 4;
+	int intervalUs = 2000;
+	uint32_t handshakeLatencyUs = 500;
+
+	for(int i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "--connections") == 0 && i + 1 < argc) {
+			connections = atoi(argv[++i]);
+		} else if(strcmp(argv[i], "--parallel") == 0 && i + 1 < argc) {
+			parallel = atoi(argv[++i]);
+		} else if(strcmp(argv[i], "--pool") == 0 && i + 1 < argc) {
+			poolSize = (size_t) atoi(argv[++i]);
+		} else if(strcmp(argv[i], "--interval-us") == 0 && i + 1 < argc) {
+			intervalUs = atoi(argv[++i]);
+		} else if(strcmp(argv[i], "--handshake-latency-us") == 0 && i + 1 < argc) {
+			handshakeLatencyUs = (uint32_t) atoi(argv[++i]);
+		} else {
+			print_help(argv);
+			return 1;
+		}
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	printf("%-10s %8s %10s %10s %10s %10s\n", "pool", "samples", "mean_us", "p50_us", "p99_us", "max_us");
+
+	for(size_t size : {(size_t) 0, poolSize}) {
+		latency_stats stats = runScenario(size, connections, parallel, intervalUs, handshakeLatencyUs);
+
+		printf("%-10zu %8zu %10.1f %10.1f %10.1f %10.1f\n",
+		       size,
+		       stats.count,
+		       stats.meanUs,
+		       stats.p50Us,
+		       stats.p99Us,
+		       stats.maxUs);
+		fflush(stdout);
+	}
+
+	return 0;
+}
@@ -0,0 +1,170 @@
+#include "bench/bench-common.h"
+#include "relay/agent-message.h"
+#include "relay/posix/unix-socket.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+// A/B comparison of the blocking thread-per-client loop, the epoll event loop, the io_uring
+// event loop and the coroutine sessions of coro_reactor: round-trip latency, throughput and proxy
+// CPU time per request, with every client doing back to back requests.
+
+struct scenario_result {
+	latency_stats latency;
+	double requestsPerSecond;
+	double cpuUsPerRequest;
+	size_t failedClients;
+};
+
+static void print_help(char* argv[]) {
+	printf("Usage: %s [--clients 1,10,100] [--requests count] [--threads count] [--payload bytes]\n\n"
+	       " --clients: comma separated list of concurrent client counts\n"
+	       " --requests: round trips made by each client\n"
+	       " --threads: event loop thread count of the epoll, io_uring and coroutines modes\n"
+	       " --payload: send SIGN_REQUEST messages with that many payload bytes instead of REQUEST_IDENTITIES\n",
+	       argv[0]);
+}
+
+static scenario_result runScenario(server_mode mode,
+                                   size_t clientCount,
+                                   int requestsPerClient,
+                                   int eventLoopThreads,
+                                   size_t payloadSize) {
+	relay_fixture fixture;
+	scenario_result result;
+
+	memset(&result, 0, sizeof(result));
+
+	if(!startRelayFixture(fixture, "uring-bench", mode, eventLoopThreads, 0)) {
+		result.failedClients = clientCount;
+		return result;
+	}
+	const std::string& proxyPath = fixture.proxyPath;
+	pid_t proxyPid = fixture.proxyPid;
+
+	// The proxy CPU time is sampled once every client is connected and again before any disconnects,
+	// so session setup and the exit of per-client threads are not counted
+	bench_barrier connected(clientCount + 1);
+	bench_barrier finished(clientCount + 1);
+	bench_barrier measured(clientCount + 1);
+	std::vector<std::vector<uint64_t>> samples(clientCount);
+	std::vector<bool> failed(clientCount, false);
+	std::vector<std::thread> clients;
+
+	for(size_t i = 0; i < clientCount; i++) {
+		clients.emplace_back([&, i]() {
+			std::vector<char> request = payloadSize > 0 ? makeAgentMessage(SSH2_AGENTC_SIGN_REQUEST, payloadSize)
+			                                            : makeAgentMessage(SSH2_AGENTC_REQUEST_IDENTITIES, 0);
+			std::vector<char> reply;
+			SOCKET sock = connectUnixSocket(proxyPath.c_str());
+
+			// One round trip so the session is fully set up before measuring
+			if(sock != INVALID_SOCKET && !agentRoundTrip(sock, request, reply))
+				failed[i] = true;
+
+			connected.wait();
+
+			samples[i].reserve(requestsPerClient);
+			for(int request_index = 0; sock != INVALID_SOCKET && !failed[i] && request_index < requestsPerClient;
+			    request_index++) {
+				uint64_t start = nowNs();
+				if(!agentRoundTrip(sock, request, reply)) {
+					failed[i] = true;
+					break;
+				}
+				samples[i].push_back(nowNs() - start);
+			}
+			if(sock == INVALID_SOCKET)
+				failed[i] = true;
+
+			finished.wait();
+			measured.wait();
+
+			if(sock != INVALID_SOCKET)
+				closesocket(sock);
+		});
+	}
+
+	process_stats before;
+	process_stats after;
+
+	connected.wait();
+	readProcessStats(proxyPid, &before);
+	uint64_t start = nowNs();
+	finished.wait();
+	uint64_t elapsed = nowNs() - start;
+	readProcessStats(proxyPid, &after);
+	measured.wait();
+
+	for(std::thread& client : clients) {
+		client.join();
+	}
+
+	std::vector<uint64_t> allSamples;
+	for(size_t i = 0; i < clientCount; i++) {
+		allSamples.insert(allSamples.end(), samples[i].begin(), samples[i].end());
+		if(failed[i])
+			result.failedClients++;
+	}
+
+	result.latency = computeLatencyStats(allSamples);
+	result.requestsPerSecond = (double) result.latency.count * 1e9 / (double) elapsed;
+	if(result.latency.count > 0)
+		result.cpuUsPerRequest = (after.cpuUs - before.cpuUs) / (double) result.latency.count;
+
+	return result;
+}
+
+int main(int argc, char* argv[]) {
+	std::vector<size_t> clientCounts = {1, 10, 100};
+	int requestsPerClient = 2000;
+	int eventLoopThreads = 1;
+	size_t payloadSize = 0;
+
+	for(int i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "--clients") == 0 && i + 1 < argc) {
+			clientCounts.clear();
+			for(char* token = strtok(argv[++i], ","); token != NULL; token = strtok(NULL, ",")) {
+				clientCounts.push_back((size_t) atol(token));
+			}
+		} else if(strcmp(argv[i], "--requests") == 0 && i + 1 < argc) {
+			requestsPerClient = atoi(argv[++i]);
+		} else if(strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+			eventLoopThreads = atoi(argv[++i]);
+		} else if(strcmp(argv[i], "--payload") == 0 && i + 1 < argc) {
+			payloadSize = (size_t) atol(argv[++i]);
+		} else {
+			print_help(argv);
+			return 1;
+		}
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	printf("%-10s %8s %10s %10s %12s %12s %7s\n", "mode", "clients", "p50_us", "p99_us", "req/s", "cpu_us/req", "failed");
+
+	for(size_t clientCount : clientCounts) {
+		for(server_mode mode :
+		     {server_mode::threads, server_mode::epoll, server_mode::io_uring, server_mode::coroutines}) {
+			scenario_result result = runScenario(mode, clientCount, requestsPerClient, eventLoopThreads, payloadSize);
+
+			printf("%-10s %8zu %10.1f %10.1f %12.0f %12.2f %7zu\n",
+			       serverModeName(mode),
+			       clientCount,
+			       result.latency.p50Us,
+			       result.latency.p99Us,
+			       result.requestsPerSecond,
+			       result.cpuUsPerRequest,
+			       result.failedClients);
+			fflush(stdout);
+		}
+	}
+
+	return 0;
+}
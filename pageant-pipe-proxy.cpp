@@ -1,90 +1,248 @@
+#include "relay/agent-session.h"
+#include "relay/buffer-pool.h"
+#include "relay/identity-cache.h"
+#include "relay/identity-prefetch.h"
+#include "relay/idle-reaper.h"
+#include "relay/logger.h"
+#include "relay/pageant-dispatcher.h"
+#include "relay/request-trace.h"
+#include "relay/session-pool.h"
+#include "relay/traffic-capture.h"
+#include "relay/upstream-scheduler.h"
+#include "relay/win32/copydata-transport.h"
+#include "relay/win32/pipe-listener.h"
+#include "relay/win32/pipe-stream.h"
+
 #include <stdint.h>
 #include <stdio.h>
 #include <strsafe.h>
 #include <tchar.h>
 #include <windows.h>
 
-#define AGENT_MAX_MSGLEN 262144
-#define AGENT_COPYDATA_ID 0x804e50ba
-
 DWORD WINAPI InstanceThread(LPVOID);
-VOID GetAnswerToRequest(void*, DWORD pchRequestBytes, void*, DWORD* pchReplyBytes);
+
+// Identity list cache, NULL when --identity-cache is not used
+static identity_cache* identityCache = NULL;
+
+// Request the identity list upstream as soon as a client connects (--prefetch-identities)
+static bool prefetchIdentities = false;
+
+// Thread sending the requests of every session to pageant
+static pageant_dispatcher* dispatcher = NULL;
+
+// Workers running the client sessions
+static session_pool* sessionPool = NULL;
+
+// Timeout of idle clients, NULL when --client-idle-timeout is not used
+static idle_reaper* idleReaper = NULL;
+
+// Fair queue of the requests sent to pageant, NULL when --fair-queue is not used
+static upstream_scheduler* scheduler = NULL;
 
 void print_help(TCHAR* argv[], LPCTSTR lpszPipename) {
-	_tprintf(TEXT("Usage: %s [pipe_path]\n\n pipe_path: path to a pipe, defaults to %s\n"), argv[0], lpszPipename);
+	_tprintf(TEXT("Usage: %s [--max-sessions count] [--session-wait ms] [--listeners count] [--pageant-queue count] ")
+	         TEXT("[--identity-cache ttl_ms] [--prefetch-identities] [--client-idle-timeout ms] ")
+	         TEXT("[--fair-queue inflight [--client-inflight count]] [--memory-budget megabytes [--memory-wait ms]] ")
+	         TEXT("[--capture path [--capture-redact]] [--trace path] [--log-level level] [pipe_path]\n\n")
+	         TEXT(" pipe_path: path to a pipe, defaults to %s\n")
+	         TEXT(" --max-sessions: run at most that many sessions at once (default %d),\n")
+	         TEXT("                 as many other clients wait for a session to end\n")
+	         TEXT(" --session-wait: refuse clients that waited that long for a session to end (default %d)\n")
+	         TEXT(" --listeners: keep that many pipe instances waiting for clients (default %d)\n")
+	         TEXT(" --pageant-queue: let that many requests wait for pageant, sessions wait when it is full\n")
+	         TEXT("                  (default %d)\n")
+	         TEXT(" --identity-cache: answer identity list requests from a cache kept up to ttl_ms milliseconds\n")
+	         TEXT(" --prefetch-identities: request the identity list upstream as soon as a client connects\n")
+	         TEXT(" --client-idle-timeout: disconnect clients not sending any request for ms\n")
+	         TEXT(" --fair-queue: send at most inflight requests to pageant at once, the others wait in a queue fair\n")
+	         TEXT("               between client processes, identity lists first\n")
+	         TEXT(" --client-inflight: send at most count requests of the same client process at once (default %d)\n")
+	         TEXT(" --memory-budget: keep message buffers within that many megabytes, messages needing more\n")
+	         TEXT("                  are answered with a failure. 4 KiB buffers count but are never refused\n")
+	         TEXT(" --memory-wait: wait up to ms for buffers to be released before refusing a request (default %d)\n")
+	         TEXT(" --capture: record every request and reply with its session and time in a binary file at path\n")
+	         TEXT(" --capture-redact: only capture the size and type of messages, not their content\n")
+	         TEXT(" --trace: write the time spent in each phase of each request to a Chrome trace event file\n")
+	         TEXT("          at path\n")
+	         TEXT(" --log-level: error, warning, info (default), debug or payload to also dump every message\n"),
+	         argv[0],
+	         lpszPipename,
+	         SESSION_POOL_DEFAULT_MAX_SESSIONS,
+	         SESSION_POOL_DEFAULT_WAIT_MS,
+	         PIPE_LISTENER_DEFAULT_INSTANCES,
+	         PAGEANT_DISPATCHER_DEFAULT_QUEUE,
+	         UPSTREAM_SCHEDULER_DEFAULT_CLIENT_INFLIGHT,
+	         BUFFER_POOL_DEFAULT_BUDGET_WAIT_MS);
 }
 
 int _tmain(void) {
-	BOOL fConnected = FALSE;
-	DWORD dwThreadId = 0;
-	HANDLE hPipe = INVALID_HANDLE_VALUE, hThread = NULL;
 	LPCTSTR pipeRequiredPrefix = TEXT("\\\\.");
 	LPCTSTR lpszPipename = TEXT("\\\\.\\pipe\\openssh-ssh-agent");
 
-	if(__argc == 2) {
-		if(_tcsncmp(__targv[1], pipeRequiredPrefix, _tcslen(pipeRequiredPrefix)) != 0) {
-			_tprintf(TEXT("Invalid argument %s, must start with %s if present\n"), __targv[1], pipeRequiredPrefix);
+	int identityCacheTtlMs = 0;
+	int maxSessions = SESSION_POOL_DEFAULT_MAX_SESSIONS;
+	int sessionWaitMs = SESSION_POOL_DEFAULT_WAIT_MS;
+	int listenInstances = PIPE_LISTENER_DEFAULT_INSTANCES;
+	int pageantQueueSize = PAGEANT_DISPATCHER_DEFAULT_QUEUE;
+	LPCTSTR capturePath = NULL;
+	bool captureRedact = false;
+	LPCTSTR tracePath = NULL;
+	int clientIdleTimeoutMs = 0;
+	int fairQueueInFlight = 0;
+	int clientInFlight = UPSTREAM_SCHEDULER_DEFAULT_CLIENT_INFLIGHT;
+	int memoryBudgetMb = 0;
+	int memoryWaitMs = BUFFER_POOL_DEFAULT_BUDGET_WAIT_MS;
+
+	for(int i = 1; i < __argc; i++) {
+		if(_tcscmp(__targv[i], TEXT("--max-sessions")) == 0 && i + 1 < __argc) {
+			maxSessions = _tstoi(__targv[++i]);
+			if(maxSessions <= 0) {
+				_tprintf(TEXT("Invalid maximum session count %s\n"), __targv[i]);
+				print_help(__targv, lpszPipename);
+				return 1;
+			}
+		} else if(_tcscmp(__targv[i], TEXT("--session-wait")) == 0 && i + 1 < __argc) {
+			sessionWaitMs = _tstoi(__targv[++i]);
+			if(sessionWaitMs < 0) {
+				_tprintf(TEXT("Invalid session wait %s\n"), __targv[i]);
+				print_help(__targv, lpszPipename);
+				return 1;
+			}
+		} else if(_tcscmp(__targv[i], TEXT("--listeners")) == 0 && i + 1 < __argc) {
+			listenInstances = _tstoi(__targv[++i]);
+			if(listenInstances <= 0) {
+				_tprintf(TEXT("Invalid listener count %s\n"), __targv[i]);
+				print_help(__targv, lpszPipename);
+				return 1;
+			}
+		} else if(_tcscmp(__targv[i], TEXT("--pageant-queue")) == 0 && i + 1 < __argc) {
+			pageantQueueSize = _tstoi(__targv[++i]);
+			if(pageantQueueSize <= 0) {
+				_tprintf(TEXT("Invalid pageant queue size %s\n"), __targv[i]);
+				print_help(__targv, lpszPipename);
+				return 1;
+			}
+		} else if(_tcscmp(__targv[i], TEXT("--identity-cache")) == 0 && i + 1 < __argc) {
+			identityCacheTtlMs = _tstoi(__targv[++i]);
+			if(identityCacheTtlMs <= 0) {
+				_tprintf(TEXT("Invalid identity cache TTL %s\n"), __targv[i]);
+				print_help(__targv, lpszPipename);
+				return 1;
+			}
+		} else if(_tcscmp(__targv[i], TEXT("--prefetch-identities")) == 0) {
+			prefetchIdentities = true;
+		} else if(_tcscmp(__targv[i], TEXT("--client-idle-timeout")) == 0 && i + 1 < __argc) {
+			clientIdleTimeoutMs = _tstoi(__targv[++i]);
+			if(clientIdleTimeoutMs <= 0) {
+				_tprintf(TEXT("Invalid client idle timeout %s\n"), __targv[i]);
+				print_help(__targv, lpszPipename);
+				return 1;
+			}
+		} else if(_tcscmp(__targv[i], TEXT("--fair-queue")) == 0 && i + 1 < __argc) {
+			fairQueueInFlight = _tstoi(__targv[++i]);
+			if(fairQueueInFlight <= 0) {
+				_tprintf(TEXT("Invalid fair queue in flight request count %s\n"), __targv[i]);
+				print_help(__targv, lpszPipename);
+				return 1;
+			}
+		} else if(_tcscmp(__targv[i], TEXT("--client-inflight")) == 0 && i + 1 < __argc) {
+			clientInFlight = _tstoi(__targv[++i]);
+			if(clientInFlight <= 0) {
+				_tprintf(TEXT("Invalid client in flight request count %s\n"), __targv[i]);
+				print_help(__targv, lpszPipename);
+				return 1;
+			}
+		} else if(_tcscmp(__targv[i], TEXT("--memory-budget")) == 0 && i + 1 < __argc) {
+			memoryBudgetMb = _tstoi(__targv[++i]);
+			if(memoryBudgetMb <= 0) {
+				_tprintf(TEXT("Invalid memory budget %s\n"), __targv[i]);
+				print_help(__targv, lpszPipename);
+				return 1;
+			}
+		} else if(_tcscmp(__targv[i], TEXT("--memory-wait")) == 0 && i + 1 < __argc) {
+			memoryWaitMs = _tstoi(__targv[++i]);
+			if(memoryWaitMs < 0) {
+				_tprintf(TEXT("Invalid memory wait %s\n"), __targv[i]);
+				print_help(__targv, lpszPipename);
+				return 1;
+			}
+		} else if(_tcscmp(__targv[i], TEXT("--capture")) == 0 && i + 1 < __argc) {
+			capturePath = __targv[++i];
+		} else if(_tcscmp(__targv[i], TEXT("--capture-redact")) == 0) {
+			captureRedact = true;
+		} else if(_tcscmp(__targv[i], TEXT("--trace")) == 0 && i + 1 < __argc) {
+			tracePath = __targv[++i];
+		} else if(_tcscmp(__targv[i], TEXT("--log-level")) == 0 && i + 1 < __argc) {
+			log_level level;
+			if(!parseLogLevel(__targv[++i], level)) {
+				_tprintf(TEXT("Invalid log level %s\n"), __targv[i]);
+				print_help(__targv, lpszPipename);
+				return 1;
+			}
+			setLogLevel(level);
+		} else if(_tcsncmp(__targv[i], pipeRequiredPrefix, _tcslen(pipeRequiredPrefix)) == 0) {
+			lpszPipename = __targv[i];
+		} else {
+			_tprintf(TEXT("Invalid argument %s, must start with %s if present\n"), __targv[i], pipeRequiredPrefix);
 			print_help(__targv, lpszPipename);
 			return 1;
 		}
+	}
+
+	if(memoryBudgetMb > 0)
+		buffer_pool::instance().setBudget((size_t) memoryBudgetMb * 1024 * 1024, memoryWaitMs);
 
-		lpszPipename = __targv[1];
-	} else if(__argc > 2) {
-		print_help(__targv, lpszPipename);
-		return 1;
+	if(identityCacheTtlMs > 0) {
+		identityCache = new identity_cache(identityCacheTtlMs);
 	}
 
-	// The main loop creates an instance of the named pipe and
-	// then waits for a client to connect to it. When the client
-	// connects, a thread is created to handle communications
-	// with that client, and this loop is free to wait for the
-	// next client connect request. It is an infinite loop.
-
-	for(;;) {
-		_tprintf(TEXT("pageant pipe server: Main thread awaiting client connection on %s\n"), lpszPipename);
-		hPipe = CreateNamedPipe(lpszPipename,              // pipe name
-		                        PIPE_ACCESS_DUPLEX,        // read/write access
-		                        PIPE_TYPE_BYTE |           // message type pipe
-		                            PIPE_READMODE_BYTE |   // message-read mode
-		                            PIPE_WAIT,             // blocking mode
-		                        PIPE_UNLIMITED_INSTANCES,  // max. instances
-		                        AGENT_MAX_MSGLEN,          // output buffer size
-		                        AGENT_MAX_MSGLEN,          // input buffer size
-		                        0,                         // client time-out
-		                        NULL);                     // default security attribute
-
-		if(hPipe == INVALID_HANDLE_VALUE) {
-			_tprintf(TEXT("CreateNamedPipe failed, GLE=%lu.\n"), GetLastError());
-			return -1;
+	if(capturePath != NULL) {
+		FILE* captureFile = _tfopen(capturePath, TEXT("wb"));
+		if(captureFile == NULL || !startTrafficCapture(captureFile, captureRedact)) {
+			_tprintf(TEXT("Cannot write traffic capture %s\n"), capturePath);
+			return 1;
 		}
+	}
+
+	if(tracePath != NULL) {
+		FILE* traceFile = _tfopen(tracePath, TEXT("w"));
+		if(traceFile == NULL || !startRequestTrace(traceFile)) {
+			_tprintf(TEXT("Cannot write request trace %s\n"), tracePath);
+			return 1;
+		}
+	}
+
+	dispatcher = new pageant_dispatcher(
+	    []() -> std::unique_ptr<pageant_transport> { return std::make_unique<copydata_transport>(); },
+	    pageantQueueSize);
 
-		// Wait for the client to connect; if it succeeds,
-		// the function returns a nonzero value. If the function
-		// returns zero, GetLastError returns ERROR_PIPE_CONNECTED.
-
-		fConnected = ConnectNamedPipe(hPipe, NULL) ? TRUE : (GetLastError() == ERROR_PIPE_CONNECTED);
-
-		if(fConnected) {
-			printf("Client connected, creating a processing thread.\n");
-
-			// Create a thread for this client.
-			hThread = CreateThread(NULL,            // no security attribute
-			                       0,               // default stack size
-			                       InstanceThread,  // thread proc
-			                       (LPVOID) hPipe,  // thread parameter
-			                       0,               // not suspended
-			                       &dwThreadId);    // returns thread ID
-
-			if(hThread == NULL) {
-				_tprintf(TEXT("CreateThread failed, GLE=%lu.\n"), GetLastError());
-				return -1;
-			} else
-				CloseHandle(hThread);
-		} else
-			// The client could not connect, so close the pipe.
-			CloseHandle(hPipe);
+	sessionPool = new session_pool(maxSessions, maxSessions, sessionWaitMs);
+
+	if(clientIdleTimeoutMs > 0) {
+		idleReaper = new idle_reaper(clientIdleTimeoutMs, 0);
+	}
+
+	if(fairQueueInFlight > 0) {
+		scheduler = new upstream_scheduler(fairQueueInFlight, clientInFlight);
 	}
 
+	// Several instances of the named pipe wait for clients at once, each one on its own thread.
+	// When a client connects to one of them, its session is handed to a worker of the session
+	// pool and a new instance replaces it, while the other instances keep accepting clients.
+	_tprintf(
+	    TEXT("pageant pipe server: %d instances awaiting client connections on %s\n"), listenInstances, lpszPipename);
+	listenNamedPipe(lpszPipename, PAGEANT_MAX_MSGLEN, listenInstances, [](HANDLE hPipe) {
+		logInfo("Client connected, queuing its session.\n");
+
+		// Run the session on a worker, or disconnect the client if there are too many sessions
+		if(!sessionPool->submit([hPipe]() { InstanceThread((LPVOID) hPipe); },
+		                        [hPipe]() {
+			                        DisconnectNamedPipe(hPipe);
+			                        CloseHandle(hPipe);
+		                        }))
+			logWarning("Too many sessions, client refused\n");
+	});
+
 	return 0;
 }
 
@@ -97,11 +255,6 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR pCmdLine,
 	return _tmain();
 }
 
-uint32_t readu32(const void* buffer) {
-	const uint8_t* buffer_char = (const uint8_t*) buffer;
-	return (buffer_char[0] << 24) | (buffer_char[1] << 16) | (buffer_char[2] << 8) | (buffer_char[3] << 0);
-}
-
 DWORD WINAPI InstanceThread(LPVOID lpvParam)
 // This routine is a thread processing function to read from and reply to a client
 // via the open pipe connection passed from the main loop. Note this allows
@@ -109,172 +262,57 @@ DWORD WINAPI InstanceThread(LPVOID lpvParam)
 // of this procedure to run concurrently, depending on the number of incoming
 // client connections.
 {
-	HANDLE hHeap = GetProcessHeap();
-	char* pchRequest = (char*) HeapAlloc(hHeap, 0, AGENT_MAX_MSGLEN);
-	char* pchReply = (char*) HeapAlloc(hHeap, 0, AGENT_MAX_MSGLEN);
-
-	DWORD cbBytesRead = 0, cbReplyBytes = 0, cbWritten = 0;
-	BOOL fSuccess = FALSE;
-	HANDLE hPipe = NULL;
-
 	// Do some extra error checking since the app will keep running even if this
 	// thread fails.
 
 	if(lpvParam == NULL) {
-		printf("\nERROR - Pipe Server Failure:\n");
-		printf("   InstanceThread got an unexpected NULL value in lpvParam.\n");
-		printf("   InstanceThread exitting.\n");
-		if(pchReply != NULL)
-			HeapFree(hHeap, 0, pchReply);
-		if(pchRequest != NULL)
-			HeapFree(hHeap, 0, pchRequest);
-		return (DWORD) -1;
-	}
-
-	if(pchRequest == NULL) {
-		printf("\nERROR - Pipe Server Failure:\n");
-		printf("   InstanceThread got an unexpected NULL heap allocation.\n");
-		printf("   InstanceThread exitting.\n");
-		if(pchReply != NULL)
-			HeapFree(hHeap, 0, pchReply);
-		return (DWORD) -1;
-	}
-
-	if(pchReply == NULL) {
-		printf("\nERROR - Pipe Server Failure:\n");
-		printf("   InstanceThread got an unexpected NULL heap allocation.\n");
-		printf("   InstanceThread exitting.\n");
-		if(pchRequest != NULL)
-			HeapFree(hHeap, 0, pchRequest);
+		logError("\nERROR - Pipe Server Failure:\n");
+		logError("   InstanceThread got an unexpected NULL value in lpvParam.\n");
+		logError("   InstanceThread exitting.\n");
 		return (DWORD) -1;
 	}
 
 	// Print verbose messages. In production code, this should be for debugging only.
-	printf("InstanceThread created, receiving and processing messages.\n");
+	logDebug("InstanceThread created, receiving and processing messages.\n");
 
 	// The thread's parameter is a handle to a pipe object instance.
-
-	hPipe = (HANDLE) lpvParam;
-
-	// Loop until done reading
-	while(1) {
-		int byteRead = 0;
-		int remainingBytes = AGENT_MAX_MSGLEN;
-		do {
-			// Read client requests from the pipe. This simplistic code only allows messages
-			// up to AGENT_MAX_MSGLEN characters in length.
-			fSuccess = ReadFile(hPipe,                  // handle to pipe
-			                    pchRequest + byteRead,  // buffer to receive data
-			                    remainingBytes,         // size of buffer
-			                    &cbBytesRead,           // number of bytes read
-			                    NULL);                  // not overlapped I/O
-
-			if(!fSuccess || cbBytesRead == 0) {
-				if(GetLastError() == ERROR_BROKEN_PIPE) {
-					_tprintf(TEXT("InstanceThread: client disconnected.\n"));
-				} else {
-					_tprintf(TEXT("InstanceThread ReadFile failed, GLE=%lu.\n"), GetLastError());
-				}
-				break;
-			} else {
-				byteRead += cbBytesRead;
-				if(byteRead > 4) {
-					remainingBytes = readu32(pchRequest) + 4 - byteRead;
-				}
-			}
-		} while(remainingBytes > 0);
-
-		if(!fSuccess) {
-			break;
-		}
-
-		// Process the incoming message.
-		GetAnswerToRequest(pchRequest, byteRead, pchReply, &cbReplyBytes);
-
-		// Write the reply to the pipe.
-		fSuccess = WriteFile(hPipe,         // handle to pipe
-		                     pchReply,      // buffer to write from
-		                     cbReplyBytes,  // number of bytes to write
-		                     &cbWritten,    // number of bytes written
-		                     NULL);         // not overlapped I/O
-
-		if(!fSuccess || cbReplyBytes != cbWritten) {
-			_tprintf(TEXT("InstanceThread WriteFile failed, GLE=%lu.\n"), GetLastError());
-			break;
-		}
+	// The pipe is flushed, disconnected and closed when client goes out of scope.
+
+	pipe_stream client((HANDLE) lpvParam);
+	upstream_connector connectPageant = []() -> std::unique_ptr<agent_upstream> {
+		return std::make_unique<dispatched_pageant_upstream>(*dispatcher);
+	};
+
+	// A prefetching upstream queues its request to pageant while the first request is read
+	std::unique_ptr<agent_upstream> upstream;
+	if(prefetchIdentities)
+		upstream = std::make_unique<prefetching_upstream>(connectPageant);
+	else
+		upstream = connectPageant();
+
+	// Cached identity lists are answered without waiting for the scheduler
+	agent_upstream* sessionUpstream = upstream.get();
+	std::unique_ptr<scheduled_upstream> scheduledUpstream;
+	if(scheduler != NULL) {
+		ULONG processId = 0;
+		if(!GetNamedPipeClientProcessId((HANDLE) lpvParam, &processId))
+			processId = 0;
+		uint64_t clientKey = scheduler->makeClientKey(processId);
+		scheduledUpstream = std::make_unique<scheduled_upstream>(*upstream, *scheduler, clientKey);
+		sessionUpstream = scheduledUpstream.get();
 	}
 
-	// Flush the pipe to allow the client to read the pipe's contents
-	// before disconnecting. Then disconnect the pipe, and close the
-	// handle to this pipe instance.
-
-	FlushFileBuffers(hPipe);
-	DisconnectNamedPipe(hPipe);
-	CloseHandle(hPipe);
-
-	HeapFree(hHeap, 0, pchRequest);
-	HeapFree(hHeap, 0, pchReply);
-
-	printf("InstanceThread exiting.\n");
-	return 1;
-}
-
-VOID GetAnswerToRequest(void* pchRequest, DWORD pchRequestBytes, void* pchReply, DWORD* pchReplyBytes) {
-	char mapName[128];
-	sprintf_s(mapName, _countof(mapName), "PageantRequest%08lx", GetCurrentThreadId());
-	mapName[_countof(mapName) - 1] = 0;
-
-	*pchReplyBytes = 0;
-
-	printf("Sending %lu bytes to pageant\n", pchRequestBytes);
-	for(DWORD i = 0; i < pchRequestBytes; i++) {
-		printf("%02x ", ((const uint8_t*) pchRequest)[i]);
-	}
-	printf("\n");
-
-	HWND pageantHwnd = FindWindow(TEXT("Pageant"), TEXT("Pageant"));
-	if(pageantHwnd == INVALID_HANDLE_VALUE) {
-		printf("Failed to find Pageant window: %lu\n", GetLastError());
-	}
-
-	HANDLE fileMap = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, AGENT_MAX_MSGLEN, mapName);
-	if(fileMap == INVALID_HANDLE_VALUE) {
-		printf("Failed to create file mapping: %lu\n", GetLastError());
-		return;
-	}
-
-	uint8_t* sharedMemory = (uint8_t*) MapViewOfFile(fileMap, FILE_MAP_WRITE, 0, 0, 0);
-
-	memcpy_s(sharedMemory, AGENT_MAX_MSGLEN, pchRequest, pchRequestBytes);
-
-	COPYDATASTRUCT cds;
-	cds.dwData = AGENT_COPYDATA_ID;
-	cds.cbData = (DWORD) (strlen(mapName) + 1);
-	cds.lpData = mapName;
-	LRESULT result = SendMessage(pageantHwnd, WM_COPYDATA, 0, (LPARAM) &cds);
-	if(result == FALSE) {
-		printf("SendMessage failed: %lu\n", GetLastError());
-	}
-
-	DWORD replyLen =
-	    (sharedMemory[0] << 24) | (sharedMemory[1] << 16) | (sharedMemory[2] << 8) | (sharedMemory[3] << 0);
-
-	replyLen += 4;
-
-	if(replyLen > AGENT_MAX_MSGLEN) {
-		printf("Invalid reply size: %lu (0x%x)\n", replyLen, replyLen);
-		replyLen = AGENT_MAX_MSGLEN;
+	if(identityCache != NULL) {
+		caching_upstream cachingUpstream(*sessionUpstream, *identityCache);
+		runAgentSession(client, cachingUpstream, PAGEANT_MAX_MSGLEN, idleReaper);
+	} else {
+		runAgentSession(client, *sessionUpstream, PAGEANT_MAX_MSGLEN, idleReaper);
 	}
 
-	*pchReplyBytes = replyLen;
-	memcpy_s(pchReply, AGENT_MAX_MSGLEN, sharedMemory, *pchReplyBytes);
-
-	printf("Read %lu bytes from pageant\n", replyLen);
-	for(DWORD i = 0; i < replyLen; i++) {
-		printf("%02x ", ((const uint8_t*) pchReply)[i]);
-	}
-	printf("\n");
-
-	UnmapViewOfFile(sharedMemory);
-	CloseHandle(fileMap);
+	logDebug("InstanceThread exiting.\n");
+	printBufferPoolStats();
+	dispatcher->printStats();
+	if(identityCache != NULL)
+		identityCache->printStats();
+	return 1;
 }
@@ -1,5 +1,24 @@
-#include <winsock2.h>
-#include <ws2tcpip.h>
+#include "relay/agent-message.h"
+#include "relay/agent-session.h"
+#include "relay/buffer-pool.h"
+#include "relay/cygwin-socket-file.h"
+#include "relay/identity-cache.h"
+#include "relay/identity-prefetch.h"
+#include "relay/idle-reaper.h"
+#include "relay/logger.h"
+#include "relay/pageant-dispatcher.h"
+#include "relay/request-trace.h"
+#include "relay/session-pool.h"
+#include "relay/socket-stream.h"
+#include "relay/traffic-capture.h"
+#include "relay/upstream-mux.h"
+#include "relay/upstream-pool.h"
+#include "relay/upstream-router.h"
+#include "relay/upstream-scheduler.h"
+#include "relay/win32/copydata-transport.h"
+#include "relay/win32/iocp-reactor.h"
+#include "relay/win32/pipe-listener.h"
+#include "relay/win32/pipe-stream.h"
 
 #include <stdint.h>
 #include <stdio.h>
@@ -10,115 +29,376 @@
 #include <memory>
 #include <vector>
 
-#define AGENT_MAX_MSGLEN 2621440
-#define AGENT_COPYDATA_ID 0x804e50ba
+DWORD WINAPI InstanceThread(LPVOID lpvData);
+SOCKET connect_unix_socket(void);
+SOCKET acquire_upstream_socket(void);
+std::unique_ptr<agent_upstream> connect_session_upstream(void);
+upstream_connector make_upstream_connector(LPCTSTR spec);
 
-template<class F> class final_act {
-public:
-	explicit final_act(F f) noexcept : f_(std::move(f)), invoke_(true) {}
+// Pool of ready upstream connections, NULL when --upstream-pool is not used
+static upstream_pool* upstreamPool = NULL;
 
-	final_act(final_act&& other) noexcept : f_(std::move(other.f_)), invoke_(other.invoke_) { other.invoke_ = false; }
+// Cached content of the SSH_AUTH_SOCK socket file
+static cygwin_socket_file* upstreamSocketFile = NULL;
 
-	final_act(const final_act&) = delete;
-	final_act& operator=(const final_act&) = delete;
+// Identity list cache, NULL when --identity-cache is not used
+static identity_cache* identityCache = NULL;
 
-	~final_act() noexcept {
-		if(invoke_)
-			f_();
-	}
+// Request the identity list upstream as soon as a client connects (--prefetch-identities)
+static bool prefetchIdentities = false;
 
-private:
-	F f_;
-	bool invoke_;
-};
+// Upstream connections shared by all clients, NULL when --multiplex is not used
+static upstream_mux* upstreamMux = NULL;
 
-struct thread_data {
-	HANDLE hPipe;
-	SOCKET sock;
-};
+// Agents given with --upstream, NULL when forwarding to SSH_AUTH_SOCK only
+static upstream_router* upstreamRouter = NULL;
 
-DWORD WINAPI InstanceThread(LPVOID lpvData);
-SOCKET connect_unix_socket(void);
+// Workers running the client sessions, NULL with --event-loop
+static session_pool* sessionPool = NULL;
+
+// Timeouts of idle clients and upstream connections, NULL when no idle timeout is given
+static idle_reaper* idleReaper = NULL;
+
+// Fair queue of the requests sent upstream, NULL when --fair-queue is not used
+static upstream_scheduler* scheduler = NULL;
 
 void print_help(TCHAR* argv[], LPCTSTR lpszPipename) {
-	_tprintf(TEXT("Usage: %s [pipe_path]\n\n pipe_path: path to a pipe, defaults to %s\n"), argv[0], lpszPipename);
+	_tprintf(TEXT("Usage: %s [--event-loop threads | --multiplex connections] [--upstream-pool size] ")
+	         TEXT("[--upstream agent]... [--upstream-timeout ms] [--max-sessions count] [--session-wait ms] ")
+	         TEXT("[--listeners count] [--identity-cache ttl_ms] [--prefetch-identities] [--client-idle-timeout ms] ")
+	         TEXT("[--upstream-idle-timeout ms] [--fair-queue inflight [--client-inflight count]] ")
+	         TEXT("[--stream-min-size bytes] [--memory-budget megabytes [--memory-wait ms]] ")
+	         TEXT("[--capture path [--capture-redact]] [--trace path] [--log-level level] [pipe_path]\n\n")
+	         TEXT(" pipe_path: path to a pipe, defaults to %s\n")
+	         TEXT(" --event-loop: handle all sessions with overlapped I/O on that many threads\n")
+	         TEXT("               instead of one thread per client\n")
+	         TEXT(" --multiplex: share that many upstream connections between all clients\n")
+	         TEXT(" --upstream-pool: keep that many connected and authenticated upstream sockets\n")
+	         TEXT("                  ready for new clients\n")
+	         TEXT(" --upstream: forward to pageant, a named pipe agent (\\\\.\\pipe\\...) or a cygwin socket file\n")
+	         TEXT("             instead of SSH_AUTH_SOCK. With several ones, identity lists are merged and\n")
+	         TEXT("             requests go to the agent owning their key\n")
+	         TEXT(" --upstream-timeout: leave agents not listing their identities within ms out of the list\n")
+	         TEXT("                     (default %d)\n")
+	         TEXT(" --max-sessions: run at most that many sessions at once without event loop (default %d),\n")
+	         TEXT("                 as many other clients wait for a session to end\n")
+	         TEXT(" --session-wait: refuse clients that waited that long for a session to end (default %d)\n")
+	         TEXT(" --listeners: keep that many pipe instances waiting for clients (default %d)\n")
+	         TEXT(" --identity-cache: answer identity list requests from a cache kept up to ttl_ms milliseconds\n")
+	         TEXT(" --prefetch-identities: request the identity list upstream as soon as a client connects,\n")
+	         TEXT("                        without event loop\n")
+	         TEXT(" --client-idle-timeout: disconnect clients not sending any request for ms, without event loop\n")
+	         TEXT(" --upstream-idle-timeout: close upstream connections unused for ms until their client sends\n")
+	         TEXT("                          a request, without event loop\n")
+	         TEXT(" --fair-queue: send at most inflight requests upstream at once, the others wait in a queue fair\n")
+	         TEXT("               between client processes, identity lists first, without event loop\n")
+	         TEXT(" --client-inflight: send at most count requests of the same client process at once (default %d)\n")
+	         TEXT(" --stream-min-size: forward requests of at least that many bytes upstream while they are read\n")
+	         TEXT("                    instead of buffering them, without event loop (default %d, 0 to disable)\n")
+	         TEXT(" --memory-budget: keep message buffers within that many megabytes, messages needing more\n")
+	         TEXT("                  are answered with a failure. 4 KiB buffers count but are never refused\n")
+	         TEXT(" --memory-wait: wait up to ms for buffers to be released before refusing a message,\n")
+	         TEXT("                without event loop (default %d)\n")
+	         TEXT(" --capture: record every request and reply with its session and time in a binary file at path\n")
+	         TEXT(" --capture-redact: only capture the size and type of messages, not their content\n")
+	         TEXT(" --trace: write the time spent in each phase of each request to a Chrome trace event file\n")
+	         TEXT("          at path, without event loop\n")
+	         TEXT(" --log-level: error, warning, info (default), debug or payload to also dump every message\n"),
+	         argv[0],
+	         lpszPipename,
+	         UPSTREAM_ROUTER_DEFAULT_TIMEOUT_MS,
+	         SESSION_POOL_DEFAULT_MAX_SESSIONS,
+	         SESSION_POOL_DEFAULT_WAIT_MS,
+	         PIPE_LISTENER_DEFAULT_INSTANCES,
+	         UPSTREAM_SCHEDULER_DEFAULT_CLIENT_INFLIGHT,
+	         AGENT_SESSION_DEFAULT_STREAM_MIN_SIZE,
+	         BUFFER_POOL_DEFAULT_BUDGET_WAIT_MS);
 }
 
 int _tmain(void) {
 	WSADATA wsaData;
-	BOOL fConnected = FALSE;
-	DWORD dwThreadId = 0;
-	HANDLE hPipe = INVALID_HANDLE_VALUE, hThread = NULL;
 	LPCTSTR pipeRequiredPrefix = TEXT("\\\\.");
 	LPCTSTR lpszPipename = TEXT("\\\\.\\pipe\\openssh-ssh-agent");
-
-	if(__argc == 2) {
-		if(_tcsncmp(__targv[1], pipeRequiredPrefix, _tcslen(pipeRequiredPrefix)) != 0) {
-			_tprintf(TEXT("Invalid argument %s, must start with %s if present\n"), __targv[1], pipeRequiredPrefix);
+	int eventLoopThreads = 0;
+	int upstreamPoolSize = 0;
+	int identityCacheTtlMs = 0;
+	int maxSessions = SESSION_POOL_DEFAULT_MAX_SESSIONS;
+	int sessionWaitMs = SESSION_POOL_DEFAULT_WAIT_MS;
+	int listenInstances = PIPE_LISTENER_DEFAULT_INSTANCES;
+	LPCTSTR capturePath = NULL;
+	bool captureRedact = false;
+	LPCTSTR tracePath = NULL;
+	int multiplexConnections = 0;
+	std::vector<LPCTSTR> upstreamSpecs;
+	int upstreamTimeoutMs = UPSTREAM_ROUTER_DEFAULT_TIMEOUT_MS;
+	int clientIdleTimeoutMs = 0;
+	int upstreamIdleTimeoutMs = 0;
+	int fairQueueInFlight = 0;
+	int clientInFlight = UPSTREAM_SCHEDULER_DEFAULT_CLIENT_INFLIGHT;
+	int streamMinSize = AGENT_SESSION_DEFAULT_STREAM_MIN_SIZE;
+	int memoryBudgetMb = 0;
+	int memoryWaitMs = BUFFER_POOL_DEFAULT_BUDGET_WAIT_MS;
+
+	for(int i = 1; i < __argc; i++) {
+		if(_tcscmp(__targv[i], TEXT("--event-loop")) == 0 && i + 1 < __argc) {
+			eventLoopThreads = _tstoi(__targv[++i]);
+			if(eventLoopThreads <= 0) {
+				_tprintf(TEXT("Invalid event loop thread count %s\n"), __targv[i]);
+				print_help(__targv, lpszPipename);
+				return 1;
+			}
+		} else if(_tcscmp(__targv[i], TEXT("--upstream-pool")) == 0 && i + 1 < __argc) {
+			upstreamPoolSize = _tstoi(__targv[++i]);
+			if(upstreamPoolSize <= 0) {
+				_tprintf(TEXT("Invalid upstream pool size %s\n"), __targv[i]);
+				print_help(__targv, lpszPipename);
+				return 1;
+			}
+		} else if(_tcscmp(__targv[i], TEXT("--upstream")) == 0 && i + 1 < __argc) {
+			upstreamSpecs.push_back(__targv[++i]);
+		} else if(_tcscmp(__targv[i], TEXT("--upstream-timeout")) == 0 && i + 1 < __argc) {
+			upstreamTimeoutMs = _tstoi(__targv[++i]);
+			if(upstreamTimeoutMs <= 0) {
+				_tprintf(TEXT("Invalid upstream timeout %s\n"), __targv[i]);
+				print_help(__targv, lpszPipename);
+				return 1;
+			}
+		} else if(_tcscmp(__targv[i], TEXT("--multiplex")) == 0 && i + 1 < __argc) {
+			multiplexConnections = _tstoi(__targv[++i]);
+			if(multiplexConnections <= 0) {
+				_tprintf(TEXT("Invalid multiplexed connection count %s\n"), __targv[i]);
+				print_help(__targv, lpszPipename);
+				return 1;
+			}
+		} else if(_tcscmp(__targv[i], TEXT("--max-sessions")) == 0 && i + 1 < __argc) {
+			maxSessions = _tstoi(__targv[++i]);
+			if(maxSessions <= 0) {
+				_tprintf(TEXT("Invalid maximum session count %s\n"), __targv[i]);
+				print_help(__targv, lpszPipename);
+				return 1;
+			}
+		} else if(_tcscmp(__targv[i], TEXT("--session-wait")) == 0 && i + 1 < __argc) {
+			sessionWaitMs = _tstoi(__targv[++i]);
+			if(sessionWaitMs < 0) {
+				_tprintf(TEXT("Invalid session wait %s\n"), __targv[i]);
+				print_help(__targv, lpszPipename);
+				return 1;
+			}
+		} else if(_tcscmp(__targv[i], TEXT("--listeners")) == 0 && i + 1 < __argc) {
+			listenInstances = _tstoi(__targv[++i]);
+			if(listenInstances <= 0) {
+				_tprintf(TEXT("Invalid listener count %s\n"), __targv[i]);
+				print_help(__targv, lpszPipename);
+				return 1;
+			}
+		} else if(_tcscmp(__targv[i], TEXT("--identity-cache")) == 0 && i + 1 < __argc) {
+			identityCacheTtlMs = _tstoi(__targv[++i]);
+			if(identityCacheTtlMs <= 0) {
+				_tprintf(TEXT("Invalid identity cache TTL %s\n"), __targv[i]);
+				print_help(__targv, lpszPipename);
+				return 1;
+			}
+		} else if(_tcscmp(__targv[i], TEXT("--prefetch-identities")) == 0) {
+			prefetchIdentities = true;
+		} else if(_tcscmp(__targv[i], TEXT("--client-idle-timeout")) == 0 && i + 1 < __argc) {
+			clientIdleTimeoutMs = _tstoi(__targv[++i]);
+			if(clientIdleTimeoutMs <= 0) {
+				_tprintf(TEXT("Invalid client idle timeout %s\n"), __targv[i]);
+				print_help(__targv, lpszPipename);
+				return 1;
+			}
+		} else if(_tcscmp(__targv[i], TEXT("--upstream-idle-timeout")) == 0 && i + 1 < __argc) {
+			upstreamIdleTimeoutMs = _tstoi(__targv[++i]);
+			if(upstreamIdleTimeoutMs <= 0) {
+				_tprintf(TEXT("Invalid upstream idle timeout %s\n"), __targv[i]);
+				print_help(__targv, lpszPipename);
+				return 1;
+			}
+		} else if(_tcscmp(__targv[i], TEXT("--fair-queue")) == 0 && i + 1 < __argc) {
+			fairQueueInFlight = _tstoi(__targv[++i]);
+			if(fairQueueInFlight <= 0) {
+				_tprintf(TEXT("Invalid fair queue in flight request count %s\n"), __targv[i]);
+				print_help(__targv, lpszPipename);
+				return 1;
+			}
+		} else if(_tcscmp(__targv[i], TEXT("--client-inflight")) == 0 && i + 1 < __argc) {
+			clientInFlight = _tstoi(__targv[++i]);
+			if(clientInFlight <= 0) {
+				_tprintf(TEXT("Invalid client in flight request count %s\n"), __targv[i]);
+				print_help(__targv, lpszPipename);
+				return 1;
+			}
+		} else if(_tcscmp(__targv[i], TEXT("--stream-min-size")) == 0 && i + 1 < __argc) {
+			streamMinSize = _tstoi(__targv[++i]);
+			if(streamMinSize < 0) {
+				_tprintf(TEXT("Invalid stream minimum size %s\n"), __targv[i]);
+				print_help(__targv, lpszPipename);
+				return 1;
+			}
+		} else if(_tcscmp(__targv[i], TEXT("--memory-budget")) == 0 && i + 1 < __argc) {
+			memoryBudgetMb = _tstoi(__targv[++i]);
+			if(memoryBudgetMb <= 0) {
+				_tprintf(TEXT("Invalid memory budget %s\n"), __targv[i]);
+				print_help(__targv, lpszPipename);
+				return 1;
+			}
+		} else if(_tcscmp(__targv[i], TEXT("--memory-wait")) == 0 && i + 1 < __argc) {
+			memoryWaitMs = _tstoi(__targv[++i]);
+			if(memoryWaitMs < 0) {
+				_tprintf(TEXT("Invalid memory wait %s\n"), __targv[i]);
+				print_help(__targv, lpszPipename);
+				return 1;
+			}
+		} else if(_tcscmp(__targv[i], TEXT("--capture")) == 0 && i + 1 < __argc) {
+			capturePath = __targv[++i];
+		} else if(_tcscmp(__targv[i], TEXT("--capture-redact")) == 0) {
+			captureRedact = true;
+		} else if(_tcscmp(__targv[i], TEXT("--trace")) == 0 && i + 1 < __argc) {
+			tracePath = __targv[++i];
+		} else if(_tcscmp(__targv[i], TEXT("--log-level")) == 0 && i + 1 < __argc) {
+			log_level level;
+			if(!parseLogLevel(__targv[++i], level)) {
+				_tprintf(TEXT("Invalid log level %s\n"), __targv[i]);
+				print_help(__targv, lpszPipename);
+				return 1;
+			}
+			setLogLevel(level);
+		} else if(_tcsncmp(__targv[i], pipeRequiredPrefix, _tcslen(pipeRequiredPrefix)) == 0) {
+			lpszPipename = __targv[i];
+		} else {
+			_tprintf(TEXT("Invalid argument %s, must start with %s if present\n"), __targv[i], pipeRequiredPrefix);
 			print_help(__targv, lpszPipename);
 			return 1;
 		}
+	}
+
+	if(eventLoopThreads > 0 && multiplexConnections > 0) {
+		_tprintf(TEXT("--event-loop and --multiplex cannot be used together\n"));
+		print_help(__targv, lpszPipename);
+		return 1;
+	}
+
+	if(prefetchIdentities && eventLoopThreads > 0) {
+		_tprintf(TEXT("--prefetch-identities cannot be used with --event-loop\n"));
+		print_help(__targv, lpszPipename);
+		return 1;
+	}
+
+	if((clientIdleTimeoutMs > 0 || upstreamIdleTimeoutMs > 0) && eventLoopThreads > 0) {
+		_tprintf(TEXT("Idle timeouts cannot be used with --event-loop\n"));
+		print_help(__targv, lpszPipename);
+		return 1;
+	}
+
+	if(fairQueueInFlight > 0 && eventLoopThreads > 0) {
+		_tprintf(TEXT("--fair-queue cannot be used with --event-loop\n"));
+		print_help(__targv, lpszPipename);
+		return 1;
+	}
+
+	if(tracePath != NULL && eventLoopThreads > 0) {
+		_tprintf(TEXT("--trace cannot be used with --event-loop\n"));
+		print_help(__targv, lpszPipename);
+		return 1;
+	}
 
-		lpszPipename = __targv[1];
-	} else if(__argc > 2) {
+	if(!upstreamSpecs.empty() && (eventLoopThreads > 0 || multiplexConnections > 0 || upstreamPoolSize > 0)) {
+		_tprintf(TEXT("--upstream cannot be used with --event-loop, --multiplex or --upstream-pool\n"));
 		print_help(__targv, lpszPipename);
 		return 1;
 	}
 
+	setRequestStreaming(streamMinSize);
+	if(memoryBudgetMb > 0)
+		buffer_pool::instance().setBudget((size_t) memoryBudgetMb * 1024 * 1024, memoryWaitMs);
+
 	// Initialize Winsock
 	WSAStartup(MAKEWORD(2, 2), &wsaData);
 
-	// The main loop creates an instance of the named pipe and
-	// then waits for a client to connect to it. When the client
-	// connects, a thread is created to handle communications
-	// with that client, and this loop is free to wait for the
-	// next client connect request. It is an infinite loop.
-
-	for(;;) {
-		_tprintf(TEXT("pageant pipe server: Main thread awaiting client connection on %s\n"), lpszPipename);
-		hPipe = CreateNamedPipe(lpszPipename,                          // pipe name
-		                        PIPE_ACCESS_DUPLEX,                    // read/write access
-		                        PIPE_TYPE_BYTE | PIPE_READMODE_BYTE |  // message type pipe
-		                            PIPE_WAIT,                         // blocking mode
-		                        PIPE_UNLIMITED_INSTANCES,              // max. instances
-		                        AGENT_MAX_MSGLEN,                      // output buffer size
-		                        AGENT_MAX_MSGLEN,                      // input buffer size
-		                        0,                                     // client time-out
-		                        NULL);                                 // default security attribute
-
-		if(hPipe == INVALID_HANDLE_VALUE) {
-			_tprintf(TEXT("CreateNamedPipe failed, GLE=%lu.\n"), GetLastError());
-			return -1;
+	// Started first to also trace the connections of the upstream pool
+	if(tracePath != NULL) {
+		FILE* traceFile = _tfopen(tracePath, TEXT("w"));
+		if(traceFile == NULL || !startRequestTrace(traceFile)) {
+			_tprintf(TEXT("Cannot write request trace %s\n"), tracePath);
+			return 1;
 		}
+	}
 
-		// Wait for the client to connect; if it succeeds,
-		// the function returns a nonzero value. If the function
-		// returns zero, GetLastError returns ERROR_PIPE_CONNECTED.
+	if(!upstreamSpecs.empty()) {
+		std::vector<upstream_connector> connectors;
+		for(LPCTSTR spec : upstreamSpecs) {
+			_tprintf(TEXT("Forwarding to upstream agent %s\n"), spec);
+			connectors.push_back(make_upstream_connector(spec));
+		}
+		upstreamRouter = new upstream_router(std::move(connectors), upstreamTimeoutMs);
+	} else {
+		TCHAR sshAuthSocket[256];
+		if(GetEnvironmentVariable(
+		       TEXT("SSH_AUTH_SOCK"), sshAuthSocket, sizeof(sshAuthSocket) / sizeof(sshAuthSocket[0])) == 0) {
+			_tprintf(TEXT("Missing SSH_AUTH_SOCK env variable\n"));
+			return 1;
+		}
+
+		_tprintf(TEXT("Forwarding to upstream ssh-agent on %s\n"), sshAuthSocket);
+		upstreamSocketFile = new cygwin_socket_file(sshAuthSocket);
+	}
+
+	if(upstreamPoolSize > 0) {
+		upstreamPool = new upstream_pool(connect_unix_socket, upstreamPoolSize);
+	}
 
-		fConnected = ConnectNamedPipe(hPipe, NULL) ? TRUE : (GetLastError() == ERROR_PIPE_CONNECTED);
+	if(identityCacheTtlMs > 0) {
+		identityCache = new identity_cache(identityCacheTtlMs);
+	}
 
-		if(!fConnected) {
-			CloseHandle(hPipe);
-			continue;
+	if(capturePath != NULL) {
+		FILE* captureFile = _tfopen(capturePath, TEXT("wb"));
+		if(captureFile == NULL || !startTrafficCapture(captureFile, captureRedact)) {
+			_tprintf(TEXT("Cannot write traffic capture %s\n"), capturePath);
+			return 1;
 		}
+	}
 
-		printf("Client connected, creating a processing thread.\n");
-
-		// Create a read thread for this client.
-		hThread = CreateThread(NULL,            // no security attribute
-		                       0,               // default stack size
-		                       InstanceThread,  // thread proc
-		                       (LPVOID) hPipe,  // thread parameter
-		                       0,               // not suspended
-		                       &dwThreadId);    // returns thread ID
-
-		if(hThread == NULL) {
-			_tprintf(TEXT("CreateThread failed, GLE=%lu.\n"), GetLastError());
-			return -1;
-		} else
-			CloseHandle(hThread);
+	if(multiplexConnections > 0) {
+		upstreamMux = new upstream_mux(acquire_upstream_socket, multiplexConnections);
 	}
 
+	if(eventLoopThreads > 0) {
+		_tprintf(TEXT("pageant pipe server: event loop awaiting client connections on %s\n"), lpszPipename);
+
+		iocp_reactor reactor(
+		    lpszPipename, AGENT_MAX_MSGLEN, acquire_upstream_socket, AGENT_MAX_MSGLEN, identityCache, listenInstances);
+		reactor.run(eventLoopThreads);
+		return -1;
+	}
+
+	sessionPool = new session_pool(maxSessions, maxSessions, sessionWaitMs);
+
+	if(clientIdleTimeoutMs > 0 || upstreamIdleTimeoutMs > 0) {
+		idleReaper = new idle_reaper(clientIdleTimeoutMs, upstreamIdleTimeoutMs);
+	}
+
+	if(fairQueueInFlight > 0) {
+		scheduler = new upstream_scheduler(fairQueueInFlight, clientInFlight);
+	}
+
+	// Several instances of the named pipe wait for clients at once, each one on its own thread.
+	// When a client connects to one of them, its session is handed to a worker of the session
+	// pool and a new instance replaces it, while the other instances keep accepting clients.
+	_tprintf(
+	    TEXT("pageant pipe server: %d instances awaiting client connections on %s\n"), listenInstances, lpszPipename);
+	listenNamedPipe(lpszPipename, AGENT_MAX_MSGLEN, listenInstances, [](HANDLE hPipe) {
+		logInfo("Client connected, queuing its session.\n");
+
+		// Run the session on a worker, or disconnect the client if there are too many sessions
+		if(!sessionPool->submit([hPipe]() { InstanceThread((LPVOID) hPipe); },
+		                        [hPipe]() {
+			                        DisconnectNamedPipe(hPipe);
+			                        CloseHandle(hPipe);
+		                        }))
+			logWarning("Too many sessions, client refused\n");
+	});
+
 	return 0;
 }
 
@@ -131,38 +411,6 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR pCmdLine,
 	return _tmain();
 }
 
-uint32_t readu32(const void* buffer) {
-	const uint8_t* buffer_char = (const uint8_t*) buffer;
-	return (buffer_char[0] << 24) | (buffer_char[1] << 16) | (buffer_char[2] << 8) | (buffer_char[3] << 0);
-}
-
-template<typename T> int32_t readAgentMessage(T readFunction, void* buffer, int32_t maxSize) {
-	uint8_t* buffer_char = (uint8_t*) buffer;
-
-	int32_t byteRead = 0;
-	do {
-		int32_t result = readFunction(buffer_char + byteRead, maxSize - byteRead);
-		if(result < 0) {
-			printf("Failed to read agent message: %d\n", result);
-			return result;
-		} else if(result == 0) {
-			// EOF
-			return 0;
-		}
-
-		printf("Read %d + %d bytes from ssh-agent\n", result, byteRead);
-		for(int32_t i = 0; i < result; i++) {
-			printf("%02x ", *(buffer_char + byteRead + i));
-		}
-		printf("\n");
-
-		byteRead += result;
-
-	} while(byteRead < 4 || byteRead < (int32_t) readu32(buffer_char) + 4);
-
-	return byteRead;
-}
-
 DWORD WINAPI InstanceThread(LPVOID lpvData)
 // This routine is a thread processing function to read from and reply to a client
 // via the open pipe connection passed from the main loop. Note this allows
@@ -170,264 +418,133 @@ DWORD WINAPI InstanceThread(LPVOID lpvData)
 // of this procedure to run concurrently, depending on the number of incoming
 // client connections.
 {
-	std::vector<char> pchRequest(AGENT_MAX_MSGLEN);
-	std::vector<char> pchReply(AGENT_MAX_MSGLEN);
-
-	DWORD cbWritten = 0;
-	BOOL fSuccess = FALSE;
 	HANDLE hPipe = (HANDLE) lpvData;
-	int result;
-
-	final_act closePipe([&hPipe]() {
-		if(hPipe) {
-			FlushFileBuffers(hPipe);
-			DisconnectNamedPipe(hPipe);
-			CloseHandle(hPipe);
-		}
-	});
 
 	// Do some extra error checking since the app will keep running even if this
 	// thread fails.
 
 	if(hPipe == NULL) {
-		printf("\nERROR - Pipe Server Failure:\n");
-		printf("   InstanceThread got an unexpected NULL value in lpvParam.\n");
-		printf("   InstanceThread exitting.\n");
+		logError("\nERROR - Pipe Server Failure:\n");
+		logError("   InstanceThread got an unexpected NULL value in lpvParam.\n");
+		logError("   InstanceThread exitting.\n");
 		return (DWORD) -1;
 	}
 
-	SOCKET sock = connect_unix_socket();
-	if(sock == INVALID_SOCKET) {
-		printf("Error: cannot connect to upstream ssh-agent\n");
+	pipe_stream client(hPipe);
+	// Opened before connecting so the upstream connection is traced with the session
+	trace_session traceSession;
+
+	// A prefetching upstream connects while the first request is read
+	std::unique_ptr<agent_upstream> upstream;
+	if(prefetchIdentities)
+		upstream = std::make_unique<prefetching_upstream>(connect_session_upstream);
+	else
+		upstream = connect_session_upstream();
+	if(!upstream) {
+		logError("Error: cannot connect to upstream ssh-agent\n");
 		return (DWORD) -2;
 	}
-	final_act closeSock([&sock]() {
-		if(sock) {
-			closesocket(sock);
-		}
-	});
 
-	// Print verbose messages. In production code, this should be for debugging only.
-	printf("InstanceThread created, receiving and processing messages.\n");
-
-	// Loop until done reading
-	while(1) {
-		int32_t byteRead = readAgentMessage(
-		    [hPipe](void* buffer, int32_t size) {
-			    DWORD cbBytesRead = 0;
-			    BOOL fSuccess = ReadFile(hPipe,         // handle to pipe
-			                             buffer,        // buffer to receive data
-			                             size,          // size of buffer
-			                             &cbBytesRead,  // number of bytes read
-			                             NULL);         // not overlapped I/O
-
-			    if(fSuccess) {
-				    return (int32_t) cbBytesRead;
-			    } else {
-				    DWORD lastError = GetLastError();
-				    if(lastError == ERROR_BROKEN_PIPE)
-					    return 0;
-				    else
-					    return -(int32_t) lastError;
-			    }
-		    },
-		    &pchRequest[0],
-		    pchRequest.size());
-
-		if(byteRead <= 0)
-			break;
-
-		printf("Sending %d bytes to ssh-agent\n", byteRead);
-		for(int i = 0; i < byteRead; i++) {
-			printf("%02x ", pchRequest[i]);
-		}
-		printf("\n");
-		result = send(sock, &pchRequest[0], byteRead, 0);
-		if(result != (int) byteRead) {
-			printf("Failed to send query data to socket : %lu\n", GetLastError());
-			break;
-		}
+	if(idleReaper != NULL && idleReaper->getUpstreamTimeoutMs() > 0)
+		upstream = std::make_unique<parking_upstream>(std::move(upstream), connect_session_upstream, *idleReaper);
 
-		byteRead = readAgentMessage(
-		    [sock](void* buffer, int32_t size) {
-			    int result = recv(sock, (char*) buffer, size, 0);
-			    if(result < 0)
-				    return -(int32_t) GetLastError();
-			    else
-				    return result;
-		    },
-		    &pchReply[0],
-		    pchReply.size());
-
-		if(byteRead <= 0) {
-			printf("ssh-agent connection closed\n");
-			break;
-		}
-
-		// Write the reply to the pipe.
-		fSuccess = WriteFile(hPipe,         // handle to pipe
-		                     &pchReply[0],  // buffer to write from
-		                     byteRead,      // number of bytes to write
-		                     &cbWritten,    // number of bytes written
-		                     NULL);         // not overlapped I/O
+	// Print verbose messages. In production code, this should be for debugging only.
+	logDebug("InstanceThread created, receiving and processing messages.\n");
+
+	// Cached identity lists are answered without waiting for the scheduler
+	agent_upstream* sessionUpstream = upstream.get();
+	std::unique_ptr<scheduled_upstream> scheduledUpstream;
+	if(scheduler != NULL) {
+		ULONG processId = 0;
+		if(!GetNamedPipeClientProcessId(hPipe, &processId))
+			processId = 0;
+		uint64_t clientKey = scheduler->makeClientKey(processId);
+		scheduledUpstream = std::make_unique<scheduled_upstream>(*upstream, *scheduler, clientKey);
+		sessionUpstream = scheduledUpstream.get();
+	}
 
-		if(!fSuccess || cbWritten == 0) {
-			_tprintf(TEXT("InstanceThread WriteFile failed, GLE=%lu.\n"), GetLastError());
-			break;
-		}
+	if(identityCache != NULL) {
+		caching_upstream cachingUpstream(*sessionUpstream, *identityCache);
+		runAgentSession(client, cachingUpstream, AGENT_MAX_MSGLEN, idleReaper);
+	} else {
+		runAgentSession(client, *sessionUpstream, AGENT_MAX_MSGLEN, idleReaper);
 	}
 
-	printf("InstanceThread exiting.\n");
+	logDebug("InstanceThread exiting.\n");
+	printBufferPoolStats();
+	if(identityCache != NULL)
+		identityCache->printStats();
+	if(upstreamMux != NULL)
+		upstreamMux->printStats();
+	if(upstreamRouter != NULL)
+		upstreamRouter->printStats();
 	return 1;
 }
 
-int recv_full(SOCKET sock, char* buffer, int size, int flags) {
-	int result;
-	int totalRead = 0;
+// Upstream of a client session: the upstream router, a multiplexed or a dedicated connection
+std::unique_ptr<agent_upstream> connect_session_upstream(void) {
+	if(upstreamRouter != NULL)
+		return std::make_unique<routed_upstream>(*upstreamRouter);
+	if(upstreamMux != NULL)
+		return std::make_unique<multiplexed_upstream>(*upstreamMux);
+
+	SOCKET sock = acquire_upstream_socket();
+	if(sock == INVALID_SOCKET)
+		return nullptr;
+	return std::make_unique<stream_upstream>(std::make_unique<socket_stream>(sock));
+}
 
-	do {
-		result = recv(sock, buffer + totalRead, size - totalRead, flags);
-		if(result > 0)
-			totalRead += result;
-	} while(totalRead < size && result > 0);
+SOCKET acquire_upstream_socket(void) {
+	if(upstreamPool != NULL)
+		return upstreamPool->acquire();
 
-	return result;
+	return connect_unix_socket();
 }
 
 SOCKET connect_unix_socket(void) {
-	HANDLE fileHandle;
-	DWORD lastError;
-	TCHAR sshAuthSocket[256];
-	char buffer[128];
-	int result;
-	DWORD bytesRead;
-	const char* SOCKET_COOKIE = "!<socket >";
-
-	if(GetEnvironmentVariable(TEXT("SSH_AUTH_SOCK"), sshAuthSocket, sizeof(sshAuthSocket) / sizeof(sshAuthSocket[0])) ==
-	   0) {
-		_tprintf(TEXT("Missing SSH_AUTH_SOCK env variable\n"));
-		return INVALID_SOCKET;
-	}
+	logDebug("Handling query, connecting to upstream\n");
 
-	_tprintf(TEXT("Handling query, connecting to upstream on %s\n"), sshAuthSocket);
-
-	do {
-		fileHandle =
-		    CreateFile(sshAuthSocket, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
-		lastError = GetLastError();
-
-		if(fileHandle != INVALID_HANDLE_VALUE || lastError != ERROR_SHARING_VIOLATION) {
-			break;
-		}
-	} while(1);
-
-	if(fileHandle == INVALID_HANDLE_VALUE) {
-		_tprintf(TEXT("Failed to open file %s: %lu\n"), sshAuthSocket, lastError);
-		return INVALID_SOCKET;
-	}
-
-	result = ReadFile(fileHandle, buffer, sizeof(buffer) - 1, &bytesRead, NULL);
-	CloseHandle(fileHandle);
-
-	if(!result) {
-		_tprintf(TEXT("Failed to read file %s: %lu\n"), sshAuthSocket, GetLastError());
-		return INVALID_SOCKET;
-	}
-
-	buffer[bytesRead] = 0;
-
-	if(memcmp(buffer, SOCKET_COOKIE, strlen(SOCKET_COOKIE)) != 0) {
-		printf("Failed to find cookie %s in %s\n", SOCKET_COOKIE, buffer);
-		return INVALID_SOCKET;
-	}
-
-	uint16_t port;
-	char type;
-	uint32_t cookie[4];
-
-	sscanf(buffer + strlen(SOCKET_COOKIE),
-	       "%hu %c %08x-%08x-%08x-%08x",
-	       &port,
-	       &type,
-	       &cookie[0],
-	       &cookie[1],
-	       &cookie[2],
-	       &cookie[3]);
-
-	printf("Connecting to upstream ssh-agent at 127.0.0.1:%u, type: %c, cookie: %08x-%08x-%08x-%08x\n",
-	       port,
-	       type,
-	       cookie[0],
-	       cookie[1],
-	       cookie[2],
-	       cookie[3]);
-
-	SOCKET sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-
-	if(sock == INVALID_SOCKET) {
-		printf("Failed to open socket: %lu\n", GetLastError());
-		return INVALID_SOCKET;
-	}
-
-	struct sockaddr_in address;
-
-	address.sin_family = AF_INET;
-	inet_pton(AF_INET, "127.0.0.1", &address.sin_addr);
-	address.sin_port = htons(port);
+	return upstreamSocketFile->connect();
+}
 
-	result = connect(sock, (const struct sockaddr*) &address, sizeof(address));
-	if(result < 0) {
-		printf("Failed to connect socket to 127.0.0.1:%u : %lu\n", port, GetLastError());
-		goto cleanup;
+// Agent given with --upstream: pageant, a named pipe agent like OpenSSH_for_Windows' one or a cygwin socket file
+upstream_connector make_upstream_connector(LPCTSTR spec) {
+	LPCTSTR pipePrefix = TEXT("\\\\.\\pipe\\");
+
+	if(_tcscmp(spec, TEXT("pageant")) == 0) {
+		// Never deleted, like the upstream router using it. Sessions share its file mapping.
+		pageant_dispatcher* dispatcher = new pageant_dispatcher(
+		    []() -> std::unique_ptr<pageant_transport> { return std::make_unique<copydata_transport>(); },
+		    PAGEANT_DISPATCHER_DEFAULT_QUEUE);
+		return [dispatcher]() -> std::unique_ptr<agent_upstream> {
+			return std::make_unique<dispatched_pageant_upstream>(*dispatcher);
+		};
 	}
 
-	result = send(sock, (const char*) cookie, sizeof(cookie), 0);
-	if(result < 0) {
-		printf("Failed to send GUID to 127.0.0.1:%u : %lu\n", port, GetLastError());
-		goto cleanup;
+	if(_tcsncmp(spec, pipePrefix, _tcslen(pipePrefix)) == 0) {
+		socket_file_path pipePath(spec);
+
+		return [pipePath]() -> std::unique_ptr<agent_upstream> {
+			uint64_t connectStartNs = traceStartNs();
+			HANDLE hPipe = CreateFile(pipePath.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+			// All instances of the agent pipe are busy, wait a bit for one of them
+			if(hPipe == INVALID_HANDLE_VALUE && GetLastError() == ERROR_PIPE_BUSY &&
+			   WaitNamedPipe(pipePath.c_str(), 1000))
+				hPipe = CreateFile(pipePath.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+			traceSpan(trace_phase::upstream_connect, connectStartNs);
+			if(hPipe == INVALID_HANDLE_VALUE) {
+				logError("Cannot open upstream agent pipe, GLE=%lu.\n", GetLastError());
+				return nullptr;
+			}
+			return std::make_unique<stream_upstream>(std::make_unique<pipe_stream>(hPipe));
+		};
 	}
 
-	result = recv_full(sock, (char*) cookie, sizeof(cookie), 0);
-	if(result < 0) {
-		printf("Failed to recv GUID to 127.0.0.1:%u : %lu\n", port, GetLastError());
-		goto cleanup;
-	}
-	printf("Received from ssh-agent: port %u, type: %c, cookie: %08x-%08x-%08x-%08x\n",
-	       port,
-	       type,
-	       cookie[0],
-	       cookie[1],
-	       cookie[2],
-	       cookie[3]);
-
-	struct id_data {
-		uint32_t pid;
-		uint32_t uid;
-		uint32_t gid;
+	std::shared_ptr<cygwin_socket_file> socketFile = std::make_shared<cygwin_socket_file>(spec);
+	return [socketFile]() -> std::unique_ptr<agent_upstream> {
+		SOCKET sock = socketFile->connect();
+		if(sock == INVALID_SOCKET)
+			return nullptr;
+		return std::make_unique<stream_upstream>(std::make_unique<socket_stream>(sock));
 	};
-
-	struct id_data ids;
-	ids.pid = GetCurrentProcessId();
-	ids.uid = ids.gid = 0;
-
-	result = send(sock, (const char*) &ids, sizeof(ids), 0);
-	if(result < 0) {
-		printf("Failed to send user IDs to 127.0.0.1:%u : %lu\n", port, GetLastError());
-		goto cleanup;
-	}
-
-	result = recv_full(sock, (char*) &ids, sizeof(ids), 0);
-	if(result < 0) {
-		printf("Failed to recv user IDs to 127.0.0.1:%u : %lu\n", port, GetLastError());
-		goto cleanup;
-	}
-
-	printf("Received from ssh-agent: pid: %u, uid: %u, gid: %u\n", ids.pid, ids.uid, ids.gid);
-
-	return sock;
-
-cleanup:
-	closesocket(sock);
-
-	return INVALID_SOCKET;
 }
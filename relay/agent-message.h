@@ -0,0 +1,126 @@
+#pragma once
+
+#include "relay/buffer-pool.h"
+#include "relay/frame-parser.h"
+#include "relay/logger.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define AGENT_MAX_MSGLEN 2621440
+
+// Agent protocol message types (draft-miller-ssh-agent)
+#define SSH_AGENT_FAILURE 5
+#define SSH_AGENT_SUCCESS 6
+#define SSH2_AGENTC_REQUEST_IDENTITIES 11
+#define SSH2_AGENT_IDENTITIES_ANSWER 12
+#define SSH2_AGENTC_SIGN_REQUEST 13
+#define SSH2_AGENT_SIGN_RESPONSE 14
+#define SSH2_AGENTC_ADD_IDENTITY 17
+#define SSH2_AGENTC_REMOVE_IDENTITY 18
+#define SSH2_AGENTC_REMOVE_ALL_IDENTITIES 19
+#define SSH_AGENTC_ADD_SMARTCARD_KEY 20
+#define SSH_AGENTC_REMOVE_SMARTCARD_KEY 21
+#define SSH_AGENTC_LOCK 22
+#define SSH_AGENTC_UNLOCK 23
+#define SSH2_AGENTC_ADD_ID_CONSTRAINED 25
+#define SSH_AGENTC_ADD_SMARTCARD_KEY_CONSTRAINED 26
+#define SSH_AGENTC_EXTENSION 27
+
+static_assert(AGENT_MAX_MSGLEN <= BUFFER_POOL_MAX_SIZE, "largest agent message must fit in a pooled buffer");
+
+inline uint32_t readu32(const void* buffer) {
+	const uint8_t* buffer_char = (const uint8_t*) buffer;
+	return (buffer_char[0] << 24) | (buffer_char[1] << 16) | (buffer_char[2] << 8) | (buffer_char[3] << 0);
+}
+
+inline void writeu32(void* buffer, uint32_t value) {
+	uint8_t* buffer_char = (uint8_t*) buffer;
+	buffer_char[0] = (uint8_t) (value >> 24);
+	buffer_char[1] = (uint8_t) (value >> 16);
+	buffer_char[2] = (uint8_t) (value >> 8);
+	buffer_char[3] = (uint8_t) (value >> 0);
+}
+
+// Type of a complete agent message, or -1 if the message has no type byte.
+inline int agentMessageType(const void* message, int32_t size) {
+	if(size < 5 || readu32(message) == 0)
+		return -1;
+	return ((const uint8_t*) message)[4];
+}
+
+// Write a reply made of its type alone, like SSH_AGENT_SUCCESS or SSH_AGENT_FAILURE.
+// Returns its size or -1 if reply could not be grown.
+inline int32_t writeStatusReply(message_buffer& reply, uint8_t type) {
+	if(!reply.reserve(5, 0))
+		return -1;
+
+	memcpy(reply.data(), "\0\0\0\1", 4);
+	reply.data()[4] = (char) type;
+
+	return 5;
+}
+
+// Whether a complete agent message is the session-bind@openssh.com extension request.
+inline bool isSessionBindRequest(const void* message, int32_t size) {
+	static const char sessionBind[] = "session-bind@openssh.com";
+	const uint8_t* buffer = (const uint8_t*) message;
+
+	return agentMessageType(message, size) == SSH_AGENTC_EXTENSION && size >= 9 &&
+	       readu32(buffer + 5) == sizeof(sessionBind) - 1 && size >= 9 + (int32_t) sizeof(sessionBind) - 1 &&
+	       memcmp(buffer + 9, sessionBind, sizeof(sessionBind) - 1) == 0;
+}
+
+// Read a complete agent message (4 bytes big endian length + payload) using readFunction.
+// readFunction(spans, count) must fill the spans in order (or only the first one) and return the number
+// of bytes read, 0 on EOF or a negative error code.
+// The pooled buffer is grown from the message length header, so small messages only use a small buffer.
+// Bytes read past the end of the message are kept by parser and returned by the next call.
+// Returns the message size, 0 on EOF or a negative error code. Messages larger than maxSize are rejected.
+// When streamMinSize is not 0, messages of at least streamMinSize bytes are only read up to their type byte:
+// the message size is returned with only parser.receivedSize() bytes in buffer, the rest is left unread.
+// When headOnlyOnRefusal is true, messages which do not fit in the memory budget are returned the same way.
+template<typename T>
+int32_t readAgentMessage(T readFunction,
+                         agent_frame_parser& parser,
+                         message_buffer& buffer,
+                         int32_t maxSize,
+                         int32_t streamMinSize = 0,
+                         bool headOnlyOnRefusal = false) {
+	frame_status status = parser.begin(buffer, maxSize);
+
+	while(status == frame_status::incomplete) {
+		bool headOnly = streamMinSize > 0 && parser.frameSize() >= streamMinSize;
+		if(headOnly && parser.receivedSize() >= 5)
+			return parser.frameSize();
+
+		agent_read_span spans[2];
+		int spanCount = headOnly ? parser.prepareHeadRead(buffer, 5, spans) : parser.prepareRead(buffer, spans);
+		if(spanCount == 0 && headOnlyOnRefusal && parser.frameSize() > 0) {
+			// Small buffers are never refused, the head still fits
+			if(parser.receivedSize() >= 5)
+				return parser.frameSize();
+			spanCount = parser.prepareHeadRead(buffer, 5, spans);
+		}
+		if(spanCount == 0)
+			return -1;
+
+		int32_t result = readFunction(spans, spanCount);
+		if(result < 0) {
+			logDebug("Failed to read agent message: %d\n", result);
+			return result;
+		} else if(result == 0) {
+			// EOF
+			return 0;
+		}
+
+		status = parser.onRead(buffer, result);
+	}
+
+	if(status == frame_status::invalid)
+		return -1;
+
+	logPayload("Read agent message", buffer.data(), parser.frameSize());
+
+	return parser.frameSize();
+}
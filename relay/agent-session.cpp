@@ -0,0 +1,169 @@
+#include "relay/agent-session.h"
+#include "relay/agent-message.h"
+#include "relay/logger.h"
+#include "relay/relay-stats.h"
+#include "relay/request-trace.h"
+#include "relay/traffic-capture.h"
+
+#include <atomic>
+#include <memory>
+
+static std::atomic<int32_t> streamMinSize(AGENT_SESSION_DEFAULT_STREAM_MIN_SIZE);
+
+void setRequestStreaming(int32_t minSize) {
+	streamMinSize = minSize;
+}
+
+// Write the head of a request already read, then forward the rest of it from the client as it arrives.
+static bool streamRequest(agent_stream& client,
+                          agent_stream& upstream,
+                          const char* head,
+                          int32_t headSize,
+                          int32_t requestSize) {
+	int32_t result = upstream.write(head, headSize);
+	if(result == headSize)
+		result = client.forwardTo(upstream, requestSize - headSize);
+	if(result != requestSize - headSize) {
+		logWarning("Failed to stream request to upstream: %d\n", result);
+		return false;
+	}
+
+	relay_stats::instance().onRequestStreamed((uint64_t) (requestSize - headSize));
+	return true;
+}
+
+void runAgentSession(agent_stream& client, agent_upstream& upstream, int32_t maxMessageSize, idle_reaper* idleReaper) {
+	// Buffers are borrowed from the pool and grown on demand, idle sessions only hold small ones
+	message_buffer pchRequest;
+	message_buffer pchReply;
+	// Keeps the bytes of pipelined requests read along with the current one
+	agent_frame_parser requestParser;
+	relay_stats& stats = relay_stats::instance();
+
+	uint32_t captureId = openCaptureSession();
+	// Already opened by servers tracing the upstream connection of the session
+	trace_session traceSession;
+
+	// Blocking reads have no timeout, the reaper interrupts the client stream instead
+	std::unique_ptr<idle_timer> idleTimer;
+	if(idleReaper != NULL && idleReaper->getClientTimeoutMs() > 0)
+		idleTimer = std::make_unique<idle_timer>(*idleReaper, [&client]() { client.interrupt(); });
+
+	stats.onSessionOpened();
+
+	// Loop until done reading
+	while(1) {
+		// The client read phase starts when the first bytes of the request are received
+		uint64_t firstReadNs = 0;
+		agent_stream* upstreamStream = NULL;
+		int32_t requestStreamMinSize = streamMinSize;
+		if(requestStreamMinSize > 0 && captureId == 0 && !isLogEnabled(log_level::payload))
+			upstreamStream = upstream.requestStream();
+
+		if(idleTimer)
+			idleTimer->arm(idleReaper->getClientTimeoutMs());
+		int32_t byteRead = readAgentMessage(
+		    [&client, &firstReadNs](const agent_read_span* spans, int count) {
+			    int32_t result = client.readSpans(spans, count);
+			    if(firstReadNs == 0)
+				    firstReadNs = monotonicNs();
+			    return result;
+		    },
+		    requestParser,
+		    pchRequest,
+		    maxMessageSize,
+		    upstreamStream != NULL ? requestStreamMinSize : 0,
+		    true);
+
+		// Only the head of large requests, or of those over the memory budget, was read. The rest goes upstream or
+		// waits for room in the budget while the idle timeout still applies.
+		bool partial = byteRead > 0 && requestParser.receivedSize() < byteRead;
+		bool streamed = partial && upstreamStream != NULL && byteRead >= requestStreamMinSize;
+		if(byteRead > 0 && isRequestTraceEnabled())
+			setTraceRequest(agentMessageType(pchRequest.data(), byteRead), byteRead);
+		uint64_t streamStartNs = streamed ? traceStartNs() : 0;
+		bool streamFailed = streamed && !streamRequest(client,
+		                                                *upstreamStream,
+		                                                pchRequest.data(),
+		                                                requestParser.receivedSize(),
+		                                                byteRead);
+
+		traceSpan(trace_phase::upstream_send, streamStartNs);
+
+		bool rejected = false;
+		if(partial && !streamed) {
+			int32_t result = readRefusedMessage(client, pchRequest, requestParser.receivedSize(), byteRead);
+			stats.onMessageOverBudget(false, result == byteRead);
+			rejected = result == 0;
+			if(result < 0)
+				byteRead = result;
+		}
+
+		if(idleTimer) {
+			idleTimer->cancel();
+			if(idleTimer->hasExpired()) {
+				logInfo("Client idle for %u ms, closing its session\n", idleReaper->getClientTimeoutMs());
+				stats.onSessionReaped(pchRequest.capacity() + pchReply.capacity());
+				break;
+			}
+		}
+
+		if(byteRead <= 0 || streamFailed)
+			break;
+
+		uint64_t requestReadNs = monotonicNs();
+		if(firstReadNs == 0)
+			firstReadNs = requestReadNs;
+		if(isRequestTraceEnabled())
+			traceSpan(trace_phase::client_read, firstReadNs, requestReadNs);
+
+		int32_t replySize;
+		if(rejected) {
+			logWarning("Request of %d bytes over the memory budget, answering a failure\n", byteRead);
+			replySize = writeStatusReply(pchReply, SSH_AGENT_FAILURE);
+		} else if(streamed) {
+			replySize = upstream.receiveReply(pchReply, maxMessageSize);
+		} else {
+			logPayload("Sending to upstream", pchRequest.data(), byteRead);
+			captureMessage(captureId, capture_event::request, pchRequest.data(), byteRead);
+
+			replySize = answerStatsRequest(pchRequest.data(), byteRead, pchReply);
+			if(replySize == 0)
+				replySize = upstream.transact(pchRequest.data(), byteRead, pchReply, maxMessageSize);
+		}
+		if(replySize <= 0) {
+			logWarning("Upstream connection closed\n");
+			break;
+		}
+		uint64_t replyReadNs = monotonicNs();
+		if(isRequestTraceEnabled())
+			traceSpan(trace_phase::upstream, requestReadNs, replyReadNs, replySize);
+		captureMessage(captureId, capture_event::reply, pchReply.data(), replySize);
+
+		// Write the reply to the client.
+		int32_t result = client.write(pchReply.data(), replySize);
+		if(result != replySize) {
+			logWarning("Failed to write reply to client: %d\n", result);
+			break;
+		}
+
+		uint64_t replyWrittenNs = monotonicNs();
+		stats.recordMessage(agentMessageType(pchRequest.data(), byteRead),
+		                    byteRead,
+		                    replySize,
+		                    requestReadNs - firstReadNs,
+		                    replyReadNs - requestReadNs,
+		                    replyWrittenNs - replyReadNs);
+		if(isRequestTraceEnabled()) {
+			traceSpan(trace_phase::reply_write, replyReadNs, replyWrittenNs, replySize);
+			setTraceRequest(-1, 0);
+		}
+
+		if(requestParser.pendingSize() == 0)
+			pchRequest.shrink();
+		pchReply.shrink();
+	}
+
+	stats.onSessionClosed();
+	closeCaptureSession(captureId);
+}
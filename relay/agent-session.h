@@ -0,0 +1,25 @@
+#pragma once
+
+#include "relay/agent-stream.h"
+#include "relay/agent-upstream.h"
+#include "relay/idle-reaper.h"
+
+#include <stdint.h>
+
+// Requests of at least that many bytes are streamed by default
+#define AGENT_SESSION_DEFAULT_STREAM_MIN_SIZE 16384
+
+// Requests of at least minSize bytes (0: none) are forwarded to upstreams offering a requestStream() while they
+// are read from the client, instead of being buffered whole, unless traffic capture or payload logging needs them.
+void setRequestStreaming(int32_t minSize);
+
+// Read requests from client, forward them to upstream and write back the replies until
+// either side closes the connection. Messages are limited to maxMessageSize bytes.
+// When idleReaper has a client timeout, the session ends once the client stayed that long without
+// sending a complete request.
+// Messages that do not fit in the buffer_pool memory budget wait for room a while, then are skipped and
+// answered with SSH_AGENT_FAILURE, the session goes on.
+void runAgentSession(agent_stream& client,
+                     agent_upstream& upstream,
+                     int32_t maxMessageSize,
+                     idle_reaper* idleReaper = NULL);
@@ -0,0 +1,68 @@
+#include "relay/agent-stream.h"
+#include "relay/buffer-pool.h"
+
+int32_t agent_stream::forwardTo(agent_stream& destination, int32_t size) {
+	message_buffer chunk;
+	int32_t forwarded = 0;
+
+	// Small chunks are slower but never refused by the memory budget
+	if(!chunk.reserve(size < AGENT_STREAM_CHUNK_SIZE ? size : AGENT_STREAM_CHUNK_SIZE, 0) &&
+	   !chunk.reserve(BUFFER_POOL_SMALL_SIZE, 0))
+		return -1;
+
+	while(forwarded < size) {
+		int32_t chunkSize = size - forwarded;
+		if(chunkSize > (int32_t) chunk.capacity())
+			chunkSize = (int32_t) chunk.capacity();
+
+		int32_t result = read(chunk.data(), chunkSize);
+		if(result <= 0)
+			return result;
+
+		int32_t written = destination.write(chunk.data(), result);
+		if(written != result)
+			return written < 0 ? written : -1;
+		forwarded += result;
+	}
+
+	return forwarded;
+}
+
+int32_t agent_stream::discard(int32_t size) {
+	message_buffer chunk;
+	int32_t discarded = 0;
+
+	if(!chunk.reserve(BUFFER_POOL_SMALL_SIZE, 0))
+		return -1;
+
+	while(discarded < size) {
+		int32_t chunkSize = size - discarded;
+		if(chunkSize > (int32_t) chunk.capacity())
+			chunkSize = (int32_t) chunk.capacity();
+
+		int32_t result = read(chunk.data(), chunkSize);
+		if(result <= 0)
+			return result;
+		discarded += result;
+	}
+
+	return discarded;
+}
+
+int32_t readRefusedMessage(agent_stream& stream, message_buffer& buffer, int32_t receivedSize, int32_t size) {
+	if(buffer_pool::instance().waitForBudget((size_t) size) && buffer.reserve((size_t) size, (size_t) receivedSize)) {
+		while(receivedSize < size) {
+			int32_t result = stream.read(buffer.data() + receivedSize, size - receivedSize);
+			if(result <= 0)
+				return result < 0 ? result : -1;
+			receivedSize += result;
+		}
+		return size;
+	}
+
+	int32_t result = stream.discard(size - receivedSize);
+	if(result != size - receivedSize)
+		return result < 0 ? result : -1;
+
+	return 0;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdint.h>
+
+// Bytes held in memory at once when a stream is forwarded to another one.
+#define AGENT_STREAM_CHUNK_SIZE 65536
+
+// Memory region filled by a scatter read.
+struct agent_read_span {
+	char* data;
+	int32_t size;
+};
+
+// Bidirectional byte stream to a client or an upstream agent.
+class agent_stream {
+public:
+	virtual ~agent_stream() = default;
+
+	// Read up to size bytes.
+	// Returns the number of bytes read, 0 on EOF or a negative error code.
+	virtual int32_t read(void* buffer, int32_t size) = 0;
+
+	// Read up to the total size of count spans, filling them in order.
+	// Streams unable to scatter only fill the first span.
+	virtual int32_t readSpans(const agent_read_span* spans, int /* count */) {
+		return read(spans[0].data, spans[0].size);
+	}
+
+	// Write size bytes.
+	// Returns the number of bytes written or a negative error code.
+	virtual int32_t write(const void* buffer, int32_t size) = 0;
+
+	// Make a read or write blocked in another thread fail, used to end idle sessions.
+	virtual void interrupt() {}
+
+	// Read exactly size bytes and write them to destination, AGENT_STREAM_CHUNK_SIZE bytes at a time.
+	// Returns size, 0 on EOF or a negative error code.
+	virtual int32_t forwardTo(agent_stream& destination, int32_t size);
+
+	// Read exactly size bytes and drop them, used to skip messages refused by the memory budget.
+	// Returns size, 0 on EOF or a negative error code.
+	int32_t discard(int32_t size);
+};
+
+class message_buffer;
+
+// Finish reading a message of size bytes from stream, of which only receivedSize bytes are in buffer because
+// the memory budget refused a larger buffer: wait for other sessions to release memory and read the rest
+// into buffer, or skip the rest when there is still no room. Blocks, only for thread-per-client sessions.
+// Returns size when the message is in buffer, 0 when it was skipped or a negative error code.
+int32_t readRefusedMessage(agent_stream& stream, message_buffer& buffer, int32_t receivedSize, int32_t size);
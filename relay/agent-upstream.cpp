@@ -0,0 +1,49 @@
+#include "relay/agent-upstream.h"
+#include "relay/agent-message.h"
+#include "relay/logger.h"
+#include "relay/relay-stats.h"
+#include "relay/request-trace.h"
+
+stream_upstream::stream_upstream(std::unique_ptr<agent_stream> stream) noexcept : stream(std::move(stream)) {}
+
+int32_t stream_upstream::transact(const void* request,
+                                  int32_t requestSize,
+                                  message_buffer& reply,
+                                  int32_t replyMaxSize) {
+	uint64_t sendStartNs = traceStartNs();
+	int32_t result = stream->write(request, requestSize);
+	traceSpan(trace_phase::upstream_send, sendStartNs);
+	if(result != requestSize) {
+		logError("Failed to send query data to upstream: %d\n", result);
+		return result < 0 ? result : -1;
+	}
+
+	return receiveReply(reply, replyMaxSize);
+}
+
+int32_t stream_upstream::receiveReply(message_buffer& reply, int32_t replyMaxSize) {
+	uint64_t waitStartNs = traceStartNs();
+	int32_t replySize = readAgentMessage(
+	    [this](const agent_read_span* spans, int count) { return stream->readSpans(spans, count); },
+	    replyParser,
+	    reply,
+	    replyMaxSize,
+	    0,
+	    true);
+
+	// Replies over the memory budget are skipped once they are known to stay so, the client gets a failure
+	if(replySize > 0 && replyParser.receivedSize() < replySize) {
+		int32_t result = readRefusedMessage(*stream, reply, replyParser.receivedSize(), replySize);
+		relay_stats::instance().onMessageOverBudget(true, result == replySize);
+		if(result == 0) {
+			logWarning("Reply of %d bytes over the memory budget, answering a failure\n", replySize);
+			replySize = writeStatusReply(reply, SSH_AGENT_FAILURE);
+		} else if(result < 0) {
+			replySize = result;
+		}
+	}
+	if(waitStartNs != 0)
+		traceSpan(trace_phase::upstream_wait, waitStartNs, monotonicNs(), replySize > 0 ? replySize : 0);
+
+	return replySize;
+}
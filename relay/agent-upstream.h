@@ -0,0 +1,50 @@
+#pragma once
+
+#include "relay/agent-stream.h"
+#include "relay/buffer-pool.h"
+#include "relay/frame-parser.h"
+
+#include <functional>
+#include <memory>
+#include <stdint.h>
+
+// Upstream agent able to answer agent requests (ssh-agent socket, Pageant, ...).
+class agent_upstream {
+public:
+	virtual ~agent_upstream() = default;
+
+	// Forward a complete request message and read the complete reply message into reply,
+	// growing it as needed up to replyMaxSize bytes.
+	// Returns the reply size, 0 if the upstream closed the connection or a negative error code.
+	virtual int32_t transact(const void* request, int32_t requestSize, message_buffer& reply, int32_t replyMaxSize) = 0;
+
+	// Stream a request can be written to while it is read from the client, its reply then being read with
+	// receiveReply(). NULL when requests must be complete to be forwarded (shared or queued upstreams, caches).
+	virtual agent_stream* requestStream() { return NULL; }
+
+	// Read the reply of a request written to requestStream(), same result as transact().
+	virtual int32_t receiveReply(message_buffer& reply, int32_t replyMaxSize) {
+		(void) reply;
+		(void) replyMaxSize;
+		return -1;
+	}
+};
+
+// Open a new upstream for a client session.
+// Returns NULL if the upstream agent cannot be reached.
+typedef std::function<std::unique_ptr<agent_upstream>()> upstream_connector;
+
+// Upstream agent reached through a byte stream (ssh-agent socket).
+class stream_upstream : public agent_upstream {
+public:
+	explicit stream_upstream(std::unique_ptr<agent_stream> stream) noexcept;
+
+	int32_t transact(const void* request, int32_t requestSize, message_buffer& reply, int32_t replyMaxSize) override;
+
+	agent_stream* requestStream() override { return stream.get(); }
+	int32_t receiveReply(message_buffer& reply, int32_t replyMaxSize) override;
+
+private:
+	std::unique_ptr<agent_stream> stream;
+	agent_frame_parser replyParser;
+};
@@ -0,0 +1,276 @@
+#include "relay/buffer-pool.h"
+#include "relay/logger.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+
+buffer_pool& buffer_pool::instance() {
+	static buffer_pool pool;
+	return pool;
+}
+
+buffer_pool::buffer_pool()
+    : hits(0),
+      misses(0),
+      bytesInUse(0),
+      bytesCached(0),
+      highWaterBytes(0),
+      budgetBytes(0),
+      budgetWaitMs(BUFFER_POOL_DEFAULT_BUDGET_WAIT_MS),
+      refusals(0),
+      budgetWaiters(0) {
+	// Cache at most 1 MB of small buffers, 2 MB of medium buffers and 2 max buffers
+	classes[0].size = BUFFER_POOL_SMALL_SIZE;
+	classes[0].maxCached = 256;
+	classes[1].size = BUFFER_POOL_MEDIUM_SIZE;
+	classes[1].maxCached = 32;
+	classes[2].size = BUFFER_POOL_MAX_SIZE;
+	classes[2].maxCached = 2;
+}
+
+buffer_pool::~buffer_pool() {
+	for(size_class& sizeClass : classes) {
+		for(char* buffer : sizeClass.freeList) {
+			free(buffer);
+		}
+	}
+}
+
+buffer_pool::size_class* buffer_pool::findClass(size_t size) {
+	for(size_class& sizeClass : classes) {
+		if(size <= sizeClass.size)
+			return &sizeClass;
+	}
+
+	return NULL;
+}
+
+void buffer_pool::updateHighWater() {
+	size_t total = bytesInUse + bytesCached;
+	size_t highWater = highWaterBytes;
+
+	while(total > highWater && !highWaterBytes.compare_exchange_weak(highWater, total)) {
+	}
+}
+
+void buffer_pool::setBudget(size_t budgetBytes, uint32_t waitMs) {
+	std::lock_guard<std::mutex> lock(budgetMutex);
+	this->budgetBytes = budgetBytes;
+	budgetWaitMs = waitMs;
+}
+
+// Called with budgetMutex held
+void buffer_pool::trimCache() {
+	for(size_class& sizeClass : classes) {
+		std::lock_guard<std::mutex> lock(sizeClass.mutex);
+		for(char* buffer : sizeClass.freeList) {
+			free(buffer);
+		}
+		bytesCached -= sizeClass.freeList.size() * sizeClass.size;
+		sizeClass.freeList.clear();
+	}
+}
+
+// Count size more bytes in use if they fit in the budget, freeing the cached buffers when they would not
+bool buffer_pool::chargeBudget(size_t size) {
+	std::lock_guard<std::mutex> lock(budgetMutex);
+	size_t budget = budgetBytes;
+
+	if(bytesInUse + bytesCached + size > budget && bytesCached > 0)
+		trimCache();
+	if(bytesInUse + bytesCached + size > budget)
+		return false;
+
+	bytesInUse += size;
+	return true;
+}
+
+char* buffer_pool::acquire(size_t size, size_t* capacity) {
+	size_class* sizeClass = findClass(size);
+	char* buffer = NULL;
+
+	if(sizeClass == NULL) {
+		logError("Message buffer too large: %zu bytes\n", size);
+		return NULL;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(sizeClass->mutex);
+		if(!sizeClass->freeList.empty()) {
+			buffer = sizeClass->freeList.back();
+			sizeClass->freeList.pop_back();
+		}
+	}
+
+	if(buffer != NULL) {
+		hits++;
+		bytesCached -= sizeClass->size;
+		bytesInUse += sizeClass->size;
+	} else {
+		// Cached buffers were already counted, only new large ones are checked against the budget
+		bool charged = sizeClass != &classes[0] && budgetBytes > 0;
+		if(charged && !chargeBudget(sizeClass->size)) {
+			refusals++;
+			logDebug("Message buffer of %zu bytes refused, over the memory budget\n", sizeClass->size);
+			return NULL;
+		}
+
+		buffer = (char*) malloc(sizeClass->size);
+		if(buffer == NULL) {
+			if(charged)
+				bytesInUse -= sizeClass->size;
+			logError("Failed to allocate message buffer of %zu bytes\n", sizeClass->size);
+			return NULL;
+		}
+		misses++;
+		if(!charged)
+			bytesInUse += sizeClass->size;
+	}
+
+	updateHighWater();
+
+	*capacity = sizeClass->size;
+	return buffer;
+}
+
+void buffer_pool::release(char* buffer, size_t capacity) {
+	size_class* sizeClass = findClass(capacity);
+	bool cached = false;
+
+	bytesInUse -= capacity;
+
+	{
+		std::lock_guard<std::mutex> lock(sizeClass->mutex);
+		if(sizeClass->freeList.size() < sizeClass->maxCached) {
+			sizeClass->freeList.push_back(buffer);
+			bytesCached += capacity;
+			cached = true;
+		}
+	}
+
+	if(!cached)
+		free(buffer);
+
+	wakeBudgetWaiters();
+}
+
+void buffer_pool::chargeExternal(size_t size) {
+	bytesInUse += size;
+	updateHighWater();
+}
+
+void buffer_pool::releaseExternal(size_t size) {
+	bytesInUse -= size;
+	wakeBudgetWaiters();
+}
+
+void buffer_pool::wakeBudgetWaiters() {
+	if(budgetWaiters > 0) {
+		std::lock_guard<std::mutex> lock(budgetMutex);
+		budgetReleased.notify_all();
+	}
+}
+
+bool buffer_pool::waitForBudget(size_t size) {
+	size_class* sizeClass = findClass(size);
+	std::unique_lock<std::mutex> lock(budgetMutex);
+	size_t budget = budgetBytes;
+
+	if(budget == 0 || sizeClass == NULL || sizeClass->size > budget)
+		return false;
+
+	// Cached buffers do not count, they are freed to make room
+	budgetWaiters++;
+	bool fits = budgetReleased.wait_for(lock, std::chrono::milliseconds(budgetWaitMs), [this, sizeClass, budget]() {
+		return bytesInUse + sizeClass->size <= budget;
+	});
+	budgetWaiters--;
+
+	return fits;
+}
+
+buffer_pool_stats buffer_pool::getStats() const {
+	buffer_pool_stats stats;
+
+	stats.hits = hits;
+	stats.misses = misses;
+	stats.bytesInUse = bytesInUse;
+	stats.bytesCached = bytesCached;
+	stats.highWaterBytes = highWaterBytes;
+	stats.budgetBytes = budgetBytes;
+	stats.refusals = refusals;
+
+	return stats;
+}
+
+message_buffer::message_buffer() noexcept : buffer(NULL), bufferCapacity(0) {}
+
+message_buffer::~message_buffer() {
+	reset();
+}
+
+message_buffer::message_buffer(message_buffer&& other) noexcept
+    : buffer(other.buffer), bufferCapacity(other.bufferCapacity) {
+	other.buffer = NULL;
+	other.bufferCapacity = 0;
+}
+
+message_buffer& message_buffer::operator=(message_buffer&& other) noexcept {
+	if(this != &other) {
+		reset();
+		buffer = other.buffer;
+		bufferCapacity = other.bufferCapacity;
+		other.buffer = NULL;
+		other.bufferCapacity = 0;
+	}
+	return *this;
+}
+
+void message_buffer::reset() {
+	if(buffer != NULL) {
+		buffer_pool::instance().release(buffer, bufferCapacity);
+		buffer = NULL;
+		bufferCapacity = 0;
+	}
+}
+
+bool message_buffer::reserve(size_t size, size_t keepSize) {
+	if(size <= bufferCapacity)
+		return true;
+
+	size_t newCapacity;
+	char* newBuffer = buffer_pool::instance().acquire(size, &newCapacity);
+	if(newBuffer == NULL)
+		return false;
+
+	if(keepSize > 0)
+		memcpy(newBuffer, buffer, keepSize);
+
+	reset();
+	buffer = newBuffer;
+	bufferCapacity = newCapacity;
+
+	return true;
+}
+
+void message_buffer::shrink() {
+	if(bufferCapacity > BUFFER_POOL_SMALL_SIZE) {
+		reset();
+		reserve(BUFFER_POOL_SMALL_SIZE, 0);
+	}
+}
+
+void printBufferPoolStats() {
+	buffer_pool_stats stats = buffer_pool::instance().getStats();
+
+	logDebug("Buffer pool: %llu hits, %llu misses, %zu bytes in use, %zu bytes cached, %zu bytes high-water, "
+	         "%llu refused over budget\n",
+	         (unsigned long long) stats.hits,
+	         (unsigned long long) stats.misses,
+	         stats.bytesInUse,
+	         stats.bytesCached,
+	         stats.highWaterBytes,
+	         (unsigned long long) stats.refusals);
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+// Size classes of pooled message buffers. Almost all agent messages fit in the small class,
+// the max class holds the largest message the proxies accept.
+#define BUFFER_POOL_SMALL_SIZE 4096
+#define BUFFER_POOL_MEDIUM_SIZE 65536
+#define BUFFER_POOL_MAX_SIZE 2621440
+
+// Time a session waits for other sessions to release memory before refusing a message over the budget
+#define BUFFER_POOL_DEFAULT_BUDGET_WAIT_MS 200
+
+struct buffer_pool_stats {
+	uint64_t hits;          // buffers reused from a free list
+	uint64_t misses;        // buffers that had to be allocated
+	size_t bytesInUse;      // bytes currently borrowed by sessions, or charged from outside the pool
+	size_t bytesCached;     // bytes kept in the free lists
+	size_t highWaterBytes;  // peak of bytesInUse + bytesCached
+	size_t budgetBytes;     // limit of bytesInUse + bytesCached, 0 when unlimited
+	uint64_t refusals;      // buffers refused because of the budget
+};
+
+// Process-wide pool of message buffers with small/medium/max size classes.
+// Released buffers are kept in a bounded free list per class for reuse by the next session.
+// With a memory budget, medium and max buffers are refused once the in use and cached bytes would exceed it,
+// after freeing cached buffers. Small buffers are always given, so every session can still read requests
+// and answer the ones it cannot hold with a failure. Their bytes still count, as do the ones charged with
+// chargeExternal(), so the larger buffers are refused sooner.
+class buffer_pool {
+public:
+	static buffer_pool& instance();
+
+	// Limit the bytes of all buffers to budgetBytes (0: unlimited). Sessions wait up to waitMs for room
+	// before refusing a message, see waitForBudget().
+	void setBudget(size_t budgetBytes, uint32_t waitMs);
+
+	// Get a buffer of at least size bytes. Returns NULL if size is too large, over the budget or allocation
+	// failed. capacity receives the real size of the buffer.
+	char* acquire(size_t size, size_t* capacity);
+
+	// Give back a buffer returned by acquire.
+	void release(char* buffer, size_t capacity);
+
+	// Count size bytes of memory held outside the pool (registered I/O buffers, queued bytes) as in use.
+	// Like small buffers they are never refused.
+	void chargeExternal(size_t size);
+	void releaseExternal(size_t size);
+
+	// Wait up to the budget wait time until a buffer of size bytes fits in the budget.
+	// Only for threads which may block, returns false on timeout or without budget.
+	bool waitForBudget(size_t size);
+
+	buffer_pool_stats getStats() const;
+
+private:
+	buffer_pool();
+	~buffer_pool();
+
+	struct size_class {
+		size_t size;
+		size_t maxCached;
+		std::mutex mutex;
+		std::vector<char*> freeList;
+	};
+
+	size_class* findClass(size_t size);
+	void updateHighWater();
+	bool chargeBudget(size_t size);
+	void trimCache();
+	void wakeBudgetWaiters();
+
+	size_class classes[3];
+	std::atomic<uint64_t> hits;
+	std::atomic<uint64_t> misses;
+	std::atomic<size_t> bytesInUse;
+	std::atomic<size_t> bytesCached;
+	std::atomic<size_t> highWaterBytes;
+
+	std::atomic<size_t> budgetBytes;
+	uint32_t budgetWaitMs;
+	std::atomic<uint64_t> refusals;
+	// Serializes budget charges of large buffers, and wakes the sessions waiting for room
+	std::mutex budgetMutex;
+	std::condition_variable budgetReleased;
+	std::atomic<int> budgetWaiters;
+};
+
+// Message buffer borrowed from buffer_pool, returned to the pool on destruction.
+// Sessions start with a small buffer and grow it from the message length header.
+class message_buffer {
+public:
+	message_buffer() noexcept;
+	~message_buffer();
+
+	message_buffer(message_buffer&& other) noexcept;
+	message_buffer& operator=(message_buffer&& other) noexcept;
+
+	message_buffer(const message_buffer&) = delete;
+	message_buffer& operator=(const message_buffer&) = delete;
+
+	char* data() const { return buffer; }
+	size_t capacity() const { return bufferCapacity; }
+
+	// Make the buffer at least size bytes long, keeping its first keepSize bytes.
+	// Returns false if size is larger than the max class or allocation failed.
+	bool reserve(size_t size, size_t keepSize);
+
+	// Go back to a small buffer once a large message has been handled, the content is lost.
+	void shrink();
+
+	// Give the buffer back to the pool while its owner is idle, the next reserve() gets a new one.
+	void release() { reset(); }
+
+private:
+	void reset();
+
+	char* buffer;
+	size_t bufferCapacity;
+};
+
+// Print pool counters, for the verbose output of the proxies.
+void printBufferPoolStats();
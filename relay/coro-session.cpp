@@ -0,0 +1,158 @@
+#include "relay/coro-session.h"
+#include "relay/agent-message.h"
+#include "relay/logger.h"
+#include "relay/relay-stats.h"
+#include "relay/traffic-capture.h"
+
+#include <algorithm>
+
+coro_session::coro_session(coro_stream& client,
+                           coro_stream& upstream,
+                           int32_t maxMessageSize,
+                           identity_cache* identityCache)
+    : client(client),
+      upstream(upstream),
+      maxMessageSize(maxMessageSize),
+      skipped(false),
+      identityCache(identityCache),
+      requestType(-1),
+      bound(false),
+      captureId(openCaptureSession()) {}
+
+coro_session::~coro_session() {
+	closeCaptureSession(captureId);
+}
+
+coro_task<void> coro_session::run() {
+	relay_stats& stats = relay_stats::instance();
+
+	for(;;) {
+		// Nothing of the next request was read ahead, the buffer goes back to the pool until the client speaks
+		if(clientParser.pendingSize() == 0) {
+			buffer.release();
+			if(co_await client.readable() <= 0)
+				break;
+		}
+
+		uint64_t firstReadNs = monotonicNs();
+		int32_t requestSize = co_await readFrame(client, clientParser);
+		if(requestSize <= 0)
+			break;
+		uint64_t requestReadNs = monotonicNs();
+
+		int32_t replySize;
+		if(skipped) {
+			replySize = writeStatusReply(buffer, SSH_AGENT_FAILURE);
+		} else {
+			requestType = agentMessageType(buffer.data(), requestSize);
+			captureMessage(captureId, capture_event::request, buffer.data(), requestSize);
+			if(isSessionBindRequest(buffer.data(), requestSize))
+				bound = true;
+
+			replySize = answerStatsRequest(buffer.data(), requestSize, buffer);
+			if(replySize == 0 && identityCache && !bound)
+				replySize = identityCache->lookup(buffer.data(), requestSize, buffer);
+			if(replySize == 0)
+				replySize = co_await roundTrip(requestSize);
+			if(replySize <= 0)
+				break;
+		}
+		uint64_t replyReadNs = monotonicNs();
+		captureMessage(captureId, capture_event::reply, buffer.data(), replySize);
+
+		if(!co_await writeFrame(client, replySize))
+			break;
+
+		stats.recordMessage(requestType,
+		                    requestSize,
+		                    replySize,
+		                    requestReadNs - firstReadNs,
+		                    replyReadNs - requestReadNs,
+		                    monotonicNs() - replyReadNs);
+		if(clientParser.pendingSize() == 0)
+			buffer.shrink();
+	}
+}
+
+coro_task<int32_t> coro_session::readFrame(coro_stream& stream, agent_frame_parser& parser) {
+	frame_status status = parser.begin(buffer, maxMessageSize);
+	skipped = false;
+
+	while(status == frame_status::incomplete) {
+		agent_read_span spans[2];
+
+		// Only the first span is read, bytes past the end of the message still go to the parser
+		if(parser.prepareRead(buffer, spans) == 0) {
+			if(parser.frameSize() == 0 || buffer.capacity() == 0)
+				co_return 0;
+			break;
+		}
+
+		int32_t result = co_await stream.read(spans[0].data, spans[0].size);
+		if(result <= 0) {
+			if(result < 0)
+				logWarning("Coroutine session I/O failed: %d\n", result);
+			co_return 0;
+		}
+		status = parser.onRead(buffer, result);
+	}
+
+	if(status == frame_status::invalid)
+		co_return 0;
+	if(status == frame_status::complete)
+		co_return parser.frameSize();
+
+	// The buffer holds the head of the message but cannot grow for the rest, usually the memory budget
+	bool reply = &stream == &upstream;
+	logWarning("%s of %d bytes over the memory budget, answering a failure\n",
+	           reply ? "Reply" : "Request",
+	           parser.frameSize());
+	relay_stats::instance().onMessageOverBudget(reply, false);
+	if(!reply)
+		requestType = parser.receivedSize() >= 5 ? (uint8_t) buffer.data()[4] : -1;
+
+	// The rest is read over the head, never past the end of the message
+	for(int32_t remaining = parser.frameSize() - parser.receivedSize(); remaining > 0;) {
+		int32_t result = co_await stream.read(buffer.data(), std::min(remaining, (int32_t) buffer.capacity()));
+		if(result <= 0)
+			co_return 0;
+		remaining -= result;
+	}
+
+	skipped = true;
+	co_return parser.frameSize();
+}
+
+coro_task<bool> coro_session::writeFrame(coro_stream& stream, int32_t size) {
+	for(int32_t written = 0; written < size;) {
+		int32_t result = co_await stream.write(buffer.data() + written, size - written);
+		if(result <= 0) {
+			if(result < 0)
+				logWarning("Coroutine session I/O failed: %d\n", result);
+			co_return false;
+		}
+		written += result;
+	}
+
+	co_return true;
+}
+
+coro_task<int32_t> coro_session::roundTrip(int32_t requestSize) {
+	uint64_t cacheToken = identityCache ? identityCache->onForward(buffer.data(), requestSize) : 0;
+
+	if(!co_await writeFrame(upstream, requestSize))
+		co_return 0;
+
+	int32_t replySize = co_await readFrame(upstream, upstreamParser);
+	if(replySize <= 0) {
+		logWarning("Upstream connection closed\n");
+		co_return 0;
+	}
+	// The agent may have changed its identities even though its reply was dropped
+	if(skipped)
+		replySize = writeStatusReply(buffer, SSH_AGENT_FAILURE);
+
+	if(identityCache && identity_cache::wantsReply(requestType, bound))
+		identityCache->onReply(requestType, cacheToken, buffer.data(), replySize);
+	co_return replySize;
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include "relay/buffer-pool.h"
+#include "relay/coro-task.h"
+#include "relay/frame-parser.h"
+#include "relay/identity-cache.h"
+
+#include <stdint.h>
+
+class coro_stream;
+
+// I/O operation awaited by a coroutine: a read or write of up to size bytes, or when size is 0 for a read,
+// a wait until the stream has bytes to read. Resumes with the byte count, 0 on EOF or a negative error code.
+struct coro_io {
+	coro_stream* stream;
+	bool isWrite;
+	char* buffer;
+	int32_t size;
+	int32_t result;
+	std::coroutine_handle<> waiter;
+
+	bool await_ready();
+	bool await_suspend(std::coroutine_handle<> handle);
+	int32_t await_resume() const { return result; }
+};
+
+// Connection awaited by coroutine sessions, implemented by each executor.
+class coro_stream {
+public:
+	virtual ~coro_stream() {}
+
+	coro_io read(char* buffer, int32_t size) { return coro_io{this, false, buffer, size, 0, {}}; }
+	coro_io write(const char* buffer, int32_t size) { return coro_io{this, true, (char*) buffer, size, 0, {}}; }
+	coro_io readable() { return read(NULL, 0); }
+
+	// Complete io without waiting if possible. Returns true when io.result is set.
+	virtual bool tryIo(coro_io& io) = 0;
+
+	// Start io which could not complete right away. Returns true when io.waiter will be resumed once io.result
+	// is set, possibly on another thread before submitIo() returns, or false when io.result is already set.
+	virtual bool submitIo(coro_io& io) = 0;
+};
+
+inline bool coro_io::await_ready() {
+	return stream->tryIo(*this);
+}
+
+inline bool coro_io::await_suspend(std::coroutine_handle<> handle) {
+	waiter = handle;
+	return stream->submitIo(*this);
+}
+
+// Coroutine counterpart of relay_session for executors resuming sessions on I/O completion:
+// read a request from the client, round trip it upstream and write the reply back, until either side closes
+// its connection, written as sequential code where every I/O is a co_await.
+// The session holds a single pooled buffer, grown from the length header of each message, and given back
+// to the pool while waiting for the next request, so idle sessions only cost their coroutine frame and sockets.
+// Identity lists, statistics requests, traffic capture and the memory budget are handled like relay_session.
+class coro_session {
+public:
+	coro_session(coro_stream& client,
+	             coro_stream& upstream,
+	             int32_t maxMessageSize,
+	             identity_cache* identityCache = NULL);
+	~coro_session();
+
+	coro_session(const coro_session&) = delete;
+	coro_session& operator=(const coro_session&) = delete;
+
+	coro_task<void> run();
+
+private:
+	// Read the next frame of stream into the buffer. Returns its size or 0 when the session must end.
+	// Frames over the memory budget are read and dropped, skipped is then set and the buffer content is lost.
+	coro_task<int32_t> readFrame(coro_stream& stream, agent_frame_parser& parser);
+	coro_task<bool> writeFrame(coro_stream& stream, int32_t size);
+	// Forward the request in the buffer upstream and read its reply over it. Returns the reply size or 0.
+	coro_task<int32_t> roundTrip(int32_t requestSize);
+
+	coro_stream& client;
+	coro_stream& upstream;
+	message_buffer buffer;
+	agent_frame_parser clientParser;
+	agent_frame_parser upstreamParser;
+	int32_t maxMessageSize;
+	bool skipped;
+
+	identity_cache* identityCache;
+	int requestType;
+	bool bound;  // session-bind@openssh.com was relayed, identity lists are filtered for this session
+
+	uint32_t captureId;  // 0 when traffic capture is disabled
+};
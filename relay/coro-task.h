@@ -0,0 +1,126 @@
+#pragma once
+
+#include <coroutine>
+#include <exception>
+#include <type_traits>
+#include <utility>
+
+template<typename T>
+class coro_task;
+
+struct coro_promise_base {
+	std::coroutine_handle<> continuation;
+
+	std::suspend_always initial_suspend() noexcept { return {}; }
+	void unhandled_exception() noexcept { std::terminate(); }
+
+	// Resume the awaiting coroutine without growing the stack, or return to whoever resumed this one
+	struct final_awaiter {
+		bool await_ready() noexcept { return false; }
+		template<typename Promise>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+			std::coroutine_handle<> continuation = handle.promise().continuation;
+			return continuation ? continuation : std::noop_coroutine();
+		}
+		void await_resume() noexcept {}
+	};
+	final_awaiter final_suspend() noexcept { return {}; }
+};
+
+template<typename T>
+struct coro_promise : coro_promise_base {
+	T value{};
+
+	coro_task<T> get_return_object() noexcept;
+	void return_value(T result) { value = std::move(result); }
+};
+
+template<>
+struct coro_promise<void> : coro_promise_base {
+	coro_task<void> get_return_object() noexcept;
+	void return_void() noexcept {}
+};
+
+// Lazily started coroutine producing a T for the coroutine awaiting it.
+// The awaiting coroutine is suspended until the task returns, then resumed by symmetric transfer, so a chain of
+// tasks suspended on I/O costs a single resume() of the innermost one and no stack.
+// Tasks are not thread safe, a session is resumed by one thread at a time.
+template<typename T>
+class coro_task {
+public:
+	using promise_type = coro_promise<T>;
+
+	coro_task() noexcept {}
+	explicit coro_task(std::coroutine_handle<promise_type> handle) noexcept : handle(handle) {}
+	~coro_task() {
+		if(handle)
+			handle.destroy();
+	}
+
+	coro_task(coro_task&& other) noexcept : handle(std::exchange(other.handle, {})) {}
+	coro_task& operator=(coro_task&& other) noexcept {
+		if(this != &other) {
+			if(handle)
+				handle.destroy();
+			handle = std::exchange(other.handle, {});
+		}
+		return *this;
+	}
+
+	coro_task(const coro_task&) = delete;
+	coro_task& operator=(const coro_task&) = delete;
+
+	bool await_ready() const noexcept { return false; }
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+		handle.promise().continuation = awaiting;
+		return handle;
+	}
+	T await_resume() {
+		if constexpr(!std::is_void_v<T>)
+			return std::move(handle.promise().value);
+	}
+
+private:
+	std::coroutine_handle<promise_type> handle;
+};
+
+template<typename T>
+coro_task<T> coro_promise<T>::get_return_object() noexcept {
+	return coro_task<T>(std::coroutine_handle<coro_promise<T>>::from_promise(*this));
+}
+
+inline coro_task<void> coro_promise<void>::get_return_object() noexcept {
+	return coro_task<void>(std::coroutine_handle<coro_promise<void>>::from_promise(*this));
+}
+
+// Coroutine owning itself, the root of a session: its frame is freed when it returns.
+// Once start() is called, the coroutine may run on another thread and the object must not be used
+// until the executor shuts down, when destroy() frees a coroutine which did not return along with the tasks
+// it awaits.
+class coro_detached {
+public:
+	struct promise_type {
+		coro_detached get_return_object() noexcept {
+			return coro_detached(std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() noexcept {}
+		void unhandled_exception() noexcept { std::terminate(); }
+	};
+
+	coro_detached() noexcept {}
+
+	void start() { handle.resume(); }
+
+	void destroy() {
+		if(handle)
+			handle.destroy();
+		handle = {};
+	}
+
+private:
+	explicit coro_detached(std::coroutine_handle<promise_type> handle) noexcept : handle(handle) {}
+
+	std::coroutine_handle<promise_type> handle;
+};
@@ -0,0 +1,60 @@
+#include "relay/cygwin-socket-file.h"
+#include "relay/logger.h"
+
+cygwin_socket_file::cygwin_socket_file(const socket_file_path& path) : path(path), cached(false), readCount(0) {
+	watching = startWatching();
+	if(!watching)
+		logWarning("Cannot watch the upstream socket file, it will be read on each connection\n");
+}
+
+cygwin_socket_file::~cygwin_socket_file() {
+	if(watching)
+		stopWatching();
+}
+
+bool cygwin_socket_file::get(cygwin_socket_info* socketInfo) {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	// Drain change notifications even when nothing is cached yet
+	if(watching && changedSinceLastCheck())
+		cached = false;
+
+	if(!cached || !watching) {
+		char buffer[128];
+
+		readCount++;
+		if(!readFile(buffer, sizeof(buffer)))
+			return false;
+
+		if(!parseCygwinSocketFile(buffer, &info))
+			return false;
+
+		cached = true;
+	}
+
+	*socketInfo = info;
+
+	return true;
+}
+
+SOCKET cygwin_socket_file::connect() {
+	cygwin_socket_info socketInfo;
+
+	if(!get(&socketInfo))
+		return INVALID_SOCKET;
+
+	SOCKET sock = connectCygwinSocket(socketInfo);
+	if(sock != INVALID_SOCKET || !watching)
+		return sock;
+
+	// The agent may have been restarted without the notification being seen yet
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		cached = false;
+	}
+
+	if(!get(&socketInfo))
+		return INVALID_SOCKET;
+
+	return connectCygwinSocket(socketInfo);
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "relay/cygwin-socket.h"
+
+#include <stdint.h>
+
+#include <atomic>
+#include <mutex>
+#include <string>
+
+#ifdef _WIN32
+#include <tchar.h>
+typedef std::basic_string<TCHAR> socket_file_path;
+#else
+typedef std::string socket_file_path;
+#endif
+
+// Cygwin socket file (SSH_AUTH_SOCK of Git Bash's ssh-agent) whose parsed content is cached in memory.
+// The file is watched for changes (directory change notification on Windows, inotify on POSIX)
+// and only read again after it was modified, so connecting to the upstream agent normally
+// does not involve any file I/O.
+class cygwin_socket_file {
+public:
+	explicit cygwin_socket_file(const socket_file_path& path);
+	~cygwin_socket_file();
+
+	cygwin_socket_file(const cygwin_socket_file&) = delete;
+	cygwin_socket_file& operator=(const cygwin_socket_file&) = delete;
+
+	// Get the socket information, reading the file only if it changed since it was last read.
+	bool get(cygwin_socket_info* info);
+
+	// Connect to the socket described by the file. If connecting with the cached information fails,
+	// the file is read again once in case it changed without a notification.
+	// Returns the connected socket or INVALID_SOCKET.
+	SOCKET connect();
+
+	// Number of times the file was actually read.
+	uint64_t getReadCount() const { return readCount; }
+
+private:
+	// Platform specific parts, in relay/posix and relay/win32.
+	bool startWatching();
+	bool changedSinceLastCheck();
+	void stopWatching();
+	bool readFile(char* buffer, size_t size);
+
+	socket_file_path path;
+
+	std::mutex mutex;
+	bool cached;
+	bool watching;
+	cygwin_socket_info info;
+	std::atomic<uint64_t> readCount;
+
+#ifdef _WIN32
+	HANDLE changeHandle;
+#else
+	int inotifyFd;
+	std::string fileName;
+#endif
+};
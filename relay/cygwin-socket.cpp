@@ -0,0 +1,125 @@
+#include "relay/cygwin-socket.h"
+#include "relay/logger.h"
+#include "relay/request-trace.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "relay/socket-stream.h"
+
+bool parseCygwinSocketFile(const char* content, cygwin_socket_info* info) {
+	const char* SOCKET_COOKIE = "!<socket >";
+
+	if(memcmp(content, SOCKET_COOKIE, strlen(SOCKET_COOKIE)) != 0) {
+		logError("Failed to find cookie %s in %s\n", SOCKET_COOKIE, content);
+		return false;
+	}
+
+	int result = sscanf(content + strlen(SOCKET_COOKIE),
+	                    "%hu %c %08x-%08x-%08x-%08x",
+	                    &info->port,
+	                    &info->type,
+	                    &info->cookie[0],
+	                    &info->cookie[1],
+	                    &info->cookie[2],
+	                    &info->cookie[3]);
+	if(result != 6) {
+		logError("Failed to parse socket file %s\n", content);
+		return false;
+	}
+
+	return true;
+}
+
+SOCKET connectCygwinSocket(const cygwin_socket_info& info) {
+	int result;
+	uint64_t spanStartNs;
+	uint16_t port = info.port;
+	char type = info.type;
+	uint32_t cookie[4];
+
+	memcpy(cookie, info.cookie, sizeof(cookie));
+
+	logDebug("Connecting to upstream ssh-agent at 127.0.0.1:%u, type: %c, cookie: %08x-%08x-%08x-%08x\n",
+	         port,
+	         type,
+	         cookie[0],
+	         cookie[1],
+	         cookie[2],
+	         cookie[3]);
+
+	SOCKET sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+	if(sock == INVALID_SOCKET) {
+		logError("Failed to open socket: %d\n", socketLastError());
+		return INVALID_SOCKET;
+	}
+
+	struct sockaddr_in address;
+
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	inet_pton(AF_INET, "127.0.0.1", &address.sin_addr);
+	address.sin_port = htons(port);
+
+	struct id_data {
+		uint32_t pid;
+		uint32_t uid;
+		uint32_t gid;
+	};
+
+	struct id_data ids;
+
+	spanStartNs = traceStartNs();
+	result = connect(sock, (const struct sockaddr*) &address, sizeof(address));
+	traceSpan(trace_phase::upstream_connect, spanStartNs);
+	if(result < 0) {
+		logError("Failed to connect socket to 127.0.0.1:%u : %d\n", port, socketLastError());
+		goto cleanup;
+	}
+
+	spanStartNs = traceStartNs();
+	result = send(sock, (const char*) cookie, sizeof(cookie), 0);
+	if(result < 0) {
+		logError("Failed to send GUID to 127.0.0.1:%u : %d\n", port, socketLastError());
+		goto cleanup;
+	}
+
+	result = recv_full(sock, (char*) cookie, sizeof(cookie), 0);
+	if(result < 0) {
+		logError("Failed to recv GUID to 127.0.0.1:%u : %d\n", port, socketLastError());
+		goto cleanup;
+	}
+	logDebug("Received from ssh-agent: port %u, type: %c, cookie: %08x-%08x-%08x-%08x\n",
+	         port,
+	         type,
+	         cookie[0],
+	         cookie[1],
+	         cookie[2],
+	         cookie[3]);
+
+	ids.pid = (uint32_t) currentProcessId();
+	ids.uid = ids.gid = 0;
+
+	result = send(sock, (const char*) &ids, sizeof(ids), 0);
+	if(result < 0) {
+		logError("Failed to send user IDs to 127.0.0.1:%u : %d\n", port, socketLastError());
+		goto cleanup;
+	}
+
+	result = recv_full(sock, (char*) &ids, sizeof(ids), 0);
+	if(result < 0) {
+		logError("Failed to recv user IDs to 127.0.0.1:%u : %d\n", port, socketLastError());
+		goto cleanup;
+	}
+
+	traceSpan(trace_phase::upstream_handshake, spanStartNs);
+	logDebug("Received from ssh-agent: pid: %u, uid: %u, gid: %u\n", ids.pid, ids.uid, ids.gid);
+
+	return sock;
+
+cleanup:
+	closesocket(sock);
+
+	return INVALID_SOCKET;
+}
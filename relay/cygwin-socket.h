@@ -0,0 +1,20 @@
+#pragma once
+
+#include "relay/socket-compat.h"
+
+#include <stdint.h>
+
+// Content of a cygwin/msys AF_UNIX emulation file: "!<socket >PORT TYPE GUID".
+// The socket is a TCP socket on 127.0.0.1:port guarded by a cookie handshake.
+struct cygwin_socket_info {
+	uint16_t port;
+	char type;
+	uint32_t cookie[4];
+};
+
+// Parse the content of a cygwin socket file. Returns false if it is not a socket file.
+bool parseCygwinSocketFile(const char* content, cygwin_socket_info* info);
+
+// Connect to the cygwin socket and run the cookie/pid/uid/gid handshake.
+// Returns the connected socket or INVALID_SOCKET.
+SOCKET connectCygwinSocket(const cygwin_socket_info& info);
@@ -0,0 +1,132 @@
+#include "relay/frame-parser.h"
+#include "relay/agent-message.h"
+#include "relay/logger.h"
+
+#include <string.h>
+
+agent_frame_parser::agent_frame_parser() noexcept
+    : maxSize(0), received(0), messageSize(0), firstSpanSize(0), spillStart(0), spillSize(0) {}
+
+void agent_frame_parser::reset() {
+	received = 0;
+	messageSize = 0;
+	spillStart = 0;
+	spillSize = 0;
+}
+
+frame_status agent_frame_parser::begin(message_buffer& buffer, int32_t maxSize) {
+	this->maxSize = maxSize;
+	received = 0;
+	messageSize = 0;
+
+	if(spillSize == 0)
+		return frame_status::incomplete;
+
+	// Only take this frame out of the spill area, the following ones stay there
+	int32_t takeSize = spillSize;
+	if(spillSize >= 4) {
+		uint32_t length = readu32(spill + spillStart);
+		if(length <= (uint32_t) maxSize - 4 && (int32_t) length + 4 < takeSize)
+			takeSize = (int32_t) length + 4;
+	}
+
+	if(!buffer.reserve(takeSize < BUFFER_POOL_SMALL_SIZE ? BUFFER_POOL_SMALL_SIZE : takeSize, 0))
+		return frame_status::invalid;
+	memcpy(buffer.data(), spill + spillStart, takeSize);
+	received = takeSize;
+	spillStart += takeSize;
+	spillSize -= takeSize;
+
+	return parse(buffer);
+}
+
+int agent_frame_parser::prepareRead(message_buffer& buffer, agent_read_span spans[2]) {
+	// The spill area is empty until the current frame is complete
+	spillStart = 0;
+
+	if(messageSize > 0) {
+		// Exact rest of the frame, anything after it goes to the spill area
+		if(!buffer.reserve(messageSize, received))
+			return 0;
+		firstSpanSize = messageSize - received;
+		spans[0].data = buffer.data() + received;
+		spans[0].size = firstSpanSize;
+		spans[1].data = spill;
+		spans[1].size = FRAME_PARSER_SPILL_SIZE;
+		return 2;
+	}
+
+	if(!buffer.reserve(BUFFER_POOL_SMALL_SIZE, received))
+		return 0;
+
+	// Unknown length: most frames fit in the small buffer and arrive in one read.
+	// Both spans together never exceed the spill area, which can then hold whatever
+	// is read past the end of the frame.
+	firstSpanSize = (int32_t) buffer.capacity() - received;
+	if(firstSpanSize > FRAME_PARSER_SPILL_SIZE)
+		firstSpanSize = FRAME_PARSER_SPILL_SIZE;
+	spans[0].data = buffer.data() + received;
+	spans[0].size = firstSpanSize;
+	if(firstSpanSize == FRAME_PARSER_SPILL_SIZE)
+		return 1;
+	spans[1].data = spill;
+	spans[1].size = FRAME_PARSER_SPILL_SIZE - firstSpanSize;
+	return 2;
+}
+
+int agent_frame_parser::prepareHeadRead(message_buffer& buffer, int32_t headSize, agent_read_span spans[2]) {
+	spillStart = 0;
+
+	if(!buffer.reserve(BUFFER_POOL_SMALL_SIZE, received))
+		return 0;
+
+	firstSpanSize = headSize - received;
+	spans[0].data = buffer.data() + received;
+	spans[0].size = firstSpanSize;
+	return 1;
+}
+
+frame_status agent_frame_parser::onRead(message_buffer& buffer, int32_t size) {
+	if(size > firstSpanSize) {
+		spillSize = size - firstSpanSize;
+		size = firstSpanSize;
+	}
+	received += size;
+
+	return parse(buffer);
+}
+
+frame_status agent_frame_parser::parse(message_buffer& buffer) {
+	if(received < 4)
+		return frame_status::incomplete;
+
+	if(messageSize == 0) {
+		uint32_t length = readu32(buffer.data());
+		if(length > (uint32_t) maxSize - 4) {
+			logWarning("Agent message too large: %u\n", length);
+			return frame_status::invalid;
+		}
+		messageSize = (int32_t) length + 4;
+	}
+
+	if(received > messageSize) {
+		// Bytes of the next frame in the buffer go in front of those already in the spill area
+		int32_t tailSize = received - messageSize;
+		memmove(spill + tailSize, spill + spillStart, spillSize);
+		memcpy(spill, buffer.data() + messageSize, tailSize);
+		spillStart = 0;
+		spillSize += tailSize;
+		received = messageSize;
+	} else if(received < messageSize && spillSize > 0) {
+		// The frame continues in the spill area
+		int32_t takeSize = messageSize - received < spillSize ? messageSize - received : spillSize;
+		if(!buffer.reserve(messageSize, received))
+			return frame_status::invalid;
+		memcpy(buffer.data() + received, spill + spillStart, takeSize);
+		spillStart += takeSize;
+		spillSize -= takeSize;
+		received += takeSize;
+	}
+
+	return received == messageSize ? frame_status::complete : frame_status::incomplete;
+}
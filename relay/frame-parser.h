@@ -0,0 +1,66 @@
+#pragma once
+
+#include "relay/agent-stream.h"
+#include "relay/buffer-pool.h"
+
+#include <stdint.h>
+
+// Bytes a parser can hold past the end of the current frame.
+#define FRAME_PARSER_SPILL_SIZE 2048
+
+enum class frame_status { incomplete, complete, invalid };
+
+// Incremental parser of agent messages (4 bytes big endian length + payload) read from a byte stream.
+// Frames split across any number of reads are assembled in the caller's message_buffer, and bytes
+// received past the end of a frame (pipelined requests) are kept in a fixed spill area for the next one.
+// The parser itself never allocates, only the message buffer is grown from the length header.
+//
+// Usage: begin() a frame, then while it is incomplete, read into the spans given by prepareRead()
+// and report the byte count to onRead(). The frame is the first frameSize() bytes of the buffer.
+class agent_frame_parser {
+public:
+	agent_frame_parser() noexcept;
+
+	// Start the next frame, moving the bytes read ahead to the beginning of buffer.
+	// Frames longer than maxSize bytes are invalid. Returns complete if the bytes read ahead hold a whole frame.
+	frame_status begin(message_buffer& buffer, int32_t maxSize);
+
+	// Get the regions the next read should fill in order: the missing part of the frame in buffer,
+	// then the spill area. Readers unable to scatter can only fill the first one.
+	// Returns the number of spans (1 or 2) or 0 if buffer could not be grown.
+	int prepareRead(message_buffer& buffer, agent_read_span spans[2]);
+
+	// Same as prepareRead() for the first headSize bytes of a frame whose length header was received,
+	// when the rest of the frame is left in the stream. Returns 1, or 0 if the buffer could not be grown.
+	int prepareHeadRead(message_buffer& buffer, int32_t headSize, agent_read_span spans[2]);
+
+	// Account for size bytes read into the spans of the last prepareRead() or prepareHeadRead().
+	frame_status onRead(message_buffer& buffer, int32_t size);
+
+	// Size of the current frame, once its length header is received (0 before).
+	int32_t frameSize() const { return messageSize; }
+
+	// Bytes of the current frame in the buffer. Bytes read ahead are only kept for complete frames,
+	// so the rest of an incomplete frame can be read from the stream by someone else.
+	int32_t receivedSize() const { return received; }
+
+	// Bytes received past the end of the current frame.
+	int32_t pendingSize() const { return spillSize; }
+
+	// True when no byte of the next frame was received yet.
+	bool isEmpty() const { return received == 0 && spillSize == 0; }
+
+	// Forget any partial frame and bytes read ahead, when the stream is replaced.
+	void reset();
+
+private:
+	frame_status parse(message_buffer& buffer);
+
+	int32_t maxSize;
+	int32_t received;     // bytes of the current frame in the message buffer
+	int32_t messageSize;  // 0 until the length header is received
+	int32_t firstSpanSize;
+	int32_t spillStart;  // bytes read ahead are spill[spillStart, spillStart + spillSize)
+	int32_t spillSize;
+	char spill[FRAME_PARSER_SPILL_SIZE];
+};
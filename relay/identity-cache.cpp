@@ -0,0 +1,133 @@
+#include "relay/identity-cache.h"
+#include "relay/agent-message.h"
+#include "relay/logger.h"
+
+#include <string.h>
+
+#include <chrono>
+
+static uint64_t monotonicMs() {
+	return (uint64_t) std::chrono::duration_cast<std::chrono::milliseconds>(
+	           std::chrono::steady_clock::now().time_since_epoch())
+	    .count();
+}
+
+identity_cache::identity_cache(uint32_t ttlMs)
+    : ttlMs(ttlMs), answerTime(0), generation(0), hits(0), misses(0), invalidations(0) {}
+
+bool identity_cache::isInvalidatingMessage(int type) {
+	switch(type) {
+		case SSH2_AGENTC_ADD_IDENTITY:
+		case SSH2_AGENTC_REMOVE_IDENTITY:
+		case SSH2_AGENTC_REMOVE_ALL_IDENTITIES:
+		case SSH_AGENTC_ADD_SMARTCARD_KEY:
+		case SSH_AGENTC_REMOVE_SMARTCARD_KEY:
+		case SSH_AGENTC_LOCK:
+		case SSH_AGENTC_UNLOCK:
+		case SSH2_AGENTC_ADD_ID_CONSTRAINED:
+		case SSH_AGENTC_ADD_SMARTCARD_KEY_CONSTRAINED:
+			return true;
+		default:
+			return false;
+	}
+}
+
+void identity_cache::invalidate() {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	answer.clear();
+	generation++;
+	invalidations++;
+}
+
+int32_t identity_cache::lookup(const void* request, int32_t requestSize, message_buffer& reply) {
+	if(agentMessageType(request, requestSize) != SSH2_AGENTC_REQUEST_IDENTITIES)
+		return 0;
+
+	std::lock_guard<std::mutex> lock(mutex);
+
+	if(answer.empty() || monotonicMs() - answerTime >= ttlMs) {
+		misses++;
+		return 0;
+	}
+
+	if(!reply.reserve(answer.size(), 0))
+		return 0;
+
+	memcpy(reply.data(), answer.data(), answer.size());
+	hits++;
+
+	return (int32_t) answer.size();
+}
+
+uint64_t identity_cache::onForward(const void* request, int32_t requestSize) {
+	// Invalidate before the change so no concurrent REQUEST_IDENTITIES can be answered
+	// from the cache while it is being applied.
+	if(isInvalidatingMessage(agentMessageType(request, requestSize)))
+		invalidate();
+
+	std::lock_guard<std::mutex> lock(mutex);
+	return generation;
+}
+
+void identity_cache::onReply(int requestType, uint64_t token, const void* reply, int32_t replySize) {
+	if(isInvalidatingMessage(requestType)) {
+		// Replies to REQUEST_IDENTITIES forwarded while the change was applied are not cached either
+		invalidate();
+		return;
+	}
+
+	if(requestType != SSH2_AGENTC_REQUEST_IDENTITIES || agentMessageType(reply, replySize) != SSH2_AGENT_IDENTITIES_ANSWER)
+		return;
+
+	std::lock_guard<std::mutex> lock(mutex);
+	if(token != generation)
+		return;
+
+	answer.assign((const char*) reply, (const char*) reply + replySize);
+	answerTime = monotonicMs();
+}
+
+identity_cache_stats identity_cache::getStats() const {
+	identity_cache_stats stats;
+
+	stats.hits = hits;
+	stats.misses = misses;
+	stats.invalidations = invalidations;
+
+	return stats;
+}
+
+void identity_cache::printStats() const {
+	logDebug("Identity cache: %llu hits, %llu misses, %llu invalidations\n",
+	         (unsigned long long) hits,
+	         (unsigned long long) misses,
+	         (unsigned long long) invalidations);
+}
+
+caching_upstream::caching_upstream(agent_upstream& upstream, identity_cache& cache) noexcept
+    : upstream(upstream), cache(cache), bound(false) {}
+
+int32_t caching_upstream::transact(const void* request,
+                                   int32_t requestSize,
+                                   message_buffer& reply,
+                                   int32_t replyMaxSize) {
+	int requestType = agentMessageType(request, requestSize);
+
+	if(isSessionBindRequest(request, requestSize))
+		bound = true;
+
+	int32_t replySize = bound ? 0 : cache.lookup(request, requestSize, reply);
+	if(replySize > 0) {
+		logDebug("Answering REQUEST_IDENTITIES from cache\n");
+		return replySize;
+	}
+
+	uint64_t token = cache.onForward(request, requestSize);
+
+	replySize = upstream.transact(request, requestSize, reply, replyMaxSize);
+	if(replySize > 0 && identity_cache::wantsReply(requestType, bound))
+		cache.onReply(requestType, token, reply.data(), replySize);
+
+	return replySize;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "relay/agent-upstream.h"
+
+#include <stdint.h>
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+struct identity_cache_stats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t invalidations;
+};
+
+// Process-wide cache of the IDENTITIES_ANSWER reply to REQUEST_IDENTITIES.
+// It is invalidated whenever a message changing the key list or the lock state is relayed,
+// and expires after ttlMs to pick up changes made by other clients of the upstream agent.
+// Once a session is bound with session-bind@openssh.com, the agent filters the identities it lists for that
+// connection (destination constrained keys), so bound sessions must neither use lookup() nor cache their
+// replies, see wantsReply().
+class identity_cache {
+public:
+	explicit identity_cache(uint32_t ttlMs);
+
+	// If request is REQUEST_IDENTITIES and a fresh answer is cached, copy it into reply.
+	// Returns the reply size or 0 if the request must be forwarded.
+	int32_t lookup(const void* request, int32_t requestSize, message_buffer& reply);
+
+	// Must be called before forwarding a request upstream.
+	// Returns a token to give to onReply once the reply is received.
+	uint64_t onForward(const void* request, int32_t requestSize);
+
+	// Must be called with the upstream reply of a forwarded request of type requestType.
+	void onReply(int requestType, uint64_t token, const void* reply, int32_t replySize);
+
+	// Whether onReply must be called for a request of requestType relayed by a session bound or not.
+	// Bound sessions only report the requests changing the keys, which invalidate the cache.
+	static bool wantsReply(int requestType, bool bound) { return !bound || isInvalidatingMessage(requestType); }
+
+	identity_cache_stats getStats() const;
+
+	void printStats() const;
+
+private:
+	static bool isInvalidatingMessage(int type);
+	void invalidate();
+
+	uint32_t ttlMs;
+
+	mutable std::mutex mutex;
+	std::vector<char> answer;
+	uint64_t answerTime;
+	// Incremented on each invalidation so a reply to a request forwarded before a
+	// key list change is not cached.
+	uint64_t generation;
+
+	std::atomic<uint64_t> hits;
+	std::atomic<uint64_t> misses;
+	std::atomic<uint64_t> invalidations;
+};
+
+// Upstream answering REQUEST_IDENTITIES from an identity_cache and forwarding everything else.
+class caching_upstream : public agent_upstream {
+public:
+	caching_upstream(agent_upstream& upstream, identity_cache& cache) noexcept;
+
+	int32_t transact(const void* request, int32_t requestSize, message_buffer& reply, int32_t replyMaxSize) override;
+
+private:
+	agent_upstream& upstream;
+	identity_cache& cache;
+	bool bound;
+};
@@ -0,0 +1,100 @@
+#include "relay/identity-prefetch.h"
+#include "relay/agent-message.h"
+#include "relay/logger.h"
+#include "relay/relay-stats.h"
+
+#include <string.h>
+
+#include <system_error>
+
+prefetching_upstream::prefetching_upstream(upstream_connector connectUpstream)
+    : connectUpstream(std::move(connectUpstream)), prefetchedSize(0), finished(false) {
+	try {
+		thread = std::thread(&prefetching_upstream::prefetch, this);
+	} catch(const std::system_error& e) {
+		// The session connects when its first request arrives, without prefetch
+		logWarning("Cannot create the identity prefetch thread: %s\n", e.what());
+	}
+}
+
+prefetching_upstream::~prefetching_upstream() {
+	if(thread.joinable())
+		thread.join();
+}
+
+void prefetching_upstream::prefetch() {
+	static const char request[] = {0, 0, 0, 1, SSH2_AGENTC_REQUEST_IDENTITIES};
+
+	upstream = connectUpstream();
+	if(!upstream)
+		return;
+
+	prefetchedSize = upstream->transact(request, sizeof(request), prefetched, AGENT_MAX_MSGLEN);
+	if(prefetchedSize <= 0) {
+		// The connection state is unknown, the session gets a new one
+		logWarning("Identity list prefetch failed: %d\n", prefetchedSize);
+		prefetchedSize = 0;
+		prefetched.shrink();
+		upstream.reset();
+	}
+}
+
+bool prefetching_upstream::finishPrefetch() {
+	if(!finished) {
+		if(thread.joinable())
+			thread.join();
+		finished = true;
+		if(!upstream)
+			upstream = connectUpstream();
+	}
+
+	return upstream != nullptr;
+}
+
+void prefetching_upstream::discardPrefetched(bool used) {
+	prefetchedSize = 0;
+	prefetched.shrink();
+	relay_stats::instance().onIdentityPrefetch(used);
+}
+
+int32_t prefetching_upstream::transact(const void* request,
+                                       int32_t requestSize,
+                                       message_buffer& reply,
+                                       int32_t replyMaxSize) {
+	if(!finishPrefetch())
+		return -1;
+
+	if(prefetchedSize > 0) {
+		int32_t replySize = prefetchedSize;
+		bool used = agentMessageType(request, requestSize) == SSH2_AGENTC_REQUEST_IDENTITIES &&
+		            replySize <= replyMaxSize && reply.reserve((size_t) replySize, 0);
+
+		if(used) {
+			logDebug("Answering REQUEST_IDENTITIES with the prefetched list\n");
+			memcpy(reply.data(), prefetched.data(), (size_t) replySize);
+		}
+		discardPrefetched(used);
+		if(used)
+			return replySize;
+	}
+
+	return upstream->transact(request, requestSize, reply, replyMaxSize);
+}
+
+agent_stream* prefetching_upstream::requestStream() {
+	return finished && upstream ? upstream->requestStream() : NULL;
+}
+
+int32_t prefetching_upstream::receiveReply(message_buffer& reply, int32_t replyMaxSize) {
+	// Only called after requestStream(), so once the prefetch is done
+	if(prefetchedSize > 0)
+		discardPrefetched(false);
+
+	return upstream->receiveReply(reply, replyMaxSize);
+}
+
+upstream_connector prefetchingConnector(upstream_connector connectUpstream) {
+	return [connectUpstream]() -> std::unique_ptr<agent_upstream> {
+		return std::make_unique<prefetching_upstream>(connectUpstream);
+	};
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "relay/agent-upstream.h"
+
+#include <stdint.h>
+
+#include <memory>
+#include <thread>
+
+// Upstream connecting and sending REQUEST_IDENTITIES on its own thread as soon as its session starts, while the
+// session reads the client's first request. Almost every OpenSSH client starts with that request, its reply is
+// then ready as soon as the request arrives: the upstream connection, handshake and round trip overlap with the
+// client's own delay before sending it.
+// If the first request is anything else, the prefetched reply is discarded. If the prefetch fails, the session
+// goes on with a new upstream connection, as without prefetch.
+class prefetching_upstream : public agent_upstream {
+public:
+	explicit prefetching_upstream(upstream_connector connectUpstream);
+	~prefetching_upstream() override;
+
+	prefetching_upstream(const prefetching_upstream&) = delete;
+	prefetching_upstream& operator=(const prefetching_upstream&) = delete;
+
+	int32_t transact(const void* request, int32_t requestSize, message_buffer& reply, int32_t replyMaxSize) override;
+
+	// None until the prefetch is done, the session must not wait for it before reading the first request.
+	// Streamed requests are large, never REQUEST_IDENTITIES, the prefetched reply is discarded with their reply.
+	agent_stream* requestStream() override;
+	int32_t receiveReply(message_buffer& reply, int32_t replyMaxSize) override;
+
+private:
+	void prefetch();
+	// Wait for the prefetch, connecting again if it failed. Returns false without upstream.
+	bool finishPrefetch();
+	void discardPrefetched(bool used);
+
+	upstream_connector connectUpstream;
+	std::unique_ptr<agent_upstream> upstream;
+	message_buffer prefetched;
+	int32_t prefetchedSize;
+	bool finished;
+	std::thread thread;
+};
+
+// Connector returning upstreams of connectUpstream that prefetch the identity list while their session starts.
+upstream_connector prefetchingConnector(upstream_connector connectUpstream);
@@ -0,0 +1,187 @@
+#include "relay/idle-reaper.h"
+#include "relay/agent-message.h"
+#include "relay/logger.h"
+#include "relay/relay-stats.h"
+
+#include <chrono>
+
+// Finest tick, so short timeouts do not wake the reaper thread too often
+#define IDLE_REAPER_MIN_TICK_MS 10
+
+idle_timer::idle_timer(idle_reaper& reaper, std::function<void()> onExpired)
+    : reaper(reaper),
+      onExpired(std::move(onExpired)),
+      prev(NULL),
+      next(NULL),
+      deadlineTick(0),
+      armed(false),
+      expired(false) {}
+
+idle_timer::~idle_timer() {
+	cancel();
+}
+
+void idle_timer::arm(uint32_t timeoutMs) {
+	reaper.arm(this, timeoutMs);
+}
+
+void idle_timer::cancel() {
+	reaper.cancel(this);
+}
+
+idle_reaper::idle_reaper(uint32_t clientTimeoutMs, uint32_t upstreamTimeoutMs)
+    : clientTimeoutMs(clientTimeoutMs), upstreamTimeoutMs(upstreamTimeoutMs), stopping(false), currentTick(0) {
+	uint32_t shortestTimeoutMs = clientTimeoutMs;
+	if(shortestTimeoutMs == 0 || (upstreamTimeoutMs > 0 && upstreamTimeoutMs < shortestTimeoutMs))
+		shortestTimeoutMs = upstreamTimeoutMs;
+
+	tickMs = shortestTimeoutMs / IDLE_REAPER_TICKS_PER_TIMEOUT;
+	if(tickMs < IDLE_REAPER_MIN_TICK_MS)
+		tickMs = IDLE_REAPER_MIN_TICK_MS;
+
+	for(idle_timer*& slot : slots) {
+		slot = NULL;
+	}
+
+	thread = std::thread(&idle_reaper::run, this);
+}
+
+idle_reaper::~idle_reaper() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	stopCondition.notify_all();
+	thread.join();
+}
+
+void idle_reaper::arm(idle_timer* timer, uint32_t timeoutMs) {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	if(timer->armed)
+		unlink(timer);
+
+	// Round up and skip the tick in progress, so the timer never fires early
+	timer->deadlineTick = currentTick + (timeoutMs + tickMs - 1) / tickMs + 1;
+	timer->armed = true;
+	timer->expired = false;
+
+	idle_timer*& head = slots[timer->deadlineTick % IDLE_REAPER_SLOTS];
+	timer->prev = NULL;
+	timer->next = head;
+	if(head != NULL)
+		head->prev = timer;
+	head = timer;
+}
+
+void idle_reaper::cancel(idle_timer* timer) {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	if(timer->armed)
+		unlink(timer);
+}
+
+void idle_reaper::unlink(idle_timer* timer) {
+	if(timer->prev != NULL)
+		timer->prev->next = timer->next;
+	else
+		slots[timer->deadlineTick % IDLE_REAPER_SLOTS] = timer->next;
+	if(timer->next != NULL)
+		timer->next->prev = timer->prev;
+
+	timer->prev = NULL;
+	timer->next = NULL;
+	timer->armed = false;
+}
+
+void idle_reaper::run() {
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	std::unique_lock<std::mutex> lock(mutex);
+
+	while(!stopping) {
+		std::chrono::steady_clock::time_point nextTick = start + std::chrono::milliseconds(tickMs * (currentTick + 1));
+		if(stopCondition.wait_until(lock, nextTick, [this]() { return stopping; }))
+			break;
+
+		// Catch up with ticks missed while the thread was not scheduled
+		std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - start;
+		uint64_t elapsedMs = (uint64_t) std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count();
+		while(currentTick < elapsedMs / tickMs) {
+			currentTick++;
+			expire(currentTick);
+		}
+
+		if(!closing.empty()) {
+			std::vector<std::unique_ptr<agent_upstream>> upstreams;
+			upstreams.swap(closing);
+			lock.unlock();
+			upstreams.clear();
+			lock.lock();
+		}
+	}
+}
+
+// Called from onExpired, with the wheel locked
+void idle_reaper::closeLater(std::unique_ptr<agent_upstream> upstream) {
+	closing.push_back(std::move(upstream));
+}
+
+void idle_reaper::expire(uint64_t tick) {
+	idle_timer* timer = slots[tick % IDLE_REAPER_SLOTS];
+
+	while(timer != NULL) {
+		idle_timer* next = timer->next;
+
+		// Timers due in a later round of the wheel stay in the slot
+		if(timer->deadlineTick <= tick) {
+			unlink(timer);
+			timer->expired = true;
+			timer->onExpired();
+		}
+		timer = next;
+	}
+}
+
+parking_upstream::parking_upstream(std::unique_ptr<agent_upstream> upstream,
+                                   upstream_connector connectUpstream,
+                                   idle_reaper& reaper)
+    : upstream(std::move(upstream)),
+      connectUpstream(std::move(connectUpstream)),
+      reaper(reaper),
+      timeoutMs(reaper.getUpstreamTimeoutMs()),
+      bound(false),
+      timer(reaper, [this]() { park(); }) {}
+
+int32_t parking_upstream::transact(const void* request,
+                                   int32_t requestSize,
+                                   message_buffer& reply,
+                                   int32_t replyMaxSize) {
+	// The upstream cannot be parked while in use
+	timer.cancel();
+
+	if(!upstream) {
+		upstream = connectUpstream();
+		if(!upstream) {
+			logError("Error: cannot reconnect to upstream ssh-agent\n");
+			return -1;
+		}
+		logDebug("Upstream connection reopened\n");
+		relay_stats::instance().onUpstreamReattached();
+	}
+
+	if(isSessionBindRequest(request, requestSize))
+		bound = true;
+
+	int32_t replySize = upstream->transact(request, requestSize, reply, replyMaxSize);
+	if(replySize > 0 && !bound)
+		timer.arm(timeoutMs);
+
+	return replySize;
+}
+
+// The session only uses the upstream after cancelling the timer, so it is moved out without a lock of its own
+void parking_upstream::park() {
+	logDebug("Closing idle upstream connection\n");
+	reaper.closeLater(std::move(upstream));
+	relay_stats::instance().onUpstreamParked();
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include "relay/agent-upstream.h"
+
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Slots of the timer wheel, a timer due more than that many ticks ahead waits for the wheel to come around
+#define IDLE_REAPER_SLOTS 256
+// Timers fire at most timeout / IDLE_REAPER_TICKS_PER_TIMEOUT late
+#define IDLE_REAPER_TICKS_PER_TIMEOUT 8
+
+class idle_reaper;
+
+// Deadline of a connection in an idle_reaper, armed each time the connection starts waiting.
+// onExpired runs on the reaper thread with the wheel locked, it must be short and must not use the reaper,
+// except to hand it an upstream to close with idle_reaper::closeLater().
+// Once cancel() returns, onExpired is not running and will not run until the timer is armed again.
+class idle_timer {
+public:
+	idle_timer(idle_reaper& reaper, std::function<void()> onExpired);
+	~idle_timer();
+
+	idle_timer(const idle_timer&) = delete;
+	idle_timer& operator=(const idle_timer&) = delete;
+
+	// Start or restart the timer.
+	void arm(uint32_t timeoutMs);
+	void cancel();
+
+	// True once onExpired was called, until the timer is armed again.
+	bool hasExpired() const { return expired; }
+
+private:
+	friend class idle_reaper;
+
+	idle_reaper& reaper;
+	std::function<void()> onExpired;
+	idle_timer* prev;
+	idle_timer* next;
+	uint64_t deadlineTick;
+	bool armed;
+	std::atomic<bool> expired;
+};
+
+// Closes connections of blocking sessions that stayed idle too long: clients silent for clientTimeoutMs are
+// disconnected, and upstream connections unused for upstreamTimeoutMs are closed until the client speaks again
+// (0 disables either timeout). All timers are kept in a single hashed timer wheel driven by one thread,
+// arming or cancelling a timer costs a lock and a list insertion or removal whatever the number of sessions.
+class idle_reaper {
+public:
+	idle_reaper(uint32_t clientTimeoutMs, uint32_t upstreamTimeoutMs);
+	~idle_reaper();
+
+	idle_reaper(const idle_reaper&) = delete;
+	idle_reaper& operator=(const idle_reaper&) = delete;
+
+	uint32_t getClientTimeoutMs() const { return clientTimeoutMs; }
+	uint32_t getUpstreamTimeoutMs() const { return upstreamTimeoutMs; }
+
+	// Only from onExpired: destroy upstream on the reaper thread once the wheel is unlocked, as closing
+	// a connection may take a while and would stall every arm() and cancel() meanwhile.
+	void closeLater(std::unique_ptr<agent_upstream> upstream);
+
+private:
+	friend class idle_timer;
+
+	void arm(idle_timer* timer, uint32_t timeoutMs);
+	void cancel(idle_timer* timer);
+	void unlink(idle_timer* timer);
+	void run();
+	void expire(uint64_t tick);
+
+	uint32_t clientTimeoutMs;
+	uint32_t upstreamTimeoutMs;
+	uint32_t tickMs;
+
+	std::mutex mutex;
+	std::condition_variable stopCondition;
+	bool stopping;
+	uint64_t currentTick;
+	idle_timer* slots[IDLE_REAPER_SLOTS];
+	std::vector<std::unique_ptr<agent_upstream>> closing;
+	std::thread thread;
+};
+
+// Upstream closed by the reaper after upstreamTimeoutMs without request, and opened again with connectUpstream
+// when the next request comes. Sessions bound with session-bind@openssh.com keep their upstream connection,
+// as the agent ties the binding, and so destination constrained keys, to that connection.
+class parking_upstream : public agent_upstream {
+public:
+	parking_upstream(std::unique_ptr<agent_upstream> upstream, upstream_connector connectUpstream, idle_reaper& reaper);
+
+	int32_t transact(const void* request, int32_t requestSize, message_buffer& reply, int32_t replyMaxSize) override;
+
+private:
+	void park();
+
+	std::unique_ptr<agent_upstream> upstream;
+	upstream_connector connectUpstream;
+	idle_reaper& reaper;
+	uint32_t timeoutMs;
+	bool bound;
+	// Destroyed first, so the reaper does not park an upstream being destroyed
+	idle_timer timer;
+};
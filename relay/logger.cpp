@@ -0,0 +1,261 @@
+#include "relay/logger.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+// Power of two number of records in the ring
+#define LOG_RING_SIZE 4096
+// Text of a message, longer messages are truncated
+#define LOG_RECORD_SIZE 256
+// Payload bytes per record, larger payloads are split in several records
+#define LOG_PAYLOAD_CHUNK_SIZE 192
+
+std::atomic<int> currentLogLevel((int) log_level::info);
+
+namespace {
+
+struct log_record {
+	std::atomic<uint64_t> sequence;
+	const char* description;  // NULL for text messages
+	uint32_t payloadOffset;
+	uint32_t payloadSize;
+	uint32_t size;
+	char data[LOG_RECORD_SIZE];
+};
+
+// Bounded multi-producer ring (one sequence number per record) with a single consumer thread.
+class async_logger {
+public:
+	async_logger() : records(new log_record[LOG_RING_SIZE]), enqueuePos(0), dequeuePos(0), dropped(0), sleeping(false) {
+		for(uint64_t i = 0; i < LOG_RING_SIZE; i++) {
+			records[i].sequence.store(i, std::memory_order_relaxed);
+		}
+		std::thread(&async_logger::writeLoop, this).detach();
+	}
+
+	// Reserve a record, NULL if the ring is full
+	log_record* beginRecord() {
+		uint64_t pos = enqueuePos.load(std::memory_order_relaxed);
+
+		for(;;) {
+			log_record* record = &records[pos & (LOG_RING_SIZE - 1)];
+			int64_t diff = (int64_t) record->sequence.load(std::memory_order_acquire) - (int64_t) pos;
+
+			if(diff == 0) {
+				if(enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					return record;
+			} else if(diff < 0) {
+				dropped.fetch_add(1, std::memory_order_relaxed);
+				return NULL;
+			} else {
+				pos = enqueuePos.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	void commitRecord(log_record* record) {
+		uint64_t pos = record->sequence.load(std::memory_order_relaxed);
+		record->sequence.store(pos + 1, std::memory_order_release);
+
+		// Only wake the writer when it waits, so a busy proxy does not pay a syscall per message
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if(sleeping.load(std::memory_order_relaxed)) {
+			std::lock_guard<std::mutex> lock(mutex);
+			wakeup.notify_one();
+		}
+	}
+
+	void flush() {
+		uint64_t target = enqueuePos.load(std::memory_order_acquire);
+		std::unique_lock<std::mutex> lock(mutex);
+
+		wakeup.notify_one();
+		flushed.wait_for(lock, std::chrono::seconds(1), [this, target]() {
+			return dequeuePos.load(std::memory_order_acquire) >= target;
+		});
+	}
+
+	uint64_t getDropped() const { return dropped; }
+
+private:
+	void writeRecord(log_record* record) {
+		if(record->description == NULL) {
+			fwrite(record->data, 1, record->size, stdout);
+			return;
+		}
+
+		static const char hexDigits[] = "0123456789abcdef";
+		char line[LOG_PAYLOAD_CHUNK_SIZE * 3 + 1];
+		for(uint32_t i = 0; i < record->size; i++) {
+			uint8_t byte = (uint8_t) record->data[i];
+			line[i * 3] = hexDigits[byte >> 4];
+			line[i * 3 + 1] = hexDigits[byte & 0xf];
+			line[i * 3 + 2] = ' ';
+		}
+		line[record->size * 3] = 0;
+
+		if(record->payloadOffset == 0 && record->size == record->payloadSize)
+			printf("%s (%u bytes): %s\n", record->description, record->payloadSize, line);
+		else
+			printf("%s (%u-%u/%u bytes): %s\n",
+			       record->description,
+			       record->payloadOffset,
+			       record->payloadOffset + record->size,
+			       record->payloadSize,
+			       line);
+	}
+
+	void writeLoop() {
+		uint64_t reportedDrops = 0;
+
+		for(;;) {
+			uint64_t pos = dequeuePos.load(std::memory_order_relaxed);
+			log_record* record = &records[pos & (LOG_RING_SIZE - 1)];
+
+			if(record->sequence.load(std::memory_order_acquire) == pos + 1) {
+				writeRecord(record);
+				record->sequence.store(pos + LOG_RING_SIZE, std::memory_order_release);
+				dequeuePos.store(pos + 1, std::memory_order_release);
+				continue;
+			}
+
+			// The ring is empty
+			uint64_t drops = dropped.load(std::memory_order_relaxed);
+			if(drops != reportedDrops) {
+				printf("%llu log messages dropped\n", (unsigned long long) (drops - reportedDrops));
+				reportedDrops = drops;
+			}
+			fflush(stdout);
+
+			std::unique_lock<std::mutex> lock(mutex);
+			flushed.notify_all();
+
+			sleeping.store(true, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if(record->sequence.load(std::memory_order_acquire) != pos + 1)
+				wakeup.wait_for(lock, std::chrono::milliseconds(100));
+			sleeping.store(false, std::memory_order_relaxed);
+		}
+	}
+
+	log_record* records;
+	std::atomic<uint64_t> enqueuePos;
+	std::atomic<uint64_t> dequeuePos;
+	std::atomic<uint64_t> dropped;
+	std::atomic<bool> sleeping;
+
+	std::mutex mutex;
+	std::condition_variable wakeup;
+	std::condition_variable flushed;
+};
+
+}  // namespace
+
+// Never destroyed: detached session threads may still log while the process exits
+static async_logger& getLogger() {
+	static async_logger* logger = []() {
+		async_logger* newLogger = new async_logger();
+		atexit(flushLog);
+		return newLogger;
+	}();
+
+	return *logger;
+}
+
+static void logFormatted(const char* format, va_list args) {
+	async_logger& logger = getLogger();
+	log_record* record = logger.beginRecord();
+	if(record == NULL)
+		return;
+
+	int size = vsnprintf(record->data, LOG_RECORD_SIZE, format, args);
+	if(size < 0)
+		size = 0;
+	else if(size >= LOG_RECORD_SIZE)
+		size = LOG_RECORD_SIZE - 1;
+
+	record->description = NULL;
+	record->size = (uint32_t) size;
+	logger.commitRecord(record);
+}
+
+#define DEFINE_LOG_FUNCTION(name, level)         \
+	void name(const char* format, ...) {         \
+		if(!isLogEnabled(level))                 \
+			return;                              \
+		va_list args;                            \
+		va_start(args, format);                  \
+		logFormatted(format, args);              \
+		va_end(args);                            \
+	}
+
+DEFINE_LOG_FUNCTION(logError, log_level::error)
+DEFINE_LOG_FUNCTION(logWarning, log_level::warning)
+DEFINE_LOG_FUNCTION(logInfo, log_level::info)
+DEFINE_LOG_FUNCTION(logDebug, log_level::debug)
+
+void logPayload(const char* description, const void* data, int32_t size) {
+	if(!isLogEnabled(log_level::payload) || size <= 0)
+		return;
+
+	async_logger& logger = getLogger();
+	for(int32_t offset = 0; offset < size; offset += LOG_PAYLOAD_CHUNK_SIZE) {
+		log_record* record = logger.beginRecord();
+		if(record == NULL)
+			return;
+
+		uint32_t chunkSize = size - offset < LOG_PAYLOAD_CHUNK_SIZE ? size - offset : LOG_PAYLOAD_CHUNK_SIZE;
+		memcpy(record->data, (const char*) data + offset, chunkSize);
+		record->description = description;
+		record->payloadOffset = (uint32_t) offset;
+		record->payloadSize = (uint32_t) size;
+		record->size = chunkSize;
+		logger.commitRecord(record);
+	}
+}
+
+void setLogLevel(log_level level) {
+	currentLogLevel = (int) level;
+}
+
+template<typename T> static bool parseLogLevelName(const T* name, log_level& level) {
+	static const char* const names[] = {"error", "warning", "info", "debug", "payload"};
+
+	for(size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		size_t j = 0;
+		while(names[i][j] != 0 && (T) names[i][j] == name[j]) {
+			j++;
+		}
+		if(names[i][j] == 0 && name[j] == 0) {
+			level = (log_level) i;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool parseLogLevel(const char* name, log_level& level) {
+	return parseLogLevelName(name, level);
+}
+
+#ifdef _WIN32
+bool parseLogLevel(const wchar_t* name, log_level& level) {
+	return parseLogLevelName(name, level);
+}
+#endif
+
+void flushLog() {
+	getLogger().flush();
+}
+
+uint64_t getDroppedLogCount() {
+	return getLogger().getDropped();
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+
+#ifdef __GNUC__
+#define LOG_PRINTF_FORMAT(formatIndex, firstArg) __attribute__((format(printf, formatIndex, firstArg)))
+#else
+#define LOG_PRINTF_FORMAT(formatIndex, firstArg)
+#endif
+
+// Levels in increasing verbosity. Hex dumps of every message are only logged at the payload level.
+enum class log_level { error, warning, info, debug, payload };
+
+// Messages are formatted into a bounded lock-free ring and written to stdout by a background thread,
+// so sessions never wait for the console. When the ring is full, messages are dropped and counted.
+extern std::atomic<int> currentLogLevel;
+
+inline bool isLogEnabled(log_level level) {
+	return (int) level <= currentLogLevel.load(std::memory_order_relaxed);
+}
+
+void setLogLevel(log_level level);
+
+// Parse a level name (error, warning, info, debug, payload). Returns false if it is unknown.
+bool parseLogLevel(const char* name, log_level& level);
+#ifdef _WIN32
+bool parseLogLevel(const wchar_t* name, log_level& level);
+#endif
+
+void logError(const char* format, ...) LOG_PRINTF_FORMAT(1, 2);
+void logWarning(const char* format, ...) LOG_PRINTF_FORMAT(1, 2);
+void logInfo(const char* format, ...) LOG_PRINTF_FORMAT(1, 2);
+void logDebug(const char* format, ...) LOG_PRINTF_FORMAT(1, 2);
+
+// Hex dump of a message at the payload level. Only the bytes are copied, they are formatted by
+// the background thread. description must be a string literal.
+void logPayload(const char* description, const void* data, int32_t size);
+
+// Wait until the messages logged so far are written. Also done at exit.
+void flushLog();
+
+uint64_t getDroppedLogCount();
@@ -0,0 +1,134 @@
+#include "relay/pageant-dispatcher.h"
+#include "relay/logger.h"
+#include "relay/request-trace.h"
+
+#include <algorithm>
+
+pageant_dispatcher::pageant_dispatcher(std::function<std::unique_ptr<pageant_transport>()> makeTransport,
+                                       size_t queueCapacity)
+    : makeTransport(std::move(makeTransport)),
+      queue(queueCapacity > 0 ? queueCapacity : 1, NULL),
+      head(0),
+      count(0),
+      stopping(false),
+      requests(0),
+      fullWaits(0),
+      maxQueued(0) {
+	thread = std::thread(&pageant_dispatcher::run, this);
+}
+
+pageant_dispatcher::~pageant_dispatcher() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	notEmpty.notify_all();
+	notFull.notify_all();
+	thread.join();
+}
+
+int32_t pageant_dispatcher::transact(const void* request,
+                                     int32_t requestSize,
+                                     message_buffer& reply,
+                                     int32_t replyMaxSize) {
+	pending_request pending;
+
+	pending.request = request;
+	pending.requestSize = requestSize;
+	pending.reply = &reply;
+	pending.replyMaxSize = replyMaxSize;
+	pending.replySize = -1;
+	pending.completed = false;
+	pending.startNs = 0;
+	pending.endNs = 0;
+
+	std::unique_lock<std::mutex> lock(mutex);
+
+	if(count == queue.size()) {
+		fullWaits++;
+		notFull.wait(lock, [this]() { return stopping || count < queue.size(); });
+	}
+	if(stopping)
+		return -1;
+
+	queue[(head + count) % queue.size()] = &pending;
+	count++;
+	if(count > maxQueued)
+		maxQueued = count;
+	notEmpty.notify_one();
+
+	pending.completion.wait(lock, [&pending]() { return pending.completed; });
+	lock.unlock();
+
+	if(pending.startNs != 0)
+		traceSpan(trace_phase::upstream_wait, pending.startNs, pending.endNs, std::max(pending.replySize, 0));
+
+	return pending.replySize;
+}
+
+void pageant_dispatcher::run() {
+	std::unique_ptr<pageant_transport> transport = makeTransport();
+	std::unique_ptr<pageant_upstream> upstream;
+	if(transport)
+		upstream = std::make_unique<pageant_upstream>(*transport);
+	else
+		logError("Cannot create the pageant transport\n");
+
+	std::unique_lock<std::mutex> lock(mutex);
+
+	// Requests still queued when stopping are answered before the thread ends
+	for(;;) {
+		notEmpty.wait(lock, [this]() { return stopping || count > 0; });
+		if(count == 0)
+			return;
+
+		pending_request* pending = queue[head];
+		head = (head + 1) % queue.size();
+		count--;
+		notFull.notify_one();
+
+		// The session waits for its completion, its request and reply buffer stay valid until then
+		lock.unlock();
+		uint64_t startNs = traceStartNs();
+		int32_t replySize = -1;
+		if(upstream)
+			replySize =
+			    upstream->transact(pending->request, pending->requestSize, *pending->reply, pending->replyMaxSize);
+		requests++;
+		uint64_t endNs = startNs != 0 ? monotonicNs() : 0;
+		lock.lock();
+
+		pending->replySize = replySize;
+		pending->startNs = startNs;
+		pending->endNs = endNs;
+		pending->completed = true;
+		pending->completion.notify_one();
+	}
+}
+
+pageant_dispatcher_stats pageant_dispatcher::getStats() const {
+	pageant_dispatcher_stats stats;
+
+	stats.requests = requests;
+	stats.fullWaits = fullWaits;
+	stats.maxQueued = maxQueued;
+
+	return stats;
+}
+
+void pageant_dispatcher::printStats() const {
+	logDebug("Pageant dispatcher: %llu requests, %llu max queued, %llu waited for a full queue\n",
+	         (unsigned long long) requests,
+	         (unsigned long long) maxQueued,
+	         (unsigned long long) fullWaits);
+}
+
+dispatched_pageant_upstream::dispatched_pageant_upstream(pageant_dispatcher& dispatcher) noexcept
+    : dispatcher(dispatcher) {}
+
+int32_t dispatched_pageant_upstream::transact(const void* request,
+                                              int32_t requestSize,
+                                              message_buffer& reply,
+                                              int32_t replyMaxSize) {
+	return dispatcher.transact(request, requestSize, reply, replyMaxSize);
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include "relay/pageant-upstream.h"
+
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define PAGEANT_DISPATCHER_DEFAULT_QUEUE 64
+
+struct pageant_dispatcher_stats {
+	uint64_t requests;   // requests sent to the agent
+	uint64_t fullWaits;  // requests which waited for room in the queue
+	uint64_t maxQueued;  // highest number of requests waiting in the queue
+};
+
+// Single thread sending the requests of every session to a Pageant-like agent, which handles them one at a time
+// anyway. The thread owns the only transport, so one shared memory area is used for the whole process instead of
+// one per session thread. Sessions put their requests in a bounded queue, waiting when it is full, and are woken
+// once their reply has been copied to their buffer. Their trace shows the time pageant spent on their request
+// as upstream_wait, the rest of their upstream span is the wait in the queue.
+// makeTransport is called on the dispatcher thread, as Pageant's file mapping names contain the thread id.
+class pageant_dispatcher {
+public:
+	pageant_dispatcher(std::function<std::unique_ptr<pageant_transport>()> makeTransport, size_t queueCapacity);
+	~pageant_dispatcher();
+
+	pageant_dispatcher(const pageant_dispatcher&) = delete;
+	pageant_dispatcher& operator=(const pageant_dispatcher&) = delete;
+
+	// Same contract as agent_upstream::transact, callable from any thread.
+	int32_t transact(const void* request, int32_t requestSize, message_buffer& reply, int32_t replyMaxSize);
+
+	pageant_dispatcher_stats getStats() const;
+
+	void printStats() const;
+
+private:
+	struct pending_request {
+		const void* request;
+		int32_t requestSize;
+		message_buffer* reply;
+		int32_t replyMaxSize;
+		int32_t replySize;
+		bool completed;
+		// Time the dispatcher spent on the request, for the session's trace
+		uint64_t startNs;
+		uint64_t endNs;
+		std::condition_variable completion;
+	};
+
+	void run();
+
+	std::function<std::unique_ptr<pageant_transport>()> makeTransport;
+
+	std::mutex mutex;
+	std::condition_variable notEmpty;
+	std::condition_variable notFull;
+	// Ring of queueCapacity requests, count of them starting at head
+	std::vector<pending_request*> queue;
+	size_t head;
+	size_t count;
+	bool stopping;
+
+	std::atomic<uint64_t> requests;
+	std::atomic<uint64_t> fullWaits;
+	std::atomic<uint64_t> maxQueued;
+
+	std::thread thread;
+};
+
+// Per-session view of a pageant_dispatcher.
+class dispatched_pageant_upstream : public agent_upstream {
+public:
+	explicit dispatched_pageant_upstream(pageant_dispatcher& dispatcher) noexcept;
+
+	int32_t transact(const void* request, int32_t requestSize, message_buffer& reply, int32_t replyMaxSize) override;
+
+private:
+	pageant_dispatcher& dispatcher;
+};
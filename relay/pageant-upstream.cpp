@@ -0,0 +1,54 @@
+#include "relay/pageant-upstream.h"
+#include "relay/agent-message.h"
+#include "relay/logger.h"
+#include "relay/relay-stats.h"
+
+#include <string.h>
+
+pageant_upstream::pageant_upstream(pageant_transport& transport) noexcept : transport(transport) {}
+
+int32_t pageant_upstream::transact(const void* request,
+                                   int32_t requestSize,
+                                   message_buffer& reply,
+                                   int32_t replyMaxSize) {
+	if(requestSize > PAGEANT_MAX_MSGLEN) {
+		logError("Request too large for pageant: %d\n", requestSize);
+		return -1;
+	}
+
+	uint8_t* sharedMemory = transport.getSharedMemory();
+	if(sharedMemory == NULL)
+		return -1;
+
+	memcpy(sharedMemory, request, requestSize);
+
+	if(!transport.sendRequest()) {
+		// Pageant may have been restarted, the cached window is only looked up again in that case
+		if(!transport.findAgent() || !transport.sendRequest()) {
+			transport.releaseSharedMemory();
+			return -1;
+		}
+	}
+
+	uint32_t replyLen = readu32(sharedMemory) + 4;
+
+	if(replyLen > PAGEANT_MAX_MSGLEN || replyLen > (uint32_t) replyMaxSize) {
+		logError("Invalid reply size: %u (0x%x)\n", replyLen, replyLen);
+		replyLen = replyMaxSize < PAGEANT_MAX_MSGLEN ? (uint32_t) replyMaxSize : PAGEANT_MAX_MSGLEN;
+	}
+
+	// Only the memory budget refuses a reply buffer, the dispatcher cannot wait for room
+	if(!reply.reserve(replyLen, 0)) {
+		transport.releaseSharedMemory();
+		logWarning("Reply of %u bytes over the memory budget, answering a failure\n", replyLen);
+		relay_stats::instance().onMessageOverBudget(true, false);
+		return writeStatusReply(reply, SSH_AGENT_FAILURE);
+	}
+	memcpy(reply.data(), sharedMemory, replyLen);
+
+	logPayload("Read from pageant", reply.data(), (int32_t) replyLen);
+
+	transport.releaseSharedMemory();
+
+	return (int32_t) replyLen;
+}
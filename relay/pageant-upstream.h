@@ -0,0 +1,38 @@
+#pragma once
+
+#include "relay/agent-upstream.h"
+
+#include <stdint.h>
+
+#define PAGEANT_MAX_MSGLEN 262144
+
+// Shared memory channel to a Pageant-like agent: the request is written to a shared memory
+// area of PAGEANT_MAX_MSGLEN bytes, the agent is notified and writes its reply in place.
+// A transport is used by one session thread at a time and keeps its resources between requests.
+class pageant_transport {
+public:
+	virtual ~pageant_transport() = default;
+
+	// Shared memory holding the request then the reply. Returns NULL on failure.
+	virtual uint8_t* getSharedMemory() = 0;
+
+	// Called once the reply has been read from the shared memory.
+	virtual void releaseSharedMemory() {}
+
+	// Look for the agent again when the cached one did not answer. Returns false if it cannot be found.
+	virtual bool findAgent() = 0;
+
+	// Ask the agent to answer the request in shared memory. Returns false if it did not answer.
+	virtual bool sendRequest() = 0;
+};
+
+// Upstream agent reached through Pageant's shared memory protocol.
+class pageant_upstream : public agent_upstream {
+public:
+	explicit pageant_upstream(pageant_transport& transport) noexcept;
+
+	int32_t transact(const void* request, int32_t requestSize, message_buffer& reply, int32_t replyMaxSize) override;
+
+private:
+	pageant_transport& transport;
+};
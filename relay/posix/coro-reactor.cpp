@@ -0,0 +1,278 @@
+#include "relay/posix/coro-reactor.h"
+#include "relay/coro-session.h"
+#include "relay/logger.h"
+#include "relay/relay-stats.h"
+
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include <thread>
+#include <vector>
+
+// Non-blocking socket of a session. The I/O its session awaits is completed by the thread receiving its event.
+class coro_reactor::endpoint : public coro_stream {
+public:
+	endpoint(int epollFd, SOCKET sock) : epollFd(epollFd), sock(sock), registered(false), pending(NULL) {}
+	~endpoint() { closesocket(sock); }
+
+	bool tryIo(coro_io& io) override {
+		// Readiness is only known from epoll
+		return io.size > 0 && transfer(io);
+	}
+
+	bool submitIo(coro_io& io) override {
+		pending = &io;
+		int error = arm(io.isWrite ? EPOLLOUT : EPOLLIN);
+		if(error != 0) {
+			pending = NULL;
+			io.result = -error;
+			return false;
+		}
+
+		// The session may already be running on another thread
+		return true;
+	}
+
+	void onReady() {
+		coro_io* io = pending;
+
+		if(io->size == 0) {
+			io->result = 1;
+		} else if(!transfer(*io)) {
+			int error = arm(io->isWrite ? EPOLLOUT : EPOLLIN);
+			if(error == 0)
+				return;
+			io->result = -error;
+		}
+
+		pending = NULL;
+		io->waiter.resume();
+	}
+
+private:
+	// Returns false if io would block
+	bool transfer(coro_io& io) {
+		for(;;) {
+			ssize_t result;
+			if(io.isWrite)
+				result = send(sock, io.buffer, io.size, MSG_NOSIGNAL);
+			else
+				result = recv(sock, io.buffer, io.size, 0);
+
+			if(result >= 0) {
+				io.result = (int32_t) result;
+				return true;
+			} else if(errno == EAGAIN || errno == EWOULDBLOCK) {
+				return false;
+			} else if(errno != EINTR) {
+				io.result = -socketLastError();
+				return true;
+			}
+		}
+	}
+
+	// Returns 0 or the error code. Once armed, the endpoint belongs to the thread receiving its event.
+	int arm(uint32_t events) {
+		struct epoll_event event;
+		int operation = registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+
+		event.events = events | EPOLLONESHOT;
+		event.data.ptr = this;
+		registered = true;
+
+		if(epoll_ctl(epollFd, operation, sock, &event) < 0) {
+			int error = socketLastError();
+			logError("Failed to arm socket %d in epoll: %d\n", sock, error);
+			return error;
+		}
+
+		return 0;
+	}
+
+	int epollFd;
+	SOCKET sock;
+	bool registered;
+	coro_io* pending;  // I/O awaited by the session while the socket is armed
+};
+
+struct coro_reactor::connection {
+	connection(int epollFd,
+	           SOCKET clientSock,
+	           SOCKET upstreamSock,
+	           int32_t maxMessageSize,
+	           identity_cache* identityCache)
+	    : client(epollFd, clientSock),
+	      upstream(epollFd, upstreamSock),
+	      session(client, upstream, maxMessageSize, identityCache) {}
+
+	endpoint client;
+	endpoint upstream;
+	coro_session session;
+	coro_detached root;
+};
+
+thread_local std::vector<coro_reactor::connection*> coro_reactor::closedConnections;
+
+coro_reactor::coro_reactor(SOCKET listenSock,
+                           socket_connector connectUpstream,
+                           int32_t maxMessageSize,
+                           identity_cache* identityCache)
+    : listenSock(listenSock),
+      connectUpstream(std::move(connectUpstream)),
+      maxMessageSize(maxMessageSize),
+      identityCache(identityCache),
+      epollFd(-1),
+      stopFd(-1),
+      activeSessions(0) {}
+
+coro_reactor::~coro_reactor() {
+	// Sessions still waiting for I/O are freed along with the tasks they await
+	for(connection* conn : connections) {
+		conn->root.destroy();
+		delete conn;
+	}
+
+	if(stopFd >= 0)
+		close(stopFd);
+	if(epollFd >= 0)
+		close(epollFd);
+}
+
+bool coro_reactor::run(int threadCount) {
+	struct epoll_event event;
+
+	epollFd = epoll_create1(EPOLL_CLOEXEC);
+	stopFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if(epollFd < 0 || stopFd < 0) {
+		logError("Failed to create epoll instance: %d\n", socketLastError());
+		return false;
+	}
+
+	fcntl(listenSock, F_SETFL, fcntl(listenSock, F_GETFL) | O_NONBLOCK);
+
+	// The stop event is level triggered so every thread sees it
+	event.events = EPOLLIN;
+	event.data.ptr = &stopFd;
+	epoll_ctl(epollFd, EPOLL_CTL_ADD, stopFd, &event);
+
+	event.events = EPOLLIN | EPOLLONESHOT;
+	event.data.ptr = &listenSock;
+	if(epoll_ctl(epollFd, EPOLL_CTL_ADD, listenSock, &event) < 0) {
+		logError("Failed to add listening socket to epoll: %d\n", socketLastError());
+		return false;
+	}
+
+	std::vector<std::thread> threads;
+	for(int i = 1; i < threadCount; i++) {
+		threads.emplace_back(&coro_reactor::loop, this);
+	}
+
+	loop();
+
+	for(std::thread& thread : threads) {
+		thread.join();
+	}
+
+	return true;
+}
+
+void coro_reactor::stop() {
+	uint64_t value = 1;
+	if(write(stopFd, &value, sizeof(value)) < 0) {
+		logError("Failed to stop event loop: %d\n", socketLastError());
+	}
+}
+
+void coro_reactor::loop() {
+	struct epoll_event events[64];
+
+	for(;;) {
+		int eventCount = epoll_wait(epollFd, events, sizeof(events) / sizeof(events[0]), -1);
+		if(eventCount < 0) {
+			if(errno == EINTR)
+				continue;
+			logError("epoll_wait failed: %d\n", socketLastError());
+			return;
+		}
+
+		bool stopping = false;
+		for(int i = 0; i < eventCount && !stopping; i++) {
+			void* data = events[i].data.ptr;
+
+			if(data == &stopFd)
+				stopping = true;
+			else if(data == &listenSock)
+				acceptClients();
+			else
+				((endpoint*) data)->onReady();
+		}
+
+		for(connection* conn : closedConnections) {
+			delete conn;
+		}
+		closedConnections.clear();
+
+		if(stopping)
+			return;
+	}
+}
+
+void coro_reactor::acceptClients() {
+	for(;;) {
+		SOCKET clientSock = accept4(listenSock, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+		if(clientSock == INVALID_SOCKET) {
+			if(errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED)
+				logError("accept failed: %d\n", socketLastError());
+			if(errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break;
+		}
+
+		// Upstream connections are local and complete immediately, so they are made synchronously
+		SOCKET upstreamSock = connectUpstream();
+		if(upstreamSock == INVALID_SOCKET) {
+			logError("Error: cannot connect to upstream ssh-agent\n");
+			closesocket(clientSock);
+			continue;
+		}
+		fcntl(upstreamSock, F_SETFL, fcntl(upstreamSock, F_GETFL) | O_NONBLOCK);
+
+		connection* conn = new connection(epollFd, clientSock, upstreamSock, maxMessageSize, identityCache);
+
+		{
+			std::lock_guard<std::mutex> lock(connectionsMutex);
+			connections.insert(conn);
+		}
+		activeSessions++;
+		relay_stats::instance().onSessionOpened();
+
+		// The session runs until it first waits for the client, then conn is only used by the thread resuming it
+		conn->root = serve(this, conn);
+		conn->root.start();
+	}
+
+	struct epoll_event event;
+	event.events = EPOLLIN | EPOLLONESHOT;
+	event.data.ptr = &listenSock;
+	if(epoll_ctl(epollFd, EPOLL_CTL_MOD, listenSock, &event) < 0)
+		logError("Failed to arm listening socket in epoll: %d\n", socketLastError());
+}
+
+coro_detached coro_reactor::serve(coro_reactor* reactor, connection* conn) {
+	co_await conn->session.run();
+	reactor->closeConnection(conn);
+}
+
+void coro_reactor::closeConnection(connection* conn) {
+	{
+		std::lock_guard<std::mutex> lock(connectionsMutex);
+		connections.erase(conn);
+	}
+	activeSessions--;
+	relay_stats::instance().onSessionClosed();
+
+	// The connection and its sockets are freed after the current epoll_wait batch, which may still refer to it.
+	// The coroutine frames are freed as soon as serve() returns, right after this.
+	closedConnections.push_back(conn);
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "relay/coro-task.h"
+#include "relay/identity-cache.h"
+#include "relay/socket-stream.h"
+
+#include <atomic>
+#include <mutex>
+#include <unordered_set>
+#include <vector>
+
+// Executor running every client session as a coro_session coroutine on a small fixed number of threads sharing
+// one epoll instance. A socket is only armed (EPOLLONESHOT) while its session awaits it, and the thread receiving
+// the event completes the I/O and resumes the session, so a session runs on a single thread at a time.
+// Sessions waiting for their next request hold no message buffer, only their coroutine frames.
+class coro_reactor {
+public:
+	coro_reactor(SOCKET listenSock,
+	             socket_connector connectUpstream,
+	             int32_t maxMessageSize,
+	             identity_cache* identityCache = NULL);
+	~coro_reactor();
+
+	coro_reactor(const coro_reactor&) = delete;
+	coro_reactor& operator=(const coro_reactor&) = delete;
+
+	// Run the event loop on threadCount threads, including the calling one.
+	// Returns when stop() is called or false if the reactor could not be initialized.
+	bool run(int threadCount);
+
+	// Make all run() threads return. Can be called from any thread.
+	void stop();
+
+	size_t getActiveSessions() const { return activeSessions; }
+
+private:
+	class endpoint;
+	struct connection;
+
+	static coro_detached serve(coro_reactor* reactor, connection* conn);
+
+	void loop();
+	void acceptClients();
+	void closeConnection(connection* conn);
+
+	SOCKET listenSock;
+	socket_connector connectUpstream;
+	int32_t maxMessageSize;
+	identity_cache* identityCache;
+	int epollFd;
+	int stopFd;
+
+	std::mutex connectionsMutex;
+	std::unordered_set<connection*> connections;
+	std::atomic<size_t> activeSessions;
+
+	// Connections closed while the calling thread handles an epoll_wait batch, freed after it
+	static thread_local std::vector<connection*> closedConnections;
+};
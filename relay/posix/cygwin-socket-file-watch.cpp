@@ -0,0 +1,83 @@
+#include "relay/cygwin-socket-file.h"
+#include "relay/logger.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/inotify.h>
+
+bool cygwin_socket_file::startWatching() {
+	std::string directory;
+	size_t separator = path.rfind('/');
+
+	if(separator == std::string::npos) {
+		directory = ".";
+		fileName = path;
+	} else {
+		directory = separator == 0 ? "/" : path.substr(0, separator);
+		fileName = path.substr(separator + 1);
+	}
+
+	inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if(inotifyFd < 0) {
+		logError("inotify_init1 failed: %d\n", errno);
+		return false;
+	}
+
+	// Watch the directory to also see the file being deleted and created again by a new agent
+	if(inotify_add_watch(inotifyFd,
+	                     directory.c_str(),
+	                     IN_CLOSE_WRITE | IN_MODIFY | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO) < 0) {
+		logError("Failed to watch %s: %d\n", directory.c_str(), errno);
+		close(inotifyFd);
+		return false;
+	}
+
+	return true;
+}
+
+bool cygwin_socket_file::changedSinceLastCheck() {
+	alignas(struct inotify_event) char buffer[4096];
+	bool changed = false;
+
+	for(;;) {
+		ssize_t length = read(inotifyFd, buffer, sizeof(buffer));
+		if(length <= 0)
+			break;
+
+		for(char* ptr = buffer; ptr < buffer + length;) {
+			const struct inotify_event* event = (const struct inotify_event*) ptr;
+
+			if((event->mask & IN_Q_OVERFLOW) || (event->len > 0 && fileName == event->name))
+				changed = true;
+
+			ptr += sizeof(struct inotify_event) + event->len;
+		}
+	}
+
+	return changed;
+}
+
+void cygwin_socket_file::stopWatching() {
+	close(inotifyFd);
+}
+
+bool cygwin_socket_file::readFile(char* buffer, size_t size) {
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if(fd < 0) {
+		logError("Failed to open file %s: %d\n", path.c_str(), errno);
+		return false;
+	}
+
+	ssize_t bytesRead = read(fd, buffer, size - 1);
+	close(fd);
+
+	if(bytesRead < 0) {
+		logError("Failed to read file %s: %d\n", path.c_str(), errno);
+		return false;
+	}
+
+	buffer[bytesRead] = 0;
+
+	return true;
+}
@@ -0,0 +1,258 @@
+#include "relay/posix/epoll-reactor.h"
+#include "relay/logger.h"
+#include "relay/relay-session.h"
+#include "relay/relay-stats.h"
+
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include <thread>
+#include <vector>
+
+struct epoll_reactor::connection {
+	connection(SOCKET clientSock, SOCKET upstreamSock, int32_t maxMessageSize, identity_cache* identityCache)
+	    : clientSock(clientSock),
+	      upstreamSock(upstreamSock),
+	      registeredSock(INVALID_SOCKET),
+	      closed(false),
+	      session(maxMessageSize, identityCache) {}
+
+	SOCKET clientSock;
+	SOCKET upstreamSock;
+	SOCKET registeredSock;  // the only socket of the connection in the epoll instance
+	bool closed;
+	relay_session session;
+};
+
+thread_local std::vector<epoll_reactor::connection*> epoll_reactor::closedConnections;
+
+epoll_reactor::epoll_reactor(SOCKET listenSock,
+                             socket_connector connectUpstream,
+                             int32_t maxMessageSize,
+                             identity_cache* identityCache)
+    : listenSock(listenSock),
+      connectUpstream(std::move(connectUpstream)),
+      maxMessageSize(maxMessageSize),
+      identityCache(identityCache),
+      epollFd(-1),
+      stopFd(-1),
+      activeSessions(0) {}
+
+epoll_reactor::~epoll_reactor() {
+	for(connection* conn : connections) {
+		closesocket(conn->clientSock);
+		closesocket(conn->upstreamSock);
+		delete conn;
+	}
+
+	if(stopFd >= 0)
+		close(stopFd);
+	if(epollFd >= 0)
+		close(epollFd);
+}
+
+bool epoll_reactor::arm(SOCKET sock, uint32_t events, void* data) {
+	struct epoll_event event;
+
+	event.events = events | EPOLLONESHOT;
+	event.data.ptr = data;
+
+	if(epoll_ctl(epollFd, EPOLL_CTL_MOD, sock, &event) < 0) {
+		logError("Failed to arm socket %d in epoll: %d\n", sock, socketLastError());
+		return false;
+	}
+
+	return true;
+}
+
+bool epoll_reactor::armConnection(connection* conn, SOCKET sock, uint32_t events) {
+	if(conn->registeredSock == sock)
+		return arm(sock, events, conn);
+
+	struct epoll_event event;
+
+	event.events = events | EPOLLONESHOT;
+	event.data.ptr = conn;
+
+	if(conn->registeredSock != INVALID_SOCKET && epoll_ctl(epollFd, EPOLL_CTL_DEL, conn->registeredSock, NULL) < 0) {
+		logError("Failed to remove socket %d from epoll: %d\n", conn->registeredSock, socketLastError());
+		return false;
+	}
+	conn->registeredSock = INVALID_SOCKET;
+
+	if(epoll_ctl(epollFd, EPOLL_CTL_ADD, sock, &event) < 0) {
+		logError("Failed to add socket %d to epoll: %d\n", sock, socketLastError());
+		return false;
+	}
+	conn->registeredSock = sock;
+
+	return true;
+}
+
+bool epoll_reactor::run(int threadCount) {
+	struct epoll_event event;
+
+	epollFd = epoll_create1(EPOLL_CLOEXEC);
+	stopFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if(epollFd < 0 || stopFd < 0) {
+		logError("Failed to create epoll instance: %d\n", socketLastError());
+		return false;
+	}
+
+	fcntl(listenSock, F_SETFL, fcntl(listenSock, F_GETFL) | O_NONBLOCK);
+
+	// The stop event is level triggered so every thread sees it
+	event.events = EPOLLIN;
+	event.data.ptr = &stopFd;
+	epoll_ctl(epollFd, EPOLL_CTL_ADD, stopFd, &event);
+
+	event.events = EPOLLIN | EPOLLONESHOT;
+	event.data.ptr = &listenSock;
+	if(epoll_ctl(epollFd, EPOLL_CTL_ADD, listenSock, &event) < 0) {
+		logError("Failed to add listening socket to epoll: %d\n", socketLastError());
+		return false;
+	}
+
+	std::vector<std::thread> threads;
+	for(int i = 1; i < threadCount; i++) {
+		threads.emplace_back(&epoll_reactor::loop, this);
+	}
+
+	loop();
+
+	for(std::thread& thread : threads) {
+		thread.join();
+	}
+
+	return true;
+}
+
+void epoll_reactor::stop() {
+	uint64_t value = 1;
+	if(write(stopFd, &value, sizeof(value)) < 0) {
+		logError("Failed to stop event loop: %d\n", socketLastError());
+	}
+}
+
+void epoll_reactor::loop() {
+	struct epoll_event events[64];
+
+	for(;;) {
+		int eventCount = epoll_wait(epollFd, events, sizeof(events) / sizeof(events[0]), -1);
+		if(eventCount < 0) {
+			if(errno == EINTR)
+				continue;
+			logError("epoll_wait failed: %d\n", socketLastError());
+			return;
+		}
+
+		bool stopping = false;
+		for(int i = 0; i < eventCount && !stopping; i++) {
+			void* data = events[i].data.ptr;
+
+			if(data == &stopFd) {
+				stopping = true;
+			} else if(data == &listenSock) {
+				acceptClients();
+			} else {
+				// A connection closed earlier in the batch is only kept for its pending events
+				connection* conn = (connection*) data;
+				if(!conn->closed)
+					drive(conn);
+			}
+		}
+
+		for(connection* conn : closedConnections) {
+			delete conn;
+		}
+		closedConnections.clear();
+
+		if(stopping)
+			return;
+	}
+}
+
+void epoll_reactor::acceptClients() {
+	for(;;) {
+		SOCKET clientSock = accept4(listenSock, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+		if(clientSock == INVALID_SOCKET) {
+			if(errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED)
+				logError("accept failed: %d\n", socketLastError());
+			if(errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break;
+		}
+
+		// Upstream connections are local and complete immediately, so they are made synchronously
+		SOCKET upstreamSock = connectUpstream();
+		if(upstreamSock == INVALID_SOCKET) {
+			logError("Error: cannot connect to upstream ssh-agent\n");
+			closesocket(clientSock);
+			continue;
+		}
+		fcntl(upstreamSock, F_SETFL, fcntl(upstreamSock, F_GETFL) | O_NONBLOCK);
+
+		// drive() registers the socket the session waits on
+		connection* conn = new connection(clientSock, upstreamSock, maxMessageSize, identityCache);
+
+		{
+			std::lock_guard<std::mutex> lock(connectionsMutex);
+			connections.insert(conn);
+		}
+		activeSessions++;
+		relay_stats::instance().onSessionOpened();
+
+		drive(conn);
+	}
+
+	arm(listenSock, EPOLLIN, &listenSock);
+}
+
+void epoll_reactor::drive(connection* conn) {
+	for(;;) {
+		relay_io io = conn->session.currentIo();
+		SOCKET sock = io.endpoint == relay_endpoint::client ? conn->clientSock : conn->upstreamSock;
+		ssize_t result;
+
+		if(io.isWrite)
+			result = send(sock, io.buffer, io.size, MSG_NOSIGNAL);
+		else
+			result = recv(sock, io.buffer, io.size, 0);
+
+		if(result < 0) {
+			if(errno == EAGAIN || errno == EWOULDBLOCK) {
+				// io.buffer is not used anymore, the next drive() asks the session for a buffer again
+				if(io.endpoint == relay_endpoint::client && !io.isWrite)
+					conn->session.releaseIdleBuffer();
+				if(!armConnection(conn, sock, io.isWrite ? EPOLLOUT : EPOLLIN))
+					closeConnection(conn);
+				return;
+			} else if(errno == EINTR) {
+				continue;
+			}
+			result = -socketLastError();
+		}
+
+		if(!conn->session.onIoComplete((int32_t) result)) {
+			closeConnection(conn);
+			return;
+		}
+	}
+}
+
+void epoll_reactor::closeConnection(connection* conn) {
+	{
+		std::lock_guard<std::mutex> lock(connectionsMutex);
+		connections.erase(conn);
+	}
+	activeSessions--;
+	relay_stats::instance().onSessionClosed();
+
+	// Closing the sockets also removes them from the epoll instance. The connection is freed after the current
+	// epoll_wait batch, which may still refer to it.
+	closesocket(conn->clientSock);
+	closesocket(conn->upstreamSock);
+	conn->closed = true;
+	closedConnections.push_back(conn);
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "relay/identity-cache.h"
+#include "relay/socket-stream.h"
+
+#include <atomic>
+#include <mutex>
+#include <unordered_set>
+#include <vector>
+
+// Event-driven server handling every client and upstream session as a non-blocking
+// relay_session state machine on a small fixed number of threads sharing one epoll instance.
+// Only the socket a session waits on is registered (EPOLLONESHOT), the other one is removed,
+// as epoll would still report hang ups on it. So a session is handled by a single thread at
+// a time without any locking.
+// Sessions waiting for their next request hold no message buffer, only readiness is waited for.
+class epoll_reactor {
+public:
+	epoll_reactor(SOCKET listenSock,
+	              socket_connector connectUpstream,
+	              int32_t maxMessageSize,
+	              identity_cache* identityCache = NULL);
+	~epoll_reactor();
+
+	epoll_reactor(const epoll_reactor&) = delete;
+	epoll_reactor& operator=(const epoll_reactor&) = delete;
+
+	// Run the event loop on threadCount threads, including the calling one.
+	// Returns when stop() is called or false if the reactor could not be initialized.
+	bool run(int threadCount);
+
+	// Make all run() threads return. Can be called from any thread.
+	void stop();
+
+	size_t getActiveSessions() const { return activeSessions; }
+
+private:
+	struct connection;
+
+	void loop();
+	void acceptClients();
+	void drive(connection* conn);
+	void closeConnection(connection* conn);
+	bool arm(SOCKET sock, uint32_t events, void* data);
+	bool armConnection(connection* conn, SOCKET sock, uint32_t events);
+
+	SOCKET listenSock;
+	socket_connector connectUpstream;
+	int32_t maxMessageSize;
+	identity_cache* identityCache;
+	int epollFd;
+	int stopFd;
+
+	std::mutex connectionsMutex;
+	std::unordered_set<connection*> connections;
+	std::atomic<size_t> activeSessions;
+
+	// Connections closed while the calling thread handles an epoll_wait batch, freed after it
+	static thread_local std::vector<connection*> closedConnections;
+};
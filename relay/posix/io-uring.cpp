@@ -0,0 +1,165 @@
+#include "relay/posix/io-uring.h"
+#include "relay/logger.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int ioUringSetup(unsigned entries, struct io_uring_params* params) {
+	return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int ioUringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+	return (int) syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+static int ioUringRegister(int fd, unsigned opcode, const void* arg, unsigned count) {
+	return (int) syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+io_uring_queue::io_uring_queue() noexcept
+    : ringFd(-1),
+      sqRing(MAP_FAILED),
+      sqRingSize(0),
+      cqRing(MAP_FAILED),
+      cqRingSize(0),
+      sqes((struct io_uring_sqe*) MAP_FAILED),
+      sqesSize(0),
+      pendingSubmissions(0),
+      enterCount(0) {}
+
+io_uring_queue::~io_uring_queue() {
+	if(sqes != MAP_FAILED)
+		munmap(sqes, sqesSize);
+	if(cqRing != MAP_FAILED && cqRing != sqRing)
+		munmap(cqRing, cqRingSize);
+	if(sqRing != MAP_FAILED)
+		munmap(sqRing, sqRingSize);
+	if(ringFd >= 0)
+		close(ringFd);
+}
+
+bool io_uring_queue::init(unsigned entries) {
+	struct io_uring_params params;
+
+	memset(&params, 0, sizeof(params));
+	ringFd = ioUringSetup(entries, &params);
+	if(ringFd < 0) {
+		logError("io_uring_setup failed: %d\n", errno);
+		return false;
+	}
+
+	sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if(params.features & IORING_FEAT_SINGLE_MMAP) {
+		if(cqRingSize > sqRingSize)
+			sqRingSize = cqRingSize;
+		cqRingSize = sqRingSize;
+	}
+
+	sqRing = mmap(NULL, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+	if(sqRing == MAP_FAILED) {
+		logError("Failed to map io_uring submission queue: %d\n", errno);
+		return false;
+	}
+
+	if(params.features & IORING_FEAT_SINGLE_MMAP) {
+		cqRing = sqRing;
+	} else {
+		cqRing = mmap(NULL, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+		if(cqRing == MAP_FAILED) {
+			logError("Failed to map io_uring completion queue: %d\n", errno);
+			return false;
+		}
+	}
+
+	sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	sqes = (struct io_uring_sqe*) mmap(
+	    NULL, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+	if(sqes == MAP_FAILED) {
+		logError("Failed to map io_uring submission entries: %d\n", errno);
+		return false;
+	}
+
+	char* sq = (char*) sqRing;
+	sqHead = (unsigned*) (sq + params.sq_off.head);
+	sqTail = (unsigned*) (sq + params.sq_off.tail);
+	sqMask = (unsigned*) (sq + params.sq_off.ring_mask);
+	sqArray = (unsigned*) (sq + params.sq_off.array);
+
+	char* cq = (char*) cqRing;
+	cqHead = (unsigned*) (cq + params.cq_off.head);
+	cqTail = (unsigned*) (cq + params.cq_off.tail);
+	cqMask = (unsigned*) (cq + params.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+
+	return true;
+}
+
+bool io_uring_queue::registerBuffers(const struct iovec* iovecs, unsigned count) {
+	if(ioUringRegister(ringFd, IORING_REGISTER_BUFFERS, iovecs, count) < 0) {
+		logWarning("Failed to register io_uring buffers: %d\n", errno);
+		return false;
+	}
+
+	return true;
+}
+
+bool io_uring_queue::reserveSqes(unsigned count) {
+	unsigned tail = *sqTail;
+
+	if(tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) + count <= *sqMask + 1)
+		return true;
+
+	// Queue full, hand the pending entries to the kernel without waiting
+	if(!submitAndWait(0))
+		return false;
+
+	return tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) + count <= *sqMask + 1;
+}
+
+struct io_uring_sqe* io_uring_queue::getSqe() {
+	if(!reserveSqes(1))
+		return NULL;
+
+	unsigned tail = *sqTail;
+	unsigned index = tail & *sqMask;
+	struct io_uring_sqe* sqe = &sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqArray[index] = index;
+	__atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+	pendingSubmissions++;
+
+	return sqe;
+}
+
+bool io_uring_queue::submitAndWait(unsigned waitCount) {
+	for(;;) {
+		enterCount++;
+		int result = ioUringEnter(ringFd, pendingSubmissions, waitCount, waitCount > 0 ? IORING_ENTER_GETEVENTS : 0);
+		if(result >= 0) {
+			pendingSubmissions -= (unsigned) result < pendingSubmissions ? (unsigned) result : pendingSubmissions;
+			return true;
+		}
+		if(errno != EINTR) {
+			logError("io_uring_enter failed: %d\n", errno);
+			return false;
+		}
+	}
+}
+
+struct io_uring_cqe* io_uring_queue::peekCqe() {
+	unsigned head = *cqHead;
+
+	if(head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	return &cqes[head & *cqMask];
+}
+
+void io_uring_queue::seenCqe() {
+	__atomic_store_n(cqHead, *cqHead + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+// Minimal io_uring instance driven with the raw system calls (no liburing dependency).
+// Only used from one thread at a time.
+class io_uring_queue {
+public:
+	io_uring_queue() noexcept;
+	~io_uring_queue();
+
+	io_uring_queue(const io_uring_queue&) = delete;
+	io_uring_queue& operator=(const io_uring_queue&) = delete;
+
+	// Create the ring with room for entries submissions. Returns false if io_uring is not available.
+	bool init(unsigned entries);
+
+	// Register buffers usable by READ_FIXED/WRITE_FIXED operations, by index in iovecs.
+	bool registerBuffers(const struct iovec* iovecs, unsigned count);
+
+	// Make room for count submission entries, submitting the pending ones if needed.
+	// Linked entries must be reserved together so a chain is never split across two submissions.
+	bool reserveSqes(unsigned count);
+
+	// Get a cleared submission entry, submitting the pending ones first if the queue is full.
+	// Returns NULL if the kernel did not accept them.
+	struct io_uring_sqe* getSqe();
+
+	// Submit the pending entries and wait for at least waitCount completions, in one io_uring_enter.
+	// Returns false on error other than EINTR.
+	bool submitAndWait(unsigned waitCount);
+
+	// Next completion, NULL if none is ready. Call seenCqe() once it is handled.
+	struct io_uring_cqe* peekCqe();
+	void seenCqe();
+
+	// Number of io_uring_enter calls made so far.
+	uint64_t getEnterCount() const { return enterCount; }
+
+private:
+	int ringFd;
+	void* sqRing;
+	size_t sqRingSize;
+	void* cqRing;
+	size_t cqRingSize;
+	struct io_uring_sqe* sqes;
+	size_t sqesSize;
+
+	unsigned* sqHead;
+	unsigned* sqTail;
+	unsigned* sqMask;
+	unsigned* sqArray;
+	unsigned* cqHead;
+	unsigned* cqTail;
+	unsigned* cqMask;
+	struct io_uring_cqe* cqes;
+
+	unsigned pendingSubmissions;
+	uint64_t enterCount;
+};
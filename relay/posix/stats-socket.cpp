@@ -0,0 +1,36 @@
+#include "relay/posix/stats-socket.h"
+#include "relay/logger.h"
+#include "relay/posix/unix-socket.h"
+#include "relay/relay-stats.h"
+#include "relay/socket-stream.h"
+
+#include <string>
+#include <thread>
+
+static void serveStats(SOCKET listenSock) {
+	for(;;) {
+		SOCKET sock = accept4(listenSock, NULL, NULL, SOCK_CLOEXEC);
+		if(sock == INVALID_SOCKET) {
+			if(errno == EINTR || errno == ECONNABORTED)
+				continue;
+			logError("Stats socket accept failed: %d\n", socketLastError());
+			return;
+		}
+
+		std::string json = relay_stats::instance().toJson() + "\n";
+		socket_stream stream(sock);
+		stream.write(json.data(), (int32_t) json.size());
+	}
+}
+
+bool startStatsSocket(const char* path) {
+	SOCKET listenSock = listenUnixSocket(path, 4);
+	if(listenSock == INVALID_SOCKET)
+		return false;
+
+	std::thread(serveStats, listenSock).detach();
+
+	logInfo("Statistics available on %s\n", path);
+
+	return true;
+}
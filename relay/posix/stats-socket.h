@@ -0,0 +1,6 @@
+#pragma once
+
+// Serve relay_stats on a unix domain socket at path from a background thread: each connection
+// receives the statistics as one JSON line and is closed (e.g. `nc -U path`).
+// Returns false if the socket could not be created.
+bool startStatsSocket(const char* path);
@@ -0,0 +1,163 @@
+#include "relay/posix/thread-server.h"
+#include "relay/agent-session.h"
+#include "relay/buffer-pool.h"
+#include "relay/logger.h"
+#include "relay/posix/unix-socket.h"
+#include "relay/request-trace.h"
+
+#include <functional>
+#include <memory>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+static void InstanceThread(SOCKET clientSock,
+                           upstream_connector connectUpstream,
+                           int32_t maxMessageSize,
+                           identity_cache* identityCache,
+                           idle_reaper* idleReaper,
+                           upstream_scheduler* scheduler) {
+	socket_stream client(clientSock);
+	// Opened before connecting so the upstream connection is traced with the session
+	trace_session traceSession;
+
+	std::unique_ptr<agent_upstream> upstream = connectUpstream();
+	if(!upstream) {
+		logError("Error: cannot connect to upstream ssh-agent\n");
+		return;
+	}
+
+	if(idleReaper && idleReaper->getUpstreamTimeoutMs() > 0)
+		upstream = std::make_unique<parking_upstream>(std::move(upstream), connectUpstream, *idleReaper);
+
+	logDebug("InstanceThread created, receiving and processing messages.\n");
+
+	// Cached identity lists are answered without waiting for the scheduler
+	agent_upstream* sessionUpstream = upstream.get();
+	std::unique_ptr<scheduled_upstream> scheduledUpstream;
+	if(scheduler) {
+		uint64_t clientKey = scheduler->makeClientKey(unixSocketPeerProcess(clientSock));
+		scheduledUpstream = std::make_unique<scheduled_upstream>(*upstream, *scheduler, clientKey);
+		sessionUpstream = scheduledUpstream.get();
+	}
+
+	if(identityCache) {
+		caching_upstream cachingUpstream(*sessionUpstream, *identityCache);
+		runAgentSession(client, cachingUpstream, maxMessageSize, idleReaper);
+	} else {
+		runAgentSession(client, *sessionUpstream, maxMessageSize, idleReaper);
+	}
+
+	logDebug("InstanceThread exiting.\n");
+	printBufferPoolStats();
+	if(identityCache)
+		identityCache->printStats();
+}
+
+static void acceptLoop(SOCKET listenSock,
+                       const upstream_connector& connectUpstream,
+                       int32_t maxMessageSize,
+                       identity_cache* identityCache,
+                       session_pool* sessionPool,
+                       idle_reaper* idleReaper,
+                       upstream_scheduler* scheduler) {
+	// The loop waits for a client to connect to the listening socket.
+	// When the client connects, a thread is created to handle communications
+	// with that client, and this loop is free to wait for the
+	// next client connect request.
+
+	for(;;) {
+		SOCKET clientSock = accept4(listenSock, NULL, NULL, SOCK_CLOEXEC);
+		if(clientSock == INVALID_SOCKET) {
+			if(errno == EINTR || errno == ECONNABORTED) {
+				logError("accept failed: %d\n", socketLastError());
+				continue;
+			}
+			logError("accept failed: %d\n", socketLastError());
+			return;
+		}
+
+		if(sessionPool != NULL) {
+			logInfo("Client connected, queuing its session.\n");
+
+			if(!sessionPool->submit(
+			       [clientSock, connectUpstream, maxMessageSize, identityCache, idleReaper, scheduler]() {
+				       InstanceThread(
+				           clientSock, connectUpstream, maxMessageSize, identityCache, idleReaper, scheduler);
+			       },
+			       [clientSock]() { closesocket(clientSock); }))
+				logWarning("Too many sessions, client refused\n");
+			continue;
+		}
+
+		logInfo("Client connected, creating a processing thread.\n");
+
+		try {
+			std::thread(
+			    InstanceThread, clientSock, connectUpstream, maxMessageSize, identityCache, idleReaper, scheduler)
+			    .detach();
+		} catch(const std::system_error& e) {
+			logError("Cannot create a session thread: %s\n", e.what());
+			closesocket(clientSock);
+		}
+	}
+}
+
+void serveThreadPerClient(SOCKET listenSock,
+                          const upstream_connector& connectUpstream,
+                          int32_t maxMessageSize,
+                          identity_cache* identityCache,
+                          session_pool* sessionPool,
+                          int acceptorThreads,
+                          idle_reaper* idleReaper,
+                          upstream_scheduler* scheduler) {
+	std::vector<std::thread> acceptors;
+
+	// Other acceptors keep taking clients from the backlog while one of them starts a session
+	for(int i = 1; i < acceptorThreads; i++) {
+		try {
+			acceptors.emplace_back(acceptLoop,
+			                       listenSock,
+			                       std::cref(connectUpstream),
+			                       maxMessageSize,
+			                       identityCache,
+			                       sessionPool,
+			                       idleReaper,
+			                       scheduler);
+		} catch(const std::system_error& e) {
+			logError("Cannot create an acceptor thread: %s\n", e.what());
+			break;
+		}
+	}
+
+	acceptLoop(listenSock, connectUpstream, maxMessageSize, identityCache, sessionPool, idleReaper, scheduler);
+
+	for(std::thread& acceptor : acceptors) {
+		acceptor.join();
+	}
+}
+
+void serveThreadPerClient(SOCKET listenSock,
+                          const socket_connector& connectUpstream,
+                          int32_t maxMessageSize,
+                          identity_cache* identityCache,
+                          session_pool* sessionPool,
+                          int acceptorThreads,
+                          idle_reaper* idleReaper,
+                          upstream_scheduler* scheduler) {
+	upstream_connector connectStreamUpstream = [connectUpstream]() -> std::unique_ptr<agent_upstream> {
+		SOCKET upstreamSock = connectUpstream();
+		if(upstreamSock == INVALID_SOCKET)
+			return nullptr;
+		return std::make_unique<stream_upstream>(std::make_unique<socket_stream>(upstreamSock));
+	};
+
+	serveThreadPerClient(listenSock,
+	                     connectStreamUpstream,
+	                     maxMessageSize,
+	                     identityCache,
+	                     sessionPool,
+	                     acceptorThreads,
+	                     idleReaper,
+	                     scheduler);
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "relay/agent-upstream.h"
+#include "relay/identity-cache.h"
+#include "relay/idle-reaper.h"
+#include "relay/session-pool.h"
+#include "relay/socket-stream.h"
+#include "relay/upstream-scheduler.h"
+
+#define THREAD_SERVER_DEFAULT_ACCEPTORS 4
+
+// Accept clients on listenSock and relay each one to the upstream returned by connectUpstream
+// on its own thread using runAgentSession. Only returns if accept fails permanently.
+// Clients are accepted by acceptorThreads threads including the calling one, so a burst of clients
+// does not wait behind the start of each session.
+// When identityCache is not NULL, identity lists are answered from it.
+// When sessionPool is not NULL, sessions run on its workers and clients it refuses are disconnected,
+// otherwise each client gets a new thread.
+// When idleReaper is not NULL, idle clients are disconnected and idle upstream connections closed
+// until their client sends a request, according to its timeouts.
+// When scheduler is not NULL, requests wait their turn in it before going upstream, each client process
+// getting its own queue.
+void serveThreadPerClient(SOCKET listenSock,
+                          const upstream_connector& connectUpstream,
+                          int32_t maxMessageSize,
+                          identity_cache* identityCache = NULL,
+                          session_pool* sessionPool = NULL,
+                          int acceptorThreads = 1,
+                          idle_reaper* idleReaper = NULL,
+                          upstream_scheduler* scheduler = NULL);
+
+// Same as above, each client getting its own upstream socket.
+void serveThreadPerClient(SOCKET listenSock,
+                          const socket_connector& connectUpstream,
+                          int32_t maxMessageSize,
+                          identity_cache* identityCache = NULL,
+                          session_pool* sessionPool = NULL,
+                          int acceptorThreads = 1,
+                          idle_reaper* idleReaper = NULL,
+                          upstream_scheduler* scheduler = NULL);
@@ -0,0 +1,83 @@
+#include "relay/posix/unix-socket.h"
+#include "relay/logger.h"
+#include "relay/request-trace.h"
+
+#include <string.h>
+#include <sys/un.h>
+
+static bool fillUnixAddress(const char* path, struct sockaddr_un* address) {
+	memset(address, 0, sizeof(*address));
+	address->sun_family = AF_UNIX;
+
+	if(strlen(path) >= sizeof(address->sun_path)) {
+		logError("Unix socket path too long: %s\n", path);
+		return false;
+	}
+
+	strcpy(address->sun_path, path);
+
+	return true;
+}
+
+SOCKET connectUnixSocket(const char* path) {
+	struct sockaddr_un address;
+
+	if(!fillUnixAddress(path, &address))
+		return INVALID_SOCKET;
+
+	SOCKET sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(sock == INVALID_SOCKET) {
+		logError("Failed to open socket: %d\n", socketLastError());
+		return INVALID_SOCKET;
+	}
+
+	uint64_t connectStartNs = traceStartNs();
+	int result = connect(sock, (const struct sockaddr*) &address, sizeof(address));
+	traceSpan(trace_phase::upstream_connect, connectStartNs);
+	if(result < 0) {
+		logError("Failed to connect socket to %s: %d\n", path, socketLastError());
+		closesocket(sock);
+		return INVALID_SOCKET;
+	}
+
+	return sock;
+}
+
+SOCKET listenUnixSocket(const char* path, int backlog) {
+	struct sockaddr_un address;
+
+	if(!fillUnixAddress(path, &address))
+		return INVALID_SOCKET;
+
+	SOCKET sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(sock == INVALID_SOCKET) {
+		logError("Failed to open socket: %d\n", socketLastError());
+		return INVALID_SOCKET;
+	}
+
+	unlink(path);
+
+	if(bind(sock, (const struct sockaddr*) &address, sizeof(address)) < 0) {
+		logError("Failed to bind socket to %s: %d\n", path, socketLastError());
+		closesocket(sock);
+		return INVALID_SOCKET;
+	}
+
+	if(listen(sock, backlog) < 0) {
+		logError("Failed to listen on %s: %d\n", path, socketLastError());
+		closesocket(sock);
+		return INVALID_SOCKET;
+	}
+
+	return sock;
+}
+
+unsigned long unixSocketPeerProcess(SOCKET sock) {
+	struct ucred credentials;
+	socklen_t size = sizeof(credentials);
+
+	if(getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &credentials, &size) < 0)
+		return 0;
+
+	return (unsigned long) credentials.pid;
+}
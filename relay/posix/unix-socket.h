@@ -0,0 +1,14 @@
+#pragma once
+
+#include "relay/socket-compat.h"
+
+// Connect to a unix domain socket at path.
+// Returns the connected socket or INVALID_SOCKET.
+SOCKET connectUnixSocket(const char* path);
+
+// Create a unix domain socket listening on path. An existing socket file at path is replaced.
+// Returns the listening socket or INVALID_SOCKET.
+SOCKET listenUnixSocket(const char* path, int backlog);
+
+// Process id of the peer of a connected unix domain socket, 0 if unknown.
+unsigned long unixSocketPeerProcess(SOCKET sock);
@@ -0,0 +1,633 @@
+#include "relay/posix/uring-reactor.h"
+#include "relay/agent-message.h"
+#include "relay/buffer-pool.h"
+#include "relay/logger.h"
+#include "relay/posix/io-uring.h"
+#include "relay/relay-stats.h"
+#include "relay/traffic-capture.h"
+
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <thread>
+#include <unordered_set>
+
+// Registered buffers of each ring, a session keeps one slot while it is open.
+// Larger messages, and sessions beyond the slot count, use pooled buffers with non-fixed operations.
+#define URING_SLOT_SIZE 16384
+#define URING_SLOT_COUNT 128
+#define URING_QUEUE_DEPTH 256
+
+// user_data of the operations not belonging to a session.
+// Session operations use the session pointer with the low bit set for writes.
+#define URING_ACCEPT_DATA ((uint64_t) 8)
+#define URING_STOP_DATA ((uint64_t) 16)
+
+enum class uring_state { read_request, write_request, read_reply, write_reply, skip_request, skip_reply };
+
+struct uring_reactor::session {
+	session(SOCKET clientSock, SOCKET upstreamSock)
+	    : clientSock(clientSock),
+	      upstreamSock(upstreamSock),
+	      state(uring_state::read_request),
+	      data(NULL),
+	      capacity(0),
+	      fixedIndex(-1),
+	      filled(0),
+	      messageSize(0),
+	      written(0),
+	      pendingCharged(0),
+	      skipRemaining(0),
+	      inflight(0),
+	      failed(false),
+	      requestType(-1),
+	      requestSize(0),
+	      firstReadNs(0),
+	      requestReadNs(0),
+	      replyReadNs(0),
+	      captureId(openCaptureSession()) {}
+
+	SOCKET clientSock;
+	SOCKET upstreamSock;
+	uring_state state;
+
+	// Registered slot when fixedIndex >= 0, pooled buffer otherwise
+	char* data;
+	int32_t capacity;
+	int fixedIndex;
+	message_buffer pooled;
+
+	int32_t filled;             // bytes read into data
+	int32_t messageSize;        // size of the message being written
+	int32_t written;            // bytes of it already written
+	std::vector<char> pending;  // pipelined bytes received after the current request
+	size_t pendingCharged;      // capacity of pending charged to the buffer pool
+	int32_t skipRemaining;      // bytes of a message over the memory budget still to be read and dropped
+
+	// The session state only changes once all its operations have completed
+	int inflight;
+	bool failed;
+
+	// Phase timestamps of the current request for relay_stats
+	int requestType;
+	int32_t requestSize;
+	uint64_t firstReadNs;
+	uint64_t requestReadNs;
+	uint64_t replyReadNs;
+
+	uint32_t captureId;  // 0 when traffic capture is disabled
+};
+
+struct uring_reactor::worker {
+	worker() : slots(MAP_FAILED), fixedBuffers(false), stopping(false) {}
+	~worker() {
+		// Registered pages stay pinned by the ring until it is closed, unmapping them first is fine
+		if(slots != MAP_FAILED)
+			munmap(slots, URING_SLOT_SIZE * URING_SLOT_COUNT);
+		if(fixedBuffers)
+			buffer_pool::instance().releaseExternal(URING_SLOT_SIZE * URING_SLOT_COUNT);
+	}
+
+	bool init();
+
+	io_uring_queue ring;
+	void* slots;
+	std::vector<int> freeSlots;
+	bool fixedBuffers;
+	bool stopping;
+	std::unordered_set<session*> sessions;
+};
+
+bool uring_reactor::worker::init() {
+	if(!ring.init(URING_QUEUE_DEPTH))
+		return false;
+
+	slots = mmap(NULL, URING_SLOT_SIZE * URING_SLOT_COUNT, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(slots == MAP_FAILED) {
+		logWarning("Failed to allocate io_uring buffers: %d\n", errno);
+		return true;
+	}
+
+	struct iovec iovecs[URING_SLOT_COUNT];
+	for(int i = 0; i < URING_SLOT_COUNT; i++) {
+		iovecs[i].iov_base = (char*) slots + i * URING_SLOT_SIZE;
+		iovecs[i].iov_len = URING_SLOT_SIZE;
+	}
+
+	// Registration can fail with a low RLIMIT_MEMLOCK on older kernels, sessions then only use pooled buffers
+	fixedBuffers = ring.registerBuffers(iovecs, URING_SLOT_COUNT);
+	if(fixedBuffers) {
+		// Pinned for the life of the ring, so they count against the memory budget
+		buffer_pool::instance().chargeExternal(URING_SLOT_SIZE * URING_SLOT_COUNT);
+		for(int i = URING_SLOT_COUNT - 1; i >= 0; i--) {
+			freeSlots.push_back(i);
+		}
+	}
+
+	return true;
+}
+
+static void prepareIo(struct io_uring_sqe* sqe,
+                      SOCKET sock,
+                      char* buffer,
+                      int32_t size,
+                      int fixedIndex,
+                      bool isWrite,
+                      uint64_t userData) {
+	if(fixedIndex >= 0) {
+		sqe->opcode = isWrite ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+		sqe->buf_index = (uint16_t) fixedIndex;
+	} else {
+		sqe->opcode = isWrite ? IORING_OP_WRITE : IORING_OP_READ;
+	}
+
+	// Sockets reject any offset other than 0
+	sqe->fd = sock;
+	sqe->off = 0;
+	sqe->addr = (uint64_t) (uintptr_t) buffer;
+	sqe->len = (uint32_t) size;
+	sqe->user_data = userData | (isWrite ? 1 : 0);
+}
+
+uring_reactor::uring_reactor(SOCKET listenSock, socket_connector connectUpstream, int32_t maxMessageSize)
+    : listenSock(listenSock),
+      connectUpstream(std::move(connectUpstream)),
+      maxMessageSize(maxMessageSize),
+      stopFd(-1),
+      activeSessions(0) {}
+
+uring_reactor::~uring_reactor() {
+	workers.clear();
+
+	if(stopFd >= 0)
+		close(stopFd);
+}
+
+bool uring_reactor::run(int threadCount) {
+	stopFd = eventfd(0, EFD_CLOEXEC);
+	if(stopFd < 0) {
+		logError("Failed to create stop event: %d\n", errno);
+		return false;
+	}
+
+	for(int i = 0; i < threadCount; i++) {
+		workers.push_back(std::make_unique<worker>());
+		worker& w = *workers.back();
+
+		if(!w.init())
+			return false;
+
+		// The stop event stays signaled, so the poll completes on every ring
+		struct io_uring_sqe* sqe = w.ring.getSqe();
+		if(sqe == NULL)
+			return false;
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = stopFd;
+		sqe->poll_events = POLLIN;
+		sqe->user_data = URING_STOP_DATA;
+
+		// Every ring has its own accept pending on the shared listening socket
+		if(!submitAccept(w))
+			return false;
+	}
+
+	logDebug("io_uring reactor: %d rings, %s\n",
+	         threadCount,
+	         workers[0]->fixedBuffers ? "registered buffers" : "no registered buffers");
+
+	std::vector<std::thread> threads;
+	for(int i = 1; i < threadCount; i++) {
+		threads.emplace_back(&uring_reactor::loop, this, std::ref(*workers[i]));
+	}
+
+	loop(*workers[0]);
+
+	for(std::thread& thread : threads) {
+		thread.join();
+	}
+
+	return true;
+}
+
+void uring_reactor::stop() {
+	uint64_t value = 1;
+	if(write(stopFd, &value, sizeof(value)) < 0) {
+		logError("Failed to stop event loop: %d\n", errno);
+	}
+}
+
+void uring_reactor::loop(worker& w) {
+	while(!w.stopping || !w.sessions.empty()) {
+		// Submissions of every session made while handling the previous completions go in one system call
+		if(!w.ring.submitAndWait(1)) {
+			// The kernel may still own session buffers, so sessions are left allocated
+			for(session* s : w.sessions) {
+				closesocket(s->clientSock);
+				closesocket(s->upstreamSock);
+			}
+			return;
+		}
+
+		struct io_uring_cqe* cqe;
+		while((cqe = w.ring.peekCqe()) != NULL) {
+			uint64_t userData = cqe->user_data;
+			int result = cqe->res;
+
+			w.ring.seenCqe();
+
+			if(userData == URING_STOP_DATA) {
+				// Pending reads complete with EOF once their sockets are shut down
+				w.stopping = true;
+				for(session* s : w.sessions) {
+					shutdown(s->clientSock, SHUT_RDWR);
+					shutdown(s->upstreamSock, SHUT_RDWR);
+				}
+			} else if(userData == URING_ACCEPT_DATA) {
+				onAccept(w, result);
+			} else {
+				onComplete(w, (session*) (uintptr_t) (userData & ~(uint64_t) 1), (userData & 1) != 0, result);
+			}
+		}
+	}
+}
+
+bool uring_reactor::submitAccept(worker& w) {
+	struct io_uring_sqe* sqe = w.ring.getSqe();
+
+	if(sqe == NULL) {
+		logError("Failed to queue accept\n");
+		return false;
+	}
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = listenSock;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	sqe->user_data = URING_ACCEPT_DATA;
+
+	return true;
+}
+
+void uring_reactor::onAccept(worker& w, int result) {
+	if(w.stopping) {
+		if(result >= 0)
+			closesocket(result);
+		return;
+	}
+
+	if(result < 0) {
+		if(result != -EINTR && result != -ECONNABORTED)
+			logError("accept failed: %d\n", -result);
+	} else {
+		SOCKET clientSock = result;
+
+		// Upstream connections are local and complete immediately, so they are made synchronously
+		SOCKET upstreamSock = connectUpstream();
+		if(upstreamSock == INVALID_SOCKET) {
+			logError("Error: cannot connect to upstream ssh-agent\n");
+			closesocket(clientSock);
+		} else {
+			session* s = new session(clientSock, upstreamSock);
+
+			w.sessions.insert(s);
+			activeSessions++;
+			relay_stats::instance().onSessionOpened();
+
+			useFixedBuffer(w, s);
+			advance(w, s);
+		}
+	}
+
+	submitAccept(w);
+}
+
+void uring_reactor::onComplete(worker& w, session* s, bool isWrite, int result) {
+	s->inflight--;
+
+	if(result == -ECANCELED) {
+		// Read linked to a short write, it is queued again with the rest of the write
+	} else if(result <= 0) {
+		if(result < 0 && result != -ECONNRESET && result != -EPIPE)
+			logWarning("Relay session I/O failed: %d\n", -result);
+		s->failed = true;
+	} else if(isWrite) {
+		s->written += result;
+		// Recorded here as the linked read may end the session before advance()
+		if(s->state == uring_state::write_reply && s->written == s->messageSize) {
+			relay_stats::instance().recordMessage(s->requestType,
+			                                      s->requestSize,
+			                                      s->messageSize,
+			                                      s->requestReadNs - s->firstReadNs,
+			                                      s->replyReadNs - s->requestReadNs,
+			                                      monotonicNs() - s->replyReadNs);
+			s->firstReadNs = 0;
+		}
+	} else {
+		// Client reads are either read_request ones or linked to the reply write
+		bool clientRead = s->state == uring_state::read_request || s->state == uring_state::write_reply;
+		if(clientRead && s->firstReadNs == 0)
+			s->firstReadNs = monotonicNs();
+		s->filled += result;
+	}
+
+	if(s->inflight > 0)
+		return;
+
+	if(s->failed || w.stopping)
+		closeSession(w, s);
+	else
+		advance(w, s);
+}
+
+void uring_reactor::advance(worker& w, session* s) {
+	bool result;
+
+	switch(s->state) {
+		case uring_state::read_request:
+		case uring_state::read_reply:
+		default:
+			result = onMessageRead(w, s);
+			break;
+
+		case uring_state::skip_request:
+		case uring_state::skip_reply:
+			s->skipRemaining -= s->filled;
+			s->filled = 0;
+			result = continueSkip(w, s);
+			break;
+
+		case uring_state::write_request:
+			if(s->written < s->messageSize) {
+				result = submitWrite(w, s, s->upstreamSock, s->upstreamSock);
+				break;
+			}
+			// The linked read may already have received the reply
+			s->state = uring_state::read_reply;
+			result = onMessageRead(w, s);
+			break;
+
+		case uring_state::write_reply:
+			if(s->written < s->messageSize) {
+				result = submitWrite(w, s, s->clientSock, s->pending.empty() ? s->clientSock : INVALID_SOCKET);
+				break;
+			}
+			s->state = uring_state::read_request;
+
+			// Go back to a registered slot, or at least a small buffer, after a large message
+			if(s->fixedIndex < 0 && !useFixedBuffer(w, s) && s->filled == 0 &&
+			   s->capacity > BUFFER_POOL_SMALL_SIZE) {
+				s->pooled.shrink();
+				s->data = s->pooled.data();
+				s->capacity = (int32_t) s->pooled.capacity();
+			}
+
+			// Pipelined bytes are only kept when no read was linked to the reply, so filled is 0
+			if(!s->pending.empty())
+				takePending(s);
+			result = onMessageRead(w, s);
+			break;
+	}
+
+	if(!result)
+		closeSession(w, s);
+}
+
+bool uring_reactor::onMessageRead(worker& w, session* s) {
+	bool isRequest = s->state == uring_state::read_request;
+	int32_t size = 4;
+
+	if(s->filled >= 4) {
+		uint32_t length = readu32(s->data);
+		if(length > (uint32_t) maxMessageSize - 4) {
+			logError("Invalid agent message size: %u\n", length);
+			return false;
+		}
+		size = (int32_t) length + 4;
+	}
+
+	if(s->filled < size) {
+		if(!growBuffer(w, s, size)) {
+			// The buffer holds the head of the message but cannot grow for the rest, usually the memory budget
+			if(s->filled >= 4)
+				return skipMessage(w, s, size);
+			logError("Failed to allocate a %d bytes message buffer\n", size);
+			return false;
+		}
+		// The rest of a pipelined request may already be pending
+		if(isRequest && !s->pending.empty()) {
+			takePending(s);
+			return onMessageRead(w, s);
+		}
+		return submitRead(w, s, isRequest ? s->clientSock : s->upstreamSock);
+	}
+
+	s->messageSize = size;
+	s->written = 0;
+
+	if(isRequest) {
+		if(s->filled > size) {
+			s->pending.insert(s->pending.begin(), s->data + size, s->data + s->filled);
+			chargePending(s);
+		}
+		s->filled = 0;
+		s->state = uring_state::write_request;
+		s->requestType = agentMessageType(s->data, size);
+		s->requestSize = size;
+		s->requestReadNs = monotonicNs();
+		if(s->firstReadNs == 0)
+			s->firstReadNs = s->requestReadNs;
+
+		logPayload("Sending to upstream", s->data, size);
+		captureMessage(s->captureId, capture_event::request, s->data, size);
+
+		message_buffer statsReply;
+		int32_t statsSize = answerStatsRequest(s->data, size, statsReply);
+		if(statsSize > 0) {
+			if(!growBuffer(w, s, statsSize)) {
+				logError("Failed to allocate a %d bytes message buffer\n", statsSize);
+				return false;
+			}
+			memcpy(s->data, statsReply.data(), statsSize);
+			s->messageSize = statsSize;
+			s->replyReadNs = s->requestReadNs;
+			s->state = uring_state::write_reply;
+			captureMessage(s->captureId, capture_event::reply, s->data, statsSize);
+			return submitWrite(w, s, s->clientSock, s->pending.empty() ? s->clientSock : INVALID_SOCKET);
+		}
+
+		return submitWrite(w, s, s->upstreamSock, s->upstreamSock);
+	}
+
+	if(s->filled > size) {
+		logError("Unexpected data after agent reply\n");
+		return false;
+	}
+	s->filled = 0;
+	s->replyReadNs = monotonicNs();
+	s->state = uring_state::write_reply;
+	captureMessage(s->captureId, capture_event::reply, s->data, size);
+
+	// The next request is read as soon as the reply is written, unless pipelined bytes are already waiting
+	return submitWrite(w, s, s->clientSock, s->pending.empty() ? s->clientSock : INVALID_SOCKET);
+}
+
+bool uring_reactor::skipMessage(worker& w, session* s, int32_t size) {
+	bool reply = s->state == uring_state::read_reply;
+
+	logWarning("%s of %d bytes over the memory budget, answering a failure\n", reply ? "Reply" : "Request", size);
+	relay_stats::instance().onMessageOverBudget(reply, false);
+	if(!reply) {
+		s->requestSize = size;
+		s->requestType = s->filled >= 5 ? (uint8_t) s->data[4] : -1;
+	}
+
+	s->skipRemaining = size - s->filled;
+	s->filled = 0;
+	s->state = reply ? uring_state::skip_reply : uring_state::skip_request;
+
+	return continueSkip(w, s);
+}
+
+bool uring_reactor::continueSkip(worker& w, session* s) {
+	bool reply = s->state == uring_state::skip_reply;
+
+	// Pipelined bytes come before the socket for the rest of a skipped request
+	if(!reply && !s->pending.empty()) {
+		size_t size = std::min(s->pending.size(), (size_t) s->skipRemaining);
+		s->pending.erase(s->pending.begin(), s->pending.begin() + size);
+		s->skipRemaining -= (int32_t) size;
+		chargePending(s);
+	}
+
+	if(s->skipRemaining > 0)
+		return submitRead(w, s, reply ? s->upstreamSock : s->clientSock);
+
+	writeu32(s->data, 1);
+	s->data[4] = SSH_AGENT_FAILURE;
+	s->messageSize = 5;
+	s->written = 0;
+	s->replyReadNs = monotonicNs();
+	if(!reply) {
+		s->requestReadNs = s->replyReadNs;
+		if(s->firstReadNs == 0)
+			s->firstReadNs = s->requestReadNs;
+	}
+
+	s->state = uring_state::write_reply;
+	captureMessage(s->captureId, capture_event::reply, s->data, s->messageSize);
+
+	return submitWrite(w, s, s->clientSock, s->pending.empty() ? s->clientSock : INVALID_SOCKET);
+}
+
+// Move the pipelined bytes that fit after the ones already in the buffer
+void uring_reactor::takePending(session* s) {
+	size_t size = std::min(s->pending.size(), (size_t) (s->capacity - s->filled));
+
+	memcpy(s->data + s->filled, s->pending.data(), size);
+	s->filled += (int32_t) size;
+	s->pending.erase(s->pending.begin(), s->pending.begin() + size);
+	chargePending(s);
+}
+
+// Keep the budget charge of the pipelined bytes in line with their vector, freed once it is empty
+void uring_reactor::chargePending(session* s) {
+	if(s->pending.empty())
+		std::vector<char>().swap(s->pending);
+
+	size_t capacity = s->pending.capacity();
+	if(capacity > s->pendingCharged)
+		buffer_pool::instance().chargeExternal(capacity - s->pendingCharged);
+	else if(capacity < s->pendingCharged)
+		buffer_pool::instance().releaseExternal(s->pendingCharged - capacity);
+	s->pendingCharged = capacity;
+}
+
+bool uring_reactor::submitRead(worker& w, session* s, SOCKET sock) {
+	struct io_uring_sqe* sqe = w.ring.getSqe();
+
+	if(sqe == NULL)
+		return false;
+
+	// Reads may take more than the current message, the rest is kept for the next one.
+	// Skipped messages are read over the start of the buffer, never past their end.
+	bool skipping = s->state == uring_state::skip_request || s->state == uring_state::skip_reply;
+	int32_t size = skipping ? std::min(s->skipRemaining, s->capacity) : s->capacity - s->filled;
+	prepareIo(sqe, sock, s->data + s->filled, size, s->fixedIndex, false, (uintptr_t) s);
+	s->inflight++;
+
+	return true;
+}
+
+bool uring_reactor::submitWrite(worker& w, session* s, SOCKET sock, SOCKET linkedReadSock) {
+	bool linked = linkedReadSock != INVALID_SOCKET;
+
+	if(!w.ring.reserveSqes(linked ? 2 : 1))
+		return false;
+
+	struct io_uring_sqe* sqe = w.ring.getSqe();
+	prepareIo(sqe, sock, s->data + s->written, s->messageSize - s->written, s->fixedIndex, true, (uintptr_t) s);
+	s->inflight++;
+
+	if(!linked)
+		return true;
+
+	// The read only starts once the whole message is written, a short write cancels it.
+	// It reuses the buffer of the message being written.
+	sqe->flags |= IOSQE_IO_LINK;
+	return submitRead(w, s, linkedReadSock);
+}
+
+bool uring_reactor::useFixedBuffer(worker& w, session* s) {
+	if(w.freeSlots.empty() || s->filled > URING_SLOT_SIZE)
+		return false;
+
+	int index = w.freeSlots.back();
+	char* slot = (char*) w.slots + index * URING_SLOT_SIZE;
+
+	w.freeSlots.pop_back();
+	if(s->filled > 0)
+		memcpy(slot, s->data, s->filled);
+
+	s->pooled = message_buffer();
+	s->fixedIndex = index;
+	s->data = slot;
+	s->capacity = URING_SLOT_SIZE;
+
+	return true;
+}
+
+bool uring_reactor::growBuffer(worker& w, session* s, int32_t size) {
+	if(s->data != NULL && s->capacity >= size)
+		return true;
+
+	if(!s->pooled.reserve(size, s->fixedIndex < 0 ? s->filled : 0))
+		return false;
+
+	if(s->fixedIndex >= 0) {
+		memcpy(s->pooled.data(), s->data, s->filled);
+		w.freeSlots.push_back(s->fixedIndex);
+		s->fixedIndex = -1;
+	}
+
+	s->data = s->pooled.data();
+	s->capacity = (int32_t) s->pooled.capacity();
+
+	return true;
+}
+
+void uring_reactor::closeSession(worker& w, session* s) {
+	w.sessions.erase(s);
+	activeSessions--;
+	relay_stats::instance().onSessionClosed();
+	closeCaptureSession(s->captureId);
+
+	if(s->fixedIndex >= 0)
+		w.freeSlots.push_back(s->fixedIndex);
+	if(s->pendingCharged > 0)
+		buffer_pool::instance().releaseExternal(s->pendingCharged);
+
+	closesocket(s->clientSock);
+	closesocket(s->upstreamSock);
+	delete s;
+}
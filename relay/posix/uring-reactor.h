@@ -0,0 +1,60 @@
+#pragma once
+
+#include "relay/socket-stream.h"
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+// Event-driven server doing all socket I/O through io_uring, one ring per thread.
+// Messages are read into registered fixed buffers, and each forwarded message is submitted
+// together with the read of the answer as a linked write -> read pair, so a full request/reply
+// cycle costs two completions and the operations of every session share a single io_uring_enter.
+// Messages whose buffer is refused by the memory budget are read and dropped, and answered with SSH_AGENT_FAILURE.
+// Registered buffers and pipelined bytes are charged to the budget too, but never refused.
+// Requires Linux 5.5 or later, run() fails when io_uring is not available.
+class uring_reactor {
+public:
+	uring_reactor(SOCKET listenSock, socket_connector connectUpstream, int32_t maxMessageSize);
+	~uring_reactor();
+
+	uring_reactor(const uring_reactor&) = delete;
+	uring_reactor& operator=(const uring_reactor&) = delete;
+
+	// Run the event loop on threadCount threads, including the calling one.
+	// Returns when stop() is called or false if the reactor could not be initialized.
+	bool run(int threadCount);
+
+	// Make all run() threads return. Can be called from any thread.
+	void stop();
+
+	size_t getActiveSessions() const { return activeSessions; }
+
+private:
+	struct session;
+	struct worker;
+
+	void loop(worker& w);
+	void onAccept(worker& w, int result);
+	void onComplete(worker& w, session* s, bool isWrite, int result);
+	void advance(worker& w, session* s);
+	bool onMessageRead(worker& w, session* s);
+	bool skipMessage(worker& w, session* s, int32_t size);
+	bool continueSkip(worker& w, session* s);
+	void takePending(session* s);
+	void chargePending(session* s);
+	bool submitRead(worker& w, session* s, SOCKET sock);
+	bool submitWrite(worker& w, session* s, SOCKET sock, SOCKET linkedReadSock);
+	bool submitAccept(worker& w);
+	bool useFixedBuffer(worker& w, session* s);
+	bool growBuffer(worker& w, session* s, int32_t size);
+	void closeSession(worker& w, session* s);
+
+	SOCKET listenSock;
+	socket_connector connectUpstream;
+	int32_t maxMessageSize;
+	int stopFd;
+
+	std::vector<std::unique_ptr<worker>> workers;
+	std::atomic<size_t> activeSessions;
+};
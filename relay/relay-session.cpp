@@ -0,0 +1,208 @@
+#include "relay/relay-session.h"
+#include "relay/agent-message.h"
+#include "relay/logger.h"
+#include "relay/relay-stats.h"
+#include "relay/traffic-capture.h"
+
+#include <algorithm>
+
+relay_session::relay_session(int32_t maxMessageSize, identity_cache* identityCache)
+    : messageSize(0),
+      maxMessageSize(maxMessageSize),
+      state(relay_state::read_request),
+      transferred(0),
+      skipRemaining(0),
+      identityCache(identityCache),
+      requestType(-1),
+      cacheToken(0),
+      bound(false),
+      requestSize(0),
+      firstReadNs(0),
+      requestReadNs(0),
+      replyReadNs(0),
+      captureId(openCaptureSession()) {
+	clientParser.begin(buffer, maxMessageSize);
+}
+
+relay_session::~relay_session() {
+	closeCaptureSession(captureId);
+}
+
+relay_io relay_session::currentIo() {
+	relay_io io;
+
+	switch(state) {
+		case relay_state::read_request:
+		case relay_state::read_reply: {
+			agent_frame_parser& parser = state == relay_state::read_request ? clientParser : upstreamParser;
+			agent_read_span spans[2];
+
+			io.endpoint = state == relay_state::read_request ? relay_endpoint::client : relay_endpoint::upstream;
+			io.isWrite = false;
+
+			// Event loops read into the first span only, bytes past the end of the message still go to the parser
+			int spanCount = parser.prepareRead(buffer, spans);
+			if(spanCount == 0 && parser.frameSize() > 0 && buffer.capacity() > 0) {
+				// The buffer holds the head of the message but cannot grow for the rest, usually the memory budget
+				bool reply = state == relay_state::read_reply;
+				logWarning("%s of %d bytes over the memory budget, answering a failure\n",
+				           reply ? "Reply" : "Request",
+				           parser.frameSize());
+				relay_stats::instance().onMessageOverBudget(reply, false);
+				if(!reply) {
+					requestSize = parser.frameSize();
+					requestType = parser.receivedSize() >= 5 ? (uint8_t) buffer.data()[4] : -1;
+				}
+				skipRemaining = parser.frameSize() - parser.receivedSize();
+				state = reply ? relay_state::skip_reply : relay_state::skip_request;
+				return currentIo();
+			} else if(spanCount == 0) {
+				// Out of memory, a zero sized I/O makes the event loop report an error
+				io.buffer = NULL;
+				io.size = 0;
+			} else {
+				io.buffer = spans[0].data;
+				io.size = spans[0].size;
+			}
+			return io;
+		}
+		case relay_state::skip_request:
+		case relay_state::skip_reply:
+			// The rest of the message is read over the head already in the buffer, never past its end
+			io.endpoint = state == relay_state::skip_request ? relay_endpoint::client : relay_endpoint::upstream;
+			io.isWrite = false;
+			io.buffer = buffer.data();
+			io.size = std::min(skipRemaining, (int32_t) buffer.capacity());
+			return io;
+		case relay_state::write_request:
+		case relay_state::write_reply:
+		default:
+			io.endpoint = state == relay_state::write_request ? relay_endpoint::upstream : relay_endpoint::client;
+			io.isWrite = true;
+			io.buffer = buffer.data() + transferred;
+			io.size = messageSize - transferred;
+			return io;
+	}
+}
+
+bool relay_session::onIoComplete(int32_t result) {
+	if(result <= 0) {
+		if(result < 0)
+			logWarning("Relay session I/O failed: %d\n", result);
+		return false;
+	}
+
+	switch(state) {
+		case relay_state::read_request:
+		case relay_state::read_reply:
+			if(state == relay_state::read_request && firstReadNs == 0)
+				firstReadNs = monotonicNs();
+			return onFrameStatus(
+			    (state == relay_state::read_request ? clientParser : upstreamParser).onRead(buffer, result));
+
+		case relay_state::skip_request:
+		case relay_state::skip_reply:
+			skipRemaining -= result;
+			if(skipRemaining <= 0)
+				onMessageSkipped();
+			return true;
+
+		case relay_state::write_request:
+		case relay_state::write_reply:
+			transferred += result;
+			if(transferred < messageSize)
+				return true;
+
+			transferred = 0;
+			if(state == relay_state::write_request) {
+				state = relay_state::read_reply;
+				return onFrameStatus(upstreamParser.begin(buffer, maxMessageSize));
+			}
+
+			relay_stats::instance().recordMessage(requestType,
+			                                      requestSize,
+			                                      messageSize,
+			                                      requestReadNs - firstReadNs,
+			                                      replyReadNs - requestReadNs,
+			                                      monotonicNs() - replyReadNs);
+			firstReadNs = 0;
+			state = relay_state::read_request;
+			if(clientParser.pendingSize() == 0)
+				buffer.shrink();
+			// A pipelined request may already be complete
+			return onFrameStatus(clientParser.begin(buffer, maxMessageSize));
+	}
+
+	return true;
+}
+
+void relay_session::releaseIdleBuffer() {
+	if(state == relay_state::read_request && clientParser.isEmpty())
+		buffer.release();
+}
+
+bool relay_session::onFrameStatus(frame_status status) {
+	if(status == frame_status::invalid)
+		return false;
+
+	if(status == frame_status::complete)
+		onMessageRead();
+
+	return true;
+}
+
+void relay_session::onMessageRead() {
+	transferred = 0;
+
+	if(state == relay_state::read_request) {
+		messageSize = clientParser.frameSize();
+		requestSize = messageSize;
+		requestType = agentMessageType(buffer.data(), messageSize);
+		requestReadNs = monotonicNs();
+		if(firstReadNs == 0)
+			firstReadNs = requestReadNs;
+		state = relay_state::write_request;
+		captureMessage(captureId, capture_event::request, buffer.data(), messageSize);
+
+		if(isSessionBindRequest(buffer.data(), messageSize))
+			bound = true;
+
+		int32_t replySize = answerStatsRequest(buffer.data(), messageSize, buffer);
+		if(replySize == 0 && identityCache && !bound)
+			replySize = identityCache->lookup(buffer.data(), messageSize, buffer);
+		if(replySize > 0) {
+			messageSize = replySize;
+			replyReadNs = requestReadNs;
+			state = relay_state::write_reply;
+			captureMessage(captureId, capture_event::reply, buffer.data(), messageSize);
+			return;
+		}
+		if(identityCache)
+			cacheToken = identityCache->onForward(buffer.data(), messageSize);
+	} else {
+		replyReadNs = monotonicNs();
+		messageSize = upstreamParser.frameSize();
+		state = relay_state::write_reply;
+		captureMessage(captureId, capture_event::reply, buffer.data(), messageSize);
+		if(identityCache && identity_cache::wantsReply(requestType, bound))
+			identityCache->onReply(requestType, cacheToken, buffer.data(), messageSize);
+	}
+}
+
+void relay_session::onMessageSkipped() {
+	transferred = 0;
+	messageSize = writeStatusReply(buffer, SSH_AGENT_FAILURE);
+	replyReadNs = monotonicNs();
+
+	if(state == relay_state::skip_request) {
+		requestReadNs = replyReadNs;
+		if(firstReadNs == 0)
+			firstReadNs = requestReadNs;
+	} else if(identityCache && identity_cache::wantsReply(requestType, bound)) {
+		// The agent may have changed its identities even though its reply was dropped
+		identityCache->onReply(requestType, cacheToken, buffer.data(), messageSize);
+	}
+
+	state = relay_state::write_reply;
+	captureMessage(captureId, capture_event::reply, buffer.data(), messageSize);
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "relay/buffer-pool.h"
+#include "relay/frame-parser.h"
+#include "relay/identity-cache.h"
+
+#include <stdint.h>
+
+enum class relay_endpoint { client, upstream };
+
+// I/O operation a relay session is waiting for.
+struct relay_io {
+	relay_endpoint endpoint;
+	bool isWrite;
+	char* buffer;
+	int32_t size;
+};
+
+// Non-blocking counterpart of runAgentSession used by event-driven servers.
+// The session alternates between reading a request from the client, writing it upstream,
+// reading the reply from upstream and writing it back to the client.
+// The event loop performs the I/O returned by currentIo() (partial transfers are fine)
+// and reports its result with onIoComplete().
+// The session holds a single pooled buffer, grown from the length header of each message.
+// Bytes of pipelined requests read along with the current one are kept by the client frame parser.
+// When identityCache is not NULL, cached identity lists are written back without going upstream,
+// until the session is bound with session-bind@openssh.com.
+// Statistics requests are answered by the session itself and every cycle is recorded in relay_stats.
+// Requests and replies are also recorded by the traffic capture when it is enabled.
+// Messages whose buffer is refused by the memory budget are skipped and answered with SSH_AGENT_FAILURE
+// without waiting, event loop threads cannot block.
+class relay_session {
+public:
+	explicit relay_session(int32_t maxMessageSize, identity_cache* identityCache = NULL);
+	~relay_session();
+
+	relay_session(const relay_session&) = delete;
+	relay_session& operator=(const relay_session&) = delete;
+
+	relay_io currentIo();
+
+	// result is the number of bytes transferred, 0 on EOF or a negative error code.
+	// Returns false when the session is finished and must be closed.
+	bool onIoComplete(int32_t result);
+
+	// Called by readiness based event loops before waiting for the client. When no request is in progress,
+	// the message buffer goes back to the pool, so idle sessions only cost this object and their sockets.
+	void releaseIdleBuffer();
+
+private:
+	enum class relay_state { read_request, write_request, read_reply, write_reply, skip_request, skip_reply };
+
+	bool onFrameStatus(frame_status status);
+	void onMessageRead();
+	void onMessageSkipped();
+
+	message_buffer buffer;
+	agent_frame_parser clientParser;
+	agent_frame_parser upstreamParser;
+	int32_t messageSize;
+	int32_t maxMessageSize;
+	relay_state state;
+	int32_t transferred;
+	int32_t skipRemaining;  // bytes of a message over the memory budget still to be read and dropped
+
+	identity_cache* identityCache;
+	int requestType;
+	uint64_t cacheToken;
+	bool bound;  // session-bind@openssh.com was relayed, identity lists are filtered for this session
+
+	// Phase timestamps of the current request for relay_stats
+	int32_t requestSize;
+	uint64_t firstReadNs;
+	uint64_t requestReadNs;
+	uint64_t replyReadNs;
+
+	uint32_t captureId;  // 0 when traffic capture is disabled
+};
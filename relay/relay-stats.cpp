@@ -0,0 +1,402 @@
+#include "relay/relay-stats.h"
+#include "relay/agent-message.h"
+#include "relay/logger.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+
+#include <tlhelp32.h>
+#endif
+
+latency_histogram::latency_histogram() noexcept : count(0), maxValue(0) {
+	for(std::atomic<uint64_t>& bucket : buckets) {
+		bucket.store(0, std::memory_order_relaxed);
+	}
+}
+
+int latency_histogram::bucketIndex(uint64_t value) {
+	if(value < 16)
+		return (int) value;
+
+	int exponent = 4;
+	while(exponent < 35 && (value >> (exponent + 1)) != 0) {
+		exponent++;
+	}
+	if((value >> (exponent + 1)) != 0)
+		return LATENCY_HISTOGRAM_BUCKETS - 1;
+
+	return 16 + (exponent - 4) * 8 + (int) ((value >> (exponent - 3)) & 7);
+}
+
+uint64_t latency_histogram::bucketUpperBound(int index) {
+	if(index < 16)
+		return (uint64_t) index;
+
+	int exponent = (index - 16) / 8 + 4;
+	uint64_t subBucket = (uint64_t) ((index - 16) % 8);
+
+	return ((8 + subBucket + 1) << (exponent - 3)) - 1;
+}
+
+void latency_histogram::record(uint64_t valueUs) {
+	buckets[bucketIndex(valueUs)].fetch_add(1, std::memory_order_relaxed);
+	count.fetch_add(1, std::memory_order_relaxed);
+
+	uint64_t previousMax = maxValue.load(std::memory_order_relaxed);
+	while(valueUs > previousMax && !maxValue.compare_exchange_weak(previousMax, valueUs, std::memory_order_relaxed)) {
+	}
+}
+
+uint64_t latency_histogram::getQuantile(double quantile) const {
+	uint64_t total = getCount();
+	uint64_t target = (uint64_t) (quantile * (double) total + 0.999999);
+	uint64_t cumulated = 0;
+
+	if(total == 0)
+		return 0;
+	if(target == 0)
+		target = 1;
+
+	for(int i = 0; i < LATENCY_HISTOGRAM_BUCKETS; i++) {
+		cumulated += buckets[i].load(std::memory_order_relaxed);
+		if(cumulated >= target) {
+			uint64_t bound = bucketUpperBound(i);
+			return bound < getMax() ? bound : getMax();
+		}
+	}
+
+	return getMax();
+}
+
+relay_stats& relay_stats::instance() {
+	static relay_stats stats;
+	return stats;
+}
+
+relay_stats::relay_stats()
+    : startNs(monotonicNs()),
+      activeSessions(0),
+      totalSessions(0),
+      queuedSessions(0),
+      maxQueuedSessions(0),
+      admittedSessions(0),
+      refusedSessions(0),
+      expiredSessions(0),
+      prefetchHits(0),
+      prefetchMisses(0),
+      reapedSessions(0),
+      reclaimedBytes(0),
+      parkedUpstreams(0),
+      reattachedUpstreams(0),
+      streamedRequests(0),
+      streamedBytes(0),
+      splicedBytes(0),
+      budgetAdmitted(0),
+      budgetRejectedRequests(0),
+      budgetRejectedReplies(0) {
+	for(int i = 0; i < 256; i++) {
+		typeCount[i].store(0, std::memory_order_relaxed);
+		typeRequestBytes[i].store(0, std::memory_order_relaxed);
+		typeReplyBytes[i].store(0, std::memory_order_relaxed);
+	}
+}
+
+void relay_stats::onSessionOpened() {
+	activeSessions.fetch_add(1, std::memory_order_relaxed);
+	totalSessions.fetch_add(1, std::memory_order_relaxed);
+}
+
+void relay_stats::onSessionClosed() {
+	activeSessions.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void relay_stats::onSessionQueued() {
+	size_t queued = queuedSessions.fetch_add(1, std::memory_order_relaxed) + 1;
+
+	size_t previousMax = maxQueuedSessions.load(std::memory_order_relaxed);
+	while(queued > previousMax &&
+	      !maxQueuedSessions.compare_exchange_weak(previousMax, queued, std::memory_order_relaxed)) {
+	}
+}
+
+void relay_stats::onSessionAdmitted(uint64_t waitNs) {
+	queuedSessions.fetch_sub(1, std::memory_order_relaxed);
+	admittedSessions.fetch_add(1, std::memory_order_relaxed);
+	queueWait.record(waitNs / 1000);
+}
+
+void relay_stats::onSessionRefused(bool wasQueued) {
+	if(wasQueued) {
+		queuedSessions.fetch_sub(1, std::memory_order_relaxed);
+		expiredSessions.fetch_add(1, std::memory_order_relaxed);
+	} else {
+		refusedSessions.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+void relay_stats::onIdentityPrefetch(bool used) {
+	if(used)
+		prefetchHits.fetch_add(1, std::memory_order_relaxed);
+	else
+		prefetchMisses.fetch_add(1, std::memory_order_relaxed);
+}
+
+void relay_stats::onSessionReaped(size_t reclaimedBytes) {
+	reapedSessions.fetch_add(1, std::memory_order_relaxed);
+	this->reclaimedBytes.fetch_add(reclaimedBytes, std::memory_order_relaxed);
+}
+
+void relay_stats::onUpstreamParked() {
+	parkedUpstreams.fetch_add(1, std::memory_order_relaxed);
+}
+
+void relay_stats::onUpstreamReattached() {
+	reattachedUpstreams.fetch_add(1, std::memory_order_relaxed);
+}
+
+void relay_stats::onRequestScheduled(bool priority, uint64_t waitNs) {
+	(priority ? priorityWait : clientQueueWait).record(waitNs / 1000);
+}
+
+void relay_stats::onRequestStreamed(uint64_t bodyBytes) {
+	streamedRequests.fetch_add(1, std::memory_order_relaxed);
+	streamedBytes.fetch_add(bodyBytes, std::memory_order_relaxed);
+}
+
+void relay_stats::onBytesSpliced(uint64_t bytes) {
+	splicedBytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void relay_stats::onMessageOverBudget(bool reply, bool admitted) {
+	if(admitted)
+		budgetAdmitted.fetch_add(1, std::memory_order_relaxed);
+	else
+		(reply ? budgetRejectedReplies : budgetRejectedRequests).fetch_add(1, std::memory_order_relaxed);
+}
+
+int relay_stats::typeGroup(int type) {
+	switch(type) {
+		case SSH2_AGENTC_REQUEST_IDENTITIES:
+			return group_request_identities;
+		case SSH2_AGENTC_SIGN_REQUEST:
+			return group_sign_request;
+		case SSH2_AGENTC_ADD_IDENTITY:
+		case SSH2_AGENTC_ADD_ID_CONSTRAINED:
+		case SSH_AGENTC_ADD_SMARTCARD_KEY:
+		case SSH_AGENTC_ADD_SMARTCARD_KEY_CONSTRAINED:
+			return group_add_identity;
+		case SSH2_AGENTC_REMOVE_IDENTITY:
+		case SSH2_AGENTC_REMOVE_ALL_IDENTITIES:
+		case SSH_AGENTC_REMOVE_SMARTCARD_KEY:
+			return group_remove_identity;
+		case SSH_AGENTC_LOCK:
+		case SSH_AGENTC_UNLOCK:
+			return group_lock;
+		case SSH_AGENTC_EXTENSION:
+			return group_extension;
+		default:
+			return group_other;
+	}
+}
+
+void relay_stats::recordMessage(int type,
+                                int32_t requestSize,
+                                int32_t replySize,
+                                uint64_t clientReadNs,
+                                uint64_t upstreamNs,
+                                uint64_t replyWriteNs) {
+	// Messages without a type byte are counted as type 0
+	int index = type < 0 ? 0 : type & 0xff;
+
+	typeCount[index].fetch_add(1, std::memory_order_relaxed);
+	typeRequestBytes[index].fetch_add((uint64_t) requestSize, std::memory_order_relaxed);
+	typeReplyBytes[index].fetch_add((uint64_t) replySize, std::memory_order_relaxed);
+
+	latency_histogram* group = latencies[typeGroup(type)];
+	group[phase_client_read].record(clientReadNs / 1000);
+	group[phase_upstream].record(upstreamNs / 1000);
+	group[phase_reply_write].record(replyWriteNs / 1000);
+}
+
+static long currentThreadCount() {
+#ifdef _WIN32
+	HANDLE snapshot = CreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, 0);
+	THREADENTRY32 entry;
+	long count = 0;
+
+	if(snapshot == INVALID_HANDLE_VALUE)
+		return -1;
+
+	entry.dwSize = sizeof(entry);
+	for(BOOL found = Thread32First(snapshot, &entry); found; found = Thread32Next(snapshot, &entry)) {
+		if(entry.th32OwnerProcessID == GetCurrentProcessId())
+			count++;
+	}
+	CloseHandle(snapshot);
+
+	return count;
+#else
+	FILE* file = fopen("/proc/self/status", "r");
+	char line[256];
+	long count = -1;
+
+	if(file == NULL)
+		return -1;
+	while(fgets(line, sizeof(line), file)) {
+		if(sscanf(line, "Threads: %ld", &count) == 1)
+			break;
+	}
+	fclose(file);
+
+	return count;
+#endif
+}
+
+static void appendFormat(std::string& out, const char* format, ...) LOG_PRINTF_FORMAT(2, 3);
+
+static void appendFormat(std::string& out, const char* format, ...) {
+	char chunk[256];
+	va_list args;
+
+	va_start(args, format);
+	int size = vsnprintf(chunk, sizeof(chunk), format, args);
+	va_end(args);
+
+	if(size > 0)
+		out.append(chunk, (size_t) size < sizeof(chunk) ? (size_t) size : sizeof(chunk) - 1);
+}
+
+std::string relay_stats::toJson() const {
+	static const char* const groupNames[group_count] = {
+	    "request_identities", "sign_request", "add_identity", "remove_identity", "lock", "extension", "other"};
+	static const char* const phaseNames[phase_count] = {"client_read", "upstream", "reply_write"};
+	buffer_pool_stats bufferStats = buffer_pool::instance().getStats();
+	std::string out;
+
+	appendFormat(out,
+	             "{\"uptime_s\":%.1f,\"active_sessions\":%zu,\"total_sessions\":%llu,\"threads\":%ld,",
+	             (double) (monotonicNs() - startNs) / 1e9,
+	             getActiveSessions(),
+	             (unsigned long long) totalSessions.load(std::memory_order_relaxed),
+	             currentThreadCount());
+	appendFormat(out,
+	             "\"buffers\":{\"in_use\":%zu,\"cached\":%zu,\"high_water\":%zu,\"budget\":%zu,\"refused\":%llu},",
+	             bufferStats.bytesInUse,
+	             bufferStats.bytesCached,
+	             bufferStats.highWaterBytes,
+	             bufferStats.budgetBytes,
+	             (unsigned long long) bufferStats.refusals);
+	appendFormat(out,
+	             "\"admission\":{\"queued\":%zu,\"max_queued\":%zu,\"admitted\":%llu,\"refused\":%llu,"
+	             "\"expired\":%llu,\"wait_us\":{\"count\":%llu,\"p50\":%llu,\"p99\":%llu,\"max\":%llu}},",
+	             queuedSessions.load(std::memory_order_relaxed),
+	             maxQueuedSessions.load(std::memory_order_relaxed),
+	             (unsigned long long) admittedSessions.load(std::memory_order_relaxed),
+	             (unsigned long long) refusedSessions.load(std::memory_order_relaxed),
+	             (unsigned long long) expiredSessions.load(std::memory_order_relaxed),
+	             (unsigned long long) queueWait.getCount(),
+	             (unsigned long long) queueWait.getQuantile(0.5),
+	             (unsigned long long) queueWait.getQuantile(0.99),
+	             (unsigned long long) queueWait.getMax());
+	appendFormat(out,
+	             "\"prefetch\":{\"hits\":%llu,\"misses\":%llu},",
+	             (unsigned long long) prefetchHits.load(std::memory_order_relaxed),
+	             (unsigned long long) prefetchMisses.load(std::memory_order_relaxed));
+	appendFormat(out,
+	             "\"idle\":{\"reaped\":%llu,\"reclaimed_bytes\":%llu,\"parked\":%llu,\"reattached\":%llu},",
+	             (unsigned long long) reapedSessions.load(std::memory_order_relaxed),
+	             (unsigned long long) reclaimedBytes.load(std::memory_order_relaxed),
+	             (unsigned long long) parkedUpstreams.load(std::memory_order_relaxed),
+	             (unsigned long long) reattachedUpstreams.load(std::memory_order_relaxed));
+	appendFormat(out,
+	             "\"scheduler\":{\"priority_wait_us\":{\"count\":%llu,\"p50\":%llu,\"p99\":%llu,\"max\":%llu},"
+	             "\"client_wait_us\":{\"count\":%llu,\"p50\":%llu,\"p99\":%llu,\"max\":%llu}},",
+	             (unsigned long long) priorityWait.getCount(),
+	             (unsigned long long) priorityWait.getQuantile(0.5),
+	             (unsigned long long) priorityWait.getQuantile(0.99),
+	             (unsigned long long) priorityWait.getMax(),
+	             (unsigned long long) clientQueueWait.getCount(),
+	             (unsigned long long) clientQueueWait.getQuantile(0.5),
+	             (unsigned long long) clientQueueWait.getQuantile(0.99),
+	             (unsigned long long) clientQueueWait.getMax());
+	appendFormat(out,
+	             "\"streaming\":{\"requests\":%llu,\"bytes\":%llu,\"spliced_bytes\":%llu},",
+	             (unsigned long long) streamedRequests.load(std::memory_order_relaxed),
+	             (unsigned long long) streamedBytes.load(std::memory_order_relaxed),
+	             (unsigned long long) splicedBytes.load(std::memory_order_relaxed));
+	appendFormat(out,
+	             "\"budget\":{\"admitted\":%llu,\"rejected_requests\":%llu,\"rejected_replies\":%llu},",
+	             (unsigned long long) budgetAdmitted.load(std::memory_order_relaxed),
+	             (unsigned long long) budgetRejectedRequests.load(std::memory_order_relaxed),
+	             (unsigned long long) budgetRejectedReplies.load(std::memory_order_relaxed));
+
+	out += "\"types\":[";
+	bool first = true;
+	for(int i = 0; i < 256; i++) {
+		uint64_t messageCount = typeCount[i].load(std::memory_order_relaxed);
+		if(messageCount == 0)
+			continue;
+		appendFormat(out,
+		             "%s{\"type\":%d,\"count\":%llu,\"request_bytes\":%llu,\"reply_bytes\":%llu}",
+		             first ? "" : ",",
+		             i,
+		             (unsigned long long) messageCount,
+		             (unsigned long long) typeRequestBytes[i].load(std::memory_order_relaxed),
+		             (unsigned long long) typeReplyBytes[i].load(std::memory_order_relaxed));
+		first = false;
+	}
+	out += "],";
+
+	// Latency percentiles in microseconds
+	out += "\"latency_us\":{";
+	first = true;
+	for(int group = 0; group < group_count; group++) {
+		if(latencies[group][phase_upstream].getCount() == 0)
+			continue;
+		appendFormat(out, "%s\"%s\":{", first ? "" : ",", groupNames[group]);
+		for(int phase = 0; phase < phase_count; phase++) {
+			const latency_histogram& histogram = latencies[group][phase];
+			appendFormat(out,
+			             "%s\"%s\":{\"count\":%llu,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu}",
+			             phase == 0 ? "" : ",",
+			             phaseNames[phase],
+			             (unsigned long long) histogram.getCount(),
+			             (unsigned long long) histogram.getQuantile(0.5),
+			             (unsigned long long) histogram.getQuantile(0.9),
+			             (unsigned long long) histogram.getQuantile(0.99),
+			             (unsigned long long) histogram.getQuantile(0.999),
+			             (unsigned long long) histogram.getMax());
+		}
+		out += "}";
+		first = false;
+	}
+	out += "}}";
+
+	return out;
+}
+
+int32_t answerStatsRequest(const void* request, int32_t requestSize, message_buffer& reply) {
+	static const char extensionName[] = RELAY_STATS_EXTENSION;
+	const uint8_t* message = (const uint8_t*) request;
+	const int32_t nameSize = (int32_t) sizeof(extensionName) - 1;
+
+	if(agentMessageType(request, requestSize) != SSH_AGENTC_EXTENSION || requestSize < 9 + nameSize ||
+	   readu32(message + 5) != (uint32_t) nameSize || memcmp(message + 9, extensionName, nameSize) != 0)
+		return 0;
+
+	std::string json = relay_stats::instance().toJson();
+	int32_t replySize = 9 + (int32_t) json.size();
+	if(!reply.reserve(replySize, 0))
+		return 0;
+
+	writeu32(reply.data(), (uint32_t) replySize - 4);
+	reply.data()[4] = SSH_AGENT_SUCCESS;
+	writeu32(reply.data() + 5, (uint32_t) json.size());
+	memcpy(reply.data() + 9, json.data(), json.size());
+
+	return replySize;
+}
@@ -0,0 +1,156 @@
+#pragma once
+
+#include "relay/buffer-pool.h"
+
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+
+// Name of the agent extension (SSH_AGENTC_EXTENSION) answered by the proxy itself with its statistics.
+#define RELAY_STATS_EXTENSION "stats@agent-relay"
+
+// Latency buckets: exact below 16us, then 8 sub-buckets per power of two (values kept within 12.5%)
+// up to 2^36us, larger values go to the last bucket.
+#define LATENCY_HISTOGRAM_BUCKETS (16 + 32 * 8)
+
+// Monotonic time in nanoseconds.
+inline uint64_t monotonicNs() {
+	return (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(
+	           std::chrono::steady_clock::now().time_since_epoch())
+	    .count();
+}
+
+// HDR-style log-linear histogram of latencies in microseconds, updated with relaxed atomics.
+class latency_histogram {
+public:
+	latency_histogram() noexcept;
+
+	void record(uint64_t valueUs);
+
+	uint64_t getCount() const { return count.load(std::memory_order_relaxed); }
+	uint64_t getMax() const { return maxValue.load(std::memory_order_relaxed); }
+
+	// Upper bound of the bucket holding the given quantile (0 to 1).
+	uint64_t getQuantile(double quantile) const;
+
+private:
+	static int bucketIndex(uint64_t value);
+	static uint64_t bucketUpperBound(int index);
+
+	std::atomic<uint64_t> buckets[LATENCY_HISTOGRAM_BUCKETS];
+	std::atomic<uint64_t> count;
+	std::atomic<uint64_t> maxValue;
+};
+
+// Process-wide counters of the relayed messages, fed by the session loops.
+// Each request/reply cycle is split in three phases: client read (first to last byte of the request),
+// upstream round trip (request forwarded to reply received) and reply write.
+class relay_stats {
+public:
+	static relay_stats& instance();
+
+	void onSessionOpened();
+	void onSessionClosed();
+
+	// Admission control of session_pool: a client waits for a worker, then is admitted or refused.
+	// Clients refused without waiting were never queued.
+	void onSessionQueued();
+	void onSessionAdmitted(uint64_t waitNs);
+	void onSessionRefused(bool wasQueued);
+
+	// First request of a session whose identity list was prefetched, used if it was REQUEST_IDENTITIES.
+	void onIdentityPrefetch(bool used);
+
+	// Idle connections closed by idle_reaper: a session ended after its client stayed silent, releasing
+	// reclaimedBytes of message buffers, or an idle upstream connection closed and reopened on the next request.
+	void onSessionReaped(size_t reclaimedBytes);
+	void onUpstreamParked();
+	void onUpstreamReattached();
+
+	// Request sent upstream by upstream_scheduler after waiting waitNs, in the priority lane or its client's queue.
+	void onRequestScheduled(bool priority, uint64_t waitNs);
+
+	// Request whose bodyBytes after its head were forwarded upstream while read from the client, without being
+	// buffered, and bytes of such bodies moved by the kernel without being copied to the relay's memory.
+	void onRequestStreamed(uint64_t bodyBytes);
+	void onBytesSpliced(uint64_t bytes);
+
+	// Message whose buffer was refused by the memory budget, read once other sessions released memory
+	// (admitted) or skipped and answered with SSH_AGENT_FAILURE.
+	void onMessageOverBudget(bool reply, bool admitted);
+
+	// Record a request/reply cycle, times are in nanoseconds.
+	void recordMessage(int type,
+	                   int32_t requestSize,
+	                   int32_t replySize,
+	                   uint64_t clientReadNs,
+	                   uint64_t upstreamNs,
+	                   uint64_t replyWriteNs);
+
+	size_t getActiveSessions() const { return activeSessions.load(std::memory_order_relaxed); }
+
+	// Statistics as a JSON object: sessions, threads, buffer memory, admission control, prefetch, idle connections,
+	// scheduler waits, streamed requests, messages over the memory budget, per type counters and latency percentiles.
+	std::string toJson() const;
+
+private:
+	relay_stats();
+
+	enum { phase_client_read, phase_upstream, phase_reply_write, phase_count };
+
+	// Latencies are kept for groups of message types
+	enum {
+		group_request_identities,
+		group_sign_request,
+		group_add_identity,
+		group_remove_identity,
+		group_lock,
+		group_extension,
+		group_other,
+		group_count
+	};
+
+	static int typeGroup(int type);
+
+	uint64_t startNs;
+	std::atomic<size_t> activeSessions;
+	std::atomic<uint64_t> totalSessions;
+
+	std::atomic<uint64_t> typeCount[256];
+	std::atomic<uint64_t> typeRequestBytes[256];
+	std::atomic<uint64_t> typeReplyBytes[256];
+
+	latency_histogram latencies[group_count][phase_count];
+
+	std::atomic<size_t> queuedSessions;
+	std::atomic<size_t> maxQueuedSessions;
+	std::atomic<uint64_t> admittedSessions;
+	std::atomic<uint64_t> refusedSessions;
+	std::atomic<uint64_t> expiredSessions;
+	latency_histogram queueWait;
+
+	std::atomic<uint64_t> prefetchHits;
+	std::atomic<uint64_t> prefetchMisses;
+
+	std::atomic<uint64_t> reapedSessions;
+	std::atomic<uint64_t> reclaimedBytes;
+	std::atomic<uint64_t> parkedUpstreams;
+	std::atomic<uint64_t> reattachedUpstreams;
+
+	latency_histogram priorityWait;
+	latency_histogram clientQueueWait;
+
+	std::atomic<uint64_t> streamedRequests;
+	std::atomic<uint64_t> streamedBytes;
+	std::atomic<uint64_t> splicedBytes;
+
+	std::atomic<uint64_t> budgetAdmitted;
+	std::atomic<uint64_t> budgetRejectedRequests;
+	std::atomic<uint64_t> budgetRejectedReplies;
+};
+
+// If request is the RELAY_STATS_EXTENSION extension, write SSH_AGENT_SUCCESS followed by the JSON
+// statistics as a string into reply. Returns the reply size or 0 if the request is something else.
+int32_t answerStatsRequest(const void* request, int32_t requestSize, message_buffer& reply);
@@ -0,0 +1,271 @@
+#include "relay/request-trace.h"
+#include "relay/agent-message.h"
+#include "relay/logger.h"
+#include "relay/socket-compat.h"
+
+#include <stdlib.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <new>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+std::atomic<bool> requestTraceEnabled(false);
+
+struct span_record {
+	uint64_t startNs;
+	uint64_t durationNs;
+	uint32_t session;
+	int16_t type;
+	trace_phase phase;
+	int32_t requestSize;
+	int32_t replySize;
+};
+
+// Single producer (the owning thread), single consumer (the flush thread) ring of spans.
+// head and tail only grow, slots are indexed modulo REQUEST_TRACE_THREAD_SPANS.
+struct thread_spans {
+	span_record spans[REQUEST_TRACE_THREAD_SPANS];
+	std::atomic<uint32_t> head{0};
+	std::atomic<uint32_t> tail{0};
+	// Set once the owning thread exited, the buffer is freed after its last spans are written
+	std::atomic<bool> retired{false};
+};
+
+struct thread_trace_state {
+	thread_spans* spans = NULL;
+	uint32_t session = 0;
+	int type = -1;
+	int32_t requestSize = 0;
+
+	~thread_trace_state() {
+		if(spans != NULL)
+			spans->retired.store(true, std::memory_order_release);
+	}
+};
+
+static thread_local thread_trace_state threadState;
+
+static std::mutex traceMutex;
+static std::condition_variable traceStopCondition;
+static std::thread flushThread;
+static bool flushStopping = false;
+static FILE* traceFile = NULL;
+static uint64_t traceStartNsBase = 0;
+static unsigned long traceProcessId = 0;
+static std::vector<thread_spans*> threadBuffers;
+static std::atomic<uint32_t> nextSessionId(1);
+static std::atomic<uint64_t> droppedSpans(0);
+
+static const char* phaseName(trace_phase phase) {
+	switch(phase) {
+		case trace_phase::client_read:
+			return "client_read";
+		case trace_phase::upstream_connect:
+			return "upstream_connect";
+		case trace_phase::upstream_handshake:
+			return "upstream_handshake";
+		case trace_phase::upstream:
+			return "upstream";
+		case trace_phase::upstream_send:
+			return "upstream_send";
+		case trace_phase::upstream_wait:
+			return "upstream_wait";
+		case trace_phase::reply_write:
+		default:
+			return "reply_write";
+	}
+}
+
+static const char* messageName(int type) {
+	switch(type) {
+		case -1:
+			return "none";
+		case SSH2_AGENTC_REQUEST_IDENTITIES:
+			return "request_identities";
+		case SSH2_AGENTC_SIGN_REQUEST:
+			return "sign_request";
+		case SSH2_AGENTC_ADD_IDENTITY:
+		case SSH2_AGENTC_ADD_ID_CONSTRAINED:
+		case SSH_AGENTC_ADD_SMARTCARD_KEY:
+		case SSH_AGENTC_ADD_SMARTCARD_KEY_CONSTRAINED:
+			return "add_identity";
+		case SSH2_AGENTC_REMOVE_IDENTITY:
+		case SSH2_AGENTC_REMOVE_ALL_IDENTITIES:
+		case SSH_AGENTC_REMOVE_SMARTCARD_KEY:
+			return "remove_identity";
+		case SSH_AGENTC_LOCK:
+			return "lock";
+		case SSH_AGENTC_UNLOCK:
+			return "unlock";
+		case SSH_AGENTC_EXTENSION:
+			return "extension";
+		default:
+			return "other";
+	}
+}
+
+// Called with traceMutex held
+static void writeEvent(const span_record& span) {
+	int64_t relativeNs = (int64_t) (span.startNs - traceStartNsBase);
+
+	fprintf(traceFile,
+	        ",\n{\"name\":\"%s\",\"cat\":\"agent\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%lu,\"tid\":%u,"
+	        "\"args\":{\"session\":%u,\"type\":%d,\"message\":\"%s\",\"request_bytes\":%d,\"reply_bytes\":%d}}",
+	        phaseName(span.phase),
+	        (double) std::max<int64_t>(relativeNs, 0) / 1000.0,
+	        (double) span.durationNs / 1000.0,
+	        traceProcessId,
+	        span.session,
+	        span.session,
+	        span.type,
+	        messageName(span.type),
+	        span.requestSize,
+	        span.replySize);
+}
+
+// Called with traceMutex held. Returns true when the buffer is retired and fully written.
+static bool drainThreadSpans(thread_spans* buffer) {
+	// A retired buffer gets no more spans, all of them are visible once retired is seen
+	bool retired = buffer->retired.load(std::memory_order_acquire);
+	uint32_t tail = buffer->tail.load(std::memory_order_relaxed);
+	uint32_t head = buffer->head.load(std::memory_order_acquire);
+
+	for(; tail != head; tail++) {
+		writeEvent(buffer->spans[tail % REQUEST_TRACE_THREAD_SPANS]);
+	}
+	buffer->tail.store(tail, std::memory_order_release);
+
+	return retired;
+}
+
+// Called with traceMutex held
+static void flushSpans() {
+	auto retired = std::remove_if(threadBuffers.begin(), threadBuffers.end(), [](thread_spans* buffer) {
+		if(!drainThreadSpans(buffer))
+			return false;
+		delete buffer;
+		return true;
+	});
+	threadBuffers.erase(retired, threadBuffers.end());
+
+	fflush(traceFile);
+}
+
+static void flushLoop() {
+	std::unique_lock<std::mutex> lock(traceMutex);
+
+	while(!flushStopping) {
+		traceStopCondition.wait_for(lock, std::chrono::milliseconds(REQUEST_TRACE_FLUSH_MS));
+		flushSpans();
+	}
+}
+
+bool startRequestTrace(FILE* file) {
+	std::lock_guard<std::mutex> lock(traceMutex);
+
+	if(traceFile != NULL)
+		return false;
+
+	traceProcessId = currentProcessId();
+	if(fprintf(file,
+	           "[{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%lu,\"args\":{\"name\":\"agent relay\"}}",
+	           traceProcessId) < 0) {
+		fclose(file);
+		return false;
+	}
+
+	try {
+		flushThread = std::thread(flushLoop);
+	} catch(const std::system_error& e) {
+		logError("Cannot create the trace thread: %s\n", e.what());
+		fclose(file);
+		return false;
+	}
+
+	traceFile = file;
+	flushStopping = false;
+	traceStartNsBase = monotonicNs();
+	requestTraceEnabled = true;
+	atexit(stopRequestTrace);
+
+	return true;
+}
+
+void stopRequestTrace() {
+	{
+		std::lock_guard<std::mutex> lock(traceMutex);
+		if(traceFile == NULL)
+			return;
+		requestTraceEnabled = false;
+		flushStopping = true;
+	}
+	traceStopCondition.notify_all();
+	flushThread.join();
+
+	std::lock_guard<std::mutex> lock(traceMutex);
+	flushSpans();
+	fputs("\n]\n", traceFile);
+	fclose(traceFile);
+	traceFile = NULL;
+
+	if(droppedSpans > 0)
+		logWarning("%llu trace spans dropped, the trace thread could not keep up\n",
+		           (unsigned long long) droppedSpans.load());
+}
+
+trace_session::trace_session() : bound(false) {
+	if(threadState.session != 0 || !isRequestTraceEnabled())
+		return;
+
+	threadState.session = nextSessionId++;
+	threadState.type = -1;
+	threadState.requestSize = 0;
+	bound = true;
+}
+
+trace_session::~trace_session() {
+	if(bound)
+		threadState.session = 0;
+}
+
+void setTraceRequest(int type, int32_t requestSize) {
+	threadState.type = type;
+	threadState.requestSize = requestSize;
+}
+
+void traceSpan(trace_phase phase, uint64_t startNs, uint64_t endNs, int32_t replySize) {
+	if(startNs == 0 || !isRequestTraceEnabled())
+		return;
+
+	thread_spans* buffer = threadState.spans;
+	if(buffer == NULL) {
+		buffer = new(std::nothrow) thread_spans();
+		if(buffer == NULL) {
+			droppedSpans++;
+			return;
+		}
+		std::lock_guard<std::mutex> lock(traceMutex);
+		threadBuffers.push_back(buffer);
+		threadState.spans = buffer;
+	}
+
+	uint32_t head = buffer->head.load(std::memory_order_relaxed);
+	if(head - buffer->tail.load(std::memory_order_acquire) >= REQUEST_TRACE_THREAD_SPANS) {
+		droppedSpans++;
+		return;
+	}
+
+	span_record& span = buffer->spans[head % REQUEST_TRACE_THREAD_SPANS];
+	span.startNs = startNs;
+	span.durationNs = endNs > startNs ? endNs - startNs : 0;
+	span.session = threadState.session;
+	span.type = (int16_t) threadState.type;
+	span.phase = phase;
+	span.requestSize = threadState.requestSize;
+	span.replySize = replySize;
+	buffer->head.store(head + 1, std::memory_order_release);
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include "relay/relay-stats.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+
+// Spans per thread waiting to be written, spans recorded while the buffer is full are dropped and counted
+#define REQUEST_TRACE_THREAD_SPANS 1024
+// Period of the thread writing the buffered spans to the trace file
+#define REQUEST_TRACE_FLUSH_MS 500
+
+// Phases of a request. upstream covers the whole upstream round trip as seen by the session, queueing
+// included, upstream_send and upstream_wait are its parts measured on the upstream connection itself.
+enum class trace_phase : uint8_t {
+	client_read,
+	upstream_connect,
+	upstream_handshake,
+	upstream,
+	upstream_send,
+	upstream_wait,
+	reply_write
+};
+
+// Sessions record spans into buffers owned by their thread, without locking. A single thread moves them to
+// the trace file in the Chrome trace event format (JSON array of complete events, loaded by Perfetto or
+// chrome://tracing), one track per session.
+extern std::atomic<bool> requestTraceEnabled;
+
+inline bool isRequestTraceEnabled() {
+	return requestTraceEnabled.load(std::memory_order_relaxed);
+}
+
+// Start tracing to file, which is owned by the trace from then on.
+bool startRequestTrace(FILE* file);
+
+// Write the remaining spans and close the trace file. Also done at exit.
+void stopRequestTrace();
+
+// Binds a new trace session to the calling thread for its lifetime, unless the thread already has one.
+// Spans recorded by the thread outside of any session (pooled connections) go to session 0.
+class trace_session {
+public:
+	trace_session();
+	~trace_session();
+
+	trace_session(const trace_session&) = delete;
+	trace_session& operator=(const trace_session&) = delete;
+
+private:
+	bool bound;
+};
+
+// Message the next spans of the calling thread refer to, type -1 between requests.
+void setTraceRequest(int type, int32_t requestSize);
+
+// Start time of a span, 0 when tracing is disabled.
+inline uint64_t traceStartNs() {
+	return isRequestTraceEnabled() ? monotonicNs() : 0;
+}
+
+// Record a span of the calling thread's session, from startNs to endNs (monotonicNs() times).
+// replySize is the reply size when known, 0 otherwise. Nothing is recorded when startNs is 0.
+void traceSpan(trace_phase phase, uint64_t startNs, uint64_t endNs, int32_t replySize = 0);
+
+inline void traceSpan(trace_phase phase, uint64_t startNs) {
+	if(startNs != 0)
+		traceSpan(phase, startNs, monotonicNs());
+}
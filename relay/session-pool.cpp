@@ -0,0 +1,149 @@
+#include "relay/session-pool.h"
+#include "relay/logger.h"
+#include "relay/relay-stats.h"
+
+#include <chrono>
+#include <system_error>
+#include <vector>
+
+// Idle workers exit after that delay, so a burst of clients does not leave its threads behind
+#define SESSION_POOL_IDLE_TIMEOUT_MS 30000
+
+session_pool::session_pool(size_t maxSessions, size_t maxQueued, uint32_t maxWaitMs)
+    : maxSessions(maxSessions > 0 ? maxSessions : 1),
+      maxQueued(maxQueued),
+      maxWaitMs(maxWaitMs),
+      workerCount(0),
+      idleWorkers(0),
+      stopping(false) {
+	expiryThread = std::thread(&session_pool::expiryLoop, this);
+}
+
+session_pool::~session_pool() {
+	std::deque<pending_session> refused;
+
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		stopping = true;
+		refused.swap(queue);
+	}
+	sessionQueued.notify_all();
+	expiryCondition.notify_all();
+	expiryThread.join();
+
+	for(pending_session& session : refused) {
+		relay_stats::instance().onSessionRefused(true);
+		session.refuse();
+	}
+
+	std::unique_lock<std::mutex> lock(mutex);
+	workersDone.wait(lock, [this]() { return workerCount == 0; });
+}
+
+bool session_pool::submit(std::function<void()> run, std::function<void()> refuse) {
+	std::unique_lock<std::mutex> lock(mutex);
+
+	// Each idle worker takes one queued session, others wait for a busy worker
+	bool workerAvailable = queue.size() < idleWorkers || workerCount < maxSessions;
+	if(stopping || (!workerAvailable && queue.size() - idleWorkers >= maxQueued)) {
+		lock.unlock();
+		relay_stats::instance().onSessionRefused(false);
+		refuse();
+		return false;
+	}
+
+	queue.push_back({std::move(run), std::move(refuse), monotonicNs()});
+	relay_stats::instance().onSessionQueued();
+
+	if(queue.size() <= idleWorkers) {
+		sessionQueued.notify_one();
+		return true;
+	}
+
+	if(workerCount < maxSessions) {
+		try {
+			std::thread(&session_pool::workerLoop, this).detach();
+			workerCount++;
+		} catch(const std::system_error& e) {
+			logError("Cannot start a session worker: %s\n", e.what());
+
+			// Without any worker, nothing would ever take the session
+			if(workerCount == 0) {
+				pending_session session = std::move(queue.back());
+				queue.pop_back();
+				lock.unlock();
+				relay_stats::instance().onSessionRefused(true);
+				session.refuse();
+				return false;
+			}
+		}
+	}
+
+	// Wake the expiry thread so it waits for the oldest session deadline
+	expiryCondition.notify_one();
+
+	return true;
+}
+
+void session_pool::workerLoop() {
+	std::unique_lock<std::mutex> lock(mutex);
+
+	for(;;) {
+		if(queue.empty() && !stopping) {
+			idleWorkers++;
+			sessionQueued.wait_for(lock, std::chrono::milliseconds(SESSION_POOL_IDLE_TIMEOUT_MS), [this]() {
+				return !queue.empty() || stopping;
+			});
+			idleWorkers--;
+		}
+		if(queue.empty())
+			break;
+
+		pending_session session = std::move(queue.front());
+		queue.pop_front();
+		lock.unlock();
+
+		relay_stats::instance().onSessionAdmitted(monotonicNs() - session.queuedNs);
+		session.run();
+		session = pending_session();
+
+		lock.lock();
+	}
+
+	workerCount--;
+	if(workerCount == 0)
+		workersDone.notify_all();
+}
+
+void session_pool::expiryLoop() {
+	std::unique_lock<std::mutex> lock(mutex);
+
+	while(!stopping) {
+		if(queue.empty()) {
+			expiryCondition.wait(lock);
+			continue;
+		}
+
+		// Sessions are queued in order, so the oldest one expires first
+		uint64_t deadline = queue.front().queuedNs + (uint64_t) maxWaitMs * 1000000;
+		uint64_t now = monotonicNs();
+		if(now < deadline) {
+			expiryCondition.wait_for(lock, std::chrono::nanoseconds(deadline - now));
+			continue;
+		}
+
+		std::vector<pending_session> expired;
+		while(!queue.empty() && queue.front().queuedNs + (uint64_t) maxWaitMs * 1000000 <= now) {
+			expired.push_back(std::move(queue.front()));
+			queue.pop_front();
+		}
+
+		lock.unlock();
+		logDebug("Refusing %zu clients that waited %u ms for a session worker\n", expired.size(), maxWaitMs);
+		for(pending_session& session : expired) {
+			relay_stats::instance().onSessionRefused(true);
+			session.refuse();
+		}
+		lock.lock();
+	}
+}
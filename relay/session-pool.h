@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#define SESSION_POOL_DEFAULT_MAX_SESSIONS 256
+#define SESSION_POOL_DEFAULT_WAIT_MS 2000
+
+// Bounded set of worker threads running client sessions, replacing a thread per client.
+// Workers are started on demand up to maxSessions and exit after being idle for a while.
+// When they are all busy, up to maxQueued clients wait for one of them for at most maxWaitMs,
+// other clients are refused right away. Queue depth, waiting times and refusals go to relay_stats.
+class session_pool {
+public:
+	session_pool(size_t maxSessions, size_t maxQueued, uint32_t maxWaitMs);
+	// Refuse queued clients and wait for the running sessions to end
+	~session_pool();
+
+	session_pool(const session_pool&) = delete;
+	session_pool& operator=(const session_pool&) = delete;
+
+	// Run a client session on a worker. When the client cannot be admitted, refuse (which must close
+	// the client connection) is called instead, either now or once the maximum waiting time has passed.
+	// Returns false if the client was refused right away.
+	bool submit(std::function<void()> run, std::function<void()> refuse);
+
+private:
+	struct pending_session {
+		std::function<void()> run;
+		std::function<void()> refuse;
+		uint64_t queuedNs;
+	};
+
+	void workerLoop();
+	void expiryLoop();
+
+	size_t maxSessions;
+	size_t maxQueued;
+	uint32_t maxWaitMs;
+
+	std::mutex mutex;
+	std::condition_variable sessionQueued;
+	std::condition_variable expiryCondition;
+	std::condition_variable workersDone;
+	std::deque<pending_session> queue;
+	size_t workerCount;
+	size_t idleWorkers;
+	bool stopping;
+	std::thread expiryThread;
+};
@@ -0,0 +1,73 @@
+#pragma once
+
+// Minimal layer hiding the differences between Winsock and BSD sockets.
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+
+#include <windows.h>
+
+inline int socketLastError() {
+	return WSAGetLastError();
+}
+
+inline unsigned long currentProcessId() {
+	return GetCurrentProcessId();
+}
+
+inline int pollSockets(WSAPOLLFD* fds, unsigned long count, int timeoutMs) {
+	return WSAPoll(fds, count, timeoutMs);
+}
+
+// Make blocked recv() and send() calls of other threads fail, the socket stays open.
+inline int shutdownSocket(SOCKET sock) {
+	return shutdown(sock, SD_BOTH);
+}
+
+typedef WSAPOLLFD socket_pollfd;
+#else
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+typedef int SOCKET;
+#define INVALID_SOCKET (-1)
+
+inline int closesocket(SOCKET sock) {
+	return close(sock);
+}
+
+inline int socketLastError() {
+	return errno;
+}
+
+inline unsigned long currentProcessId() {
+	return (unsigned long) getpid();
+}
+
+inline int pollSockets(struct pollfd* fds, unsigned long count, int timeoutMs) {
+	return poll(fds, (nfds_t) count, timeoutMs);
+}
+
+inline int shutdownSocket(SOCKET sock) {
+	return shutdown(sock, SHUT_RDWR);
+}
+
+typedef struct pollfd socket_pollfd;
+#endif
+
+// Check that an idle connection was not closed by its peer.
+// An agent never sends anything unsolicited, so any pending input means the connection is not usable.
+inline bool isIdleSocketAlive(SOCKET sock) {
+	socket_pollfd fd;
+
+	fd.fd = sock;
+	fd.events = POLLIN;
+	fd.revents = 0;
+
+	return pollSockets(&fd, 1, 0) == 0;
+}
@@ -0,0 +1,162 @@
+#include "relay/socket-stream.h"
+#include "relay/relay-stats.h"
+
+#include <string.h>
+
+#ifndef _WIN32
+#include <sys/uio.h>
+#endif
+
+#ifdef __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Result of spliceSockets when the sockets cannot be spliced and nothing was moved
+#define SPLICE_UNSUPPORTED INT32_MIN
+
+// Move size bytes from source to destination through a pipe, the kernel passes the pages along
+// without copying them to user memory. Returns size, 0 on EOF, a negative error code or SPLICE_UNSUPPORTED.
+static int32_t spliceSockets(SOCKET source, SOCKET destination, int32_t size) {
+	int pipeFds[2];
+	int32_t forwarded = 0;
+	int32_t result = size;
+
+	if(pipe2(pipeFds, O_CLOEXEC) != 0)
+		return SPLICE_UNSUPPORTED;
+
+	while(forwarded < size && result == size) {
+		ssize_t received = splice(source, NULL, pipeFds[1], NULL, (size_t) (size - forwarded), SPLICE_F_MOVE);
+		if(received <= 0) {
+			if(received == 0)
+				result = 0;
+			else if(errno == EINVAL && forwarded == 0)
+				result = SPLICE_UNSUPPORTED;
+			else
+				result = -(int32_t) errno;
+			break;
+		}
+
+		// Drain the pipe before reading more, it only holds what the last splice() received
+		while(received > 0) {
+			ssize_t sent = splice(pipeFds[0], NULL, destination, NULL, (size_t) received, SPLICE_F_MOVE);
+			if(sent <= 0) {
+				result = sent < 0 ? -(int32_t) errno : -1;
+				break;
+			}
+			received -= sent;
+			forwarded += (int32_t) sent;
+		}
+	}
+
+	close(pipeFds[0]);
+	close(pipeFds[1]);
+
+	if(forwarded > 0)
+		relay_stats::instance().onBytesSpliced((uint64_t) forwarded);
+
+	return result;
+}
+#endif
+
+socket_stream::socket_stream(SOCKET sock) noexcept : sock(sock) {}
+
+socket_stream::~socket_stream() {
+	if(sock != INVALID_SOCKET)
+		closesocket(sock);
+}
+
+int32_t socket_stream::read(void* buffer, int32_t size) {
+	int result = recv(sock, (char*) buffer, size, 0);
+	if(result < 0)
+		return -(int32_t) socketLastError();
+	else
+		return result;
+}
+
+int32_t socket_stream::readSpans(const agent_read_span* spans, int count) {
+	return recvSpans(sock, spans, count);
+}
+
+int32_t socket_stream::write(const void* buffer, int32_t size) {
+	const char* buffer_char = (const char*) buffer;
+	int32_t totalWritten = 0;
+
+	while(totalWritten < size) {
+		int result = send(sock, buffer_char + totalWritten, size - totalWritten, 0);
+		if(result <= 0)
+			return -(int32_t) socketLastError();
+		totalWritten += result;
+	}
+
+	return totalWritten;
+}
+
+void socket_stream::interrupt() {
+	shutdownSocket(sock);
+}
+
+int32_t socket_stream::forwardTo(agent_stream& destination, int32_t size) {
+#ifdef __linux__
+	socket_stream* socketDestination = dynamic_cast<socket_stream*>(&destination);
+	if(socketDestination != NULL) {
+		int32_t result = spliceSockets(sock, socketDestination->sock, size);
+		if(result != SPLICE_UNSUPPORTED)
+			return result;
+	}
+#endif
+
+	return agent_stream::forwardTo(destination, size);
+}
+
+int recv_full(SOCKET sock, char* buffer, int size, int flags) {
+	int result;
+	int totalRead = 0;
+
+	do {
+		result = recv(sock, buffer + totalRead, size - totalRead, flags);
+		if(result > 0)
+			totalRead += result;
+	} while(totalRead < size && result > 0);
+
+	return result;
+}
+
+int32_t recvSpans(SOCKET sock, const agent_read_span* spans, int count) {
+	if(count > SOCKET_MAX_SPANS)
+		count = SOCKET_MAX_SPANS;
+
+#ifdef _WIN32
+	WSABUF buffers[SOCKET_MAX_SPANS];
+	DWORD received = 0;
+	DWORD flags = 0;
+
+	for(int i = 0; i < count; i++) {
+		buffers[i].buf = spans[i].data;
+		buffers[i].len = (ULONG) spans[i].size;
+	}
+
+	if(WSARecv(sock, buffers, (DWORD) count, &received, &flags, NULL, NULL) != 0)
+		return -(int32_t) socketLastError();
+
+	return (int32_t) received;
+#else
+	struct iovec buffers[SOCKET_MAX_SPANS];
+	struct msghdr message;
+
+	for(int i = 0; i < count; i++) {
+		buffers[i].iov_base = spans[i].data;
+		buffers[i].iov_len = (size_t) spans[i].size;
+	}
+
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = buffers;
+	message.msg_iovlen = (size_t) count;
+
+	ssize_t result = recvmsg(sock, &message, 0);
+	if(result < 0)
+		return -(int32_t) socketLastError();
+
+	return (int32_t) result;
+#endif
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "relay/agent-stream.h"
+#include "relay/socket-compat.h"
+
+#include <functional>
+
+// Stream over a connected socket. The socket is closed on destruction.
+class socket_stream : public agent_stream {
+public:
+	explicit socket_stream(SOCKET sock) noexcept;
+	~socket_stream() override;
+
+	socket_stream(const socket_stream&) = delete;
+	socket_stream& operator=(const socket_stream&) = delete;
+
+	int32_t read(void* buffer, int32_t size) override;
+	int32_t readSpans(const agent_read_span* spans, int count) override;
+	int32_t write(const void* buffer, int32_t size) override;
+	void interrupt() override;
+
+	// On Linux, bytes forwarded to another socket_stream are moved with splice() through a pipe.
+	int32_t forwardTo(agent_stream& destination, int32_t size) override;
+
+	SOCKET getSocket() const { return sock; }
+
+private:
+	SOCKET sock;
+};
+
+// Scatter recv() into up to SOCKET_MAX_SPANS spans.
+// Returns the number of bytes received, 0 on EOF or a negative error code.
+#define SOCKET_MAX_SPANS 4
+int32_t recvSpans(SOCKET sock, const agent_read_span* spans, int count);
+
+// recv() until size bytes are received or an error occurs. Returns the last recv() result.
+int recv_full(SOCKET sock, char* buffer, int size, int flags);
+
+// Open a new connection to the upstream agent.
+// Returns the connected socket or INVALID_SOCKET.
+typedef std::function<SOCKET()> socket_connector;
@@ -0,0 +1,123 @@
+#include "relay/traffic-capture.h"
+#include "relay/agent-message.h"
+#include "relay/logger.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <mutex>
+
+// Buffer of the capture file, records are written with one fwrite each
+#define TRAFFIC_CAPTURE_FILE_BUFFER (256 * 1024)
+
+std::atomic<bool> trafficCaptureEnabled(false);
+
+static std::mutex captureMutex;
+static FILE* captureFile = NULL;
+static bool captureRedact = false;
+static std::chrono::steady_clock::time_point captureStart;
+static std::atomic<uint32_t> nextSessionId(1);
+
+static void writeu64(uint8_t* buffer, uint64_t value) {
+	writeu32(buffer, (uint32_t) (value >> 32));
+	writeu32(buffer + 4, (uint32_t) value);
+}
+
+// Called with captureMutex held
+static void writeRecord(uint32_t sessionId, capture_event event, const void* data, int32_t size) {
+	uint8_t header[TRAFFIC_CAPTURE_RECORD_SIZE];
+	uint32_t storedSize = captureRedact || data == NULL ? 0 : (uint32_t) size;
+	uint64_t elapsedUs =
+	    std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - captureStart).count();
+
+	writeu64(header, elapsedUs);
+	writeu32(header + 8, sessionId);
+	header[12] = (uint8_t) event;
+	header[13] = data != NULL && size >= 5 ? ((const uint8_t*) data)[4] : 0;
+	header[14] = 0;
+	header[15] = 0;
+	writeu32(header + 16, (uint32_t) size);
+	writeu32(header + 20, storedSize);
+
+	if(fwrite(header, 1, sizeof(header), captureFile) != sizeof(header) ||
+	   (storedSize > 0 && fwrite(data, 1, storedSize, captureFile) != storedSize)) {
+		logError("Traffic capture write failed, capture stopped\n");
+		trafficCaptureEnabled = false;
+	}
+}
+
+bool startTrafficCapture(FILE* file, bool redact) {
+	std::lock_guard<std::mutex> lock(captureMutex);
+	uint8_t header[TRAFFIC_CAPTURE_HEADER_SIZE];
+	uint64_t startMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+	                       std::chrono::system_clock::now().time_since_epoch())
+	                       .count();
+
+	if(captureFile != NULL)
+		return false;
+
+	memcpy(header, TRAFFIC_CAPTURE_MAGIC, 8);
+	writeu32(header + 8, redact ? TRAFFIC_CAPTURE_REDACTED : 0);
+	writeu32(header + 12, 0);
+	writeu64(header + 16, startMs);
+
+	setvbuf(file, NULL, _IOFBF, TRAFFIC_CAPTURE_FILE_BUFFER);
+	if(fwrite(header, 1, sizeof(header), file) != sizeof(header)) {
+		fclose(file);
+		return false;
+	}
+
+	captureFile = file;
+	captureRedact = redact;
+	captureStart = std::chrono::steady_clock::now();
+	trafficCaptureEnabled = true;
+	atexit(stopTrafficCapture);
+
+	return true;
+}
+
+void stopTrafficCapture() {
+	std::lock_guard<std::mutex> lock(captureMutex);
+
+	trafficCaptureEnabled = false;
+	if(captureFile != NULL) {
+		fclose(captureFile);
+		captureFile = NULL;
+	}
+}
+
+uint32_t openCaptureSession() {
+	if(!isTrafficCaptureEnabled())
+		return 0;
+
+	std::lock_guard<std::mutex> lock(captureMutex);
+	uint32_t sessionId = nextSessionId++;
+
+	if(captureFile != NULL && isTrafficCaptureEnabled())
+		writeRecord(sessionId, capture_event::session_open, NULL, 0);
+
+	return sessionId;
+}
+
+void closeCaptureSession(uint32_t sessionId) {
+	if(sessionId == 0 || !isTrafficCaptureEnabled())
+		return;
+
+	std::lock_guard<std::mutex> lock(captureMutex);
+	if(captureFile == NULL || !isTrafficCaptureEnabled())
+		return;
+
+	writeRecord(sessionId, capture_event::session_close, NULL, 0);
+	// Completed sessions are on disk even if the proxy is killed afterwards
+	fflush(captureFile);
+}
+
+void captureMessage(uint32_t sessionId, capture_event event, const void* data, int32_t size) {
+	if(sessionId == 0 || !isTrafficCaptureEnabled())
+		return;
+
+	std::lock_guard<std::mutex> lock(captureMutex);
+	if(captureFile != NULL && isTrafficCaptureEnabled())
+		writeRecord(sessionId, event, data, size);
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+
+// Capture file layout, all integers big-endian like the agent protocol:
+//  - file header (24 bytes): "AGNTCAP1", flags (u32), reserved (u32), capture start as unix time in ms (u64)
+//  - records (24 bytes + stored bytes): time since capture start in us (u64), session id (u32), event (u8),
+//    message type (u8), reserved (u16), message size (u32), stored size (u32), then the stored message bytes.
+// Message sizes include the 4 bytes length header. Redacted captures store no message bytes,
+// only the size and type of each message.
+#define TRAFFIC_CAPTURE_MAGIC "AGNTCAP1"
+#define TRAFFIC_CAPTURE_HEADER_SIZE 24
+#define TRAFFIC_CAPTURE_RECORD_SIZE 24
+#define TRAFFIC_CAPTURE_REDACTED 0x1
+
+enum class capture_event : uint8_t { session_open, request, reply, session_close };
+
+// Sessions record into a mutex protected buffered file, flushed when a session closes.
+extern std::atomic<bool> trafficCaptureEnabled;
+
+inline bool isTrafficCaptureEnabled() {
+	return trafficCaptureEnabled.load(std::memory_order_relaxed);
+}
+
+// Start capturing to file, which is owned by the capture from then on. Returns false if the header
+// could not be written. When redact is true, payloads are reduced to their size and type byte.
+bool startTrafficCapture(FILE* file, bool redact);
+
+// Flush and close the capture file. Also done at exit.
+void stopTrafficCapture();
+
+// Returns the id of a new session, 0 when capture is disabled.
+uint32_t openCaptureSession();
+void closeCaptureSession(uint32_t sessionId);
+
+// Record a complete agent message (length header included) of an open session.
+void captureMessage(uint32_t sessionId, capture_event event, const void* data, int32_t size);
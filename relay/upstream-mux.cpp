@@ -0,0 +1,197 @@
+#include "relay/upstream-mux.h"
+#include "relay/agent-message.h"
+#include "relay/frame-parser.h"
+#include "relay/logger.h"
+#include "relay/relay-stats.h"
+
+#include <string.h>
+
+struct upstream_mux::channel {
+	channel() : sock(INVALID_SOCKET), nextTicket(0), nextReply(0), broken(false), pending(0) {}
+
+	std::mutex writeMutex;
+	std::mutex mutex;
+	std::condition_variable changed;
+	SOCKET sock;
+	uint64_t nextTicket;
+	uint64_t nextReply;
+	bool broken;
+	std::atomic<size_t> pending;
+
+	// Only used by the request whose reply is next
+	agent_frame_parser replyParser;
+};
+
+upstream_mux::upstream_mux(socket_connector connectUpstream, size_t connectionCount)
+    : connectUpstream(std::move(connectUpstream)), requests(0), connects(0), failures(0), maxPending(0) {
+	for(size_t i = 0; i < connectionCount; i++) {
+		channels.push_back(std::make_unique<channel>());
+	}
+}
+
+upstream_mux::~upstream_mux() {
+	for(std::unique_ptr<channel>& ch : channels) {
+		if(ch->sock != INVALID_SOCKET)
+			closesocket(ch->sock);
+	}
+}
+
+upstream_mux::channel& upstream_mux::pickChannel() {
+	channel* best = channels[0].get();
+
+	for(std::unique_ptr<channel>& ch : channels) {
+		if(ch->pending < best->pending)
+			best = ch.get();
+	}
+
+	return *best;
+}
+
+// Called with ch.mutex held once a request got its reply or failed.
+void upstream_mux::releaseTicket(channel& ch) {
+	ch.pending--;
+	if(ch.broken && ch.pending == 0) {
+		// Every request pending on the broken connection has failed, it can be reopened
+		closesocket(ch.sock);
+		ch.sock = INVALID_SOCKET;
+		ch.nextTicket = 0;
+		ch.nextReply = 0;
+		ch.broken = false;
+		ch.replyParser.reset();
+	}
+	ch.changed.notify_all();
+}
+
+int32_t upstream_mux::transact(const void* request,
+                               int32_t requestSize,
+                               message_buffer& reply,
+                               int32_t replyMaxSize) {
+	channel& ch = pickChannel();
+
+	// Tickets are taken in write order. The channel mutex is not held while writing so
+	// replies keep being read even if the agent stops reading requests until its replies are read.
+	std::unique_lock<std::mutex> writeLock(ch.writeMutex);
+	std::unique_lock<std::mutex> lock(ch.mutex);
+
+	ch.changed.wait(lock, [&ch]() { return !ch.broken; });
+
+	if(ch.sock == INVALID_SOCKET) {
+		ch.sock = connectUpstream();
+		if(ch.sock == INVALID_SOCKET) {
+			logError("Error: cannot connect to upstream ssh-agent\n");
+			return -1;
+		}
+		connects++;
+	}
+
+	uint64_t ticket = ch.nextTicket++;
+	size_t pending = ++ch.pending;
+	uint64_t previousMax = maxPending;
+	while(pending > previousMax && !maxPending.compare_exchange_weak(previousMax, pending)) {
+	}
+	requests++;
+
+	SOCKET sock = ch.sock;
+	lock.unlock();
+
+	bool sent = true;
+	const char* requestBytes = (const char*) request;
+	for(int32_t written = 0; written < requestSize;) {
+		int result = send(sock, requestBytes + written, requestSize - written, 0);
+		if(result <= 0) {
+			logError("Failed to send query data to upstream: %d\n", socketLastError());
+			sent = false;
+			break;
+		}
+		written += result;
+	}
+
+	writeLock.unlock();
+	lock.lock();
+
+	if(!sent)
+		ch.broken = true;
+
+	// Only the request whose reply is next reads from the socket, the others keep pipelining
+	ch.changed.wait(lock, [&ch, ticket]() { return ch.broken || ch.nextReply == ticket; });
+	if(ch.broken) {
+		failures++;
+		releaseTicket(ch);
+		return -1;
+	}
+
+	lock.unlock();
+
+	// The parser keeps the bytes of the following pipelined replies for the next ticket
+	int32_t replySize = readAgentMessage(
+	    [sock](const agent_read_span* spans, int count) { return recvSpans(sock, spans, count); },
+	    ch.replyParser,
+	    reply,
+	    replyMaxSize,
+	    0,
+	    true);
+
+	// Replies over the memory budget are skipped without waiting, as the following replies wait for this one
+	if(replySize > 0 && ch.replyParser.receivedSize() < replySize) {
+		int32_t remaining = replySize - ch.replyParser.receivedSize();
+		while(remaining > 0 && replySize > 0) {
+			int chunkSize = remaining < (int32_t) reply.capacity() ? remaining : (int) reply.capacity();
+			if(recv_full(sock, reply.data(), chunkSize, 0) <= 0)
+				replySize = -1;
+			remaining -= chunkSize;
+		}
+		if(replySize > 0) {
+			logWarning("Reply of %d bytes over the memory budget, answering a failure\n", replySize);
+			relay_stats::instance().onMessageOverBudget(true, false);
+			replySize = writeStatusReply(reply, SSH_AGENT_FAILURE);
+		}
+	}
+
+	lock.lock();
+	if(replySize <= 0) {
+		ch.broken = true;
+		failures++;
+	} else {
+		ch.nextReply++;
+	}
+	releaseTicket(ch);
+
+	return replySize;
+}
+
+upstream_mux_stats upstream_mux::getStats() const {
+	upstream_mux_stats stats;
+
+	stats.requests = requests;
+	stats.connects = connects;
+	stats.failures = failures;
+	stats.maxPending = maxPending;
+
+	return stats;
+}
+
+void upstream_mux::printStats() const {
+	logDebug("Upstream mux: %llu requests on %zu connections, %llu connects, %llu failures, %llu max pipelined\n",
+	         (unsigned long long) requests,
+	         channels.size(),
+	         (unsigned long long) connects,
+	         (unsigned long long) failures,
+	         (unsigned long long) maxPending);
+}
+
+multiplexed_upstream::multiplexed_upstream(upstream_mux& mux) noexcept : mux(mux) {}
+
+int32_t multiplexed_upstream::transact(const void* request,
+                                       int32_t requestSize,
+                                       message_buffer& reply,
+                                       int32_t replyMaxSize) {
+	if(isSessionBindRequest(request, requestSize)) {
+		if(!reply.reserve(5, 0))
+			return -1;
+		memcpy(reply.data(), "\0\0\0\1", 4);
+		reply.data()[4] = SSH_AGENT_FAILURE;
+		return 5;
+	}
+
+	return mux.transact(request, requestSize, reply, replyMaxSize);
+}
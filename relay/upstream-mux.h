@@ -0,0 +1,67 @@
+#pragma once
+
+#include "relay/agent-upstream.h"
+#include "relay/socket-stream.h"
+
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+struct upstream_mux_stats {
+	uint64_t requests;    // requests forwarded upstream
+	uint64_t connects;    // upstream connections opened, including reconnections
+	uint64_t failures;    // requests failed because their upstream connection broke
+	uint64_t maxPending;  // highest number of requests pipelined on one connection
+};
+
+// Shares at most connectionCount upstream connections between all client sessions.
+// The agent protocol answers requests in order on each connection, so requests are pipelined:
+// each one takes a ticket when it is written and its reply is the ticket-th reply read
+// from that connection. New requests go to the connection with the fewest pending requests.
+// Connections are opened on first use and reopened once all requests pending on a broken one failed.
+class upstream_mux {
+public:
+	upstream_mux(socket_connector connectUpstream, size_t connectionCount);
+	~upstream_mux();
+
+	upstream_mux(const upstream_mux&) = delete;
+	upstream_mux& operator=(const upstream_mux&) = delete;
+
+	// Same contract as agent_upstream::transact, callable from any thread.
+	int32_t transact(const void* request, int32_t requestSize, message_buffer& reply, int32_t replyMaxSize);
+
+	upstream_mux_stats getStats() const;
+
+	void printStats() const;
+
+private:
+	struct channel;
+
+	channel& pickChannel();
+	void releaseTicket(channel& ch);
+
+	socket_connector connectUpstream;
+	std::vector<std::unique_ptr<channel>> channels;
+
+	std::atomic<uint64_t> requests;
+	std::atomic<uint64_t> connects;
+	std::atomic<uint64_t> failures;
+	std::atomic<uint64_t> maxPending;
+};
+
+// Per-session view of an upstream_mux.
+class multiplexed_upstream : public agent_upstream {
+public:
+	explicit multiplexed_upstream(upstream_mux& mux) noexcept;
+
+	// Session-bind extension requests are answered with a failure: the binding would
+	// apply to a connection shared with other clients.
+	int32_t transact(const void* request, int32_t requestSize, message_buffer& reply, int32_t replyMaxSize) override;
+
+private:
+	upstream_mux& mux;
+};
@@ -0,0 +1,119 @@
+#include "relay/upstream-pool.h"
+#include "relay/logger.h"
+
+#include <chrono>
+#include <vector>
+
+// Interval at which idle pooled sockets are checked, and delay before retrying after a failed connection
+#define UPSTREAM_POOL_CHECK_INTERVAL_MS 1000
+
+upstream_pool::upstream_pool(socket_connector connectUpstream, size_t size)
+    : connectUpstream(std::move(connectUpstream)), size(size), stopping(false), hits(0), misses(0), evicted(0) {
+	refillThread = std::thread(&upstream_pool::refillLoop, this);
+}
+
+upstream_pool::~upstream_pool() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	refillCondition.notify_all();
+	refillThread.join();
+
+	for(SOCKET sock : sockets) {
+		closesocket(sock);
+	}
+}
+
+SOCKET upstream_pool::acquire() {
+	for(;;) {
+		SOCKET sock;
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if(sockets.empty())
+				break;
+			sock = sockets.front();
+			sockets.pop_front();
+		}
+		refillCondition.notify_one();
+
+		// The agent may have closed the socket since the last check
+		if(isIdleSocketAlive(sock)) {
+			hits++;
+			return sock;
+		}
+
+		closesocket(sock);
+		evicted++;
+	}
+
+	misses++;
+	refillCondition.notify_one();
+
+	return connectUpstream();
+}
+
+upstream_pool_stats upstream_pool::getStats() {
+	upstream_pool_stats stats;
+
+	stats.hits = hits;
+	stats.misses = misses;
+	stats.evicted = evicted;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stats.idle = sockets.size();
+	}
+
+	return stats;
+}
+
+void upstream_pool::evictDeadSockets() {
+	std::vector<SOCKET> deadSockets;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		for(auto it = sockets.begin(); it != sockets.end();) {
+			if(!isIdleSocketAlive(*it)) {
+				deadSockets.push_back(*it);
+				it = sockets.erase(it);
+			} else {
+				++it;
+			}
+		}
+	}
+
+	for(SOCKET sock : deadSockets) {
+		closesocket(sock);
+		evicted++;
+	}
+}
+
+void upstream_pool::refillLoop() {
+	std::unique_lock<std::mutex> lock(mutex);
+
+	while(!stopping) {
+		if(sockets.size() >= size) {
+			if(refillCondition.wait_for(lock, std::chrono::milliseconds(UPSTREAM_POOL_CHECK_INTERVAL_MS)) ==
+			   std::cv_status::timeout) {
+				lock.unlock();
+				evictDeadSockets();
+				lock.lock();
+			}
+			continue;
+		}
+
+		// Connect without holding the lock so sessions can still take pooled sockets
+		lock.unlock();
+		SOCKET sock = connectUpstream();
+		lock.lock();
+
+		if(sock == INVALID_SOCKET) {
+			logWarning("Upstream pool: failed to connect, retrying later\n");
+			refillCondition.wait_for(lock, std::chrono::milliseconds(UPSTREAM_POOL_CHECK_INTERVAL_MS));
+			continue;
+		}
+
+		sockets.push_back(sock);
+	}
+}
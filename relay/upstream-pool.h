@@ -0,0 +1,54 @@
+#pragma once
+
+#include "relay/socket-stream.h"
+
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+struct upstream_pool_stats {
+	uint64_t hits;     // sessions given an already connected socket
+	uint64_t misses;   // sessions that had to connect synchronously
+	uint64_t evicted;  // pooled sockets found closed by the upstream agent
+	size_t idle;       // sockets currently waiting in the pool
+};
+
+// Pool of already connected (and for cygwin sockets, already authenticated) upstream sockets.
+// New sessions take ownership of a pooled socket instead of paying the connection setup
+// on their critical path. A background thread refills the pool and evicts sockets closed
+// by the upstream agent.
+class upstream_pool {
+public:
+	upstream_pool(socket_connector connectUpstream, size_t size);
+	~upstream_pool();
+
+	upstream_pool(const upstream_pool&) = delete;
+	upstream_pool& operator=(const upstream_pool&) = delete;
+
+	// Take a connected socket, connecting synchronously if the pool is empty.
+	// Returns INVALID_SOCKET if the upstream agent cannot be reached.
+	SOCKET acquire();
+
+	upstream_pool_stats getStats();
+
+private:
+	void refillLoop();
+	void evictDeadSockets();
+
+	socket_connector connectUpstream;
+	size_t size;
+
+	std::mutex mutex;
+	std::condition_variable refillCondition;
+	std::deque<SOCKET> sockets;
+	bool stopping;
+	std::thread refillThread;
+
+	std::atomic<uint64_t> hits;
+	std::atomic<uint64_t> misses;
+	std::atomic<uint64_t> evicted;
+};
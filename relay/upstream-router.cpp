@@ -0,0 +1,440 @@
+#include "relay/upstream-router.h"
+#include "relay/agent-message.h"
+#include "relay/logger.h"
+
+#include <string.h>
+
+#include <chrono>
+#include <thread>
+
+// Fan-out thread of one upstream, with its own connection kept between fan-outs
+struct upstream_router::worker {
+	size_t index;
+	std::thread thread;
+	std::condition_variable posted;
+	// A fan-out is pending while postedRound != doneRound
+	uint64_t postedRound;
+	uint64_t doneRound;
+	bool answered;
+	std::vector<char> answer;
+};
+
+// Read an SSH string (u32 length + bytes) at offset, advancing offset past it
+static bool readString(const uint8_t* message, size_t size, size_t& offset, const uint8_t** value, uint32_t* valueSize) {
+	if(size < 4 || offset > size - 4)
+		return false;
+
+	uint32_t length = readu32(message + offset);
+	if(length > size - offset - 4)
+		return false;
+
+	*value = message + offset + 4;
+	*valueSize = length;
+	offset += 4 + length;
+
+	return true;
+}
+
+// Merge the IDENTITIES_ANSWER of each upstream, NULL for the ones which did not answer, into merged.
+// A key listed by several upstreams belongs to the first one, keyOwners receives the owner of each key.
+// Returns false if no upstream answered.
+static bool mergeIdentityAnswers(const std::vector<const std::vector<char>*>& answers,
+                                 std::vector<char>& merged,
+                                 std::unordered_map<std::string, size_t>& keyOwners) {
+	std::vector<char> answer(9);
+	uint32_t keyCount = 0;
+	bool anyAnswer = false;
+
+	keyOwners.clear();
+
+	for(size_t index = 0; index < answers.size(); index++) {
+		if(answers[index] == NULL)
+			continue;
+
+		const uint8_t* message = (const uint8_t*) answers[index]->data();
+		size_t size = answers[index]->size();
+		size_t offset = 9;
+
+		if(size < 9)
+			continue;
+		anyAnswer = true;
+
+		uint32_t count = readu32(message + 5);
+		for(uint32_t i = 0; i < count; i++) {
+			size_t keyStart = offset;
+			const uint8_t* keyBlob;
+			const uint8_t* comment;
+			uint32_t keySize;
+			uint32_t commentSize;
+
+			if(!readString(message, size, offset, &keyBlob, &keySize) ||
+			   !readString(message, size, offset, &comment, &commentSize)) {
+				logWarning("Invalid identity list from upstream %zu\n", index);
+				break;
+			}
+
+			if(!keyOwners.emplace(std::string((const char*) keyBlob, keySize), index).second)
+				continue;
+
+			answer.insert(answer.end(), (const char*) message + keyStart, (const char*) message + offset);
+			keyCount++;
+		}
+	}
+
+	if(!anyAnswer)
+		return false;
+
+	writeu32(answer.data(), (uint32_t) answer.size() - 4);
+	answer[4] = SSH2_AGENT_IDENTITIES_ANSWER;
+	writeu32(answer.data() + 5, keyCount);
+	merged.swap(answer);
+
+	return true;
+}
+
+upstream_router::upstream_router(std::vector<upstream_connector> connectors, uint32_t timeoutMs)
+    : connectors(std::move(connectors)),
+      timeoutMs(timeoutMs),
+      stopping(false),
+      listing(false),
+      currentRound(0),
+      completedRound(0),
+      indexStale(true),
+      generation(0),
+      listings(0),
+      timeouts(0),
+      routed(0),
+      indexMisses(0) {
+	for(size_t i = 0; i < this->connectors.size(); i++) {
+		std::unique_ptr<worker> w = std::make_unique<worker>();
+
+		w->index = i;
+		w->postedRound = 0;
+		w->doneRound = 0;
+		w->answered = false;
+		w->thread = std::thread(&upstream_router::workerLoop, this, w.get());
+		workers.push_back(std::move(w));
+	}
+}
+
+upstream_router::~upstream_router() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+
+	for(std::unique_ptr<worker>& w : workers) {
+		w->posted.notify_one();
+		w->thread.join();
+	}
+}
+
+void upstream_router::workerLoop(worker* w) {
+	static const char request[] = {0, 0, 0, 1, SSH2_AGENTC_REQUEST_IDENTITIES};
+	std::unique_ptr<agent_upstream> upstream;
+	message_buffer reply;
+	std::unique_lock<std::mutex> lock(mutex);
+
+	for(;;) {
+		w->posted.wait(lock, [this, w]() { return stopping || w->postedRound != w->doneRound; });
+		if(stopping)
+			break;
+
+		uint64_t round = w->postedRound;
+		lock.unlock();
+
+		int32_t replySize = -1;
+		if(!upstream)
+			upstream = connectors[w->index]();
+		if(upstream) {
+			replySize = upstream->transact(request, sizeof(request), reply, AGENT_MAX_MSGLEN);
+			// Reconnect on the next fan-out
+			if(replySize <= 0)
+				upstream.reset();
+		}
+
+		bool answered = replySize > 0 && agentMessageType(reply.data(), replySize) == SSH2_AGENT_IDENTITIES_ANSWER;
+		if(!answered)
+			logWarning("Upstream %zu did not list its identities\n", w->index);
+
+		lock.lock();
+		w->answered = answered;
+		if(answered)
+			w->answer.assign(reply.data(), reply.data() + replySize);
+		w->doneRound = round;
+		roundDone.notify_all();
+
+		reply.shrink();
+	}
+}
+
+// Called with mutex held
+void upstream_router::mergeAnswers(uint64_t round) {
+	std::vector<const std::vector<char>*> answers;
+
+	for(std::unique_ptr<worker>& w : workers) {
+		answers.push_back(w->doneRound == round && w->answered ? &w->answer : NULL);
+	}
+
+	if(!mergeIdentityAnswers(answers, mergedAnswer, keyOwners))
+		mergedAnswer.clear();
+}
+
+int32_t upstream_router::listIdentities(message_buffer& reply, int32_t replyMaxSize) {
+	std::unique_lock<std::mutex> lock(mutex);
+
+	if(listing) {
+		// Share the fan-out in progress
+		uint64_t round = currentRound;
+		listed.wait(lock, [this, round]() { return completedRound >= round; });
+	} else {
+		uint64_t round = ++currentRound;
+		uint64_t startGeneration = generation;
+		std::vector<worker*> asked;
+
+		listing = true;
+		listings++;
+
+		for(std::unique_ptr<worker>& w : workers) {
+			if(w->postedRound != w->doneRound) {
+				logDebug("Upstream %zu is still busy, left out of the identity list\n", w->index);
+				continue;
+			}
+			w->postedRound = round;
+			w->posted.notify_one();
+			asked.push_back(w.get());
+		}
+
+		roundDone.wait_for(lock, std::chrono::milliseconds(timeoutMs), [&asked, round]() {
+			for(worker* w : asked) {
+				if(w->doneRound != round)
+					return false;
+			}
+			return true;
+		});
+
+		for(worker* w : asked) {
+			if(w->doneRound != round) {
+				logWarning("Upstream %zu did not list its identities within %u ms\n", w->index, timeoutMs);
+				timeouts++;
+			}
+		}
+
+		mergeAnswers(round);
+		if(generation == startGeneration)
+			indexStale = false;
+
+		listing = false;
+		completedRound = round;
+		listed.notify_all();
+	}
+
+	if(mergedAnswer.empty() || mergedAnswer.size() > (size_t) replyMaxSize || !reply.reserve(mergedAnswer.size(), 0))
+		return -1;
+
+	memcpy(reply.data(), mergedAnswer.data(), mergedAnswer.size());
+
+	return (int32_t) mergedAnswer.size();
+}
+
+int upstream_router::findOwner(const uint8_t* keyBlob, uint32_t keySize) {
+	std::string key((const char*) keyBlob, keySize);
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if(!indexStale) {
+			auto it = keyOwners.find(key);
+			if(it != keyOwners.end()) {
+				routed++;
+				return (int) it->second;
+			}
+		}
+	}
+
+	// The key may have been added since the last fan-out
+	indexMisses++;
+	message_buffer answer;
+	listIdentities(answer, AGENT_MAX_MSGLEN);
+
+	std::lock_guard<std::mutex> lock(mutex);
+	auto it = keyOwners.find(key);
+	if(it == keyOwners.end())
+		return -1;
+
+	routed++;
+	return (int) it->second;
+}
+
+void upstream_router::invalidate() {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	indexStale = true;
+	generation++;
+}
+
+upstream_router_stats upstream_router::getStats() const {
+	upstream_router_stats stats;
+
+	stats.listings = listings;
+	stats.timeouts = timeouts;
+	stats.routed = routed;
+	stats.indexMisses = indexMisses;
+
+	std::lock_guard<std::mutex> lock(mutex);
+	stats.indexedKeys = keyOwners.size();
+
+	return stats;
+}
+
+void upstream_router::printStats() const {
+	upstream_router_stats stats = getStats();
+
+	logDebug("Upstream router: %llu listings, %llu timeouts, %llu routed requests, %llu index misses, %zu keys\n",
+	         (unsigned long long) stats.listings,
+	         (unsigned long long) stats.timeouts,
+	         (unsigned long long) stats.routed,
+	         (unsigned long long) stats.indexMisses,
+	         stats.indexedKeys);
+}
+
+routed_upstream::routed_upstream(upstream_router& router)
+    : router(router), upstreams(router.getUpstreamCount()), bound(false) {}
+
+int32_t routed_upstream::forward(size_t index,
+                                 const void* request,
+                                 int32_t requestSize,
+                                 message_buffer& reply,
+                                 int32_t replyMaxSize) {
+	if(!upstreams[index]) {
+		upstreams[index] = router.connect(index);
+		if(!upstreams[index]) {
+			logWarning("Cannot connect to upstream %zu\n", index);
+			return writeStatusReply(reply, SSH_AGENT_FAILURE);
+		}
+	}
+
+	int32_t replySize = upstreams[index]->transact(request, requestSize, reply, replyMaxSize);
+	if(replySize <= 0) {
+		logWarning("Upstream %zu connection closed\n", index);
+		upstreams[index].reset();
+		return writeStatusReply(reply, SSH_AGENT_FAILURE);
+	}
+
+	return replySize;
+}
+
+int32_t routed_upstream::broadcast(const void* request,
+                                   int32_t requestSize,
+                                   message_buffer& reply,
+                                   int32_t replyMaxSize) {
+	bool succeeded = true;
+
+	for(size_t i = 0; i < upstreams.size(); i++) {
+		int32_t replySize = forward(i, request, requestSize, reply, replyMaxSize);
+		if(agentMessageType(reply.data(), replySize) != SSH_AGENT_SUCCESS)
+			succeeded = false;
+	}
+
+	return writeStatusReply(reply, succeeded ? SSH_AGENT_SUCCESS : SSH_AGENT_FAILURE);
+}
+
+// Identities listed by the session's own, bound, connections. They may differ from the router's fan-out, so they
+// are not indexed: keys are still routed to the owner found by the router.
+int32_t routed_upstream::listBoundIdentities(const void* request,
+                                             int32_t requestSize,
+                                             message_buffer& reply,
+                                             int32_t replyMaxSize) {
+	std::vector<std::vector<char>> answers(upstreams.size());
+	std::vector<const std::vector<char>*> answered(upstreams.size(), NULL);
+	std::unordered_map<std::string, size_t> keyOwners;
+	std::vector<char> merged;
+
+	for(size_t i = 0; i < upstreams.size(); i++) {
+		int32_t replySize = forward(i, request, requestSize, reply, replyMaxSize);
+		if(agentMessageType(reply.data(), replySize) != SSH2_AGENT_IDENTITIES_ANSWER) {
+			logWarning("Upstream %zu did not list its identities\n", i);
+			continue;
+		}
+		answers[i].assign(reply.data(), reply.data() + replySize);
+		answered[i] = &answers[i];
+	}
+
+	if(!mergeIdentityAnswers(answered, merged, keyOwners) || merged.size() > (size_t) replyMaxSize ||
+	   !reply.reserve(merged.size(), 0))
+		return writeStatusReply(reply, SSH_AGENT_FAILURE);
+
+	memcpy(reply.data(), merged.data(), merged.size());
+
+	return (int32_t) merged.size();
+}
+
+int32_t routed_upstream::transact(const void* request,
+                                  int32_t requestSize,
+                                  message_buffer& reply,
+                                  int32_t replyMaxSize) {
+	int type = agentMessageType(request, requestSize);
+	int32_t replySize;
+
+	switch(type) {
+		case SSH2_AGENTC_REQUEST_IDENTITIES:
+			if(bound)
+				return listBoundIdentities(request, requestSize, reply, replyMaxSize);
+			replySize = router.listIdentities(reply, replyMaxSize);
+			return replySize > 0 ? replySize : writeStatusReply(reply, SSH_AGENT_FAILURE);
+
+		case SSH2_AGENTC_SIGN_REQUEST:
+		case SSH2_AGENTC_REMOVE_IDENTITY: {
+			size_t offset = 5;
+			const uint8_t* keyBlob;
+			uint32_t keySize;
+
+			if(!readString((const uint8_t*) request, (size_t) requestSize, offset, &keyBlob, &keySize))
+				return writeStatusReply(reply, SSH_AGENT_FAILURE);
+
+			int owner = router.findOwner(keyBlob, keySize);
+			if(owner < 0) {
+				logDebug("No upstream has the requested key\n");
+				return writeStatusReply(reply, SSH_AGENT_FAILURE);
+			}
+
+			if(type == SSH2_AGENTC_SIGN_REQUEST)
+				return forward((size_t) owner, request, requestSize, reply, replyMaxSize);
+
+			router.invalidate();
+			replySize = forward((size_t) owner, request, requestSize, reply, replyMaxSize);
+			router.invalidate();
+			return replySize;
+		}
+
+		case SSH2_AGENTC_REMOVE_ALL_IDENTITIES:
+		case SSH_AGENTC_LOCK:
+		case SSH_AGENTC_UNLOCK:
+			// A locked agent lists no keys
+			router.invalidate();
+			replySize = broadcast(request, requestSize, reply, replyMaxSize);
+			router.invalidate();
+			return replySize;
+
+		case SSH2_AGENTC_ADD_IDENTITY:
+		case SSH2_AGENTC_ADD_ID_CONSTRAINED:
+		case SSH_AGENTC_ADD_SMARTCARD_KEY:
+		case SSH_AGENTC_REMOVE_SMARTCARD_KEY:
+		case SSH_AGENTC_ADD_SMARTCARD_KEY_CONSTRAINED:
+			// New keys go to the first upstream
+			router.invalidate();
+			replySize = forward(0, request, requestSize, reply, replyMaxSize);
+			router.invalidate();
+			return replySize;
+
+		case SSH_AGENTC_EXTENSION:
+			// Each upstream connection must be bound to the client session
+			if(isSessionBindRequest(request, requestSize)) {
+				bound = true;
+				return broadcast(request, requestSize, reply, replyMaxSize);
+			}
+			return forward(0, request, requestSize, reply, replyMaxSize);
+
+		default:
+			return forward(0, request, requestSize, reply, replyMaxSize);
+	}
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include "relay/agent-upstream.h"
+
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#define UPSTREAM_ROUTER_DEFAULT_TIMEOUT_MS 1000
+
+struct upstream_router_stats {
+	uint64_t listings;     // identity list fan-outs to all upstreams
+	uint64_t timeouts;     // upstreams left out of a fan-out because they did not answer in time
+	uint64_t routed;       // requests sent to the upstream owning their key
+	uint64_t indexMisses;  // key lookups that had to list the identities again
+	size_t indexedKeys;    // keys in the index
+};
+
+// Several upstream agents (for example Git Bash's ssh-agent, Pageant and a hardware token agent) seen as one.
+// REQUEST_IDENTITIES is sent to all upstreams in parallel, each one from its own thread and connection, and the
+// key lists are merged, a key listed by several upstreams belonging to the first one. Upstreams that do not answer
+// within timeoutMs are left out of the list, and are not asked again until they answered.
+// The merged list fills an index from key blob to owning upstream, so a SIGN_REQUEST goes straight to the agent
+// holding its key. Messages adding or removing keys mark the index stale, the next lookup then lists the keys again.
+class upstream_router {
+public:
+	upstream_router(std::vector<upstream_connector> connectors, uint32_t timeoutMs);
+	// Waits for the fan-out threads, which may be blocked on an upstream that never answers
+	~upstream_router();
+
+	upstream_router(const upstream_router&) = delete;
+	upstream_router& operator=(const upstream_router&) = delete;
+
+	size_t getUpstreamCount() const { return connectors.size(); }
+
+	// Open a new connection to upstream index, used by the calling thread only.
+	std::unique_ptr<agent_upstream> connect(size_t index) const { return connectors[index](); }
+
+	// Write the merged IDENTITIES_ANSWER of all upstreams into reply.
+	// Concurrent calls share the same fan-out. Returns the reply size or -1 if no upstream answered.
+	int32_t listIdentities(message_buffer& reply, int32_t replyMaxSize);
+
+	// Index of the upstream owning the key blob, listing the identities again if the index is stale
+	// or does not know the key. Returns -1 if no upstream has that key.
+	int findOwner(const uint8_t* keyBlob, uint32_t keySize);
+
+	// Mark the index stale, must be called before and after relaying a message changing the keys of an upstream.
+	void invalidate();
+
+	upstream_router_stats getStats() const;
+
+	void printStats() const;
+
+private:
+	struct worker;
+
+	void workerLoop(worker* w);
+	void mergeAnswers(uint64_t round);
+
+	std::vector<upstream_connector> connectors;
+	uint32_t timeoutMs;
+
+	mutable std::mutex mutex;
+	std::condition_variable roundDone;
+	std::condition_variable listed;
+	std::vector<std::unique_ptr<worker>> workers;
+	bool stopping;
+	bool listing;
+	uint64_t currentRound;
+	uint64_t completedRound;
+	std::vector<char> mergedAnswer;
+	std::unordered_map<std::string, size_t> keyOwners;
+	bool indexStale;
+	// Incremented by invalidate so a fan-out started before a key change does not mark the index fresh
+	uint64_t generation;
+
+	std::atomic<uint64_t> listings;
+	std::atomic<uint64_t> timeouts;
+	std::atomic<uint64_t> routed;
+	std::atomic<uint64_t> indexMisses;
+};
+
+// Per-session view of an upstream_router, with its own connection to each upstream opened on first use.
+// Requests without a key go to the first upstream, except REMOVE_ALL_IDENTITIES, LOCK, UNLOCK and
+// session-bind which go to every upstream and only succeed if all of them succeeded.
+// Once bound, the session lists the identities through its own connections, since agents filter the identities
+// of a bound connection (destination constrained keys), instead of sharing the router's fan-out.
+// A request whose upstream cannot be reached gets a failure reply instead of ending the session.
+class routed_upstream : public agent_upstream {
+public:
+	explicit routed_upstream(upstream_router& router);
+
+	int32_t transact(const void* request, int32_t requestSize, message_buffer& reply, int32_t replyMaxSize) override;
+
+private:
+	int32_t forward(size_t index, const void* request, int32_t requestSize, message_buffer& reply, int32_t replyMaxSize);
+	int32_t broadcast(const void* request, int32_t requestSize, message_buffer& reply, int32_t replyMaxSize);
+	int32_t listBoundIdentities(const void* request, int32_t requestSize, message_buffer& reply, int32_t replyMaxSize);
+
+	upstream_router& router;
+	std::vector<std::unique_ptr<agent_upstream>> upstreams;
+	bool bound;
+};
@@ -0,0 +1,142 @@
+#include "relay/upstream-scheduler.h"
+#include "relay/agent-message.h"
+#include "relay/relay-stats.h"
+
+// Session keys are above any process id
+#define UPSTREAM_SCHEDULER_FIRST_SESSION_KEY (1ull << 32)
+
+upstream_scheduler::upstream_scheduler(size_t maxInFlight, size_t maxClientInFlight)
+    : maxInFlight(maxInFlight > 0 ? maxInFlight : 1),
+      maxClientInFlight(maxClientInFlight > 0 ? maxClientInFlight : 1),
+      inFlight(0),
+      virtualNs(0),
+      servedSeq(0),
+      nextSessionKey(UPSTREAM_SCHEDULER_FIRST_SESSION_KEY) {}
+
+bool upstream_scheduler::isPriorityType(int type) {
+	return type == SSH2_AGENTC_REQUEST_IDENTITIES || type == SSH_AGENTC_EXTENSION;
+}
+
+uint64_t upstream_scheduler::makeClientKey(unsigned long processId) {
+	if(processId != 0)
+		return processId;
+
+	std::lock_guard<std::mutex> lock(mutex);
+	return nextSessionKey++;
+}
+
+void upstream_scheduler::acquire(uint64_t clientKey, int type) {
+	uint64_t queuedNs = monotonicNs();
+	bool priority = isPriorityType(type);
+	waiter w;
+
+	w.granted = false;
+
+	std::unique_lock<std::mutex> lock(mutex);
+
+	client_state& client = clients[clientKey];
+	if(client.waiting.empty() && client.priorityWaiting == 0 && client.inFlight == 0) {
+		// A new or idle client does not get credit for the time it did not use the upstream
+		if(client.usedNs < virtualNs)
+			client.usedNs = virtualNs;
+	}
+
+	if(priority) {
+		priorityLane.emplace_back(clientKey, &w);
+		client.priorityWaiting++;
+	} else {
+		client.waiting.push_back(&w);
+	}
+
+	dispatch();
+	w.condition.wait(lock, [&w]() { return w.granted; });
+	lock.unlock();
+
+	relay_stats::instance().onRequestScheduled(priority, monotonicNs() - queuedNs);
+}
+
+void upstream_scheduler::release(uint64_t clientKey, uint64_t upstreamNs) {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	inFlight--;
+
+	auto it = clients.find(clientKey);
+	if(it != clients.end()) {
+		client_state& client = it->second;
+		client.inFlight--;
+		client.usedNs += upstreamNs;
+		// Idle clients are forgotten, they start again from virtualNs
+		if(client.inFlight == 0 && client.waiting.empty() && client.priorityWaiting == 0)
+			clients.erase(it);
+	}
+
+	dispatch();
+}
+
+void upstream_scheduler::grant(waiter* w) {
+	w->granted = true;
+	w->condition.notify_one();
+}
+
+void upstream_scheduler::dispatch() {
+	while(inFlight < maxInFlight) {
+		// Oldest lane request of a client under its in-flight limit, requests of the other clients keep their place.
+		// The client is kept while it has requests in the lane.
+		auto request = priorityLane.begin();
+		while(request != priorityLane.end() && clients[request->first].inFlight >= maxClientInFlight) {
+			request++;
+		}
+		if(request != priorityLane.end()) {
+			client_state& client = clients[request->first];
+			waiter* w = request->second;
+
+			priorityLane.erase(request);
+			client.priorityWaiting--;
+			client.inFlight++;
+			inFlight++;
+			grant(w);
+			continue;
+		}
+
+		// Linear in the number of clients with requests in flight or waiting, which are few
+		client_state* next = NULL;
+		for(auto& entry : clients) {
+			client_state& client = entry.second;
+			if(client.waiting.empty() || client.inFlight >= maxClientInFlight)
+				continue;
+			if(next == NULL || client.usedNs < next->usedNs ||
+			   (client.usedNs == next->usedNs && client.lastServedSeq < next->lastServedSeq))
+				next = &client;
+		}
+		if(next == NULL)
+			return;
+
+		waiter* w = next->waiting.front();
+		next->waiting.pop_front();
+		next->inFlight++;
+		next->lastServedSeq = ++servedSeq;
+		if(virtualNs < next->usedNs)
+			virtualNs = next->usedNs;
+
+		inFlight++;
+		grant(w);
+	}
+}
+
+scheduled_upstream::scheduled_upstream(agent_upstream& upstream,
+                                       upstream_scheduler& scheduler,
+                                       uint64_t clientKey) noexcept
+    : upstream(upstream), scheduler(scheduler), clientKey(clientKey) {}
+
+int32_t scheduled_upstream::transact(const void* request,
+                                     int32_t requestSize,
+                                     message_buffer& reply,
+                                     int32_t replyMaxSize) {
+	scheduler.acquire(clientKey, agentMessageType(request, requestSize));
+
+	uint64_t startNs = monotonicNs();
+	int32_t replySize = upstream.transact(request, requestSize, reply, replyMaxSize);
+	scheduler.release(clientKey, monotonicNs() - startNs);
+
+	return replySize;
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "relay/agent-upstream.h"
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+
+#define UPSTREAM_SCHEDULER_DEFAULT_CLIENT_INFLIGHT 1
+
+// Fair queue in front of an upstream agent handling one request at a time (Pageant's window procedure,
+// ssh-agent's event loop), so a client flooding it with sign requests cannot delay every other client.
+// At most maxInFlight requests are sent upstream at once, and at most maxClientInFlight of them from the
+// same client, the others wait here. Cheap requests (REQUEST_IDENTITIES and extensions) go first, within the
+// same per-client limit so a client flooding them cannot take every slot, then the waiting client which used
+// the upstream for the shortest time, so a client starting to send requests is served before a client which
+// kept it busy. Clients are identified by their process when known.
+class upstream_scheduler {
+public:
+	upstream_scheduler(size_t maxInFlight, size_t maxClientInFlight);
+
+	upstream_scheduler(const upstream_scheduler&) = delete;
+	upstream_scheduler& operator=(const upstream_scheduler&) = delete;
+
+	// Wait until a request of the given message type from clientKey may be sent upstream.
+	void acquire(uint64_t clientKey, int type);
+
+	// The request of clientKey got its reply after spending upstreamNs upstream, charged to the client.
+	void release(uint64_t clientKey, uint64_t upstreamNs);
+
+	// Key of a session from the client process processId, or of the session alone when processId is 0 (unknown).
+	uint64_t makeClientKey(unsigned long processId);
+
+	static bool isPriorityType(int type);
+
+private:
+	struct waiter {
+		std::condition_variable condition;
+		bool granted;
+	};
+
+	struct client_state {
+		std::deque<waiter*> waiting;
+		size_t priorityWaiting = 0;  // requests of the client in priorityLane
+		size_t inFlight = 0;
+		uint64_t usedNs = 0;         // upstream time used while the client had requests waiting or in flight
+		uint64_t lastServedSeq = 0;  // breaks ties between clients in round-robin order
+	};
+
+	void dispatch();
+	void grant(waiter* w);
+
+	size_t maxInFlight;
+	size_t maxClientInFlight;
+
+	std::mutex mutex;
+	size_t inFlight;
+	std::deque<std::pair<uint64_t, waiter*>> priorityLane;
+	std::unordered_map<uint64_t, client_state> clients;
+	// Used time of the last client served, clients starting to send requests start from there
+	uint64_t virtualNs;
+	uint64_t servedSeq;
+	uint64_t nextSessionKey;
+};
+
+// Upstream of one session whose requests go through an upstream_scheduler.
+class scheduled_upstream : public agent_upstream {
+public:
+	scheduled_upstream(agent_upstream& upstream, upstream_scheduler& scheduler, uint64_t clientKey) noexcept;
+
+	int32_t transact(const void* request, int32_t requestSize, message_buffer& reply, int32_t replyMaxSize) override;
+
+private:
+	agent_upstream& upstream;
+	upstream_scheduler& scheduler;
+	uint64_t clientKey;
+};
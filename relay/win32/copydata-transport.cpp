@@ -0,0 +1,75 @@
+#include "relay/win32/copydata-transport.h"
+#include "relay/logger.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <tchar.h>
+
+std::atomic<HWND> copydata_transport::pageantHwnd(NULL);
+
+copydata_transport::copydata_transport() noexcept : fileMap(NULL), sharedMemory(NULL) {
+	sprintf_s(mapName, _countof(mapName), "PageantRequest%08lx", GetCurrentThreadId());
+	mapName[_countof(mapName) - 1] = 0;
+}
+
+copydata_transport::~copydata_transport() {
+	if(sharedMemory != NULL)
+		UnmapViewOfFile(sharedMemory);
+	if(fileMap != NULL)
+		CloseHandle(fileMap);
+}
+
+uint8_t* copydata_transport::getSharedMemory() {
+	if(sharedMemory != NULL)
+		return sharedMemory;
+
+	fileMap = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, PAGEANT_MAX_MSGLEN, mapName);
+	if(fileMap == NULL) {
+		logError("Failed to create file mapping: %lu\n", GetLastError());
+		return NULL;
+	}
+
+	sharedMemory = (uint8_t*) MapViewOfFile(fileMap, FILE_MAP_WRITE, 0, 0, 0);
+	if(sharedMemory == NULL) {
+		logError("Failed to map file mapping: %lu\n", GetLastError());
+		CloseHandle(fileMap);
+		fileMap = NULL;
+		return NULL;
+	}
+
+	return sharedMemory;
+}
+
+bool copydata_transport::findAgent() {
+	HWND hwnd = FindWindow(TEXT("Pageant"), TEXT("Pageant"));
+	if(hwnd == NULL) {
+		logError("Failed to find Pageant window: %lu\n", GetLastError());
+		return false;
+	}
+
+	pageantHwnd = hwnd;
+	return true;
+}
+
+bool copydata_transport::sendRequest() {
+	HWND hwnd = pageantHwnd;
+	if(hwnd == NULL) {
+		if(!findAgent())
+			return false;
+		hwnd = pageantHwnd;
+	}
+
+	COPYDATASTRUCT cds;
+	cds.dwData = AGENT_COPYDATA_ID;
+	cds.cbData = (DWORD) (strlen(mapName) + 1);
+	cds.lpData = mapName;
+	LRESULT result = SendMessage(hwnd, WM_COPYDATA, 0, (LPARAM) &cds);
+	if(result == FALSE) {
+		logWarning("SendMessage failed: %lu\n", GetLastError());
+		// Forget the window unless another thread already replaced it
+		pageantHwnd.compare_exchange_strong(hwnd, NULL);
+		return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "relay/pageant-upstream.h"
+
+#include <windows.h>
+
+#include <atomic>
+
+#define AGENT_COPYDATA_ID 0x804e50ba
+
+// Pageant's WM_COPYDATA protocol: the request is passed in a named file mapping
+// whose name is sent to the Pageant window.
+// The file mapping is created on first use and kept until the transport is destroyed,
+// the Pageant window is shared by all transports and only looked up again when it does not answer.
+// The mapping name contains the thread id, so a transport must only be used by the thread that created it.
+class copydata_transport : public pageant_transport {
+public:
+	copydata_transport() noexcept;
+	~copydata_transport() override;
+
+	copydata_transport(const copydata_transport&) = delete;
+	copydata_transport& operator=(const copydata_transport&) = delete;
+
+	uint8_t* getSharedMemory() override;
+	bool findAgent() override;
+	bool sendRequest() override;
+
+private:
+	char mapName[128];
+	HANDLE fileMap;
+	uint8_t* sharedMemory;
+
+	static std::atomic<HWND> pageantHwnd;
+};
@@ -0,0 +1,90 @@
+#include "relay/cygwin-socket-file.h"
+#include "relay/logger.h"
+
+// Bounded exponential backoff when the socket file is being written by the agent
+#define SOCKET_FILE_OPEN_RETRIES 10
+#define SOCKET_FILE_OPEN_FIRST_DELAY_MS 1
+#define SOCKET_FILE_OPEN_MAX_DELAY_MS 100
+
+// Paths are TCHAR strings while log formats are narrow
+#ifdef UNICODE
+#define PATH_FORMAT "%ls"
+#else
+#define PATH_FORMAT "%s"
+#endif
+
+bool cygwin_socket_file::startWatching() {
+	socket_file_path directory;
+	size_t separator = path.find_last_of(TEXT("\\/"));
+
+	if(separator == socket_file_path::npos)
+		directory = TEXT(".");
+	else
+		directory = path.substr(0, separator + 1);
+
+	// Any change of a file in the directory invalidates the cached content
+	changeHandle = FindFirstChangeNotification(directory.c_str(),
+	                                           FALSE,
+	                                           FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_LAST_WRITE |
+	                                               FILE_NOTIFY_CHANGE_SIZE);
+	if(changeHandle == INVALID_HANDLE_VALUE) {
+		logError("Failed to watch " PATH_FORMAT ": %lu\n", directory.c_str(), GetLastError());
+		return false;
+	}
+
+	return true;
+}
+
+bool cygwin_socket_file::changedSinceLastCheck() {
+	bool changed = false;
+
+	while(WaitForSingleObject(changeHandle, 0) == WAIT_OBJECT_0) {
+		changed = true;
+		if(!FindNextChangeNotification(changeHandle))
+			break;
+	}
+
+	return changed;
+}
+
+void cygwin_socket_file::stopWatching() {
+	FindCloseChangeNotification(changeHandle);
+}
+
+bool cygwin_socket_file::readFile(char* buffer, size_t size) {
+	HANDLE fileHandle;
+	DWORD lastError;
+	DWORD bytesRead;
+	DWORD delayMs = SOCKET_FILE_OPEN_FIRST_DELAY_MS;
+
+	for(int retry = 0;; retry++) {
+		fileHandle =
+		    CreateFile(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		lastError = GetLastError();
+
+		if(fileHandle != INVALID_HANDLE_VALUE || lastError != ERROR_SHARING_VIOLATION ||
+		   retry == SOCKET_FILE_OPEN_RETRIES) {
+			break;
+		}
+
+		Sleep(delayMs);
+		delayMs = delayMs * 2 < SOCKET_FILE_OPEN_MAX_DELAY_MS ? delayMs * 2 : SOCKET_FILE_OPEN_MAX_DELAY_MS;
+	}
+
+	if(fileHandle == INVALID_HANDLE_VALUE) {
+		logError("Failed to open file " PATH_FORMAT ": %lu\n", path.c_str(), lastError);
+		return false;
+	}
+
+	BOOL result = ReadFile(fileHandle, buffer, (DWORD) size - 1, &bytesRead, NULL);
+	CloseHandle(fileHandle);
+
+	if(!result) {
+		logError("Failed to read file " PATH_FORMAT ": %lu\n", path.c_str(), GetLastError());
+		return false;
+	}
+
+	buffer[bytesRead] = 0;
+
+	return true;
+}
@@ -0,0 +1,239 @@
+#include "relay/win32/iocp-reactor.h"
+#include "relay/logger.h"
+#include "relay/relay-session.h"
+#include "relay/relay-stats.h"
+
+#include <string.h>
+#include <tchar.h>
+
+#include <thread>
+#include <vector>
+
+// A connection object is created for each pipe instance before a client connects to it,
+// it is used as the completion key of both the pipe and the upstream socket.
+struct iocp_reactor::connection {
+	connection(HANDLE hPipe, int32_t maxMessageSize, identity_cache* identityCache)
+	    : hPipe(hPipe), upstreamSock(INVALID_SOCKET), connecting(true), session(maxMessageSize, identityCache) {
+		memset(&overlapped, 0, sizeof(overlapped));
+	}
+
+	OVERLAPPED overlapped;
+	HANDLE hPipe;
+	SOCKET upstreamSock;
+	bool connecting;
+	relay_session session;
+};
+
+iocp_reactor::iocp_reactor(LPCTSTR pipeName,
+                           DWORD pipeBufferSize,
+                           socket_connector connectUpstream,
+                           int32_t maxMessageSize,
+                           identity_cache* identityCache,
+                           int listenInstances)
+    : pipeName(pipeName),
+      pipeBufferSize(pipeBufferSize),
+      connectUpstream(std::move(connectUpstream)),
+      maxMessageSize(maxMessageSize),
+      identityCache(identityCache),
+      listenInstances(listenInstances > 0 ? listenInstances : 1),
+      completionPort(NULL),
+      activeSessions(0) {}
+
+iocp_reactor::~iocp_reactor() {
+	if(completionPort != NULL)
+		CloseHandle(completionPort);
+}
+
+bool iocp_reactor::run(int threadCount) {
+	completionPort = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, threadCount);
+	if(completionPort == NULL) {
+		logError("CreateIoCompletionPort failed, GLE=%lu.\n", GetLastError());
+		return false;
+	}
+
+	for(int i = 0; i < listenInstances; i++) {
+		if(!listenNextClient())
+			return false;
+	}
+
+	std::vector<std::thread> threads;
+	for(int i = 1; i < threadCount; i++) {
+		threads.emplace_back(&iocp_reactor::loop, this);
+	}
+
+	loop();
+
+	for(std::thread& thread : threads) {
+		thread.join();
+	}
+
+	return true;
+}
+
+bool iocp_reactor::listenNextClient() {
+	HANDLE hPipe = CreateNamedPipe(pipeName,                                  // pipe name
+	                               PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED,  // read/write access, overlapped
+	                               PIPE_TYPE_BYTE | PIPE_READMODE_BYTE |       // byte type pipe
+	                                   PIPE_WAIT,                              // blocking mode
+	                               PIPE_UNLIMITED_INSTANCES,                   // max. instances
+	                               pipeBufferSize,                             // output buffer size
+	                               pipeBufferSize,                             // input buffer size
+	                               0,                                          // client time-out
+	                               NULL);                                      // default security attribute
+
+	if(hPipe == INVALID_HANDLE_VALUE) {
+		logError("CreateNamedPipe failed, GLE=%lu.\n", GetLastError());
+		return false;
+	}
+
+	connection* conn = new connection(hPipe, maxMessageSize, identityCache);
+
+	if(CreateIoCompletionPort(hPipe, completionPort, (ULONG_PTR) conn, 0) == NULL) {
+		logError("Failed to associate pipe to completion port, GLE=%lu.\n", GetLastError());
+		CloseHandle(hPipe);
+		delete conn;
+		return false;
+	}
+
+	if(!ConnectNamedPipe(hPipe, &conn->overlapped)) {
+		DWORD lastError = GetLastError();
+
+		if(lastError == ERROR_PIPE_CONNECTED) {
+			// The client connected before ConnectNamedPipe, no completion will be queued
+			PostQueuedCompletionStatus(completionPort, 0, (ULONG_PTR) conn, &conn->overlapped);
+		} else if(lastError != ERROR_IO_PENDING) {
+			logError("ConnectNamedPipe failed, GLE=%lu.\n", lastError);
+			CloseHandle(hPipe);
+			delete conn;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void iocp_reactor::loop() {
+	for(;;) {
+		DWORD bytesTransferred = 0;
+		ULONG_PTR completionKey = 0;
+		LPOVERLAPPED overlapped = NULL;
+
+		BOOL fSuccess =
+		    GetQueuedCompletionStatus(completionPort, &bytesTransferred, &completionKey, &overlapped, INFINITE);
+		DWORD lastError = fSuccess ? ERROR_SUCCESS : GetLastError();
+		if(overlapped == NULL) {
+			logError("GetQueuedCompletionStatus failed, GLE=%lu.\n", lastError);
+			return;
+		}
+
+		connection* conn = (connection*) completionKey;
+
+		if(conn->connecting) {
+			conn->connecting = false;
+
+			// Replace the instance so as many of them keep waiting for the next clients
+			while(!listenNextClient()) {
+				Sleep(100);
+			}
+
+			if(!fSuccess && lastError != ERROR_PIPE_CONNECTED) {
+				closeConnection(conn);
+				continue;
+			}
+
+			onClientConnected(conn);
+			continue;
+		}
+
+		int32_t result;
+		if(fSuccess) {
+			result = (int32_t) bytesTransferred;
+		} else {
+			if(lastError == ERROR_BROKEN_PIPE || lastError == ERROR_HANDLE_EOF || lastError == ERROR_NETNAME_DELETED)
+				result = 0;
+			else
+				result = -(int32_t) lastError;
+		}
+
+		if(conn->session.onIoComplete(result))
+			issueIo(conn);
+		else
+			closeConnection(conn);
+	}
+}
+
+void iocp_reactor::onClientConnected(connection* conn) {
+	logInfo("Client connected, connecting to upstream.\n");
+
+	// Upstream connections are local and complete immediately, so they are made synchronously
+	conn->upstreamSock = connectUpstream();
+	if(conn->upstreamSock == INVALID_SOCKET) {
+		logError("Error: cannot connect to upstream ssh-agent\n");
+		closeConnection(conn);
+		return;
+	}
+
+	// Counted as soon as the upstream socket is open, closeConnection() uncounts it
+	activeSessions++;
+	relay_stats::instance().onSessionOpened();
+
+	if(CreateIoCompletionPort((HANDLE) conn->upstreamSock, completionPort, (ULONG_PTR) conn, 0) == NULL) {
+		logError("Failed to associate socket to completion port, GLE=%lu.\n", GetLastError());
+		closeConnection(conn);
+		return;
+	}
+
+	issueIo(conn);
+}
+
+void iocp_reactor::issueIo(connection* conn) {
+	relay_io io = conn->session.currentIo();
+	BOOL fSuccess;
+	DWORD lastError;
+
+	memset(&conn->overlapped, 0, sizeof(conn->overlapped));
+
+	// Even when the operation completes immediately, a completion packet is queued
+	if(io.endpoint == relay_endpoint::client) {
+		if(io.isWrite)
+			fSuccess = WriteFile(conn->hPipe, io.buffer, io.size, NULL, &conn->overlapped);
+		else
+			fSuccess = ReadFile(conn->hPipe, io.buffer, io.size, NULL, &conn->overlapped);
+		lastError = fSuccess ? ERROR_SUCCESS : GetLastError();
+	} else {
+		WSABUF wsaBuffer;
+		DWORD flags = 0;
+		int result;
+
+		wsaBuffer.buf = io.buffer;
+		wsaBuffer.len = io.size;
+
+		if(io.isWrite)
+			result = WSASend(conn->upstreamSock, &wsaBuffer, 1, NULL, 0, &conn->overlapped, NULL);
+		else
+			result = WSARecv(conn->upstreamSock, &wsaBuffer, 1, NULL, &flags, &conn->overlapped, NULL);
+		fSuccess = result == 0;
+		lastError = fSuccess ? ERROR_SUCCESS : WSAGetLastError();
+	}
+
+	if(!fSuccess && lastError != ERROR_IO_PENDING) {
+		if(lastError != ERROR_BROKEN_PIPE && lastError != ERROR_NO_DATA)
+			logWarning("Relay session I/O failed: %lu\n", lastError);
+		closeConnection(conn);
+	}
+}
+
+void iocp_reactor::closeConnection(connection* conn) {
+	if(conn->upstreamSock != INVALID_SOCKET) {
+		closesocket(conn->upstreamSock);
+		activeSessions--;
+		relay_stats::instance().onSessionClosed();
+	}
+
+	// Sessions are only closed once the last reply write has completed, so there is
+	// no need for a blocking FlushFileBuffers here.
+	DisconnectNamedPipe(conn->hPipe);
+	CloseHandle(conn->hPipe);
+
+	delete conn;
+}
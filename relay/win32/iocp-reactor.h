@@ -0,0 +1,49 @@
+#pragma once
+
+#include "relay/identity-cache.h"
+#include "relay/socket-stream.h"
+
+#include <atomic>
+
+// Event-driven server handling every named pipe client and upstream socket as a relay_session
+// state machine driven by overlapped I/O on a single completion port shared by a small fixed
+// number of threads. Each session has at most one outstanding I/O, so it is handled by a single
+// thread at a time without any locking. listenInstances pipe instances wait for clients at once,
+// each one being replaced as soon as a client connects to it.
+class iocp_reactor {
+public:
+	iocp_reactor(LPCTSTR pipeName,
+	             DWORD pipeBufferSize,
+	             socket_connector connectUpstream,
+	             int32_t maxMessageSize,
+	             identity_cache* identityCache = NULL,
+	             int listenInstances = 1);
+	~iocp_reactor();
+
+	iocp_reactor(const iocp_reactor&) = delete;
+	iocp_reactor& operator=(const iocp_reactor&) = delete;
+
+	// Run the event loop on threadCount threads, including the calling one.
+	// Returns false if the reactor could not be initialized, otherwise never returns.
+	bool run(int threadCount);
+
+	size_t getActiveSessions() const { return activeSessions; }
+
+private:
+	struct connection;
+
+	void loop();
+	bool listenNextClient();
+	void onClientConnected(connection* conn);
+	void issueIo(connection* conn);
+	void closeConnection(connection* conn);
+
+	LPCTSTR pipeName;
+	DWORD pipeBufferSize;
+	socket_connector connectUpstream;
+	int32_t maxMessageSize;
+	identity_cache* identityCache;
+	int listenInstances;
+	HANDLE completionPort;
+	std::atomic<size_t> activeSessions;
+};
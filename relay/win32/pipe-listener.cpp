@@ -0,0 +1,57 @@
+#include "relay/win32/pipe-listener.h"
+#include "relay/logger.h"
+
+#include <system_error>
+#include <thread>
+#include <vector>
+
+static void acceptLoop(LPCTSTR pipeName, DWORD pipeBufferSize, const std::function<void(HANDLE hPipe)>& onClient) {
+	for(;;) {
+		HANDLE hPipe = CreateNamedPipe(pipeName,                              // pipe name
+		                               PIPE_ACCESS_DUPLEX,                    // read/write access
+		                               PIPE_TYPE_BYTE | PIPE_READMODE_BYTE |  // byte type pipe
+		                                   PIPE_WAIT,                         // blocking mode
+		                               PIPE_UNLIMITED_INSTANCES,              // max. instances
+		                               pipeBufferSize,                        // output buffer size
+		                               pipeBufferSize,                        // input buffer size
+		                               0,                                     // client time-out
+		                               NULL);                                 // default security attribute
+
+		if(hPipe == INVALID_HANDLE_VALUE) {
+			logError("CreateNamedPipe failed, GLE=%lu.\n", GetLastError());
+			Sleep(100);
+			continue;
+		}
+
+		// Wait for the client to connect; if it succeeds,
+		// the function returns a nonzero value. If the function
+		// returns zero, GetLastError returns ERROR_PIPE_CONNECTED.
+
+		BOOL fConnected = ConnectNamedPipe(hPipe, NULL) ? TRUE : (GetLastError() == ERROR_PIPE_CONNECTED);
+
+		if(!fConnected) {
+			CloseHandle(hPipe);
+			continue;
+		}
+
+		onClient(hPipe);
+	}
+}
+
+void listenNamedPipe(LPCTSTR pipeName,
+                     DWORD pipeBufferSize,
+                     int instanceCount,
+                     const std::function<void(HANDLE hPipe)>& onClient) {
+	std::vector<std::thread> acceptors;
+
+	for(int i = 1; i < instanceCount; i++) {
+		try {
+			acceptors.emplace_back(acceptLoop, pipeName, pipeBufferSize, std::cref(onClient));
+		} catch(const std::system_error& e) {
+			logError("Cannot create a pipe acceptor thread: %s\n", e.what());
+			break;
+		}
+	}
+
+	acceptLoop(pipeName, pipeBufferSize, onClient);
+}
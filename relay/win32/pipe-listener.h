@@ -0,0 +1,17 @@
+#pragma once
+
+#include <windows.h>
+
+#include <functional>
+
+#define PIPE_LISTENER_DEFAULT_INSTANCES 4
+
+// Keep instanceCount instances of the named pipe waiting for clients, each one on its own acceptor
+// thread including the calling one. When a client connects, onClient gets the connected pipe handle
+// and its acceptor creates the next instance, while the other instances keep accepting clients,
+// so a burst of clients does not get ERROR_PIPE_BUSY between two instances.
+// onClient is called concurrently by the acceptor threads. Never returns.
+void listenNamedPipe(LPCTSTR pipeName,
+                     DWORD pipeBufferSize,
+                     int instanceCount,
+                     const std::function<void(HANDLE hPipe)>& onClient);
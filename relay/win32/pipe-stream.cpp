@@ -0,0 +1,89 @@
+#include "relay/win32/pipe-stream.h"
+
+pipe_stream::pipe_stream(HANDLE hPipe) noexcept : hPipe(hPipe), readerThreadId(0), interrupted(false) {}
+
+pipe_stream::~pipe_stream() {
+	// Flush the pipe to allow the client to read the pipe's contents
+	// before disconnecting. Then disconnect the pipe, and close the
+	// handle to this pipe instance.
+	if(hPipe != NULL && hPipe != INVALID_HANDLE_VALUE) {
+		FlushFileBuffers(hPipe);
+		DisconnectNamedPipe(hPipe);
+		CloseHandle(hPipe);
+	}
+}
+
+int32_t pipe_stream::read(void* buffer, int32_t size) {
+	DWORD cbBytesRead = 0;
+
+	{
+		std::lock_guard<std::mutex> lock(interruptMutex);
+		if(interrupted)
+			return -(int32_t) ERROR_OPERATION_ABORTED;
+		readerThreadId = GetCurrentThreadId();
+	}
+
+	BOOL fSuccess = ReadFile(hPipe,         // handle to pipe
+	                         buffer,        // buffer to receive data
+	                         size,          // size of buffer
+	                         &cbBytesRead,  // number of bytes read
+	                         NULL);         // not overlapped I/O
+	DWORD lastError = fSuccess ? ERROR_SUCCESS : GetLastError();
+
+	{
+		std::lock_guard<std::mutex> lock(interruptMutex);
+		readerThreadId = 0;
+		// Bytes read just before the interrupt are dropped, the session ends anyway
+		if(interrupted)
+			return -(int32_t) ERROR_OPERATION_ABORTED;
+	}
+
+	if(fSuccess) {
+		return (int32_t) cbBytesRead;
+	} else if(lastError == ERROR_BROKEN_PIPE) {
+		return 0;
+	} else {
+		return -(int32_t) lastError;
+	}
+}
+
+int32_t pipe_stream::write(const void* buffer, int32_t size) {
+	DWORD cbWritten = 0;
+
+	if(interrupted)
+		return -(int32_t) ERROR_OPERATION_ABORTED;
+
+	BOOL fSuccess = WriteFile(hPipe,       // handle to pipe
+	                          buffer,      // buffer to write from
+	                          size,        // number of bytes to write
+	                          &cbWritten,  // number of bytes written
+	                          NULL);       // not overlapped I/O
+
+	if(!fSuccess)
+		return -(int32_t) GetLastError();
+
+	return (int32_t) cbWritten;
+}
+
+void pipe_stream::interrupt() {
+	// The blocked ReadFile then fails with ERROR_OPERATION_ABORTED. A reader between its registration and
+	// ReadFile has no I/O to cancel yet, the cancel is retried until its read is cancelled or returns.
+	for(;;) {
+		{
+			std::lock_guard<std::mutex> lock(interruptMutex);
+			interrupted = true;
+			if(readerThreadId == 0)
+				return;
+
+			HANDLE hThread = OpenThread(THREAD_TERMINATE, FALSE, readerThreadId);
+			if(hThread == NULL)
+				return;
+			BOOL cancelled = CancelSynchronousIo(hThread);
+			DWORD lastError = GetLastError();
+			CloseHandle(hThread);
+			if(cancelled || lastError != ERROR_NOT_FOUND)
+				return;
+		}
+		Sleep(1);
+	}
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "relay/agent-stream.h"
+
+#include <windows.h>
+
+#include <atomic>
+#include <mutex>
+
+// Stream over a connected named pipe instance.
+// The pipe is flushed, disconnected and closed on destruction.
+// Once interrupted, reads and writes fail with ERROR_OPERATION_ABORTED, like a shut down socket.
+class pipe_stream : public agent_stream {
+public:
+	explicit pipe_stream(HANDLE hPipe) noexcept;
+	~pipe_stream() override;
+
+	pipe_stream(const pipe_stream&) = delete;
+	pipe_stream& operator=(const pipe_stream&) = delete;
+
+	int32_t read(void* buffer, int32_t size) override;
+	int32_t write(const void* buffer, int32_t size) override;
+	void interrupt() override;
+
+private:
+	HANDLE hPipe;
+	// Thread in ReadFile, whose synchronous I/O interrupt() cancels. Only set around ReadFile,
+	// under interruptMutex like interrupted, so no other I/O of that thread is ever cancelled.
+	std::mutex interruptMutex;
+	DWORD readerThreadId;
+	std::atomic<bool> interrupted;
+};
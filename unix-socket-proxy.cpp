@@ -0,0 +1,471 @@
+#include "relay/agent-message.h"
+#include "relay/agent-session.h"
+#include "relay/buffer-pool.h"
+#include "relay/cygwin-socket-file.h"
+#include "relay/identity-cache.h"
+#include "relay/identity-prefetch.h"
+#include "relay/idle-reaper.h"
+#include "relay/logger.h"
+#include "relay/posix/coro-reactor.h"
+#include "relay/posix/epoll-reactor.h"
+#include "relay/posix/stats-socket.h"
+#include "relay/posix/thread-server.h"
+#include "relay/posix/unix-socket.h"
+#include "relay/posix/uring-reactor.h"
+#include "relay/request-trace.h"
+#include "relay/session-pool.h"
+#include "relay/traffic-capture.h"
+#include "relay/upstream-mux.h"
+#include "relay/upstream-pool.h"
+#include "relay/upstream-router.h"
+#include "relay/upstream-scheduler.h"
+
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <memory>
+#include <vector>
+
+// Portable counterpart of ssh-agent-pipe-proxy: listen on a unix domain socket
+// and forward every request to the ssh-agent given by SSH_AUTH_SOCK. SSH_AUTH_SOCK can be either
+// a native unix socket or a cygwin/msys socket file like the one ssh-agent-pipe-proxy connects to.
+
+static socket_connector make_socket_connector(const char* path);
+static upstream_connector make_stream_connector(socket_connector connectSocket);
+
+void print_help(char* argv[]) {
+	printf("Usage: %s [--event-loop threads | --io-uring threads | --coroutines threads | --multiplex connections] "
+	       "[--upstream-pool size] [--upstream path]... [--upstream-timeout ms] [--max-sessions count] "
+	       "[--session-wait ms] [--listeners count] [--identity-cache ttl_ms] [--prefetch-identities] "
+	       "[--client-idle-timeout ms] [--upstream-idle-timeout ms] [--fair-queue inflight [--client-inflight count]] "
+	       "[--stream-min-size bytes] [--memory-budget megabytes [--memory-wait ms]] [--stats-socket path] "
+	       "[--capture path [--capture-redact]] [--trace path] [--log-level level] socket_path\n\n"
+	       " socket_path: path of the unix socket to listen on\n"
+	       " --event-loop: handle all sessions with an event loop running on that many threads\n"
+	       "               instead of one thread per client\n"
+	       " --io-uring: like --event-loop but with io_uring rings (Linux 5.5+), without identity cache\n"
+	       " --coroutines: like --event-loop but with each session written as a C++20 coroutine resumed by the loop\n"
+	       " --multiplex: share that many upstream connections between all clients\n"
+	       " --upstream-pool: keep that many upstream connections ready for new clients\n"
+	       " --upstream: forward to the agent socket (or cygwin socket file) at path instead of SSH_AUTH_SOCK,\n"
+	       "             with several ones, identity lists are merged and requests go to the agent owning their key\n"
+	       " --upstream-timeout: leave agents not listing their identities within ms out of the list (default %d)\n"
+	       " --max-sessions: run at most that many sessions at once without event loop (default %d),\n"
+	       "                 as many other clients wait for a session to end\n"
+	       " --session-wait: refuse clients that waited that long for a session to end (default %d)\n"
+	       " --listeners: accept clients on that many threads without event loop (default %d)\n"
+	       " --identity-cache: answer identity list requests from a cache kept up to ttl_ms milliseconds\n"
+	       " --prefetch-identities: request the identity list upstream as soon as a client connects,\n"
+	       "                        without event loop\n"
+	       " --client-idle-timeout: disconnect clients not sending any request for ms, without event loop\n"
+	       " --upstream-idle-timeout: close upstream connections unused for ms until their client sends a request,\n"
+	       "                          without event loop\n"
+	       " --fair-queue: send at most inflight requests upstream at once, the others wait in a queue fair\n"
+	       "               between client processes, identity lists first, without event loop\n"
+	       " --client-inflight: send at most count requests of the same client process at once (default %d)\n"
+	       " --stream-min-size: forward requests of at least that many bytes upstream while they are read instead\n"
+	       "                    of buffering them, without event loop (default %d, 0 to disable)\n"
+	       " --memory-budget: keep message buffers within that many megabytes, messages needing more are answered\n"
+	       "                  with a failure. 4 KiB buffers, io_uring registered buffers and pipelined bytes count\n"
+	       "                  but are never refused\n"
+	       " --memory-wait: wait up to ms for buffers to be released before refusing a message, without event loop\n"
+	       "                (default %d)\n"
+	       " --stats-socket: serve the relay statistics as JSON on a unix socket at path\n"
+	       " --capture: record every request and reply with its session and time in a binary file at path\n"
+	       " --capture-redact: only capture the size and type of messages, not their content\n"
+	       " --trace: write the time spent in each phase of each request to a Chrome trace event file at path,\n"
+	       "          without event loop\n"
+	       " --log-level: error, warning, info (default), debug or payload to also dump every message\n",
+	       argv[0],
+	       UPSTREAM_ROUTER_DEFAULT_TIMEOUT_MS,
+	       SESSION_POOL_DEFAULT_MAX_SESSIONS,
+	       SESSION_POOL_DEFAULT_WAIT_MS,
+	       THREAD_SERVER_DEFAULT_ACCEPTORS,
+	       UPSTREAM_SCHEDULER_DEFAULT_CLIENT_INFLIGHT,
+	       AGENT_SESSION_DEFAULT_STREAM_MIN_SIZE,
+	       BUFFER_POOL_DEFAULT_BUDGET_WAIT_MS);
+}
+
+int main(int argc, char* argv[]) {
+	const char* socketPath = NULL;
+	int eventLoopThreads = 0;
+	int ioUringThreads = 0;
+	int coroutineThreads = 0;
+	int upstreamPoolSize = 0;
+	int identityCacheTtlMs = 0;
+	bool prefetchIdentities = false;
+	int clientIdleTimeoutMs = 0;
+	int upstreamIdleTimeoutMs = 0;
+	int multiplexConnections = 0;
+	int fairQueueInFlight = 0;
+	int clientInFlight = UPSTREAM_SCHEDULER_DEFAULT_CLIENT_INFLIGHT;
+	int streamMinSize = AGENT_SESSION_DEFAULT_STREAM_MIN_SIZE;
+	int memoryBudgetMb = 0;
+	int memoryWaitMs = BUFFER_POOL_DEFAULT_BUDGET_WAIT_MS;
+	int maxSessions = SESSION_POOL_DEFAULT_MAX_SESSIONS;
+	int sessionWaitMs = SESSION_POOL_DEFAULT_WAIT_MS;
+	int acceptorThreads = THREAD_SERVER_DEFAULT_ACCEPTORS;
+	std::vector<const char*> upstreamPaths;
+	int upstreamTimeoutMs = UPSTREAM_ROUTER_DEFAULT_TIMEOUT_MS;
+	const char* statsSocketPath = NULL;
+	const char* capturePath = NULL;
+	bool captureRedact = false;
+	const char* tracePath = NULL;
+
+	for(int i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "--event-loop") == 0 && i + 1 < argc) {
+			eventLoopThreads = atoi(argv[++i]);
+			if(eventLoopThreads <= 0) {
+				printf("Invalid event loop thread count %s\n", argv[i]);
+				print_help(argv);
+				return 1;
+			}
+		} else if(strcmp(argv[i], "--io-uring") == 0 && i + 1 < argc) {
+			ioUringThreads = atoi(argv[++i]);
+			if(ioUringThreads <= 0) {
+				printf("Invalid io_uring thread count %s\n", argv[i]);
+				print_help(argv);
+				return 1;
+			}
+		} else if(strcmp(argv[i], "--coroutines") == 0 && i + 1 < argc) {
+			coroutineThreads = atoi(argv[++i]);
+			if(coroutineThreads <= 0) {
+				printf("Invalid coroutine thread count %s\n", argv[i]);
+				print_help(argv);
+				return 1;
+			}
+		} else if(strcmp(argv[i], "--upstream-pool") == 0 && i + 1 < argc) {
+			upstreamPoolSize = atoi(argv[++i]);
+			if(upstreamPoolSize <= 0) {
+				printf("Invalid upstream pool size %s\n", argv[i]);
+				print_help(argv);
+				return 1;
+			}
+		} else if(strcmp(argv[i], "--upstream") == 0 && i + 1 < argc) {
+			upstreamPaths.push_back(argv[++i]);
+		} else if(strcmp(argv[i], "--upstream-timeout") == 0 && i + 1 < argc) {
+			upstreamTimeoutMs = atoi(argv[++i]);
+			if(upstreamTimeoutMs <= 0) {
+				printf("Invalid upstream timeout %s\n", argv[i]);
+				print_help(argv);
+				return 1;
+			}
+		} else if(strcmp(argv[i], "--multiplex") == 0 && i + 1 < argc) {
+			multiplexConnections = atoi(argv[++i]);
+			if(multiplexConnections <= 0) {
+				printf("Invalid multiplexed connection count %s\n", argv[i]);
+				print_help(argv);
+				return 1;
+			}
+		} else if(strcmp(argv[i], "--max-sessions") == 0 && i + 1 < argc) {
+			maxSessions = atoi(argv[++i]);
+			if(maxSessions <= 0) {
+				printf("Invalid maximum session count %s\n", argv[i]);
+				print_help(argv);
+				return 1;
+			}
+		} else if(strcmp(argv[i], "--session-wait") == 0 && i + 1 < argc) {
+			sessionWaitMs = atoi(argv[++i]);
+			if(sessionWaitMs < 0) {
+				printf("Invalid session wait %s\n", argv[i]);
+				print_help(argv);
+				return 1;
+			}
+		} else if(strcmp(argv[i], "--listeners") == 0 && i + 1 < argc) {
+			acceptorThreads = atoi(argv[++i]);
+			if(acceptorThreads <= 0) {
+				printf("Invalid listener count %s\n", argv[i]);
+				print_help(argv);
+				return 1;
+			}
+		} else if(strcmp(argv[i], "--identity-cache") == 0 && i + 1 < argc) {
+			identityCacheTtlMs = atoi(argv[++i]);
+			if(identityCacheTtlMs <= 0) {
+				printf("Invalid identity cache TTL %s\n", argv[i]);
+				print_help(argv);
+				return 1;
+			}
+		} else if(strcmp(argv[i], "--prefetch-identities") == 0) {
+			prefetchIdentities = true;
+		} else if(strcmp(argv[i], "--client-idle-timeout") == 0 && i + 1 < argc) {
+			clientIdleTimeoutMs = atoi(argv[++i]);
+			if(clientIdleTimeoutMs <= 0) {
+				printf("Invalid client idle timeout %s\n", argv[i]);
+				print_help(argv);
+				return 1;
+			}
+		} else if(strcmp(argv[i], "--upstream-idle-timeout") == 0 && i + 1 < argc) {
+			upstreamIdleTimeoutMs = atoi(argv[++i]);
+			if(upstreamIdleTimeoutMs <= 0) {
+				printf("Invalid upstream idle timeout %s\n", argv[i]);
+				print_help(argv);
+				return 1;
+			}
+		} else if(strcmp(argv[i], "--fair-queue") == 0 && i + 1 < argc) {
+			fairQueueInFlight = atoi(argv[++i]);
+			if(fairQueueInFlight <= 0) {
+				printf("Invalid fair queue in flight request count %s\n", argv[i]);
+				print_help(argv);
+				return 1;
+			}
+		} else if(strcmp(argv[i], "--client-inflight") == 0 && i + 1 < argc) {
+			clientInFlight = atoi(argv[++i]);
+			if(clientInFlight <= 0) {
+				printf("Invalid client in flight request count %s\n", argv[i]);
+				print_help(argv);
+				return 1;
+			}
+		} else if(strcmp(argv[i], "--stream-min-size") == 0 && i + 1 < argc) {
+			streamMinSize = atoi(argv[++i]);
+			if(streamMinSize < 0) {
+				printf("Invalid stream minimum size %s\n", argv[i]);
+				print_help(argv);
+				return 1;
+			}
+		} else if(strcmp(argv[i], "--memory-budget") == 0 && i + 1 < argc) {
+			memoryBudgetMb = atoi(argv[++i]);
+			if(memoryBudgetMb <= 0) {
+				printf("Invalid memory budget %s\n", argv[i]);
+				print_help(argv);
+				return 1;
+			}
+		} else if(strcmp(argv[i], "--memory-wait") == 0 && i + 1 < argc) {
+			memoryWaitMs = atoi(argv[++i]);
+			if(memoryWaitMs < 0) {
+				printf("Invalid memory wait %s\n", argv[i]);
+				print_help(argv);
+				return 1;
+			}
+		} else if(strcmp(argv[i], "--stats-socket") == 0 && i + 1 < argc) {
+			statsSocketPath = argv[++i];
+		} else if(strcmp(argv[i], "--capture") == 0 && i + 1 < argc) {
+			capturePath = argv[++i];
+		} else if(strcmp(argv[i], "--capture-redact") == 0) {
+			captureRedact = true;
+		} else if(strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+			tracePath = argv[++i];
+		} else if(strcmp(argv[i], "--log-level") == 0 && i + 1 < argc) {
+			log_level level;
+			if(!parseLogLevel(argv[++i], level)) {
+				printf("Invalid log level %s\n", argv[i]);
+				print_help(argv);
+				return 1;
+			}
+			setLogLevel(level);
+		} else if(socketPath == NULL && argv[i][0] != '-') {
+			socketPath = argv[i];
+		} else {
+			print_help(argv);
+			return 1;
+		}
+	}
+
+	if(socketPath == NULL) {
+		print_help(argv);
+		return 1;
+	}
+
+	if(eventLoopThreads > 0 && multiplexConnections > 0) {
+		printf("--event-loop and --multiplex cannot be used together\n");
+		print_help(argv);
+		return 1;
+	}
+
+	if(ioUringThreads > 0 && (eventLoopThreads > 0 || multiplexConnections > 0 || identityCacheTtlMs > 0)) {
+		printf("--io-uring cannot be used with --event-loop, --multiplex or --identity-cache\n");
+		print_help(argv);
+		return 1;
+	}
+
+	if(coroutineThreads > 0 && (eventLoopThreads > 0 || ioUringThreads > 0 || multiplexConnections > 0)) {
+		printf("--coroutines cannot be used with --event-loop, --io-uring or --multiplex\n");
+		print_help(argv);
+		return 1;
+	}
+
+	// Every event loop server, sessions do not have their own thread
+	bool eventLoop = eventLoopThreads > 0 || ioUringThreads > 0 || coroutineThreads > 0;
+
+	if(prefetchIdentities && eventLoop) {
+		printf("--prefetch-identities cannot be used with --event-loop, --io-uring or --coroutines\n");
+		print_help(argv);
+		return 1;
+	}
+
+	if((clientIdleTimeoutMs > 0 || upstreamIdleTimeoutMs > 0) && eventLoop) {
+		printf("Idle timeouts cannot be used with --event-loop, --io-uring or --coroutines\n");
+		print_help(argv);
+		return 1;
+	}
+
+	if(fairQueueInFlight > 0 && eventLoop) {
+		printf("--fair-queue cannot be used with --event-loop, --io-uring or --coroutines\n");
+		print_help(argv);
+		return 1;
+	}
+
+	if(tracePath != NULL && eventLoop) {
+		printf("--trace cannot be used with --event-loop, --io-uring or --coroutines\n");
+		print_help(argv);
+		return 1;
+	}
+
+	if(upstreamPaths.size() > 1 && (eventLoop || multiplexConnections > 0 || upstreamPoolSize > 0)) {
+		printf("Several --upstream cannot be used with --event-loop, --io-uring, --coroutines, --multiplex or "
+		       "--upstream-pool\n");
+		print_help(argv);
+		return 1;
+	}
+
+	// SSH_AUTH_SOCK is the default upstream, resolved once like --upstream
+	if(upstreamPaths.empty()) {
+		const char* sshAuthSocket = getenv("SSH_AUTH_SOCK");
+		if(sshAuthSocket == NULL) {
+			logError("Missing SSH_AUTH_SOCK env variable\n");
+			return -1;
+		}
+		upstreamPaths.push_back(sshAuthSocket);
+	}
+
+	setRequestStreaming(streamMinSize);
+	if(memoryBudgetMb > 0)
+		buffer_pool::instance().setBudget((size_t) memoryBudgetMb * 1024 * 1024, memoryWaitMs);
+
+	// A client closing its connection must not kill the whole proxy.
+	signal(SIGPIPE, SIG_IGN);
+
+	SOCKET listenSock = listenUnixSocket(socketPath, SOMAXCONN);
+	if(listenSock == INVALID_SOCKET) {
+		return -1;
+	}
+
+	logInfo("unix socket server: awaiting client connection on %s\n", socketPath);
+
+	if(statsSocketPath != NULL && !startStatsSocket(statsSocketPath))
+		return -1;
+
+	if(capturePath != NULL) {
+		FILE* captureFile = fopen(capturePath, "wb");
+		if(captureFile == NULL || !startTrafficCapture(captureFile, captureRedact)) {
+			logError("Cannot write traffic capture %s\n", capturePath);
+			return -1;
+		}
+		logInfo("Capturing traffic to %s%s\n", capturePath, captureRedact ? " (redacted)" : "");
+	}
+
+	if(tracePath != NULL) {
+		FILE* traceFile = fopen(tracePath, "w");
+		if(traceFile == NULL || !startRequestTrace(traceFile)) {
+			logError("Cannot write request trace %s\n", tracePath);
+			return -1;
+		}
+		logInfo("Tracing requests to %s\n", tracePath);
+	}
+
+	// Only used with a single upstream, several ones are routed below
+	socket_connector connectUpstream = make_socket_connector(upstreamPaths[0]);
+
+	std::unique_ptr<upstream_pool> upstreamPool;
+	if(upstreamPoolSize > 0) {
+		upstreamPool = std::make_unique<upstream_pool>(connectUpstream, upstreamPoolSize);
+		connectUpstream = [&upstreamPool]() { return upstreamPool->acquire(); };
+	}
+
+	std::unique_ptr<identity_cache> identityCache;
+	if(identityCacheTtlMs > 0)
+		identityCache = std::make_unique<identity_cache>(identityCacheTtlMs);
+
+	// Never deleted: sessions still running when accept fails end with the process
+	session_pool* sessionPool = NULL;
+	if(!eventLoop)
+		sessionPool = new session_pool(maxSessions, maxSessions, sessionWaitMs);
+
+	if(ioUringThreads > 0) {
+		uring_reactor reactor(listenSock, connectUpstream, AGENT_MAX_MSGLEN);
+		if(!reactor.run(ioUringThreads))
+			return -1;
+	} else if(eventLoopThreads > 0) {
+		epoll_reactor reactor(listenSock, connectUpstream, AGENT_MAX_MSGLEN, identityCache.get());
+		if(!reactor.run(eventLoopThreads))
+			return -1;
+	} else if(coroutineThreads > 0) {
+		coro_reactor reactor(listenSock, connectUpstream, AGENT_MAX_MSGLEN, identityCache.get());
+		if(!reactor.run(coroutineThreads))
+			return -1;
+	} else {
+		std::unique_ptr<upstream_router> router;
+		std::unique_ptr<upstream_mux> mux;
+		upstream_connector connectSession;
+
+		if(upstreamPaths.size() > 1) {
+			std::vector<upstream_connector> connectors;
+			for(const char* path : upstreamPaths) {
+				connectors.push_back(make_stream_connector(make_socket_connector(path)));
+			}
+
+			router = std::make_unique<upstream_router>(std::move(connectors), upstreamTimeoutMs);
+			connectSession = [&router]() -> std::unique_ptr<agent_upstream> {
+				return std::make_unique<routed_upstream>(*router);
+			};
+		} else if(multiplexConnections > 0) {
+			mux = std::make_unique<upstream_mux>(connectUpstream, multiplexConnections);
+			connectSession = [&mux]() -> std::unique_ptr<agent_upstream> {
+				return std::make_unique<multiplexed_upstream>(*mux);
+			};
+		} else {
+			connectSession = make_stream_connector(connectUpstream);
+		}
+
+		if(prefetchIdentities)
+			connectSession = prefetchingConnector(connectSession);
+
+		// Never deleted, like sessionPool
+		idle_reaper* idleReaper = NULL;
+		if(clientIdleTimeoutMs > 0 || upstreamIdleTimeoutMs > 0)
+			idleReaper = new idle_reaper(clientIdleTimeoutMs, upstreamIdleTimeoutMs);
+
+		// Never deleted, like sessionPool
+		upstream_scheduler* scheduler = NULL;
+		if(fairQueueInFlight > 0)
+			scheduler = new upstream_scheduler(fairQueueInFlight, clientInFlight);
+
+		serveThreadPerClient(listenSock,
+		                     connectSession,
+		                     AGENT_MAX_MSGLEN,
+		                     identityCache.get(),
+		                     sessionPool,
+		                     acceptorThreads,
+		                     idleReaper,
+		                     scheduler);
+	}
+
+	closesocket(listenSock);
+
+	return -1;
+}
+
+// Connector to an agent socket given with --upstream or SSH_AUTH_SOCK, either a native unix socket or a cygwin
+// socket file. The kind of socket is found once, a cygwin socket file is parsed again only after it changes.
+static socket_connector make_socket_connector(const char* path) {
+	struct stat fileStat;
+	if(stat(path, &fileStat) == 0 && S_ISREG(fileStat.st_mode)) {
+		std::shared_ptr<cygwin_socket_file> socketFile = std::make_shared<cygwin_socket_file>(path);
+		return [socketFile]() { return socketFile->connect(); };
+	}
+
+	return [path]() { return connectUnixSocket(path); };
+}
+
+// Each session upstream getting its own socket
+static upstream_connector make_stream_connector(socket_connector connectSocket) {
+	return [connectSocket]() -> std::unique_ptr<agent_upstream> {
+		SOCKET upstreamSock = connectSocket();
+		if(upstreamSock == INVALID_SOCKET)
+			return nullptr;
+		return std::make_unique<stream_upstream>(std::make_unique<socket_stream>(upstreamSock));
+	};
+}